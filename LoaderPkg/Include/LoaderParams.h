@@ -12,6 +12,11 @@ typedef struct {
   ///
   EFI_VIRTUAL_ADDRESS      SelfVirtual;
 
+  ///
+  /// Boot page tables, kernel bootstrap reads it at offset 8.
+  ///
+  EFI_PHYSICAL_ADDRESS     PageTable;                   // PML4 with the identity and kernel mappings, 0 if none
+
   ///
   /// UEFI services and configuration.
   ///
@@ -62,6 +67,14 @@ typedef struct {
   EFI_PHYSICAL_ADDRESS     StringTableStart;
   EFI_PHYSICAL_ADDRESS     StringTableEnd;
 
+  ///
+  /// Boot timeline, TSC values at the end of each loader phase.
+  ///
+  UINT64                   LoaderStartTsc;              // Loader entered, firmware is done
+  UINT64                   LoaderKernelReadTsc;         // Kernel file read and decompressed
+  UINT64                   LoaderKernelLoadedTsc;       // Segments and debug sections placed
+  UINT64                   LoaderExitTsc;               // Boot services exited, kernel is called next
+
 } LOADER_PARAMS;
 
 #endif // LOADER_PARAMS_H
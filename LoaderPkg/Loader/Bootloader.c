@@ -8,6 +8,7 @@
 #include <Library/DebugLib.h>
 #include "Bootloader.h"
 #include "VirtualMemory.h"
+#include "Lz4.h"
 
 VOID *
 AllocateLowRuntimePool (
@@ -392,74 +393,225 @@ GetKernelFile (
   return EFI_SUCCESS;
 }
 
+//
+// Kernel file contents staged in memory, so that it is read from the boot
+// media with a few large requests instead of one per header and section.
+//
+typedef struct {
+  UINT8  *Data;
+  UINTN  Size;
+} KERNEL_IMAGE;
+
+//
+// Some firmware implementations fail on very large single reads.
+//
+#define KERNEL_READ_CHUNK  SIZE_16MB
+
+/**
+  Free the kernel image read by ReadKernelImage.
+
+  @param[in]  Image   Kernel image contents.
+**/
+STATIC
+VOID
+FreeKernelImage (
+  IN  KERNEL_IMAGE  *Image
+  )
+{
+  ASSERT (Image != NULL);
+
+  gBS->FreePages ((UINTN) Image->Data, EFI_SIZE_TO_PAGES (Image->Size));
+  Image->Data = NULL;
+  Image->Size = 0;
+}
+
+/**
+  Replace an LZ4 compressed kernel image with its contents.
+  Images that are not compressed are kept as is.
+
+  @param[in, out] Image   Kernel image contents.
+
+  @retval EFI_SUCCESS on success.
+**/
+STATIC
+EFI_STATUS
+DecompressKernelImage (
+  IN OUT KERNEL_IMAGE  *Image
+  )
+{
+  EFI_STATUS            Status;
+  UINT64                ContentSize;
+  EFI_PHYSICAL_ADDRESS  Buffer;
+
+  ASSERT (Image != NULL);
+
+  Status = Lz4FrameGetContentSize (Image->Data, Image->Size, &ContentSize);
+  if (Status == EFI_NOT_FOUND) {
+    return EFI_SUCCESS;
+  }
+
+  if (!EFI_ERROR (Status) && (ContentSize == 0 || ContentSize > MAX_UINTN)) {
+    Status = EFI_UNSUPPORTED;
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = gBS->AllocatePages (
+      AllocateAnyPages,
+      EfiLoaderData,
+      EFI_SIZE_TO_PAGES ((UINTN) ContentSize),
+      &Buffer
+      );
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = Lz4FrameDecompress (Image->Data, Image->Size, (VOID *)(UINTN) Buffer, (UINTN) ContentSize);
+    if (EFI_ERROR (Status)) {
+      gBS->FreePages (Buffer, EFI_SIZE_TO_PAGES ((UINTN) ContentSize));
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "JOS: Failed to decompress LZ4 kernel image - %r\n", Status));
+    FreeKernelImage (Image);
+    return Status;
+  }
+
+  DEBUG ((
+    DEBUG_INFO,
+    "JOS: Decompressed kernel image from %u to %u bytes\n",
+    (UINT32) Image->Size,
+    (UINT32) ContentSize
+    ));
+
+  FreeKernelImage (Image);
+  Image->Data = (UINT8 *)(UINTN) Buffer;
+  Image->Size = (UINTN) ContentSize;
+  return EFI_SUCCESS;
+}
+
 /**
-  Read file data at offset of specified size.
+  Read the whole kernel file into a newly allocated page-aligned buffer.
+  LZ4 compressed kernel files are decompressed on the way.
 
   @param[in]  File    File protocol instance.
-  @param[in]  Offset  Data reading offset.
-  @param[in]  Size    Amount of data to read.
-  @param[out] Data    Preallocated buffer for data reading.
+  @param[out] Image   Kernel image contents.
 
   @retval EFI_SUCCESS on success.
 **/
 STATIC
 EFI_STATUS
-CheckedReadData (
+ReadKernelImage (
   IN  EFI_FILE_PROTOCOL  *File,
-  IN  UINTN              Offset,
-  IN  UINTN              Size,
-  OUT VOID               *Data
+  OUT KERNEL_IMAGE       *Image
   )
 {
-  EFI_STATUS  Status;
-  UINTN       ReadSize;
+  EFI_STATUS            Status;
+  UINT64                FileSize;
+  EFI_PHYSICAL_ADDRESS  Buffer;
+  UINTN                 Offset;
+  UINTN                 ReadSize;
 
   ASSERT (File != NULL);
-  ASSERT (Data != NULL);
+  ASSERT (Image != NULL);
 
-  Status = File->SetPosition (File, Offset);
+  //
+  // Seeking to the maximum position moves to the end of file.
+  //
+  Status = File->SetPosition (File, MAX_UINT64);
+  if (!EFI_ERROR (Status)) {
+    Status = File->GetPosition (File, &FileSize);
+  }
   if (EFI_ERROR (Status)) {
-    DEBUG ((
-      DEBUG_ERROR,
-      "JOS: Failed to set poisitition to 0x%X to read %u bytes - %r\n",
-      (UINT32) Offset,
-      (UINT32) Size,
-      Status
-      ));
+    DEBUG ((DEBUG_ERROR, "JOS: Failed to get kernel file size - %r\n", Status));
     return Status;
   }
 
-  ReadSize = Size;
-  Status = File->Read (File, &ReadSize, Data);
+  if (FileSize == 0 || FileSize > MAX_UINTN) {
+    DEBUG ((DEBUG_ERROR, "JOS: Kernel file has invalid size %Lu\n", FileSize));
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = gBS->AllocatePages (
+    AllocateAnyPages,
+    EfiLoaderData,
+    EFI_SIZE_TO_PAGES ((UINTN) FileSize),
+    &Buffer
+    );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "JOS: Failed to allocate %Lu bytes for kernel file - %r\n", FileSize, Status));
+    return Status;
+  }
+
+  Offset = 0;
+  Status = File->SetPosition (File, 0);
+  while (!EFI_ERROR (Status) && Offset < FileSize) {
+    ReadSize = MIN ((UINTN) FileSize - Offset, KERNEL_READ_CHUNK);
+    Status = File->Read (File, &ReadSize, (UINT8 *)(UINTN) Buffer + Offset);
+    if (!EFI_ERROR (Status) && ReadSize == 0) {
+      Status = EFI_END_OF_FILE;
+    }
+    Offset += ReadSize;
+  }
+
   if (EFI_ERROR (Status)) {
     DEBUG ((
       DEBUG_ERROR,
-      "JOS: Failed to read %u bytes at 0x%X - %r\n",
-      (UINT32) Size,
+      "JOS: Failed to read kernel file at 0x%X of %Lu bytes - %r\n",
       (UINT32) Offset,
+      FileSize,
       Status
       ));
+    gBS->FreePages (Buffer, EFI_SIZE_TO_PAGES ((UINTN) FileSize));
     return Status;
   }
 
-  if (Size != ReadSize) {
+  Image->Data = (UINT8 *)(UINTN) Buffer;
+  Image->Size = (UINTN) FileSize;
+
+  return DecompressKernelImage (Image);
+}
+
+/**
+  Read image data at offset of specified size.
+
+  @param[in]  Image   Kernel image contents.
+  @param[in]  Offset  Data reading offset.
+  @param[in]  Size    Amount of data to read.
+  @param[out] Data    Preallocated buffer for data reading.
+
+  @retval EFI_SUCCESS on success.
+**/
+STATIC
+EFI_STATUS
+CheckedReadData (
+  IN  CONST KERNEL_IMAGE  *Image,
+  IN  UINTN               Offset,
+  IN  UINTN               Size,
+  OUT VOID                *Data
+  )
+{
+  ASSERT (Image != NULL);
+  ASSERT (Data != NULL);
+
+  if (Offset > Image->Size || Size > Image->Size - Offset) {
     DEBUG ((
       DEBUG_ERROR,
-      "JOS: Failed to read %u bytes at %u, read only %u bytes\n",
+      "JOS: Failed to read %u bytes at 0x%X, image has only %u bytes\n",
       (UINT32) Size,
       (UINT32) Offset,
-      (UINT32) ReadSize
+      (UINT32) Image->Size
       ));
     return EFI_DEVICE_ERROR;
   }
 
+  CopyMem (Data, Image->Data + Offset, Size);
   return EFI_SUCCESS;
 }
 
 /**
   Read C string at offset of specified maximum size.
 
-  @param[in]  File    File protocol instance.
+  @param[in]  Image   Kernel image contents.
   @param[in]  Offset  String reading offset.
   @param[in]  Size    Maximum string size to read.
   @param[out] String  Preallocated buffer for string reading.
@@ -468,44 +620,31 @@ CheckedReadData (
 **/
 EFI_STATUS
 CheckedReadString (
-  IN  EFI_FILE_PROTOCOL  *File,
-  IN  UINTN              Offset,
-  IN  UINTN              Size,
-  OUT CHAR8              *String
+  IN  CONST KERNEL_IMAGE  *Image,
+  IN  UINTN               Offset,
+  IN  UINTN               Size,
+  OUT CHAR8               *String
   )
 {
-  EFI_STATUS  Status;
-  UINTN       ReadSize;
+  UINTN  ReadSize;
 
-  ASSERT (File != NULL);
+  ASSERT (Image != NULL);
   ASSERT (Size > 1);
   ASSERT (String != NULL);
 
-  Status = File->SetPosition (File, Offset);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((
-      DEBUG_ERROR,
-      "JOS: Failed to set poisitition to 0x%X to read %u-byte string - %r\n",
-      (UINT32) Offset,
-      (UINT32) Size,
-      Status
-      ));
-    return Status;
-  }
-
-  ReadSize = Size - 1;
-  Status = File->Read (File, &ReadSize, String);
-  if (EFI_ERROR (Status)) {
+  if (Offset > Image->Size) {
     DEBUG ((
       DEBUG_ERROR,
-      "JOS: Failed to read %u-byte string at 0x%X - %r\n",
+      "JOS: Failed to read %u-byte string at 0x%X, image has only %u bytes\n",
       (UINT32) Size,
       (UINT32) Offset,
-      Status
+      (UINT32) Image->Size
       ));
-    return Status;
+    return EFI_DEVICE_ERROR;
   }
 
+  ReadSize = AsciiStrnLenS ((CONST CHAR8 *) Image->Data + Offset, MIN (Size - 1, Image->Size - Offset));
+  CopyMem (String, Image->Data + Offset, ReadSize);
   String[ReadSize] = '\0';
   return EFI_SUCCESS;
 }
@@ -527,6 +666,7 @@ LoadKernel (
 {
   EFI_STATUS            Status;
   EFI_FILE_PROTOCOL     *KernelFile;
+  KERNEL_IMAGE          KernelImage;
   UINTN                 Index;
   UINTN                 Index2;
   struct Elf            ElfHeader;
@@ -554,16 +694,28 @@ LoadKernel (
 
   DEBUG ((DEBUG_INFO, "JOS: Loading kernel image...\n"));
 
+  //
+  // Everything below is parsed from memory, the file is not needed after that.
+  //
+  Status = ReadKernelImage (KernelFile, &KernelImage);
+  KernelFile->Close (KernelFile);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "JOS: Cannot read kernel image - %r\n", Status));
+    return Status;
+  }
+
+  LoaderParams->LoaderKernelReadTsc = AsmReadTsc ();
+
   //
   // Read and verify ELF header.
   // TODO: Here we blindly trust that ELF file has valid data. Anybody implementing
   // Secure Boot functionality will have to ensure this by checking the signature
   // or at least verifying the bounds.
   //
-  Status = CheckedReadData (KernelFile, 0, sizeof (ElfHeader), &ElfHeader);
+  Status = CheckedReadData (&KernelImage, 0, sizeof (ElfHeader), &ElfHeader);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_ERROR, "JOS: Cannot read kernel header - %r\n", Status));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return Status;
   }
 
@@ -574,7 +726,7 @@ LoadKernel (
       ElfHeader.e_magic,
       ELF_MAGIC
       ));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
@@ -594,7 +746,7 @@ LoadKernel (
       ElfHeader.e_shentsize,
       (UINT32) sizeof (struct Secthdr)
       ));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
@@ -605,7 +757,7 @@ LoadKernel (
       ElfHeader.e_shstrndx,
       ElfHeader.e_shnum
       ));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
@@ -616,7 +768,7 @@ LoadKernel (
       ElfHeader.e_phentsize,
       (UINT32) sizeof (struct Proghdr)
       ));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
@@ -627,7 +779,7 @@ LoadKernel (
       "JOS: Failed to allocate memory for %u kernel section headers\n",
       ElfHeader.e_shnum
       ));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
@@ -638,13 +790,13 @@ LoadKernel (
       "JOS: Failed to allocate memory for %u kernel program headers\n",
       ElfHeader.e_phnum
       ));
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     FreePool (Sections);
     return EFI_UNSUPPORTED;
   }
 
   Status = CheckedReadData (
-    KernelFile,
+    &KernelImage,
     ElfHeader.e_shoff,
     ElfHeader.e_shnum * sizeof (struct Secthdr),
     Sections
@@ -658,14 +810,14 @@ LoadKernel (
       ));
     FreePool (Sections);
     FreePool (ProgramHeaders);
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
   StringOffset = Sections[ElfHeader.e_shstrndx].sh_offset;
 
   Status = CheckedReadData (
-    KernelFile,
+    &KernelImage,
     ElfHeader.e_phoff,
     ElfHeader.e_phnum * sizeof (struct Proghdr),
     ProgramHeaders
@@ -679,7 +831,7 @@ LoadKernel (
       ));
     FreePool (Sections);
     FreePool (ProgramHeaders);
-    KernelFile->Close (KernelFile);
+    FreeKernelImage (&KernelImage);
     return EFI_UNSUPPORTED;
   }
 
@@ -703,7 +855,7 @@ LoadKernel (
 
   for (Index = 0; Index < ElfHeader.e_shnum; ++Index) {
     Status = CheckedReadString (
-      KernelFile,
+      &KernelImage,
       StringOffset + Sections[Index].sh_name,
       sizeof (NameTemp),
       NameTemp
@@ -749,7 +901,7 @@ LoadKernel (
         DEBUG ((DEBUG_VERBOSE, "JOS: Allocated section %a to %p\n", NameTemp, SectionData));
 
         Status = CheckedReadData (
-          KernelFile,
+          &KernelImage,
           Sections[Index].sh_offset,
           Sections[Index].sh_size,
           SectionData
@@ -821,7 +973,7 @@ LoadKernel (
           if (ProgramHeaders[Index].p_type == PT_LOAD &&
               ProgramHeaders[Index].p_filesz > 0) {
             Status = CheckedReadData (
-              KernelFile,
+              &KernelImage,
               ProgramHeaders[Index].p_offset,
               ProgramHeaders[Index].p_filesz,
               (VOID *)(UINTN) ProgramHeaders[Index].p_pa
@@ -843,10 +995,11 @@ LoadKernel (
   }
 
   //
-  // Free sections and headers.
+  // Free sections, headers and the staged image.
   //
   FreePool (Sections);
   FreePool (ProgramHeaders);
+  FreeKernelImage (&KernelImage);
 
   //
   // Free allocated memory on error.
@@ -854,6 +1007,7 @@ LoadKernel (
   if (!EFI_ERROR (Status)) {
     DEBUG ((DEBUG_INFO, "JOS: Loaded kernel with %Lx entry point\n", ElfHeader.e_entry));
     *EntryPoint = (UINTN) ElfHeader.e_entry;
+    LoaderParams->LoaderKernelLoadedTsc = AsmReadTsc ();
   } else {
     for (Index = 0; Index < ARRAY_SIZE (mDebugMapping); ++Index) {
       SectionData = (VOID *)(UINTN) *(EFI_PHYSICAL_ADDRESS *)(
@@ -900,7 +1054,17 @@ TransitionToKernelMode (
   ASSERT (LoaderParams != NULL);
   ASSERT (GateData != NULL);
 
+  //
+  // Build the page table the kernel starts on, so that it does not have to.
+  //
+  LoaderParams->PageTable = (UINTN) PreparePageTable ();
+  if (LoaderParams->PageTable == 0) {
+    DEBUG ((DEBUG_ERROR, "JOS: Failed to allocate page table\n"));
+    return EFI_OUT_OF_RESOURCES;
+  }
+
   Status = GenerateGateData (
+    LoaderParams,
     GateData
     );
   if (EFI_ERROR (Status)) {
@@ -959,6 +1123,8 @@ TransitionToKernelMode (
     return Status;
   }
 
+  LoaderParams->LoaderExitTsc = AsmReadTsc ();
+
   return EFI_SUCCESS;
 }
 
@@ -1048,6 +1214,9 @@ UefiMain (
   EFI_EVENT          VirtualNotifyEvent;
   UINTN              EntryPoint;
   VOID               *GateData;
+  UINT64             StartTsc;
+
+  StartTsc = AsmReadTsc ();
 
 #if 0 // Set to 1 to wait for debugger
   volatile BOOLEAN   Connected;
@@ -1087,6 +1256,7 @@ UefiMain (
   LoaderParams->RTServices   = (UINTN) gRT;
   LoaderParams->ACPIRoot     = (UINTN) AcpiFindRsdp ();
   LoaderParams->SelfVirtual  = (UINTN) LoaderParams;
+  LoaderParams->LoaderStartTsc = StartTsc;
 
   Status = InitGraphics (LoaderParams);
   if (EFI_ERROR (Status)) {
@@ -32,13 +32,15 @@
 /**
   Generate architecture-specific kernel call gate data.
 
-  @param[out] GateData   Pointer to gate data pointer.
+  @param[in]  LoaderParams  Loader parameters with the boot page table.
+  @param[out] GateData      Pointer to gate data pointer.
 
   @retval EFI_SUCCESS on success.
 **/
 EFI_STATUS
 GenerateGateData (
-  OUT VOID **GateData
+  IN  LOADER_PARAMS  *LoaderParams,
+  OUT VOID           **GateData
   );
 
 /**
@@ -73,16 +73,16 @@ CallKernelThroughGate (
 
 EFI_STATUS
 GenerateGateData (
-  OUT VOID **GateData
+  IN  LOADER_PARAMS  *LoaderParams,
+  OUT VOID           **GateData
   )
 {
+  ASSERT (LoaderParams != NULL);
   ASSERT (GateData != NULL);
 
-  *GateData = PreparePageTable ();
-  if (*GateData == NULL) {
-    DEBUG ((DEBUG_ERROR, "JOS: Failed to allocate page table\n"));
-    return EFI_OUT_OF_RESOURCES;
-  }
-
+  //
+  // Long mode is entered right on the boot page table.
+  //
+  *GateData = (VOID *)(UINTN) LoaderParams->PageTable;
   return EFI_SUCCESS;
 }
@@ -0,0 +1,287 @@
+/** @file
+  LZ4 frame decompression for compressed kernel images.
+  See lz4_Frame_format.md and lz4_Block_format.md in the LZ4 sources.
+
+  Copyright (c) 2020, ISP RAS. All rights reserved.
+  SPDX-License-Identifier: BSD-3-Clause
+**/
+
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+
+#include "Lz4.h"
+
+//
+// Frame descriptor flags.
+//
+#define LZ4_FLG_VERSION_MASK    0xC0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_DICT_ID         0x01
+
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000U
+#define LZ4_MIN_MATCH           4
+
+STATIC
+UINT32
+Lz4Read32 (
+  IN CONST UINT8  *Data
+  )
+{
+  return Data[0] | (Data[1] << 8) | (Data[2] << 16) | ((UINT32) Data[3] << 24);
+}
+
+/**
+  Parse the frame header.
+
+  @param[in]  Source       Compressed data.
+  @param[in]  SourceSize   Size of compressed data.
+  @param[out] ContentSize  Size of decompressed data.
+  @param[out] Flags        Frame descriptor flags.
+  @param[out] HeaderSize   Size of the frame header, blocks follow it.
+
+  @retval EFI_SUCCESS on success.
+**/
+STATIC
+EFI_STATUS
+Lz4ParseHeader (
+  IN  CONST UINT8  *Source,
+  IN  UINTN        SourceSize,
+  OUT UINT64       *ContentSize,
+  OUT UINT8        *Flags,
+  OUT UINTN        *HeaderSize
+  )
+{
+  UINTN  Index;
+
+  //
+  // Magic, FLG, BD, optional content size, header checksum.
+  //
+  if (SourceSize < 7 || Lz4Read32 (Source) != LZ4_FRAME_MAGIC) {
+    return EFI_NOT_FOUND;
+  }
+
+  *Flags = Source[4];
+  if ((*Flags & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if ((*Flags & LZ4_FLG_CONTENT_SIZE) == 0 || (*Flags & LZ4_FLG_DICT_ID) != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (SourceSize < 15) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  *ContentSize = 0;
+  for (Index = 0; Index < 8; ++Index) {
+    *ContentSize |= (UINT64) Source[6 + Index] << (8 * Index);
+  }
+
+  *HeaderSize = 15;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+Lz4FrameGetContentSize (
+  IN  CONST VOID  *Source,
+  IN  UINTN       SourceSize,
+  OUT UINT64      *ContentSize
+  )
+{
+  UINT8  Flags;
+  UINTN  HeaderSize;
+
+  ASSERT (Source != NULL);
+  ASSERT (ContentSize != NULL);
+
+  return Lz4ParseHeader (Source, SourceSize, ContentSize, &Flags, &HeaderSize);
+}
+
+/**
+  Decompress one block. Matches may refer to the previous blocks,
+  which precede it in the output buffer.
+
+  @param[in]      Source     Block data.
+  @param[in]      BlockSize  Size of block data.
+  @param[in]      Output     Start of the output buffer.
+  @param[in, out] Position   Current output position.
+  @param[in]      OutputEnd  End of the output buffer.
+
+  @retval EFI_SUCCESS on success.
+**/
+STATIC
+EFI_STATUS
+Lz4DecompressBlock (
+  IN     CONST UINT8  *Source,
+  IN     UINTN        BlockSize,
+  IN     UINT8        *Output,
+  IN OUT UINT8        **Position,
+  IN     UINT8        *OutputEnd
+  )
+{
+  CONST UINT8  *SourceEnd;
+  CONST UINT8  *Match;
+  UINT8        *Out;
+  UINT8        Token;
+  UINTN        Length;
+  UINTN        Offset;
+
+  SourceEnd = Source + BlockSize;
+  Out       = *Position;
+
+  while (Source < SourceEnd) {
+    Token = *Source++;
+
+    //
+    // Literals.
+    //
+    Length = Token >> 4;
+    if (Length == 15) {
+      do {
+        if (Source >= SourceEnd) {
+          return EFI_VOLUME_CORRUPTED;
+        }
+        Length += *Source;
+      } while (*Source++ == 255);
+    }
+
+    if (Length > (UINTN) (SourceEnd - Source) || Length > (UINTN) (OutputEnd - Out)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    CopyMem (Out, Source, Length);
+    Out    += Length;
+    Source += Length;
+
+    //
+    // The last sequence of a block has literals only.
+    //
+    if (Source == SourceEnd) {
+      break;
+    }
+
+    //
+    // Match.
+    //
+    if (SourceEnd - Source < 2) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    Offset  = Source[0] | (Source[1] << 8);
+    Source += 2;
+    if (Offset == 0 || Offset > (UINTN) (Out - Output)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    Length = Token & 15;
+    if (Length == 15) {
+      do {
+        if (Source >= SourceEnd) {
+          return EFI_VOLUME_CORRUPTED;
+        }
+        Length += *Source;
+      } while (*Source++ == 255);
+    }
+    Length += LZ4_MIN_MATCH;
+
+    if (Length > (UINTN) (OutputEnd - Out)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    //
+    // Matches may overlap the output, so no CopyMem here unless they don't.
+    //
+    Match = Out - Offset;
+    if (Offset >= Length) {
+      CopyMem (Out, Match, Length);
+      Out += Length;
+    } else {
+      while (Length-- > 0) {
+        *Out++ = *Match++;
+      }
+    }
+  }
+
+  *Position = Out;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS
+Lz4FrameDecompress (
+  IN  CONST VOID  *Source,
+  IN  UINTN       SourceSize,
+  OUT VOID        *Destination,
+  IN  UINTN       DestinationSize
+  )
+{
+  EFI_STATUS   Status;
+  CONST UINT8  *Input;
+  CONST UINT8  *InputEnd;
+  UINT8        *Output;
+  UINT8        *OutputEnd;
+  UINT64       ContentSize;
+  UINT8        Flags;
+  UINTN        HeaderSize;
+  UINT32       BlockSize;
+
+  ASSERT (Source != NULL);
+  ASSERT (Destination != NULL);
+
+  Status = Lz4ParseHeader (Source, SourceSize, &ContentSize, &Flags, &HeaderSize);
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (ContentSize != DestinationSize) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Input     = (CONST UINT8 *) Source + HeaderSize;
+  InputEnd  = (CONST UINT8 *) Source + SourceSize;
+  Output    = Destination;
+  OutputEnd = Output + DestinationSize;
+
+  for (;;) {
+    if (InputEnd - Input < 4) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    BlockSize = Lz4Read32 (Input);
+    Input    += 4;
+
+    //
+    // End mark, an optional content checksum follows.
+    //
+    if (BlockSize == 0) {
+      break;
+    }
+
+    if ((BlockSize & ~LZ4_BLOCK_UNCOMPRESSED) > (UINTN) (InputEnd - Input)) {
+      return EFI_VOLUME_CORRUPTED;
+    }
+
+    if ((BlockSize & LZ4_BLOCK_UNCOMPRESSED) != 0) {
+      BlockSize &= ~LZ4_BLOCK_UNCOMPRESSED;
+      if (BlockSize > (UINTN) (OutputEnd - Output)) {
+        return EFI_VOLUME_CORRUPTED;
+      }
+      CopyMem (Output, Input, BlockSize);
+      Output += BlockSize;
+    } else {
+      Status = Lz4DecompressBlock (Input, BlockSize, Destination, &Output, OutputEnd);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+    }
+
+    Input += BlockSize;
+    if ((Flags & LZ4_FLG_BLOCK_CHECKSUM) != 0) {
+      Input += 4;
+    }
+  }
+
+  return Output == OutputEnd ? EFI_SUCCESS : EFI_VOLUME_CORRUPTED;
+}
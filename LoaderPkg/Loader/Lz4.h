@@ -0,0 +1,51 @@
+/** @file
+  Copyright (c) 2020, ISP RAS. All rights reserved.
+  SPDX-License-Identifier: BSD-3-Clause
+**/
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <Uefi.h>
+
+#define LZ4_FRAME_MAGIC  0x184D2204U
+
+/**
+  Check that the buffer holds an LZ4 frame and get its decompressed size.
+  The frame has to be produced with the content size (lz4 --content-size).
+
+  @param[in]  Source       Compressed data.
+  @param[in]  SourceSize   Size of compressed data.
+  @param[out] ContentSize  Size of decompressed data.
+
+  @retval EFI_SUCCESS        on success.
+  @retval EFI_NOT_FOUND      if the buffer is not an LZ4 frame.
+  @retval EFI_UNSUPPORTED    if the frame has no content size or uses a dictionary.
+**/
+EFI_STATUS
+Lz4FrameGetContentSize (
+  IN  CONST VOID  *Source,
+  IN  UINTN       SourceSize,
+  OUT UINT64      *ContentSize
+  );
+
+/**
+  Decompress an LZ4 frame. Checksums are not verified.
+
+  @param[in]  Source           Compressed data.
+  @param[in]  SourceSize       Size of compressed data.
+  @param[out] Destination      Buffer for decompressed data.
+  @param[in]  DestinationSize  Size of the buffer, the content size of the frame.
+
+  @retval EFI_SUCCESS           on success.
+  @retval EFI_VOLUME_CORRUPTED  if the frame is malformed.
+**/
+EFI_STATUS
+Lz4FrameDecompress (
+  IN  CONST VOID  *Source,
+  IN  UINTN       SourceSize,
+  OUT VOID        *Destination,
+  IN  UINTN       DestinationSize
+  );
+
+#endif // LZ4_H
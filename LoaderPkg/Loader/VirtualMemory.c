@@ -6,25 +6,117 @@
 
 #include "VirtualMemory.h"
 
+#include <Register/Intel/Cpuid.h>
+
 //
-// Create 2M-page table
+// Create the boot page table
 // PML4 (47:39)
 // PDPTE (38:30)
 // PDE (29:21)
 //
+// The low 4 GiB are identity mapped and the first 1 GiB is mapped once more
+// at the kernel base, so that the kernel can run on this table right away.
+// With PDPE1GB support both use 1 GiB pages and the page directories
+// are not needed at all, 2 MiB pages are used otherwise.
+//
 
 #define EFI_MAX_ENTRY_NUM     512
 
-#define EFI_PML4_ENTRY_NUM    1
 #define EFI_PDPTE_ENTRY_NUM   4
 #define EFI_PDE_ENTRY_NUM     EFI_MAX_ENTRY_NUM
 
+//
+// Keep in sync with KERN_BASE_ADDR in inc/memlayout.h
+//
+#define KERNEL_BASE_ADDRESS   0x8040000000ULL
+#define KERNEL_PML4_INDEX     ((KERNEL_BASE_ADDRESS >> 39) & (EFI_MAX_ENTRY_NUM - 1))
+#define KERNEL_PDPTE_INDEX    ((KERNEL_BASE_ADDRESS >> 30) & (EFI_MAX_ENTRY_NUM - 1))
+
 #define EFI_PML4_PAGE_NUM     1
-#define EFI_PDPTE_PAGE_NUM    EFI_PML4_ENTRY_NUM
-#define EFI_PDE_PAGE_NUM      (EFI_PML4_ENTRY_NUM * EFI_PDPTE_ENTRY_NUM)
+#define EFI_PDPTE_PAGE_NUM    2
+#define EFI_PDE_PAGE_NUM      (EFI_PDPTE_ENTRY_NUM + 1)
 
-#define EFI_PAGE_NUMBER       (EFI_PML4_PAGE_NUM + EFI_PDPTE_PAGE_NUM + EFI_PDE_PAGE_NUM)
 #define EFI_PAGE_SIZE_2M      0x200000
+#define EFI_PAGE_SIZE_1G      0x40000000
+
+STATIC
+BOOLEAN
+IsPage1GbSupported (
+  VOID
+  )
+{
+  UINT32                       Level;
+  CPUID_EXTENDED_CPU_SIG_EDX   ExFlags;
+
+  AsmCpuid (CPUID_EXTENDED_FUNCTION, &Level, NULL, NULL, NULL);
+  if (Level < CPUID_EXTENDED_CPU_SIG) {
+    return FALSE;
+  }
+
+  AsmCpuid (CPUID_EXTENDED_CPU_SIG, NULL, NULL, NULL, &ExFlags.Uint32);
+  return ExFlags.Bits.Page1GB != 0;
+}
+
+//
+// Fill Count page-directory-pointer entries, either with 1 GiB pages
+// or with page directories of 2 MiB pages taken from *PageTablePtr.
+//
+STATIC
+VOID
+FillPageDirectoryPointers (
+  IN     X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K  *PageDirectoryPointerEntry,
+  IN     UINTN                                      Count,
+  IN     UINT64                                     PageAddress,
+  IN     BOOLEAN                                    Page1Gb,
+  IN OUT UINT8                                      **PageTablePtr
+  )
+{
+  UINTN                    PDPTEIndex;
+  UINTN                    PDEIndex;
+  X64_PAGE_TABLE_ENTRY_2M  *PageDirectoryEntry2MB;
+
+  for (PDPTEIndex = 0; PDPTEIndex < Count; PDPTEIndex++, PageDirectoryPointerEntry++) {
+    if (Page1Gb) {
+      //
+      // Make a 1 GiB page Page-Directory-Pointer-Table Entry, its PS bit is where
+      // the 2 MiB entry has it.
+      //
+      PageDirectoryEntry2MB = (X64_PAGE_TABLE_ENTRY_2M *)PageDirectoryPointerEntry;
+      PageDirectoryEntry2MB->Uint64 = (UINT64)PageAddress;
+      PageDirectoryEntry2MB->Bits.ReadWrite = 1;
+      PageDirectoryEntry2MB->Bits.Present = 1;
+      PageDirectoryEntry2MB->Bits.MustBe1 = 1;
+
+      PageAddress += EFI_PAGE_SIZE_1G;
+      continue;
+    }
+
+    //
+    // Each Page-Directory-Pointer-Table Entry points to the base address of a Page-Directory Entry
+    //
+    PageDirectoryEntry2MB = (X64_PAGE_TABLE_ENTRY_2M *)*PageTablePtr;
+    *PageTablePtr += EFI_PAGE_SIZE;
+
+    //
+    // Make a Page-Directory-Pointer-Table Entry
+    //
+    PageDirectoryPointerEntry->Uint64 = (UINT64)(UINTN) PageDirectoryEntry2MB;
+    PageDirectoryPointerEntry->Bits.ReadWrite = 1;
+    PageDirectoryPointerEntry->Bits.Present = 1;
+
+    for (PDEIndex = 0; PDEIndex < EFI_PDE_ENTRY_NUM; PDEIndex++, PageDirectoryEntry2MB++) {
+      //
+      // Make a Page-Directory Entry
+      //
+      PageDirectoryEntry2MB->Uint64 = (UINT64)PageAddress;
+      PageDirectoryEntry2MB->Bits.ReadWrite = 1;
+      PageDirectoryEntry2MB->Bits.Present = 1;
+      PageDirectoryEntry2MB->Bits.MustBe1 = 1;
+
+      PageAddress += EFI_PAGE_SIZE_2M;
+    }
+  }
+}
 
 VOID *
 PreparePageTable (
@@ -32,23 +124,27 @@ PreparePageTable (
   )
 {
   EFI_STATUS                                    Status;
-  UINT64                                        PageAddress;
+  BOOLEAN                                       Page1Gb;
+  UINTN                                         PageNumber;
   EFI_PHYSICAL_ADDRESS                          PageTableMemory;
   UINT8                                         *PageTable;
   UINT8                                         *PageTablePtr;
-  INTN                                          PML4Index;
-  INTN                                          PDPTEIndex;
-  INTN                                          PDEIndex;
   X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K     *PageMapLevel4Entry;
-  X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K     *PageDirectoryPointerEntry;
-  X64_PAGE_TABLE_ENTRY_2M                       *PageDirectoryEntry2MB;
+  X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K     *IdentityPointerEntry;
+  X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K     *KernelPointerEntry;
 
+  Page1Gb = IsPage1GbSupported ();
+  PageNumber = EFI_PML4_PAGE_NUM + EFI_PDPTE_PAGE_NUM + (Page1Gb ? 0 : EFI_PDE_PAGE_NUM);
 
+  //
+  // Both the loader gate and the kernel bootstrap access the table
+  // through the identity mapping, so it has to be below 4 GiB.
+  //
   PageTableMemory = BASE_4GB;
   Status = gBS->AllocatePages (
     AllocateMaxAddress,
     EfiRuntimeServicesData,
-    EFI_PAGE_NUMBER,
+    PageNumber,
     &PageTableMemory
     );
   if (EFI_ERROR (Status)) {
@@ -57,64 +153,42 @@ PreparePageTable (
 
   PageTable = (VOID *)(UINTN) PageTableMemory;
 
-  ZeroMem (PageTable, (EFI_PAGE_NUMBER * EFI_PAGE_SIZE));
-  PageTablePtr = PageTable;
-
-  PageAddress = 0;
+  ZeroMem (PageTable, (PageNumber * EFI_PAGE_SIZE));
 
   //
-  //  Page Table structure 3 level 2MB.
+  //  Page Table structure 3 level 2MB, or 2 level 1GB.
   //
   //                   Page-Map-Level-4-Table        : bits 47-39
-  //                   Page-Directory-Pointer-Table  : bits 38-30
+  //  Page Table 1GB : Page-Directory-Pointer-Table  : bits 38-30
   //
   //  Page Table 2MB : Page-Directory(2M)            : bits 29-21
   //
   //
 
-  PageMapLevel4Entry = (X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K *)PageTablePtr;
+  PageMapLevel4Entry   = (X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K *)PageTable;
+  IdentityPointerEntry = (X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K *)(PageTable + EFI_PAGE_SIZE);
+  KernelPointerEntry   = (X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K *)(PageTable + 2 * EFI_PAGE_SIZE);
+  PageTablePtr         = PageTable + 3 * EFI_PAGE_SIZE;
 
-  for (PML4Index = 0; PML4Index < EFI_PML4_ENTRY_NUM; PML4Index++, PageMapLevel4Entry++) {
-    //
-    // Each Page-Map-Level-4-Table Entry points to the base address of a Page-Directory-Pointer-Table Entry
-    //
-    PageTablePtr += EFI_PAGE_SIZE;
-    PageDirectoryPointerEntry = (X64_PAGE_MAP_AND_DIRECTORY_POINTER_2MB_4K *)PageTablePtr;
+  //
+  // Make Page-Map-Level-4-Table Entries for both Page-Directory-Pointer-Tables
+  //
+  PageMapLevel4Entry[0].Uint64 = (UINT64)(UINTN) IdentityPointerEntry;
+  PageMapLevel4Entry[0].Bits.ReadWrite = 1;
+  PageMapLevel4Entry[0].Bits.Present = 1;
 
-    //
-    // Make a Page-Map-Level-4-Table Entry
-    //
-    PageMapLevel4Entry->Uint64 = (UINT64)(UINTN) PageDirectoryPointerEntry;
-    PageMapLevel4Entry->Bits.ReadWrite = 1;
-    PageMapLevel4Entry->Bits.Present = 1;
+  PageMapLevel4Entry[KERNEL_PML4_INDEX].Uint64 = (UINT64)(UINTN) KernelPointerEntry;
+  PageMapLevel4Entry[KERNEL_PML4_INDEX].Bits.ReadWrite = 1;
+  PageMapLevel4Entry[KERNEL_PML4_INDEX].Bits.Present = 1;
 
-    for (PDPTEIndex = 0; PDPTEIndex < EFI_PDPTE_ENTRY_NUM; PDPTEIndex++, PageDirectoryPointerEntry++) {
-      //
-      // Each Page-Directory-Pointer-Table Entry points to the base address of a Page-Directory Entry
-      //
-      PageTablePtr += EFI_PAGE_SIZE;
-      PageDirectoryEntry2MB = (X64_PAGE_TABLE_ENTRY_2M *)PageTablePtr;
+  //
+  // The kernel gets its own page directory in the 2 MiB case, it remaps
+  // some of its pages early and the identity mapping must stay intact.
+  //
+  FillPageDirectoryPointers (IdentityPointerEntry, EFI_PDPTE_ENTRY_NUM, 0, Page1Gb, &PageTablePtr);
+  FillPageDirectoryPointers (KernelPointerEntry + KERNEL_PDPTE_INDEX, 1, 0, Page1Gb, &PageTablePtr);
 
-      //
-      // Make a Page-Directory-Pointer-Table Entry
-      //
-      PageDirectoryPointerEntry->Uint64 = (UINT64)(UINTN) PageDirectoryEntry2MB;
-      PageDirectoryPointerEntry->Bits.ReadWrite = 1;
-      PageDirectoryPointerEntry->Bits.Present = 1;
-
-      for (PDEIndex = 0; PDEIndex < EFI_PDE_ENTRY_NUM; PDEIndex++, PageDirectoryEntry2MB++) {
-        //
-        // Make a Page-Directory Entry
-        //
-        PageDirectoryEntry2MB->Uint64 = (UINT64)PageAddress;
-        PageDirectoryEntry2MB->Bits.ReadWrite = 1;
-        PageDirectoryEntry2MB->Bits.Present = 1;
-        PageDirectoryEntry2MB->Bits.MustBe1 = 1;
-
-        PageAddress += EFI_PAGE_SIZE_2M;
-      }
-    }
-  }
+  DEBUG ((DEBUG_INFO, "JOS: Boot page table at %p, %a pages\n", PageTable, Page1Gb ? "1G" : "2M"));
 
   return PageTable;
 }
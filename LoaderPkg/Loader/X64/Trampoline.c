@@ -7,12 +7,15 @@
 
 EFI_STATUS
 GenerateGateData (
-  OUT VOID **GateData
+  IN  LOADER_PARAMS  *LoaderParams,
+  OUT VOID           **GateData
   )
 {
+  ASSERT (LoaderParams != NULL);
   ASSERT (GateData != NULL);
   //
-  // No need for any extra data in 64-bit mode.
+  // No need for any extra data in 64-bit mode,
+  // the kernel switches to the boot page table itself.
   //
   *GateData = NULL;
   return EFI_SUCCESS;
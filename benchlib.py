@@ -0,0 +1,257 @@
+from __future__ import print_function, division
+
+import sys, os, re, time, json, select, math
+from optparse import OptionParser
+
+import gradelib
+from gradelib import QEMU, make, color
+
+__all__ = ["workload", "run_benchmarks"]
+
+##################################################################
+# Workloads
+#
+# A workload is one kernel configuration that is booted --runs times.
+# Every boot is left running until the monitor prompt, then the boot
+# timeline is requested with the boottime command and QEMU is stopped.
+# Metrics of a boot are taken from its serial output:
+#
+#   boot.<phase>     ms taken by every boot phase, see kern/boottime.c
+#   boot.total       ms from reset to the end of the last phase
+#   <name>.<key>     key=value of "BENCH <name> ..." lines printed by
+#                    prog/bench_*.c, the median over the instances
+#
+# Non-numeric values (such as role=spin) become part of the metric
+# name, "id" is dropped and "tsc" is reported as the spread between
+# the first and the last instance. Every workload reports its own
+# boot timeline, so results and baselines key metrics as
+# <workload>/<metric>.
+
+WORKLOADS = []
+
+PROMPT = "K> "
+TIMELINE_RE = re.compile(r"^  (\S.*?)\s+(\d+)\.(\d{3}) ms\s+(\d+)\.(\d{3}) ms\s*$")
+BENCH_RE = re.compile(r"^BENCH (\S+)((?: \S+=\S+)*)\s*$")
+
+def workload(name, prog=None, count=1):
+    """Register a workload.  Without prog the kernel is booted as is,
+    otherwise only count instances of prog are created (see TEST and
+    TEST_COUNT in kern/init.c)."""
+
+    if prog:
+        target = "run-%s-nox" % prog
+        make_args = ["INIT_CFLAGS=-DTEST_COUNT=%d" % count]
+    else:
+        target = "qemu-nox"
+        make_args = []
+    WORKLOADS.append((name, target, make_args))
+
+def wait_output(qemu, start, pattern, deadline):
+    """Read QEMU output until pattern appears after offset start.
+    Returns False if QEMU exits or the deadline passes."""
+
+    while pattern not in qemu.output[start:]:
+        timeleft = deadline - time.time()
+        if timeleft < 0 or qemu.fileno() is None:
+            return False
+        rset, _, _ = select.select([qemu], [], [], timeleft)
+        if rset:
+            qemu.handle_read()
+    return True
+
+def stop_qemu(qemu):
+    # Ctrl-a x, QEMU serial is multiplexed with its monitor
+    try:
+        qemu.proc.stdin.write(b"\x01x")
+        qemu.proc.stdin.flush()
+    except (EnvironmentError, AttributeError):
+        pass
+
+    deadline = time.time() + 5
+    while qemu.proc and qemu.proc.poll() is None and time.time() < deadline:
+        time.sleep(0.1)
+    qemu.kill()
+    qemu.wait()
+
+def boot_once(target, make_args, timeout):
+    """Boot the kernel once, returns its serial output or None."""
+
+    qemu = QEMU(target, *make_args)
+    try:
+        deadline = time.time() + timeout
+        if not wait_output(qemu, 0, PROMPT, deadline):
+            return None
+
+        start = len(qemu.output)
+        qemu.proc.stdin.write(b"boottime\n")
+        qemu.proc.stdin.flush()
+        if not wait_output(qemu, start, PROMPT, deadline):
+            return None
+        return qemu.output
+    finally:
+        stop_qemu(qemu)
+
+def parse_metrics(output):
+    """Extract metrics of one boot from its serial output."""
+
+    metrics = {}
+    bench = {}
+    for line in output.splitlines():
+        line = line.rstrip("\r")
+
+        m = TIMELINE_RE.match(line)
+        if m:
+            took = int(m.group(2)) + int(m.group(3)) / 1000
+            metrics["boot." + re.sub(r"\W+", "_", m.group(1)).strip("_")] = took
+            metrics["boot.total"] = int(m.group(4)) + int(m.group(5)) / 1000
+            continue
+
+        m = BENCH_RE.match(line)
+        if not m:
+            continue
+        name = [m.group(1)]
+        values = []
+        for kv in m.group(2).split():
+            key, value = kv.split("=", 1)
+            try:
+                values.append((key, float(value)))
+            except ValueError:
+                name.append(value)
+        for key, value in values:
+            if key != "id":
+                bench.setdefault("%s.%s" % (".".join(name), key), []).append(value)
+
+    for metric, values in bench.items():
+        if metric.endswith(".tsc"):
+            metrics[metric + "_spread"] = max(values) - min(values)
+        else:
+            metrics[metric] = median(values)
+    return metrics
+
+##################################################################
+# Statistics
+#
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+    if n % 2:
+        return values[n // 2]
+    return (values[n // 2 - 1] + values[n // 2]) / 2
+
+def summarize(samples):
+    """Summarize a list of per-boot metric dicts.  Metrics missing
+    from some boots are summarized over the boots that have them."""
+
+    summary = {}
+    for metric in set(k for s in samples for k in s):
+        values = [s[metric] for s in samples if metric in s]
+        mean = sum(values) / len(values)
+        var = sum((v - mean) ** 2 for v in values) / max(len(values) - 1, 1)
+        summary[metric] = {"median": median(values), "mean": mean,
+                           "stdev": math.sqrt(var), "min": min(values),
+                           "max": max(values), "runs": len(values)}
+    return summary
+
+def compare(summary, baseline, threshold):
+    """Return metrics whose median grew by more than threshold
+    (a fraction) relative to the baseline, as (metric, old, new)."""
+
+    regressions = []
+    for metric in sorted(summary):
+        if metric not in baseline:
+            continue
+        old, new = baseline[metric]["median"], summary[metric]["median"]
+        if new > old * (1 + threshold):
+            regressions.append((metric, old, new))
+    return regressions
+
+def show_summary(summary, baseline):
+    print("  %-50s %14s %12s %7s %10s" % ("metric", "median", "stdev", "cv", "vs base"))
+    for metric in sorted(summary):
+        s = summary[metric]
+        cv = "%6.1f%%" % (100 * s["stdev"] / s["mean"]) if s["mean"] else "      -"
+        delta = "-"
+        if metric in baseline and baseline[metric]["median"]:
+            delta = "%+.1f%%" % (100 * (s["median"] / baseline[metric]["median"] - 1))
+        print("  %-50s %14.3f %12.3f %7s %10s" % (metric, s["median"], s["stdev"], cv, delta))
+
+##################################################################
+# Driver
+#
+
+def run_benchmarks():
+    """Boot every registered workload, summarize and compare
+    against the baseline."""
+
+    parser = OptionParser(usage="usage: %prog [options] [workloads...]")
+    parser.add_option("-v", "--verbose", action="store_true",
+                      help="print commands")
+    parser.add_option("--color", choices=["never", "always", "auto"],
+                      default="auto", help="never, always, or auto")
+    parser.add_option("--make", action="append", type="string", default=[],
+                      dest="make_args", help="arguments to make command")
+    parser.add_option("-n", "--runs", type="int", default=5,
+                      help="boots per workload (default 5)")
+    parser.add_option("--timeout", type="int", default=120,
+                      help="seconds per boot (default 120)")
+    parser.add_option("--baseline", default="bench-baseline.json",
+                      help="baseline to compare against")
+    parser.add_option("--save", metavar="PATH",
+                      help="write the results as a new baseline")
+    parser.add_option("--threshold", type="float", default=10,
+                      help="regression threshold in percent (default 10)")
+    parser.add_option("--output", default="bench.json",
+                      help="where to store results of this run")
+    (options, args) = parser.parse_args()
+    gradelib.options = options
+
+    make(*options.make_args)
+
+    baseline = {}
+    if os.path.exists(options.baseline):
+        with open(options.baseline) as f:
+            baseline = json.load(f)
+
+    results = {}
+    failed = False
+    limit = list(map(str.lower, args))
+    for name, target, make_args in WORKLOADS:
+        if limit and name.lower() not in limit:
+            continue
+
+        samples = []
+        for i in range(options.runs):
+            sys.stdout.write("%s: run %d/%d " % (name, i + 1, options.runs))
+            sys.stdout.flush()
+            start = time.time()
+            output = boot_once(target, options.make_args + make_args, options.timeout)
+            if output is None:
+                print(color("red", "FAIL"), "(no monitor prompt)")
+                failed = True
+                continue
+            samples.append(parse_metrics(output))
+            print("(%.1fs)" % (time.time() - start))
+
+        if samples:
+            summary = dict(("%s/%s" % (name, metric), s)
+                           for metric, s in summarize(samples).items())
+            show_summary(summary, baseline)
+            results.update(summary)
+
+    with open(options.output, "w") as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+    if options.save:
+        with open(options.save, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+        print("Baseline saved to %s" % options.save)
+
+    regressions = compare(results, baseline, options.threshold / 100)
+    for metric, old, new in regressions:
+        print("%s %s: %.3f -> %.3f (%+.1f%%)" % (color("red", "REGRESSION"),
+              metric, old, new, 100 * (new / old - 1) if old else float("inf")))
+    if baseline and not regressions:
+        print(color("green", "No regressions over %g%%" % options.threshold))
+
+    if failed or regressions:
+        sys.exit(1)
@@ -1,3 +1,4 @@
 LAB=7
 CONFIG_KSPACE=y
+CONFIG_SLAB=y
 LABDEFS=-Ddebug=0
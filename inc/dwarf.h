@@ -384,6 +384,7 @@ int line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_Off lin
 int function_by_info(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_Off cu_offset, char **buf, uintptr_t *offset);
 int address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *offset);
 int naive_address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *offset);
+int pubnames_foreach(const struct Dwarf_Addrs *addrs, int (*fn)(const char *name, uintptr_t addr, void *arg), void *arg);
 
 /* dwarf_entry_len - return the length of an FDE or CIE
  *
@@ -11,23 +11,26 @@ typedef int32_t envid_t;
 
 /* An environment ID 'envid_t' has three parts:
  *
- * +1+---------------21-----------------+--------10--------+
- * |0|          Uniqueifier             |   Environment    |
- * | |                                  |      Index       |
- * +------------------------------------+------------------+
- *                                       \--- ENVX(eid) --/
+ * +1+---------16---------+-------------15-------------+
+ * |0|     Uniqueifier     |    Environment Index       |
+ * +-----------------------+----------------------------+
+ *                          \------- ENVX(eid) --------/
  *
- * The environment index ENVX(eid) equals the environment's offset in the
- * 'envs[]' array.  The uniqueifier distinguishes environments that were
- * created at different times, but share the same environment index.
+ * The environment index ENVX(eid) is the environment's slot in the
+ * env table, which grows in chunks up to NENV slots (see kern/env.c).
+ * The uniqueifier distinguishes environments that were created at
+ * different times, but share the same environment index.
  *
  * All real environments are greater than 0 (so the sign bit is zero).
  * envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
  * stands for the current environment.
  */
 
-#define LOG2NENV    10
+#define LOG2NENV    15
 #define NENV        (1 << LOG2NENV)
+
+/* Performance counters kept per env, see kern/pmu.h */
+#define PMU_NEVENTS 5
 #define ENVX(envid) ((envid) & (NENV - 1))
 
 /* Values of env_status in struct Env */
@@ -54,22 +57,70 @@ struct AddressSpace {
     pml4e_t *pml4;     /* Virtual address of pml4 */
     uintptr_t cr3;     /* Physical address of pml4 */
     struct Page *root; /* root node of address space tree */
+    uint16_t pcid;     /* Process-context identifier, 0 if not assigned */
+    uint32_t pcid_gen; /* Value of pcid_generation when pcid was assigned */
+    struct Page *lookup_node; /* Last looked up 2MB subtree of root, see page_lookup_virtual() */
+    uintptr_t lookup_addr;    /* Base address of lookup_node */
+    uint16_t fault_around;    /* Max mappings resolved after a fault, 0 disables */
+    uint16_t fault_window;    /* Current window, grows on sequential faults */
+    uintptr_t fault_next;     /* End of the last range resolved on fault */
+    uint64_t faults_avoided;  /* Mappings resolved ahead of faults */
+    size_t ws_mapped;         /* User memory mapped at the last working set scan */
+    size_t ws_size;           /* Part of it accessed in the last WSS_WINDOW scans */
 };
 
 
+/* The fields the scheduler and envid2env() look at on every decision
+ * are kept in one cache line right after the trap frame (which has to
+ * stay the first field, see kern/entry.S), everything else follows */
 struct Env {
     struct Trapframe env_tf; /* Saved registers */
-    struct Env *env_link;    /* Next free Env */
-    envid_t env_id;          /* Unique environment identifier */
-    envid_t env_parent_id;   /* env_id of this env's parent */
+
+    /* Scheduler-hot state, exactly one cache line */
+    envid_t env_id __attribute__((aligned(64))); /* Unique environment identifier */
+    unsigned env_status;         /* Status of the environment */
+    int env_cpunum;              /* The CPU that the env last ran on */
+    uint32_t env_weight;         /* Share of CPU time, SCHED_WEIGHT_DEFAULT is normal */
+    struct List env_runq;        /* Link in the run queue while ENV_RUNNABLE */
+    struct Env *env_link;        /* Next free Env */
+    uint64_t env_vruntime;       /* Weighted TSC cycles consumed (fair class) */
+    uint64_t env_run_start;      /* TSC value when the env was last charged */
+    uint64_t env_runnable_since; /* TSC value when last put into a run queue */
+
+    envid_t env_parent_id __attribute__((aligned(64))); /* env_id of this env's parent */
     enum EnvType env_type;   /* Indicates special system environments */
-    unsigned env_status;     /* Status of the environment */
     uint32_t env_runs;       /* Number of times environment has run */
 
+    /* CPU accounting, TSC cycles, see sched_account_run() */
+    uint64_t env_user_cycles;   /* Running the env itself */
+    uint64_t env_kernel_cycles; /* In the kernel, from an entry until the next switch */
+    uint64_t env_wait_cycles;   /* Runnable, waiting for a CPU */
+    uint32_t env_nvcsw;         /* Switches away because it gave up the CPU */
+    uint32_t env_nivcsw;        /* Switches away because it was preempted */
+
     uint8_t *binary; /* Pointer to process ELF image in kernel memory */
 
+    /* IPC receive, see kern/syscall.c */
+    bool env_ipc_recving;    /* Env is blocked receiving */
+    uintptr_t env_ipc_dstva; /* VA at which to map received pages */
+    size_t env_ipc_maxsz;    /* Maximal size of that mapping */
+
+    /* Performance counter totals, see kern/pmu.c */
+    uint64_t env_pmc[PMU_NEVENTS];
+
+    /* Saved FPU registers once the env has used them, see kern/fpu.c */
+    void *env_fpu_state;
+
+    /* Futex wait, see kern/futex.c */
+    struct List env_futex;                /* Link in the wait queue */
+    struct AddressSpace *env_futex_space; /* Key waited on, NULL if not waiting */
+    uintptr_t env_futex_addr;
+
+    /* Heap window, 0 if none, see kern/uheap.c */
+    uintptr_t env_heap;
+
     /* Address space */
     struct AddressSpace address_space;
-};
+} __attribute__((aligned(64)));
 
 #endif /* !JOS_INC_ENV_H */
@@ -16,6 +16,9 @@
 #include <inc/env.h>
 #include <inc/memlayout.h>
 #include <inc/trap.h>
+#include <inc/syscall.h>
+#include <inc/ring.h>
+#include <inc/vsyscall.h>
 
 #ifdef SANITIZE_USER_SHADOW_BASE
 /* asan unpoison routine used for whitelisting regions. */
@@ -37,8 +40,95 @@ extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 
 #ifdef JOS_PROG
+/* System call through the SYSCALL instruction, see inc/syscall.h */
+static inline int64_t
+syscall(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    register uint64_t r10 asm("r10") = a4;
+    register uint64_t r8 asm("r8") = a5;
+    int64_t ret;
+
+    asm volatile("syscall"
+                 : "=a"(ret)
+                 : "a"(num), "D"(a1), "S"(a2), "d"(a3), "r"(r10), "r"(r8)
+                 : "rcx", "r11", "cc", "memory");
+    return ret;
+}
+
+/* Message received through IPC, see kern/syscall.c */
+struct IpcMessage {
+    envid_t from;  /* Sender */
+    uint64_t value;
+    size_t size;   /* Size of the pages mapped at dstva, 0 if none */
+    int perm;      /* Their protection */
+};
+
+/* IPC system call that waits for a message, which comes back in registers */
+static inline int64_t
+ipc_syscall(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5, struct IpcMessage *msg) {
+    register uint64_t r10 asm("r10") = a4;
+    register uint64_t r8 asm("r8") = a5;
+    int64_t ret = num;
+
+    asm volatile("syscall"
+                 : "+a"(ret), "+D"(a1), "+S"(a2), "+d"(a3), "+r"(r10)
+                 : "r"(r8)
+                 : "rcx", "r11", "cc", "memory");
+
+    if (!ret && msg) *msg = (struct IpcMessage){.from = a1, .value = a2, .size = a3, .perm = r10};
+    return ret;
+}
+
+static inline int
+ipc_recv(void *dstva, size_t maxsize, struct IpcMessage *msg) {
+    return ipc_syscall(SYS_ipc_recv, (uintptr_t)dstva, maxsize, 0, 0, 0, msg);
+}
+
+static inline int
+ipc_send(envid_t to, uint64_t value, void *srcva, size_t size, int perm) {
+    return syscall(SYS_ipc_send, to, value, (uintptr_t)srcva, size, perm);
+}
+
+static inline int
+ipc_call(envid_t to, uint64_t value, void *srcva, size_t size, int perm, struct IpcMessage *reply) {
+    return ipc_syscall(SYS_ipc_call, to, value, (uintptr_t)srcva, size, perm, reply);
+}
+
+static inline int
+ipc_reply_recv(envid_t to, uint64_t value, void *dstva, size_t maxsize, struct IpcMessage *msg) {
+    return ipc_syscall(SYS_ipc_reply_recv, to, value, (uintptr_t)dstva, maxsize, 0, msg);
+}
+
+static inline int
+futex_wait(volatile uint32_t *addr, uint32_t val) {
+    return syscall(SYS_futex_wait, (uintptr_t)addr, val, 0, 0, 0);
+}
+
+static inline int
+futex_wake(volatile uint32_t *addr, int n) {
+    return syscall(SYS_futex_wake, (uintptr_t)addr, n, 0, 0, 0);
+}
+
+/* ring.c */
+struct Ring {
+    int id;
+    struct RingHeader *hdr;
+    uint8_t *data;
+};
+
+int ring_create(struct Ring *ring, envid_t peer, void *va, void *peer_va, size_t size);
+int ring_attach(struct Ring *ring, int id);
+ssize_t ring_write(struct Ring *ring, const void *buf, size_t len);
+ssize_t ring_read(struct Ring *ring, void *buf, size_t len);
+
+/* malloc.c */
+void *malloc(size_t size);
+void free(void *ptr);
+void *calloc(size_t n, size_t size);
+void *realloc(void *ptr, size_t size);
+
 extern void (*volatile sys_exit)(void);
 extern void (*volatile sys_yield)(void);
+extern void (*volatile sys_sleep)(uint64_t nsec);
 #endif
 
 #ifndef debug
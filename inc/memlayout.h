@@ -16,8 +16,8 @@
 #define GD_KD   0x10 /* kernel data */
 #define GD_KT32 0x18 /* kernel text 32bit */
 #define GD_KD32 0x20 /* kernel data 32bit */
-#define GD_UT   0x28 /* user text */
-#define GD_UD   0x30 /* user data */
+#define GD_UD   0x28 /* user data, right below user text as SYSRET expects */
+#define GD_UT   0x30 /* user text */
 #define GD_TSS0 0x38 /* Task segment selector for CPU 0 */
 
 /*
@@ -168,6 +168,12 @@
 #define MAXOPEN   512
 #define FILE_BASE 0x200000000
 
+/* User heaps, one window per env that has called sys_heap_attach(),
+ * see kern/uheap.c. The windows end where the user ASAN shadow starts */
+#define UHEAP_BASE        0x1000000000
+#define UHEAP_WINDOW_SIZE 0x40000000ULL
+#define UHEAP_WINDOWS     192
+
 #ifdef SAN_ENABLE_KASAN
 /* (this *should* be defined as a literal number) */
 #define SANITIZE_SHADOW_BASE 0xA000000000
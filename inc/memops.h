@@ -0,0 +1,158 @@
+#ifndef JOS_INC_MEMOPS_H
+#define JOS_INC_MEMOPS_H
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+/* Copy and fill primitives shared by lib/string.c and the
+ * non-instrumented __nosan_* variants used by the sanitizers.
+ *
+ * String instructions are picked at run time from CPUID: with ERMS
+ * (or FSRM for short copies) "rep movsb/stosb" is the fastest way to
+ * move any amount of memory, otherwise quadwords are moved.
+ *
+ * With CONFIG_STRING_SIMD large operations use SSE2 non-temporal
+ * stores, which bypass the cache and don't evict the working set.
+ * The kernel neither uses nor saves vector registers, so this is
+ * off for it and can only be enabled for code that owns its FPU
+ * state (see CONFIG_USER_SIMD in GNUmakefile). */
+
+#define MEMOPS_ERMS  0x1        /* CPUID.(EAX=7,ECX=0):EBX[9] */
+#define MEMOPS_FSRM  0x2        /* CPUID.(EAX=7,ECX=0):EDX[4] */
+#define MEMOPS_READY 0x80000000 /* Features have been detected */
+
+/* Below this rep movsb is slow unless FSRM is present */
+#define MEMOPS_ERMS_THRESHOLD 64
+/* Copies and fills at least this large use non-temporal stores */
+#define MEMOPS_NT_THRESHOLD (64 * 1024)
+
+static inline uint32_t
+memops_features(void) {
+    static uint32_t features;
+
+    if (!features) {
+        uint32_t max_leaf, ebx = 0, edx = 0, res = MEMOPS_READY;
+        cpuid(0, &max_leaf, NULL, NULL, NULL);
+        if (max_leaf >= 7) cpuid_count(7, 0, NULL, &ebx, NULL, &edx);
+        if (ebx & (1 << 9)) res |= MEMOPS_ERMS;
+        if (edx & (1 << 4)) res |= MEMOPS_FSRM;
+        features = res;
+    }
+    return features;
+}
+
+#ifdef CONFIG_STRING_SIMD
+/* dst must be 16-byte aligned, n a multiple of 64 */
+static inline void __attribute__((target("sse2")))
+memops_copy_nt(void *dst, const void *src, size_t n) {
+    asm volatile("1:\n"
+                 "movdqu 0(%1), %%xmm0\n"
+                 "movdqu 16(%1), %%xmm1\n"
+                 "movdqu 32(%1), %%xmm2\n"
+                 "movdqu 48(%1), %%xmm3\n"
+                 "movntdq %%xmm0, 0(%0)\n"
+                 "movntdq %%xmm1, 16(%0)\n"
+                 "movntdq %%xmm2, 32(%0)\n"
+                 "movntdq %%xmm3, 48(%0)\n"
+                 "add $64, %0\n"
+                 "add $64, %1\n"
+                 "sub $64, %2\n"
+                 "jnz 1b\n"
+                 "sfence\n"
+                 : "+r"(dst), "+r"(src), "+r"(n)
+                 :
+                 : "xmm0", "xmm1", "xmm2", "xmm3", "cc", "memory");
+}
+
+/* dst must be 16-byte aligned, n a multiple of 64 */
+static inline void __attribute__((target("sse2")))
+memops_fill_nt(void *dst, uint64_t k, size_t n) {
+    asm volatile("movq %2, %%xmm0\n"
+                 "punpcklqdq %%xmm0, %%xmm0\n"
+                 "1:\n"
+                 "movntdq %%xmm0, 0(%0)\n"
+                 "movntdq %%xmm0, 16(%0)\n"
+                 "movntdq %%xmm0, 32(%0)\n"
+                 "movntdq %%xmm0, 48(%0)\n"
+                 "add $64, %0\n"
+                 "sub $64, %1\n"
+                 "jnz 1b\n"
+                 "sfence\n"
+                 : "+r"(dst), "+r"(n)
+                 : "r"(k)
+                 : "xmm0", "cc", "memory");
+}
+#endif
+
+static inline void
+memops_movsb(void *dst, const void *src, size_t n) {
+    asm volatile("cld; rep movsb\n"
+                 : "+D"(dst), "+S"(src), "+c"(n)
+                 :
+                 : "cc", "memory");
+}
+
+/* Forward copy, regions must not overlap unless dst < src */
+static inline void
+memops_copy(void *dst, const void *src, size_t n) {
+    uint32_t features = memops_features();
+
+#ifdef CONFIG_STRING_SIMD
+    if (n >= MEMOPS_NT_THRESHOLD) {
+        size_t head = -(uintptr_t)dst & 15;
+        memops_movsb(dst, src, head);
+        dst = (uint8_t *)dst + head, src = (const uint8_t *)src + head, n -= head;
+
+        size_t body = n & ~(size_t)63;
+        memops_copy_nt(dst, src, body);
+        dst = (uint8_t *)dst + body, src = (const uint8_t *)src + body, n -= body;
+    }
+#endif
+
+    if ((features & MEMOPS_FSRM) || ((features & MEMOPS_ERMS) && n >= MEMOPS_ERMS_THRESHOLD)) {
+        memops_movsb(dst, src, n);
+        return;
+    }
+
+    size_t words = n / 8;
+    asm volatile("cld; rep movsq\n"
+                 : "+D"(dst), "+S"(src), "+c"(words)
+                 :
+                 : "cc", "memory");
+    memops_movsb(dst, src, n & 7);
+}
+
+static inline void
+memops_fill(void *dst, int c, size_t n) {
+    uint32_t features = memops_features();
+    uint64_t k = 0x101010101010101ULL * (c & 0xFFU);
+
+#ifdef CONFIG_STRING_SIMD
+    if (n >= MEMOPS_NT_THRESHOLD) {
+        size_t head = -(uintptr_t)dst & 15;
+        for (size_t i = 0; i < head; i++) ((uint8_t *)dst)[i] = c;
+        dst = (uint8_t *)dst + head, n -= head;
+
+        size_t body = n & ~(size_t)63;
+        memops_fill_nt(dst, k, body);
+        dst = (uint8_t *)dst + body, n -= body;
+    }
+#endif
+
+    if ((features & MEMOPS_ERMS) && n >= MEMOPS_ERMS_THRESHOLD) {
+        asm volatile("cld; rep stosb\n"
+                     : "+D"(dst), "+c"(n)
+                     : "a"(c)
+                     : "cc", "memory");
+        return;
+    }
+
+    size_t words = n / 8;
+    asm volatile("cld; rep stosq\n"
+                 : "+D"(dst), "+c"(words)
+                 : "a"(k)
+                 : "cc", "memory");
+    for (size_t i = 0; i < (n & 7); i++) ((uint8_t *)dst)[i] = c;
+}
+
+#endif /* !JOS_INC_MEMOPS_H */
@@ -117,6 +117,9 @@
 #define CR0_CD 0x40000000 /* Cache Disable */
 #define CR0_PG 0x80000000 /* Paging */
 
+#define CR3_PCID_MASK 0x00000FFF /* PCID of the loaded address space (CR4_PCIDE) */
+#define CR3_NOFLUSH   (1ULL << 63) /* Keep TLB entries of the loaded PCID */
+
 #define CR4_VME        0x00000001 /* V86 Mode Extensions */
 #define CR4_PVI        0x00000002 /* Protected-Mode Virtual Interrupts */
 #define CR4_TSD        0x00000004 /* Time Stamp Disable */
@@ -144,6 +147,37 @@
 #define EFER_LME (1ULL << 8)
 #define EFER_LMA (1ULL << 10)
 #define EFER_NXE (1ULL << 11)
+#define EFER_SCE (1ULL << 0) /* SYSCALL/SYSRET enable */
+
+/* SYSCALL/SYSRET: segment selector bases, entry point
+ * and RFLAGS bits cleared on SYSCALL */
+#define STAR_MSR  0xC0000081
+#define LSTAR_MSR 0xC0000082
+#define FMASK_MSR 0xC0000084
+
+/* Value RDTSCP returns in %ecx along with the TSC */
+#define TSC_AUX_MSR 0xC0000103
+
+/* Page attribute table. The PAT, PCD and PWT bits of an entry
+ * select one of its 8 memory types, entry i is in byte i */
+#define PAT_MSR       0x277
+#define PAT_UC        0x00
+#define PAT_WC        0x01
+#define PAT_WT        0x04
+#define PAT_WB        0x06
+#define PAT_UC_MINUS  0x07
+#define PAT_ENTRY(i, type) ((uint64_t)(type) << (8 * (i)))
+
+/* Architectural performance monitoring, counter i of each kind */
+#define PERFEVTSEL_MSR(i)     (0x186 + (i))
+#define PMC_MSR(i)            (0xC1 + (i))
+#define FIXED_CTR_MSR(i)      (0x309 + (i))
+#define FIXED_CTR_CTRL_MSR    0x38D
+#define PERF_GLOBAL_CTRL_MSR  0x38F
+#define PERFEVTSEL_USR        (1 << 16)
+#define PERFEVTSEL_OS         (1 << 17)
+#define PERFEVTSEL_EN         (1 << 22)
+#define FIXED_CTR_CTRL_ALL(i) (3ULL << (4 * (i))) /* Count in ring 0 and 3 */
 
 /* RFLAGS register */
 #define FL_CF        0x00000001 /* Carry Flag */
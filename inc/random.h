@@ -1,10 +1,25 @@
 #ifndef _INC_RANDOM_H_
 #define _INC_RANDOM_H_
 
+#include <inc/types.h>
+
 #define RAND_MAX 0x7FFFFFFF
 
+/* Pseudo-random generator state (xoshiro256**).
+ * Every thread or env should have its own, the state
+ * behind rand() is shared by all of its users */
+struct RandState {
+    uint64_t s[4];
+};
+
+extern void rand_seed(struct RandState *state, uint64_t seed);
+extern uint64_t rand_next(struct RandState *state);
+extern void rand_fill_r(struct RandState *state, void *buf, size_t n);
+
+/* Same on the state seeded by srand() and rand_init() */
 extern int rand(void);
 extern void srand(unsigned int seed);
+extern void rand_fill(void *buf, size_t n);
 extern void rand_init(unsigned int num);
 extern unsigned char _dev_urandom[];
 extern unsigned int _dev_urandom_len;
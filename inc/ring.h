@@ -0,0 +1,31 @@
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+/* Single-producer, single-consumer ring shared between two envs.
+ *
+ * The ring is one header page followed by a power of two data area,
+ * mapped into both envs. The producer only moves head, the consumer
+ * only moves tail, both count bytes from the start and wrap around on
+ * access. The counters are on separate cache lines, so the two sides
+ * don't bounce a line on every update.
+ *
+ * Nothing goes through the kernel while the ring is neither empty nor
+ * full. A side that finds it empty (full) sets its waiting flag, checks
+ * again and blocks in sys_ring_wait() only if nothing has changed. The
+ * other side calls sys_ring_wake() after an update only if it sees the
+ * flag set. See lib/ring.c */
+
+#define RING_DATA_OFFSET PAGE_SIZE
+
+struct RingHeader {
+    volatile uint64_t head __attribute__((aligned(64))); /* Bytes written, moved by the producer */
+    volatile uint64_t tail __attribute__((aligned(64))); /* Bytes read, moved by the consumer */
+    volatile uint32_t reader_waiting __attribute__((aligned(64)));
+    volatile uint32_t writer_waiting;
+    uint64_t size; /* Data area size, set by the kernel on creation */
+};
+
+#endif /* !JOS_INC_RING_H */
@@ -22,12 +22,14 @@
 
 /* lib/stdio.c */
 void cputchar(int c);
+void cputs(const char *str, size_t len);
 int getchar(void);
 int iscons(int fd);
 
 /* lib/printfmt.c */
 void printfmt(void (*putch)(int, void *), void *putdat, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 void vprintfmt(void (*putch)(int, void *), void *putdat, const char *fmt, va_list) __attribute__((format(printf, 3, 0)));
+void vprintfmt_puts(void (*putstr)(const char *, size_t, void *), void *putdat, const char *fmt, va_list) __attribute__((format(printf, 3, 0)));
 int snprintf(char *str, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 int vsnprintf(char *str, size_t size, const char *fmt, va_list) __attribute__((format(printf, 3, 0)));
 
@@ -0,0 +1,32 @@
+#ifndef JOS_INC_SYSCALL_H
+#define JOS_INC_SYSCALL_H
+
+/* System call numbers.
+ *
+ * The number is passed in %rax and up to five arguments in %rdi, %rsi,
+ * %rdx, %r10 and %r8, the result is returned in %rax. Both the SYSCALL
+ * instruction and int $T_SYSCALL use this convention, SYSCALL itself
+ * clobbers %rcx and %r11 */
+enum {
+    SYS_cputs = 0,
+    SYS_getenvid,
+    SYS_yield,
+    SYS_sleep,
+    SYS_exit,
+    SYS_ipc_recv,
+    SYS_ipc_send,
+    SYS_ipc_call,
+    SYS_ipc_reply_recv,
+    SYS_ring_create,
+    SYS_ring_attach,
+    SYS_ring_wait,
+    SYS_ring_wake,
+    SYS_futex_wait,
+    SYS_futex_wake,
+    SYS_heap_attach,
+    SYS_heap_map,
+    SYS_heap_unmap,
+    NSYSCALLS
+};
+
+#endif /* !JOS_INC_SYSCALL_H */
@@ -27,6 +27,7 @@
 /* These are arbitrarily chosen, but with care not to overlap
  * processor defined exceptions or interrupt vectors.*/
 #define T_SYSCALL 48  /* system call */
+#define T_FASTCALL 49 /* system call through the SYSCALL instruction */
 #define T_DEFAULT 500 /* catchall */
 
 // The first 0x20 entries
@@ -50,6 +51,11 @@
 #define UTRAP_RSP 152
 #define UTRAP_RIP 136
 
+/* sizeof(struct Trapframe), and offsets used by the entry code */
+#define TRAPFRAME_SIZE 192
+#define TF_TRAPNO      136
+#define TF_RSP         176
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
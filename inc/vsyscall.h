@@ -0,0 +1,44 @@
+#ifndef JOS_INC_VSYSCALL_H
+#define JOS_INC_VSYSCALL_H
+
+#include <inc/types.h>
+#include <inc/env.h>
+#include <inc/memlayout.h>
+
+/* Kernel data page mapped read-only at UVSYS in every address space.
+ *
+ * Time is computed from the TSC: the wall clock time was boot_time_ns
+ * when the TSC read tsc_base. The kernel updates the three clock fields
+ * together under the seqlock 'seq', which is odd while an update is in
+ * progress. Readers retry until they see the same even value before
+ * and after reading the fields, see lib/vsyscall.c.
+ *
+ * cpu[i] is the env running on CPU i; RDTSCP returns i in TSC_AUX
+ * if the CPU has it (rdtscp set), otherwise there is only cpu[0]. */
+
+#define VSYS_CPUS 8
+
+struct VsysPage {
+    volatile uint32_t seq;
+    volatile uint64_t tsc_freq;     /* Hz */
+    volatile uint64_t tsc_base;     /* TSC value at boot_time_ns */
+    volatile uint64_t boot_time_ns; /* Nanoseconds since 1970-01-01 00:00 UTC */
+
+    bool rdtscp;
+    struct {
+        volatile envid_t env_id; /* 0 if idle */
+        volatile uint32_t env_runs;
+        volatile uintptr_t env_heap; /* Its heap window, 0 if none */
+    } __attribute__((aligned(64))) cpu[VSYS_CPUS];
+};
+
+#ifndef JOS_KERNEL
+#define vsys ((const struct VsysPage *)UVSYS)
+
+uint64_t vsys_time_ns(void);
+envid_t vsys_getenvid(void);
+uint32_t vsys_env_runs(void);
+uintptr_t vsys_env_heap(void);
+#endif
+
+#endif /* !JOS_INC_VSYSCALL_H */
@@ -183,9 +183,8 @@ rdmsr(uint32_t msr) {
 static inline void __attribute__((always_inline))
 wrmsr(uint32_t msr, uint64_t val) {
     uint64_t rax = val & 0xFFFFFFFF, rdx = val >> 32;
-    asm volatile("rdmsr"
-                 : "=a"(rax), "=d"(rdx)
-                 : "c"(msr));
+    asm volatile("wrmsr" ::"a"(rax), "d"(rdx), "c"(msr)
+                 : "memory");
 }
 
 static inline void __attribute__((always_inline))
@@ -245,6 +244,55 @@ cpuid(uint32_t info, uint32_t *raxp, uint32_t *rbxp, uint32_t *rcxp, uint32_t *r
     if (rdxp) *rdxp = edx;
 }
 
+/* cpuid for leaves with subleaves (e.g. 7), subleaf is passed in ecx */
+static inline void __attribute__((always_inline))
+cpuid_count(uint32_t info, uint32_t subleaf, uint32_t *raxp, uint32_t *rbxp, uint32_t *rcxp, uint32_t *rdxp) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid"
+                 : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                 : "a"(info), "c"(subleaf));
+    if (raxp) *raxp = eax;
+    if (rbxp) *rbxp = ebx;
+    if (rcxp) *rcxp = ecx;
+    if (rdxp) *rdxp = edx;
+}
+
+/* Extended processor state, see kern/fpu.c */
+static inline void __attribute__((always_inline))
+clts(void) {
+    asm volatile("clts");
+}
+
+static inline void __attribute__((always_inline))
+xsetbv(uint32_t xcr, uint64_t val) {
+    asm volatile("xsetbv" ::"c"(xcr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline void __attribute__((always_inline))
+xsave(void *area, uint64_t mask) {
+    asm volatile("xsave64 %0" : "+m"(*(uint8_t(*)[512])area) : "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+static inline void __attribute__((always_inline))
+xsaveopt(void *area, uint64_t mask) {
+    asm volatile("xsaveopt64 %0" : "+m"(*(uint8_t(*)[512])area) : "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+static inline void __attribute__((always_inline))
+xrstor(const void *area, uint64_t mask) {
+    asm volatile("xrstor64 %0" ::"m"(*(const uint8_t(*)[512])area), "a"((uint32_t)mask), "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+static inline void __attribute__((always_inline))
+fxsave(void *area) {
+    asm volatile("fxsave64 %0" : "=m"(*(uint8_t(*)[512])area) :: "memory");
+}
+
+static inline void __attribute__((always_inline))
+fxrstor(const void *area) {
+    asm volatile("fxrstor64 %0" ::"m"(*(const uint8_t(*)[512])area) : "memory");
+}
+
 static inline uint64_t __attribute__((always_inline))
 read_tsc(void) {
     uint32_t lo, hi;
@@ -253,6 +301,15 @@ read_tsc(void) {
     return (uint64_t)lo | ((uint64_t)hi << 32);
 }
 
+/* TSC together with TSC_AUX_MSR of the CPU it was read on */
+static inline uint64_t __attribute__((always_inline))
+read_tscp(uint32_t *aux) {
+    uint32_t lo, hi;
+    asm volatile("rdtscp"
+                 : "=a"(lo), "=d"(hi), "=c"(*aux));
+    return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
 static inline uint32_t __attribute__((always_inline))
 xchg(volatile uint32_t *addr, uint32_t newval) {
     uint32_t result = __atomic_exchange_n(addr, newval, __ATOMIC_ACQ_REL);
@@ -2,11 +2,33 @@
 #include <kern/alloc.h>
 #include <inc/assert.h>
 #include <kern/spinlock.h>
+#include <kern/kmalloc.h>
+
+#ifdef CONFIG_SLAB
+
+/* Object caches from kern/kmalloc.c are used,
+ * first-fit arena below is kept as a debug fallback
+ * (build without CONFIG_SLAB to enable it) */
+
+void *
+test_alloc(uint8_t nbytes) {
+    return kmalloc(nbytes);
+}
+
+void
+test_free(void *ap) {
+    kfree(ap);
+}
+
+#else
 
 #define SPACE_SIZE 5 * 0x1000
 
 static uint8_t space[SPACE_SIZE];
 
+/* Protects the free list below */
+static struct spinlock alloc_lock = SPINLOCK_INITIALIZER(alloc_lock, LOCK_ORDER_ALLOC);
+
 /* empty list to get started */
 static Header base = {.next = (Header *)space, .prev = (Header *)space};
 /* start of free list */
@@ -29,7 +51,7 @@ test_alloc(uint8_t nbytes) {
 
     /* Make allocator thread-safe with the help of spin_lock/spin_unlock. */
     // LAB 5: Your code here
-    lock_kernel();
+    spin_lock(&alloc_lock);
 
     size_t nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
 
@@ -59,13 +81,13 @@ test_alloc(uint8_t nbytes) {
                 p += p->size;
                 p->size = nunits;
             }
-            unlock_kernel();
+            spin_unlock(&alloc_lock);
             return (void *)(p + 1);
         }
 
         /* wrapped around free list */
         if (p == freep) {
-            unlock_kernel();
+            spin_unlock(&alloc_lock);
             return NULL;
         }
     }
@@ -83,7 +105,7 @@ test_free(void *ap) {
 
     /* Make allocator thread-safe with the help of spin_lock/spin_unlock. */
     // LAB 5: Your code here
-    lock_kernel();
+    spin_lock(&alloc_lock);
 
     /* freed block at start or end of arena */
     Header *p = freep;
@@ -112,6 +134,8 @@ test_free(void *ap) {
 
     check_list();
 
-    unlock_kernel();
+    spin_unlock(&alloc_lock);
 
 }
+
+#endif
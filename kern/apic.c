@@ -0,0 +1,354 @@
+/* Local APIC and IO-APIC support, discovered through the ACPI MADT */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+
+#include <kern/apic.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/pmap.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
+
+/* Local APIC registers, byte offsets from its base */
+#define LAPIC_ID         0x020
+#define LAPIC_TPR        0x080 /* Task priority */
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0 /* Spurious interrupt vector */
+#define LAPIC_SVR_ENABLE 0x100 /*     APIC software enable */
+#define LAPIC_ESR        0x280 /* Error status */
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_LVT_LINT1  0x360
+#define LAPIC_LVT_ERROR  0x370
+#define LAPIC_LVT_NMI    0x00400 /* NMI delivery mode */
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_LVT_TSC_DEADLINE 0x40000 /* Timer mode: fire at IA32_TSC_DEADLINE */
+
+#define IA32_TSC_DEADLINE      0x6E0
+#define CPUID_ECX_TSC_DEADLINE (1 << 24)
+
+/* Scheduler tick of the LAPIC timer */
+#define LAPIC_TIMER_HZ 100
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+/* IO-APIC registers are accessed through a select/window pair */
+#define IOAPIC_REGSEL      0x00
+#define IOAPIC_WINDOW      0x10
+#define IOAPIC_VER         0x01
+#define IOAPIC_REDTBL(pin) (0x10 + 2 * (pin))
+#define IOAPIC_ACTIVE_LOW  0x02000 /* Redirection entry bits */
+#define IOAPIC_LEVEL       0x08000
+#define IOAPIC_MASKED      0x10000
+
+/* MPS INTI flags of interrupt source overrides */
+#define MPS_POLARITY_MASK 0x3
+#define MPS_POLARITY_LOW  0x3
+#define MPS_TRIGGER_MASK  0xC
+#define MPS_TRIGGER_LEVEL 0xC
+
+#define MAX_IOAPICS  4
+#define IOAPIC_NO_PIN 0xFFFFFFFF
+
+struct IoApic {
+    volatile uint32_t *base;
+    uint32_t gsi_base;
+    uint32_t npins;
+};
+
+bool apic_enabled = 0;
+
+static volatile uint32_t *lapic;
+static struct IoApic ioapics[MAX_IOAPICS];
+static size_t nioapics;
+
+/* APIC ids of the enabled processors, in MADT order */
+static uint8_t cpu_apic_ids[NCPU];
+static size_t ncpu_apic_ids;
+
+/* Where each ISA IRQ arrives: identity mapped, edge triggered,
+ * active high, unless the MADT overrides it */
+static struct {
+    uint32_t gsi;
+    uint32_t flags; /* IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL */
+    uint8_t apic_id;
+    bool masked;
+} isa_irqs[MAX_IRQS];
+
+static inline uint32_t
+lapic_read(uint32_t reg) {
+    return lapic[reg / sizeof(uint32_t)];
+}
+
+static inline void
+lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / sizeof(uint32_t)] = val;
+    /* Wait for the write to finish by reading */
+    (void)lapic[LAPIC_ID / sizeof(uint32_t)];
+}
+
+static uint32_t
+ioapic_read(struct IoApic *io, uint32_t reg) {
+    io->base[IOAPIC_REGSEL / sizeof(uint32_t)] = reg;
+    return io->base[IOAPIC_WINDOW / sizeof(uint32_t)];
+}
+
+static void
+ioapic_write(struct IoApic *io, uint32_t reg, uint32_t val) {
+    io->base[IOAPIC_REGSEL / sizeof(uint32_t)] = reg;
+    io->base[IOAPIC_WINDOW / sizeof(uint32_t)] = val;
+}
+
+static struct IoApic *
+ioapic_for_gsi(uint32_t gsi) {
+    for (size_t i = 0; i < nioapics; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].npins)
+            return &ioapics[i];
+    }
+    return NULL;
+}
+
+/* Write the redirection entry of an ISA IRQ from isa_irqs[] */
+static void
+ioapic_program(uint8_t irq) {
+    struct IoApic *io = ioapic_for_gsi(isa_irqs[irq].gsi);
+    if (!io) return;
+
+    uint32_t pin = isa_irqs[irq].gsi - io->gsi_base;
+    uint32_t low = (IRQ_OFFSET + irq) | isa_irqs[irq].flags;
+    if (isa_irqs[irq].masked) low |= IOAPIC_MASKED;
+
+    /* Mask while the destination changes */
+    ioapic_write(io, IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+    ioapic_write(io, IOAPIC_REDTBL(pin) + 1, (uint32_t)isa_irqs[irq].apic_id << 24);
+    ioapic_write(io, IOAPIC_REDTBL(pin), low);
+}
+
+uint32_t
+lapic_id(void) {
+    return lapic ? lapic_read(LAPIC_ID) >> 24 : 0;
+}
+
+/* Signal the end of an interrupt, a single MMIO write */
+void
+lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+/* Enable the local APIC of this CPU */
+void
+lapic_init(void) {
+    if (!lapic) return;
+
+    /* Only the IO-APIC delivers external interrupts, the 8259
+     * virtual wire on LINT0 is not used */
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+
+    /* Clear errors, back-to-back writes are required */
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ESR, 0);
+
+    /* Acknowledge any outstanding interrupt, accept all priorities */
+    lapic_write(LAPIC_EOI, 0);
+    lapic_write(LAPIC_TPR, 0);
+}
+
+void
+ioapic_set_mask(uint8_t irq, bool masked) {
+    assert(irq < MAX_IRQS);
+    isa_irqs[irq].masked = masked;
+    ioapic_program(irq);
+}
+
+/* Deliver irq to the given CPU from now on */
+int
+ioapic_route(uint8_t irq, int cpu) {
+    if (irq >= MAX_IRQS || cpu < 0 || cpu >= (int)ncpu_apic_ids) return -E_INVAL;
+
+    isa_irqs[irq].apic_id = cpu_apic_ids[cpu];
+    ioapic_program(irq);
+    return 0;
+}
+
+static void
+madt_parse(MADT *madt, uint64_t *lapic_base) {
+    uint8_t *ptr = madt->Entries;
+    uint8_t *end = (uint8_t *)madt + madt->h.Length;
+
+    while (ptr + sizeof(MADTEntry) <= end) {
+        MADTEntry *entry = (MADTEntry *)ptr;
+        if (entry->Length < sizeof(MADTEntry) || ptr + entry->Length > end) break;
+
+        switch (entry->Type) {
+        case MADT_LAPIC: {
+            MADTLapic *cpu = (MADTLapic *)entry;
+            if ((cpu->Flags & MADT_LAPIC_ENABLED) && ncpu_apic_ids < NCPU)
+                cpu_apic_ids[ncpu_apic_ids++] = cpu->ApicId;
+            break;
+        }
+        case MADT_IOAPIC: {
+            MADTIoApic *io = (MADTIoApic *)entry;
+            if (nioapics < MAX_IOAPICS) {
+                ioapics[nioapics].base = mmio_map_region(io->IoApicAddress, PAGE_SIZE);
+                ioapics[nioapics].gsi_base = io->GsiBase;
+                ioapics[nioapics].npins = ((ioapic_read(&ioapics[nioapics], IOAPIC_VER) >> 16) & 0xFF) + 1;
+                nioapics++;
+            }
+            break;
+        }
+        case MADT_ISO: {
+            MADTIso *iso = (MADTIso *)entry;
+            /* Bus 0 is ISA, the only one with overrides */
+            if (iso->Bus || iso->Source >= MAX_IRQS) break;
+            uint32_t flags = 0;
+            if ((iso->Flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW) flags |= IOAPIC_ACTIVE_LOW;
+            if ((iso->Flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL) flags |= IOAPIC_LEVEL;
+            isa_irqs[iso->Source].gsi = iso->Gsi;
+            isa_irqs[iso->Source].flags = flags;
+            break;
+        }
+        case MADT_LAPIC_OVERRIDE:
+            *lapic_base = ((MADTLapicOverride *)entry)->LapicAddress;
+            break;
+        }
+
+        ptr += entry->Length;
+    }
+}
+
+/* Switch interrupt delivery from the 8259s to the IO-APIC. Returns
+ * false and leaves everything alone if the firmware reports none.
+ * All ISA IRQs start masked and routed to the boot CPU */
+bool
+apic_init(void) {
+    MADT *madt = get_madt();
+    if (!madt) return 0;
+
+    for (uint8_t irq = 0; irq < MAX_IRQS; irq++) {
+        isa_irqs[irq].gsi = irq;
+        isa_irqs[irq].flags = 0;
+        isa_irqs[irq].masked = 1;
+    }
+
+    uint64_t lapic_base = madt->LocalApicAddress ? madt->LocalApicAddress : LAPIC_DEFAULT_BASE;
+    madt_parse(madt, &lapic_base);
+    if (!nioapics) return 0;
+
+    /* An IRQ whose pin was taken by an override of another one
+     * (typically the timer on pin 2) has no pin of its own */
+    for (uint8_t irq = 0; irq < MAX_IRQS; irq++) {
+        uint32_t gsi = isa_irqs[irq].gsi;
+        if (gsi != irq && gsi < MAX_IRQS && isa_irqs[gsi].gsi == gsi)
+            isa_irqs[gsi].gsi = IOAPIC_NO_PIN;
+    }
+
+    /* Pins past the ISA IRQs are not used yet, whatever the firmware left */
+    for (size_t i = 0; i < nioapics; i++) {
+        for (uint32_t pin = 0; pin < ioapics[i].npins; pin++)
+            ioapic_write(&ioapics[i], IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+    }
+
+    lapic = mmio_map_region(lapic_base, PAGE_SIZE);
+    lapic_init();
+
+    uint8_t boot_id = lapic_id();
+    for (uint8_t irq = 0; irq < MAX_IRQS; irq++) {
+        isa_irqs[irq].apic_id = boot_id;
+        ioapic_program(irq);
+    }
+
+    if (!ncpu_apic_ids) cpu_apic_ids[ncpu_apic_ids++] = boot_id;
+
+    apic_enabled = 1;
+    return 1;
+}
+
+/* Local APIC timer in TSC-deadline mode. The periodic tick is emulated
+ * by arming the next deadline from the interrupt, which makes one-shot
+ * deadlines of any length just as cheap */
+
+struct Timer timer_lapic = {
+        .timer_name = "lapic",
+        .get_cpu_freq = tsc_calibrate,
+        .enable_interrupts = lapic_timer_enable_interrupts,
+        .handle_interrupts = lapic_timer_handle_interrupts,
+        .set_oneshot = lapic_timer_set_oneshot,
+        .resume_periodic = lapic_timer_resume_periodic,
+};
+
+/* TSC cycles per tick */
+static uint64_t lapic_timer_period;
+
+/* Per-CPU: the deadline currently armed, 0 if none, and whether
+ * the interrupt arms the next periodic one */
+static uint64_t lapic_timer_deadline[NCPU];
+static bool lapic_timer_periodic[NCPU];
+
+bool
+lapic_timer_supported(void) {
+    uint32_t ecx;
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    return apic_enabled && (ecx & CPUID_ECX_TSC_DEADLINE);
+}
+
+static void
+lapic_timer_arm(uint64_t deadline) {
+    lapic_timer_deadline[cpunum()] = deadline;
+    wrmsr(IA32_TSC_DEADLINE, deadline);
+}
+
+void
+lapic_timer_enable_interrupts(void) {
+    if (!lapic_timer_supported()) panic("LAPIC timer has no TSC-deadline mode");
+
+    lapic_timer_period = tsc_calibrate() / LAPIC_TIMER_HZ;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_TSC_DEADLINE | (IRQ_OFFSET + IRQ_TIMER));
+    /* The LVT write must be visible before the MSR is armed */
+    asm volatile("mfence" ::: "memory");
+
+    lapic_timer_resume_periodic();
+}
+
+void
+lapic_timer_handle_interrupts(void) {
+    int cpu = cpunum();
+
+    if (lapic_timer_periodic[cpu]) {
+        /* Keep the tick on its grid unless we fell behind by a whole period */
+        uint64_t now = read_tsc();
+        uint64_t next = lapic_timer_deadline[cpu] + lapic_timer_period;
+        lapic_timer_arm(next > now ? next : now + lapic_timer_period);
+    } else {
+        lapic_timer_deadline[cpu] = 0;
+    }
+
+    lapic_eoi();
+}
+
+void
+lapic_timer_set_oneshot(uint64_t nsec) {
+    lapic_timer_periodic[cpunum()] = 0;
+    if (!nsec) {
+        /* Writing 0 disarms the timer */
+        lapic_timer_arm(0);
+        return;
+    }
+
+    uint64_t freq = tsc_calibrate();
+    uint64_t cycles = nsec / 1000000000ULL * freq + nsec % 1000000000ULL * freq / 1000000000ULL;
+    lapic_timer_arm(read_tsc() + (cycles ? cycles : 1));
+}
+
+void
+lapic_timer_resume_periodic(void) {
+    lapic_timer_periodic[cpunum()] = 1;
+    lapic_timer_arm(read_tsc() + lapic_timer_period);
+}
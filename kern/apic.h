@@ -0,0 +1,31 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_APIC_H
+#define JOS_KERN_APIC_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/* Local APIC and IO-APIC interrupt delivery. When the MADT describes
+ * an IO-APIC, apic_init() takes over from the 8259 pair and the
+ * pic_irq_*() and pic_send_eoi() functions in kern/picirq.c
+ * are served by these instead */
+extern bool apic_enabled;
+
+bool apic_init(void);
+void lapic_init(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+void ioapic_set_mask(uint8_t irq, bool masked);
+int ioapic_route(uint8_t irq, int cpu);
+
+bool lapic_timer_supported(void);
+void lapic_timer_enable_interrupts(void);
+void lapic_timer_handle_interrupts(void);
+void lapic_timer_set_oneshot(uint64_t nsec);
+void lapic_timer_resume_periodic(void);
+
+#endif /* !JOS_KERN_APIC_H */
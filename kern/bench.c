@@ -0,0 +1,258 @@
+/* In-kernel microbenchmarks, see the bench monitor command */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/bench.h>
+#include <kern/kdebug.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/trap.h>
+
+/* A benchmark times iterations of run(). setup() and teardown(),
+ * both optional, are called once around the whole series */
+struct Benchmark {
+    const char *name;
+    int (*setup)(void);
+    void (*run)(void);
+    void (*teardown)(void);
+};
+
+/* Scratch address space for the mapping benchmarks */
+static struct AddressSpace bench_space;
+#define BENCH_VA 0x10000000ULL
+
+static int
+bench_space_setup(void) {
+    return init_address_space(&bench_space);
+}
+
+static void
+bench_space_teardown(void) {
+    release_address_space(&bench_space);
+}
+
+static void
+bench_alloc_page_4k(void) {
+    kfree_page(kalloc_page(0), 0);
+}
+
+static void
+bench_alloc_page_2m(void) {
+    kfree_page(kalloc_page(9), 9);
+}
+
+#define BENCH_MAP(class)                                                                              \
+    static void                                                                                       \
+    bench_map_##class(void) {                                                                         \
+        int res = map_region(&bench_space, BENCH_VA, NULL, 0, CLASS_SIZE(class), PROT_R | PROT_W | ALLOC_ZERO); \
+        assert(!res);                                                                                 \
+        unmap_region(&bench_space, BENCH_VA, CLASS_SIZE(class));                                      \
+    }
+
+BENCH_MAP(0)
+BENCH_MAP(4)
+BENCH_MAP(9)
+
+static void
+bench_switch_space(void) {
+    struct AddressSpace *old = switch_address_space(&bench_space);
+    switch_address_space(old);
+}
+
+static struct spinlock bench_lock;
+
+static int
+bench_lock_setup(void) {
+    spin_initlock(&bench_lock, LOCK_ORDER_NONE);
+    return 0;
+}
+
+static void
+bench_spin_lock(void) {
+    spin_lock(&bench_lock);
+    spin_unlock(&bench_lock);
+}
+
+/* Buffers for memcpy/memset, two halves of one block */
+#define BENCH_BUF_CLASS 5
+#define BENCH_BUF_SIZE  (CLASS_SIZE(BENCH_BUF_CLASS) / 2)
+
+static uint8_t *bench_buf;
+
+static int
+bench_buf_setup(void) {
+    bench_buf = kalloc_page(BENCH_BUF_CLASS);
+    return bench_buf ? 0 : -E_NO_MEM;
+}
+
+static void
+bench_buf_teardown(void) {
+    kfree_page(bench_buf, BENCH_BUF_CLASS);
+    bench_buf = NULL;
+}
+
+#define BENCH_MEM(size)                                       \
+    static void                                               \
+    bench_memcpy_##size(void) {                               \
+        memcpy(bench_buf, bench_buf + BENCH_BUF_SIZE, size);  \
+    }                                                         \
+    static void                                               \
+    bench_memset_##size(void) {                               \
+        memset(bench_buf, 0x5A, size);                        \
+    }                                                         \
+    static_assert(size <= BENCH_BUF_SIZE, "Buffer too small")
+
+BENCH_MEM(64);
+BENCH_MEM(4096);
+BENCH_MEM(65536);
+
+static void
+bench_cprintf(void) {
+    /* Returns the carriage, so the series doesn't scroll the console */
+    cprintf("\r");
+}
+
+static void
+bench_debuginfo_rip(void) {
+    struct Ripdebuginfo info;
+    debuginfo_rip((uintptr_t)bench_debuginfo_rip, &info);
+}
+
+/* Bare kernel entry and exit through SYSCALL/popfq and int/iretq. The
+ * vectors point to stubs that return right away for the duration */
+static uint64_t bench_saved_lstar;
+static struct Gatedesc bench_saved_gate;
+
+static int
+bench_syscall_setup(void) {
+    extern void bench_syscall_ret(void);
+    bench_saved_lstar = rdmsr(LSTAR_MSR);
+    wrmsr(LSTAR_MSR, (uintptr_t)bench_syscall_ret);
+    return 0;
+}
+
+static void
+bench_syscall_teardown(void) {
+    wrmsr(LSTAR_MSR, bench_saved_lstar);
+}
+
+static void
+bench_syscall(void) {
+    asm volatile("syscall" ::
+                         : "rcx", "r11", "memory");
+}
+
+static int
+bench_int_setup(void) {
+    extern void bench_int_ret(void);
+    bench_saved_gate = idt[T_SYSCALL];
+    idt[T_SYSCALL] = GATE(0, GD_KT, &bench_int_ret, 0);
+    return 0;
+}
+
+static void
+bench_int_teardown(void) {
+    idt[T_SYSCALL] = bench_saved_gate;
+}
+
+static void
+bench_int(void) {
+    asm volatile("int %0" ::"i"(T_SYSCALL)
+                 : "memory");
+}
+
+static const struct Benchmark benchmarks[] = {
+        {"alloc_page_4k", NULL, bench_alloc_page_4k, NULL},
+        {"alloc_page_2m", NULL, bench_alloc_page_2m, NULL},
+        {"map_region_4k", bench_space_setup, bench_map_0, bench_space_teardown},
+        {"map_region_64k", bench_space_setup, bench_map_4, bench_space_teardown},
+        {"map_region_2m", bench_space_setup, bench_map_9, bench_space_teardown},
+        {"switch_address_space", bench_space_setup, bench_switch_space, bench_space_teardown},
+        {"spin_lock", bench_lock_setup, bench_spin_lock, NULL},
+        {"memcpy_64", bench_buf_setup, bench_memcpy_64, bench_buf_teardown},
+        {"memcpy_4k", bench_buf_setup, bench_memcpy_4096, bench_buf_teardown},
+        {"memcpy_64k", bench_buf_setup, bench_memcpy_65536, bench_buf_teardown},
+        {"memset_64", bench_buf_setup, bench_memset_64, bench_buf_teardown},
+        {"memset_4k", bench_buf_setup, bench_memset_4096, bench_buf_teardown},
+        {"memset_64k", bench_buf_setup, bench_memset_65536, bench_buf_teardown},
+        {"cprintf", NULL, bench_cprintf, NULL},
+        {"debuginfo_rip", NULL, bench_debuginfo_rip, NULL},
+        {"syscall_entry", bench_syscall_setup, bench_syscall, bench_syscall_teardown},
+        {"int_entry", bench_int_setup, bench_int, bench_int_teardown},
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(*benchmarks))
+
+static uint64_t bench_samples[BENCH_MAX_ITERS];
+
+static void
+sort_samples(uint64_t *samples, size_t n) {
+    /* Shell sort with Ciura's gaps, good enough for a few thousand entries */
+    static const size_t gaps[] = {701, 301, 132, 57, 23, 10, 4, 1};
+    for (size_t g = 0; g < sizeof(gaps) / sizeof(*gaps); g++) {
+        size_t gap = gaps[g];
+        for (size_t i = gap; i < n; i++) {
+            uint64_t tmp = samples[i];
+            size_t j = i;
+            for (; j >= gap && samples[j - gap] > tmp; j -= gap)
+                samples[j] = samples[j - gap];
+            samples[j] = tmp;
+        }
+    }
+}
+
+static int
+bench_one(const struct Benchmark *bench, size_t iters) {
+    if (bench->setup) {
+        int res = bench->setup();
+        if (res < 0) {
+            cprintf("%-22s setup failed: %d\n", bench->name, res);
+            return res;
+        }
+    }
+
+    /* Warm up caches, TLB and page pools before measuring */
+    for (size_t i = 0; i < MAX(iters / 10, 10); i++) bench->run();
+
+    for (size_t i = 0; i < iters; i++) {
+        uint64_t start = read_tsc();
+        bench->run();
+        bench_samples[i] = read_tsc() - start;
+    }
+
+    if (bench->teardown) bench->teardown();
+
+    sort_samples(bench_samples, iters);
+    cprintf("%-22s %8zu %12lu %12lu %12lu\n", bench->name, iters,
+            (unsigned long)bench_samples[0],
+            (unsigned long)bench_samples[iters / 2],
+            (unsigned long)bench_samples[iters * 99 / 100]);
+    return 0;
+}
+
+void
+bench_list(void) {
+    for (size_t i = 0; i < NBENCHMARKS; i++)
+        cprintf("  %s\n", benchmarks[i].name);
+}
+
+/* Run the benchmark called name, or every one for "all".
+ * Results are TSC cycles per iteration */
+int
+bench_run(const char *name, size_t iters) {
+    if (!iters || iters > BENCH_MAX_ITERS) return -E_INVAL;
+
+    bool all = !strcmp(name, "all"), found = 0;
+    cprintf("%-22s %8s %12s %12s %12s\n", "benchmark", "iters", "min", "median", "p99");
+    for (size_t i = 0; i < NBENCHMARKS; i++) {
+        if (!all && strcmp(name, benchmarks[i].name)) continue;
+        found = 1;
+        int res = bench_one(&benchmarks[i], iters);
+        if (res < 0 && !all) return res;
+    }
+    return found ? 0 : -E_NO_ENT;
+}
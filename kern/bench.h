@@ -0,0 +1,17 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_BENCH_H
+#define JOS_KERN_BENCH_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define BENCH_DEFAULT_ITERS 1000
+#define BENCH_MAX_ITERS     4096
+
+void bench_list(void);
+int bench_run(const char *name, size_t iters);
+
+#endif /* !JOS_KERN_BENCH_H */
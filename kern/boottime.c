@@ -0,0 +1,61 @@
+/* Boot phase timeline */
+
+#include <inc/stdio.h>
+#include <inc/uefi.h>
+#include <inc/x86.h>
+
+#include <kern/boottime.h>
+#include <kern/tsc.h>
+
+struct BootPhase {
+    const char *name;
+    uint64_t tsc; /* When the phase ended */
+};
+
+static struct BootPhase boot_phases[BOOT_TRACE_MAX];
+static size_t boot_nphases;
+
+/* Mark the end of the boot phase 'phase', which started
+ * when the previous one ended. 'phase' has to be a literal */
+void
+boot_trace(const char *phase) {
+    if (boot_nphases < BOOT_TRACE_MAX)
+        boot_phases[boot_nphases++] = (struct BootPhase){phase, read_tsc()};
+}
+
+static uint64_t
+boot_tsc2us(uint64_t tsc, uint64_t freq) {
+    return tsc / freq * 1000000 + tsc % freq * 1000000 / freq;
+}
+
+static void
+boot_phase_print(const char *name, uint64_t tsc, uint64_t *prev, uint64_t freq) {
+    /* Loader timestamps are 0 with an older loader */
+    if (!tsc) return;
+
+    uint64_t took = boot_tsc2us(tsc - *prev, freq), at = boot_tsc2us(tsc, freq);
+    cprintf("  %-32s %8lu.%03lu ms %8lu.%03lu ms\n", name,
+            (unsigned long)(took / 1000), (unsigned long)(took % 1000),
+            (unsigned long)(at / 1000), (unsigned long)(at % 1000));
+    *prev = tsc;
+}
+
+void
+boot_timeline_print(void) {
+    uint64_t freq = tsc_calibrate();
+    if (!freq) {
+        cprintf("TSC frequency is unknown\n");
+        return;
+    }
+
+    /* The TSC starts at reset, so the first phase is the firmware */
+    uint64_t prev = 0;
+    cprintf("  %-32s %15s %15s\n", "phase", "took", "ended at");
+    boot_phase_print("firmware", uefi_lp->LoaderStartTsc, &prev, freq);
+    boot_phase_print("loader: read kernel image", uefi_lp->LoaderKernelReadTsc, &prev, freq);
+    boot_phase_print("loader: place kernel", uefi_lp->LoaderKernelLoadedTsc, &prev, freq);
+    boot_phase_print("loader: exit boot services", uefi_lp->LoaderExitTsc, &prev, freq);
+
+    for (size_t i = 0; i < boot_nphases; i++)
+        boot_phase_print(boot_phases[i].name, boot_phases[i].tsc, &prev, freq);
+}
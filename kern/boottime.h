@@ -0,0 +1,18 @@
+#ifndef JOS_KERN_BOOTTIME_H
+#define JOS_KERN_BOOTTIME_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/* Boot timeline: a TSC timestamp at the end of every boot phase.
+ * The loader phases come from LOADER_PARAMS, see the boottime
+ * monitor command */
+
+#define BOOT_TRACE_MAX 32
+
+void boot_trace(const char *phase);
+void boot_timeline_print(void);
+
+#endif /* !JOS_KERN_BOOTTIME_H */
@@ -9,8 +9,12 @@
 #include <inc/x86.h>
 
 #include <kern/console.h>
+#include <kern/klog.h>
 #include <kern/picirq.h>
 #include <kern/pmap.h>
+#include <kern/trap.h>
+
+struct spinlock console_lock = SPINLOCK_INITIALIZER(console_lock, LOCK_ORDER_CONSOLE);
 
 #define COM1 0x3F8
 
@@ -20,8 +24,13 @@
 #define COM_DLM       1    /* OUT: Divisor Latch High (DLAB=1) */
 #define COM_IER       1    /* OUT: Interrupt Enable Register */
 #define COM_IER_RDI   0x01 /*     Enable receiver data interrupt */
+#define COM_IER_TXI   0x02 /*     Enable transmitter empty interrupt */
 #define COM_IIR       2    /* IN:  Interrupt ID Register */
+#define COM_IIR_FIFO  0xC0 /*     FIFOs enabled (16550A) */
 #define COM_FCR       2    /* OUT: FIFO Control Register */
+#define COM_FCR_FIFO  0x01 /*     Enable FIFOs */
+#define COM_FCR_RCLR  0x02 /*     Clear receive FIFO */
+#define COM_FCR_TCLR  0x04 /*     Clear transmit FIFO */
 #define COM_LCR       3    /* OUT: Line Control Register */
 #define COM_LCR_DLAB  0x80 /*     Divisor latch access bit */
 #define COM_LCR_WLEN8 0x03 /*     Wordlength: 8 bits */
@@ -43,11 +52,27 @@ static uint32_t uefi_stride;
 static uint32_t crt_rows;
 static uint32_t crt_cols;
 static uint32_t crt_size;
-static uint16_t crt_pos;
+static uint32_t crt_pos;
 static uint32_t *crt_buf = (uint32_t *)FRAMEBUFFER;
 
 static bool serial_exists;
 
+/* Bytes the UART accepts at once when THR is empty (16 with a 16550A FIFO) */
+static unsigned serial_fifo_depth = 1;
+
+/* Transmit queue, emptied by the THRE interrupt once serial_intr_init()
+ * has been called, protected by console_lock */
+#define SERIAL_TXQ_SIZE 4096
+static struct {
+    uint8_t buf[SERIAL_TXQ_SIZE];
+    uint32_t rpos;
+    uint32_t wpos;
+} serial_txq;
+static bool serial_tx_irq;
+
+/* Input interrupts are set up, see kbd_intr_init() */
+static bool cons_irq_ready;
+
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
@@ -184,15 +209,49 @@ static char font8x8_basic[128][8] = {
         {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* U+007F */
 };
 
-void
+/* Text grid, screen row r is row (crt_origin + r) % crt_rows of crt_text,
+ * so scrolling only moves crt_origin. crt_shown is what the framebuffer
+ * displays at each screen position, repainting after a scroll only
+ * redraws the cells where the two differ */
+#define CRT_MAX_CELLS ((2560 / SYMBOL_SIZE) * (1600 / SYMBOL_SIZE))
+static uint8_t crt_text[CRT_MAX_CELLS];
+static uint8_t crt_shown[CRT_MAX_CELLS];
+static uint32_t crt_origin;
+static bool crt_repaint;
+
+/* Render into a copy of the framebuffer in normal memory and copy
+ * the changed parts of each text row to the device in fb_flush(),
+ * so writes to it are batched and it is never read */
+bool fb_double_buffer = 1;
+static uint32_t *crt_back = (uint32_t *)FRAMEBUFFER;
+
+/* Columns [crt_span_lo, crt_span_hi) of each text row differ
+ * between crt_back and the framebuffer */
+#define CRT_MAX_ROWS (2160 / SYMBOL_SIZE)
+static uint16_t crt_span_lo[CRT_MAX_ROWS];
+static uint16_t crt_span_hi[CRT_MAX_ROWS];
+static bool crt_unflushed;
+
+/* Two adjacent pixels, the framebuffer is only 4-byte aligned */
+typedef uint64_t __attribute__((aligned(4), may_alias)) fb_pixel2_t;
+
+/* Pixels of a glyph row: fb_row_masks[bits] has all bits set
+ * in the pixels that are lit, two pixels per element */
+static uint64_t fb_row_masks[256][SYMBOL_SIZE / 2];
+
+static void
 draw_char(uint32_t *buffer, uint32_t x, uint32_t y, uint32_t color, uint8_t charcode) {
-    char *chr = font8x8_basic[(unsigned)charcode];
+    const uint8_t *chr = (const uint8_t *)font8x8_basic[charcode & 0x7F];
     uint32_t *buf = buffer + uefi_stride * SYMBOL_SIZE * y + SYMBOL_SIZE * x;
-
-    for (size_t heigth = 0; heigth < 8; heigth++) {
-        for (size_t width = 0; width < 8; width++) {
-            buf[uefi_stride * heigth + width] = color * ((chr[heigth] >> width) & 1);
-        }
+    uint64_t color2 = color * 0x100000001ULL;
+
+    for (size_t heigth = 0; heigth < SYMBOL_SIZE; heigth++, buf += uefi_stride) {
+        const uint64_t *mask = fb_row_masks[chr[heigth]];
+        fb_pixel2_t *row = (fb_pixel2_t *)buf;
+        row[0] = mask[0] & color2;
+        row[1] = mask[1] & color2;
+        row[2] = mask[2] & color2;
+        row[3] = mask[3] & color2;
     }
 }
 
@@ -202,30 +261,113 @@ fb_init(void) {
     uefi_vres = lp->VerticalResolution;
     uefi_hres = lp->HorizontalResolution;
     uefi_stride = lp->PixelsPerScanLine;
-    crt_rows = uefi_vres / SYMBOL_SIZE;
+    crt_rows = MIN(uefi_vres / SYMBOL_SIZE, CRT_MAX_ROWS);
     crt_cols = uefi_hres / SYMBOL_SIZE;
+    if (crt_rows * crt_cols > CRT_MAX_CELLS) crt_rows = CRT_MAX_CELLS / crt_cols;
     crt_size = crt_rows * crt_cols;
     crt_pos = crt_cols;
 
+    for (size_t bits = 0; bits < 256; bits++) {
+        for (size_t px = 0; px < SYMBOL_SIZE; px++) {
+            uint64_t lit = (bits >> px) & 1 ? 0xFFFFFFFFULL : 0;
+            fb_row_masks[bits][px / 2] |= lit << (32 * (px % 2));
+        }
+    }
+
     /* Clear screen */
     memset(crt_buf, 0, lp->FrameBufferSize);
 
+    crt_back = fb_double_buffer ? kzalloc_region(uefi_stride * uefi_vres * sizeof(uint32_t)) : NULL;
+    if (!crt_back) crt_back = crt_buf;
+    crt_unflushed = 0;
+    memset(crt_text, 0, sizeof(crt_text));
+    memset(crt_shown, 0, sizeof(crt_shown));
+    crt_origin = 0;
+    crt_repaint = 0;
+
     graphics_exists = true;
 }
 
+static inline uint8_t *
+fb_text_row(uint32_t row) {
+    return crt_text + ((crt_origin + row) % crt_rows) * crt_cols;
+}
+
+static void
+fb_draw_cell(uint32_t col, uint32_t row, uint8_t ch) {
+    draw_char(crt_back, col, row, 0xFFFFFFFF, ch);
+    if (crt_back == crt_buf) return;
+
+    if (crt_span_lo[row] >= crt_span_hi[row]) {
+        crt_span_lo[row] = col;
+        crt_span_hi[row] = col + 1;
+    } else {
+        crt_span_lo[row] = MIN(crt_span_lo[row], col);
+        crt_span_hi[row] = MAX(crt_span_hi[row], col + 1);
+    }
+    crt_unflushed = 1;
+}
+
+/* Put a glyph at screen position pos. While a repaint is pending
+ * only the text grid is updated, fb_flush() draws it */
+static void
+fb_set_cell(uint32_t pos, uint8_t ch) {
+    fb_text_row(pos / crt_cols)[pos % crt_cols] = ch;
+    if (crt_repaint || crt_shown[pos] == ch) return;
+
+    fb_draw_cell(pos % crt_cols, pos / crt_cols, ch);
+    crt_shown[pos] = ch;
+}
+
+/* Redraw the cells that changed since the last scroll
+ * and copy the changed spans of the back buffer to the device */
+static void
+fb_flush(void) {
+    if (crt_repaint) {
+        for (uint32_t row = 0; row < crt_rows; row++) {
+            const uint8_t *text = fb_text_row(row);
+            uint8_t *shown = crt_shown + row * crt_cols;
+            for (uint32_t col = 0; col < crt_cols; col++) {
+                if (text[col] == shown[col]) continue;
+                fb_draw_cell(col, row, text[col]);
+                shown[col] = text[col];
+            }
+        }
+        crt_repaint = 0;
+    }
+
+    if (!crt_unflushed) return;
+
+    for (uint32_t row = 0; row < crt_rows; row++) {
+        if (crt_span_lo[row] >= crt_span_hi[row]) continue;
+
+        size_t offset = uefi_stride * SYMBOL_SIZE * row + SYMBOL_SIZE * crt_span_lo[row];
+        size_t len = SYMBOL_SIZE * (crt_span_hi[row] - crt_span_lo[row]) * sizeof(uint32_t);
+        for (size_t line = 0; line < SYMBOL_SIZE; line++, offset += uefi_stride)
+            nosan_memcpy(crt_buf + offset, crt_back + offset, len);
+
+        crt_span_lo[row] = crt_span_hi[row] = 0;
+    }
+
+    crt_unflushed = 0;
+}
+
+/* Scoll up one text row, the screen is repainted by fb_flush() */
+static void
+fb_scroll(void) {
+    crt_origin = (crt_origin + 1) % crt_rows;
+    memset(fb_text_row(crt_rows - 1), 0, crt_cols);
+    crt_pos -= crt_cols;
+    crt_repaint = 1;
+}
+
 static void
 fb_putc(int c) {
     if (!graphics_exists) return;
 
-    /* If no attribute given, then use black on white */
-    if (!(c & ~0xFF)) c |= 0x0700;
-
     switch (c & 0xFF) {
     case '\b':
-        if (crt_pos > 0) {
-            crt_pos--;
-            draw_char(crt_buf, crt_pos % crt_cols, crt_pos / crt_cols, 0x0, 0x8);
-        }
+        if (crt_pos > 0) fb_set_cell(--crt_pos, 0);
         break;
     case '\n':
         crt_pos += crt_cols;
@@ -234,24 +376,18 @@ fb_putc(int c) {
         crt_pos -= (crt_pos % crt_cols);
         break;
     case '\t':
-        for (size_t i = 0; i < TABW; i++)
-            fb_putc(' ');
+        for (size_t i = 0; i < TABW; i++) {
+            fb_set_cell(crt_pos++, ' ');
+            if (crt_pos >= crt_size) fb_scroll();
+        }
         break;
     default:
         /* write the character */
-        draw_char(crt_buf, crt_pos % crt_cols, crt_pos / crt_cols, 0xFFFFFFFF, (uint8_t)c);
-        crt_pos++;
+        fb_set_cell(crt_pos++, (uint8_t)c);
     }
 
     /* Scoll up when we have reached the bottom of screen */
-    if (crt_pos >= crt_size) {
-        nosan_memmove(crt_buf, crt_buf + uefi_stride * SYMBOL_SIZE,
-                      uefi_stride * (uefi_vres - SYMBOL_SIZE) * sizeof(uint32_t));
-
-        size_t i = (uefi_vres - (uefi_vres % SYMBOL_SIZE) - SYMBOL_SIZE);
-        nosan_memset(crt_buf + i * uefi_stride, 0, uefi_stride * (uefi_vres - i) * sizeof(uint32_t));
-        crt_pos -= crt_cols;
-    }
+    if (crt_pos >= crt_size) fb_scroll();
 }
 
 /* Serial I/O code */
@@ -278,20 +414,90 @@ serial_intr(void) {
     if (serial_exists) cons_intr(serial_proc_data);
 }
 
+/* Wait until the transmitter can take more bytes */
 static void
-serial_putc(int c) {
+serial_wait_txrdy(void) {
     for (size_t i = 0; i < 12800; i++) {
         if (inb(COM1 + COM_LSR) & COM_LSR_TXRDY) break;
         delay();
     }
+}
+
+/* Move up to a FIFO worth of queued bytes to the UART if THR is empty */
+static void
+serial_tx_fill(void) {
+    if (!(inb(COM1 + COM_LSR) & COM_LSR_TXRDY)) return;
+
+    for (unsigned i = 0; i < serial_fifo_depth && serial_txq.rpos != serial_txq.wpos; i++) {
+        outb(COM1 + COM_TX, serial_txq.buf[serial_txq.rpos++ % SERIAL_TXQ_SIZE]);
+    }
+}
 
-    outb(COM1 + COM_TX, c);
+/* Send everything queued by polling, for panic and for a full queue */
+static void
+serial_tx_flush(void) {
+    while (serial_txq.rpos != serial_txq.wpos) {
+        serial_wait_txrdy();
+        serial_tx_fill();
+    }
+}
+
+static void
+serial_putc(int c) {
+    extern const char *panicstr;
+
+    if (!serial_tx_irq || panicstr) {
+        /* Early boot or panic: no interrupts, keep the output in order */
+        serial_tx_flush();
+        serial_wait_txrdy();
+        outb(COM1 + COM_TX, c);
+        return;
+    }
+
+    if (serial_txq.wpos - serial_txq.rpos == SERIAL_TXQ_SIZE) {
+        /* Wait for room rather than drop output */
+        serial_wait_txrdy();
+        serial_tx_fill();
+    }
+
+    serial_txq.buf[serial_txq.wpos++ % SERIAL_TXQ_SIZE] = c;
+    serial_tx_fill();
+}
+
+/* IRQ4, the UART has received data or emptied its transmit FIFO */
+void
+serial_irq(void) {
+    /* Reading IIR acknowledges a THRE interrupt,
+     * the received data is taken below anyway */
+    (void)inb(COM1 + COM_IIR);
+
+    serial_intr();
+
+    uint64_t rflags = spin_lock_irqsave(&console_lock);
+    serial_tx_fill();
+    spin_unlock_irqrestore(&console_lock, rflags);
+
+    pic_send_eoi(IRQ_SERIAL);
+}
+
+/* Switch serial output to interrupt-driven transmission.
+ * Called once the IDT and the PIC are set up */
+void
+serial_intr_init(void) {
+    if (!serial_exists) return;
+
+    /* OUT2 gates the UART interrupt line on PCs */
+    outb(COM1 + COM_MCR, COM_MCR_OUT2);
+    outb(COM1 + COM_IER, COM_IER_RDI | COM_IER_TXI);
+    pic_irq_unmask(IRQ_SERIAL);
+
+    serial_tx_irq = 1;
 }
 
 static void
 serial_init(void) {
-    /* Turn off the FIFO */
-    outb(COM1 + COM_FCR, 0);
+    /* Enable and reset the FIFOs, receive interrupts after every byte */
+    outb(COM1 + COM_FCR, COM_FCR_FIFO | COM_FCR_RCLR | COM_FCR_TCLR);
 
     /* Set speed; requires DLAB latch */
     outb(COM1 + COM_LCR, COM_LCR_DLAB);
@@ -309,8 +515,12 @@ serial_init(void) {
     /* Clear any preexisting overrun indications and interrupts
      * Serial port doesn't exist if COM_LSR returns 0xFF */
     serial_exists = (inb(COM1 + COM_LSR) != 0xFF);
-    (void)inb(COM1 + COM_IIR);
+    uint8_t iir = inb(COM1 + COM_IIR);
     (void)inb(COM1 + COM_RX);
+
+    /* Only a 16550A reports working FIFOs, older UARTs take one byte */
+    serial_fifo_depth = (iir & COM_IIR_FIFO) == COM_IIR_FIFO ? 16 : 1;
+    if (serial_fifo_depth == 1) outb(COM1 + COM_FCR, 0);
 }
 
 /* Parallel port output code */
@@ -477,6 +687,22 @@ kbd_intr(void) {
     cons_intr(kbd_proc_data);
 }
 
+/* IRQ1, a key was pressed or released */
+void
+kbd_irq(void) {
+    kbd_intr();
+    pic_send_eoi(IRQ_KBD);
+}
+
+/* Take keyboard input from IRQ1 and let console readers sleep until
+ * input arrives (see getchar()). Called once the IDT and the PIC are
+ * set up, after serial_intr_init() */
+void
+kbd_intr_init(void) {
+    pic_irq_unmask(IRQ_KBD);
+    cons_irq_ready = 1;
+}
+
 static void
 kbd_init(void) {
     /* nothing */
@@ -503,10 +729,14 @@ static void
 cons_intr(int (*proc)(void)) {
     int ch;
 
+    /* Don't hold the lock while polling the device,
+     * the keyboard driver may print */
     while ((ch = (*proc)()) != -1) {
         if (!ch) continue;
+        uint64_t rflags = spin_lock_irqsave(&console_lock);
         cons.buf[cons.wpos++] = ch;
         if (cons.wpos == CONSBUFSIZE) cons.wpos = 0;
+        spin_unlock_irqrestore(&console_lock, rflags);
     }
 }
 
@@ -521,11 +751,18 @@ cons_getc(void) {
     kbd_intr();
 
     /* Grab the next character from the input buffer */
+    uint64_t rflags = spin_lock_irqsave(&console_lock);
+
+    /* The monitor polls with interrupts disabled, keep output moving */
+    serial_tx_fill();
+
     if (cons.rpos != cons.wpos) {
         uint8_t ch = cons.buf[cons.rpos++];
         cons.rpos %= CONSBUFSIZE;
+        spin_unlock_irqrestore(&console_lock, rflags);
         return ch;
     }
+    spin_unlock_irqrestore(&console_lock, rflags);
     return 0;
 }
 
@@ -555,15 +792,32 @@ cons_init(void) {
 
 void
 cputchar(int c) {
-    cons_putc(c);
+    char ch = c;
+    klog_write(&ch, 1);
+    if (!klog_async) klog_drain(0);
+}
+
+/* Write straight to the devices, bypassing the kernel log.
+ * Used by klog_drain(), which holds console_lock */
+void
+cputs(const char *str, size_t len) {
+    while (len--) cons_putc(*str++);
+    fb_flush();
 }
 
 int
 getchar(void) {
+    extern const char *panicstr;
     int ch;
 
-    while (!(ch = cons_getc()))
-        /* nothing */;
+    /* Waiting for input is idle time, show the pending output meanwhile.
+     * Input interrupts fill the buffer, so sleep until one of them
+     * (or the next tick) instead of polling. After a panic interrupts
+     * are not handled anymore, the devices are polled then */
+    while (!(ch = cons_getc())) {
+        klog_drain(0);
+        if (cons_irq_ready && !panicstr) trap_wait();
+    }
 
     return ch;
 }
@@ -7,19 +7,30 @@
 #endif
 
 #include <inc/types.h>
+#include <kern/spinlock.h>
 
 #define CRT_ROWS    25
 #define CRT_COLS    80
 #define CRT_SIZE    (CRT_ROWS * CRT_COLS)
 #define SYMBOL_SIZE 8
 
+/* Serializes console output and the input buffer */
+extern struct spinlock console_lock;
+
 void cons_init(void);
 void fb_init(void);
+
+/* Render the framebuffer console into a back buffer, read by fb_init() */
+extern bool fb_double_buffer;
 int cons_getc(void);
 
 /* IRQ1 */
 void kbd_intr(void);
+void kbd_irq(void);
+void kbd_intr_init(void);
 /* IRQ4 */
 void serial_intr(void);
+void serial_irq(void);
+void serial_intr_init(void);
 
 #endif /* _CONSOLE_H_ */
@@ -15,6 +15,14 @@ extern struct Taskstate cpu_ts;
 extern char in_intr;
 extern bool in_clk_intr;
 
+/* Index of the CPU executing this code.
+ * Application processors are not started yet,
+ * so everything runs on the bootstrap processor */
+static inline int
+cpunum(void) {
+    return 0;
+}
+
 static inline bool
 in_interrupt(void) {
     return !!in_intr;
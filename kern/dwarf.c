@@ -4,6 +4,9 @@
 #include <inc/string.h>
 #include <inc/types.h>
 #include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/preempt.h>
 
 struct Slice {
     const void *mem;
@@ -17,7 +20,7 @@ info_by_address_debug_aranges(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwar
         int count = 0;
         unsigned long len;
         const uint8_t *header = set;
-        set += dwarf_entry_len(set, &len);
+        set += count = dwarf_entry_len(set, &len);
         if (!count) return -E_BAD_DWARF;
         const uint8_t *set_end = set + len;
 
@@ -265,6 +268,91 @@ dwarf_read_abbrev_entry(const void *entry, unsigned form, void *buf, int bufsize
     return bytes;
 }
 
+/* Abbreviation tables decoded into code-indexed arrays, one per CU table
+ * in .debug_abbrev, so that each DIE costs an array lookup instead of a
+ * scan from the start of its CU's table. Like the line table cache this
+ * is bypassed instead of locked when another CPU is using it. */
+#define ABBREV_CACHE_TABLES 8
+#define ABBREV_CACHE_CODES  256
+
+struct AbbrevEntry {
+    const uint8_t *attrs; /* attribute/form pairs, NULL if code is absent */
+    uint64_t tag;
+};
+
+static struct AbbrevTable {
+    const uint8_t *table; /* NULL if unused */
+    struct AbbrevEntry entries[ABBREV_CACHE_CODES];
+} abbrev_cache[ABBREV_CACHE_TABLES];
+
+static size_t abbrev_cache_next;
+static volatile uint32_t abbrev_cache_busy;
+
+static int
+abbrev_table_decode(const struct Dwarf_Addrs *addrs, const uint8_t *abbrev_entry, struct AbbrevTable *table) {
+    memset(table->entries, 0, sizeof(table->entries));
+
+    while (abbrev_entry < addrs->abbrev_end) {
+        uint64_t code = 0, tag = 0, name = 0, form = 0;
+        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &code);
+        if (!code) return 0;
+        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &tag);
+        abbrev_entry += sizeof(Dwarf_Small);
+        if (code >= ABBREV_CACHE_CODES) return -E_NO_MEM;
+
+        table->entries[code] = (struct AbbrevEntry){abbrev_entry, tag};
+        do {
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
+        } while (name || form);
+    }
+    return -E_BAD_DWARF;
+}
+
+/* Find abbreviation `code` in the table at `abbrev_offset`. Returns a
+ * pointer to its attribute specifications and stores its tag, or returns
+ * NULL if the table has no such code. */
+static const uint8_t *
+find_abbrev(const struct Dwarf_Addrs *addrs, Dwarf_Off abbrev_offset, uint64_t code, uint64_t *tag) {
+    const uint8_t *abbrev_entry = addrs->abbrev_begin + abbrev_offset;
+
+    if (code < ABBREV_CACHE_CODES && !xchg(&abbrev_cache_busy, 1)) {
+        struct AbbrevTable *table = NULL;
+        for (size_t i = 0; i < ABBREV_CACHE_TABLES; i++)
+            if (abbrev_cache[i].table == abbrev_entry) table = &abbrev_cache[i];
+
+        if (!table) {
+            table = &abbrev_cache[abbrev_cache_next];
+            abbrev_cache_next = (abbrev_cache_next + 1) % ABBREV_CACHE_TABLES;
+            table->table = abbrev_table_decode(addrs, abbrev_entry, table) < 0 ? NULL : abbrev_entry;
+        }
+
+        if (table->table) {
+            struct AbbrevEntry ent = table->entries[code];
+            xchg(&abbrev_cache_busy, 0);
+            *tag = ent.tag;
+            return ent.attrs;
+        }
+        xchg(&abbrev_cache_busy, 0);
+    }
+
+    /* Table didn't fit into the cache, scan it */
+    while (abbrev_entry < addrs->abbrev_end) {
+        uint64_t table_code = 0, name = 0, form = 0;
+        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &table_code);
+        if (!table_code) break;
+        abbrev_entry += dwarf_read_uleb128(abbrev_entry, tag);
+        abbrev_entry += sizeof(Dwarf_Small);
+        if (table_code == code) return abbrev_entry;
+
+        do {
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
+        } while (name || form);
+    }
+    return NULL;
+}
+
 /* Find a compilation unit, which contains given address from .debug_info section */
 static int
 info_by_address_debug_info(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_Off *store) {
@@ -330,9 +418,97 @@ info_by_address_debug_info(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_O
     return -E_NO_ENT;
 }
 
+/* Sorted [start, end) -> CU offset index over .debug_aranges, built the
+ * first time a given aranges section is queried, so that symbolizing
+ * backtraces costs a binary search instead of a scan of every set. */
+#define ARANGES_INDEX_SIZE 512
+
+static struct ArangeEntry {
+    uintptr_t start;
+    uintptr_t end;
+    Dwarf_Off cu_offset;
+} aranges_index[ARANGES_INDEX_SIZE];
+
+static size_t aranges_index_count;
+/* Section the index was built for, NULL if not built or unusable */
+static const uint8_t *aranges_index_section;
+static const uint8_t *aranges_index_tried;
+
+static int
+aranges_index_build(const struct Dwarf_Addrs *addrs) {
+    const uint8_t *set = addrs->aranges_begin;
+    size_t count = 0;
+
+    while (set < addrs->aranges_end) {
+        uint64_t len = 0;
+        const uint8_t *header = set;
+        uint32_t nread = dwarf_entry_len(set, &len);
+        if (!nread) return -E_BAD_DWARF;
+        set += nread;
+        const uint8_t *set_end = set + len;
+
+        Dwarf_Half version = get_unaligned(set, Dwarf_Half);
+        if (version != 2) return -E_BAD_DWARF;
+        set += sizeof(Dwarf_Half);
+        Dwarf_Off offset = get_unaligned(set, uint32_t);
+        set += sizeof(uint32_t);
+        Dwarf_Small address_size = get_unaligned(set, Dwarf_Small);
+        set += sizeof(Dwarf_Small);
+        Dwarf_Small segment_size = get_unaligned(set, Dwarf_Small);
+        set += sizeof(Dwarf_Small);
+        if (address_size != sizeof(uintptr_t) || segment_size) return -E_BAD_DWARF;
+
+        /* Tuples are aligned to their own size relative to the set header */
+        uint32_t entry_size = 2 * address_size;
+        uint32_t remainder = (set - header) % entry_size;
+        if (remainder) set += entry_size - remainder;
+
+        while (set + entry_size <= set_end) {
+            uintptr_t start = get_unaligned(set, uintptr_t);
+            uintptr_t size = get_unaligned(set + address_size, uintptr_t);
+            set += entry_size;
+            if (!start && !size) break;
+            if (!size) continue;
+            if (count == ARANGES_INDEX_SIZE) return -E_NO_MEM;
+
+            /* Insertion sort: sets are emitted almost in address order */
+            size_t i = count++;
+            for (; i && aranges_index[i - 1].start > start; i--)
+                aranges_index[i] = aranges_index[i - 1];
+            aranges_index[i] = (struct ArangeEntry){start, start + size, offset};
+        }
+        set = set_end;
+    }
+
+    aranges_index_count = count;
+    return 0;
+}
+
+static int
+info_by_address_aranges_index(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_Off *store) {
+    if (aranges_index_tried != addrs->aranges_begin) {
+        aranges_index_tried = addrs->aranges_begin;
+        aranges_index_section = aranges_index_build(addrs) < 0 ? NULL : addrs->aranges_begin;
+    }
+    if (aranges_index_section != addrs->aranges_begin)
+        return info_by_address_debug_aranges(addrs, p, store);
+
+    /* Find the last range starting at or below p */
+    size_t lo = 0, hi = aranges_index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (aranges_index[mid].start <= p) lo = mid + 1;
+        else hi = mid;
+    }
+    if (!lo || p >= aranges_index[lo - 1].end) return -E_NO_ENT;
+
+    *store = aranges_index[lo - 1].cu_offset;
+    return 0;
+}
+
 int
 info_by_address(const struct Dwarf_Addrs *addrs, uintptr_t addr, Dwarf_Off *store) {
-    int res = info_by_address_debug_aranges(addrs, addr, store);
+    int res = info_by_address_aranges_index(addrs, addr, store);
     if (res < 0) res = info_by_address_debug_info(addrs, addr, store);
     return res;
 }
@@ -417,31 +593,17 @@ function_by_info(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_Off cu_offs
 
     /* Parse abbrev and info sections */
     uint64_t abbrev_code = 0;
-    uint64_t table_abbrev_code = 0;
-    const uint8_t *abbrev_entry = addrs->abbrev_begin + abbrev_offset;
 
     while (entry < entry_end) {
         /* Read info abbreviation code */
         entry += dwarf_read_uleb128(entry, &abbrev_code);
         if (!abbrev_code) continue;
 
-        const uint8_t *curr_abbrev_entry = abbrev_entry;
         uint64_t name = 0, form = 0, tag = 0;
 
         /* Find abbreviation in abbrev section */
-        /* UNSAFE Needs to be replaced */
-        while (curr_abbrev_entry < addrs->abbrev_end) {
-            curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &table_abbrev_code);
-            curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &tag);
-            curr_abbrev_entry += sizeof(Dwarf_Small);
-            if (table_abbrev_code == abbrev_code) break;
-
-            /* Skip attributes */
-            do {
-                curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &name);
-                curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &form);
-            } while (name != 0 || form != 0);
-        }
+        const uint8_t *curr_abbrev_entry = find_abbrev(addrs, abbrev_offset, abbrev_code, &tag);
+        if (!curr_abbrev_entry) return -E_BAD_DWARF;
         /* Parse subprogram DIE */
         if (tag == DW_TAG_subprogram) {
             uintptr_t low_pc = 0, high_pc = 0;
@@ -490,11 +652,96 @@ function_by_info(const struct Dwarf_Addrs *addrs, uintptr_t p, Dwarf_Off cu_offs
     return -E_NO_ENT;
 }
 
-int
-address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *offset) {
-    const int flen = strlen(fname);
-    if (!flen) return -E_INVAL;
+/* Resolve the address of the pubnames entry at func_offset within the
+ * compilation unit at cu_offset. Returns -E_NO_ENT if the DIE is not a
+ * subprogram or has no DW_AT_low_pc (e.g. a declaration only). */
+static int
+pubname_address(const struct Dwarf_Addrs *addrs, Dwarf_Off cu_offset, Dwarf_Off func_offset, uintptr_t *offset) {
+    uint32_t count = 0;
+    uint64_t len = 0;
+
+    /* Parse compilation unit header */
+    const uint8_t *entry = addrs->info_begin + cu_offset;
+    // In the compilation header there are addresses of the entry in all debug segments.
+    // They have the remaining information about the entry. Dwarf format is like a number
+    //   of segments, in each segment there is a tree with some information about the
+    //   entities? (TODO: CHECK, then replace the question mark with a period).
+    const uint8_t *func_entry = entry + func_offset;
+    entry += count = dwarf_entry_len(entry, &len);
+    if (!count) return -E_BAD_DWARF;
+
+    Dwarf_Half version = get_unaligned(entry, Dwarf_Half);
+    assert(version == 4 || version == 2);
+    entry += sizeof(Dwarf_Half);
+    Dwarf_Off abbrev_offset = get_unaligned(entry, uint32_t);
+    entry += sizeof(uint32_t);
+    Dwarf_Small address_size = get_unaligned(entry, Dwarf_Small);
+    assert(address_size == sizeof(uintptr_t));
+
+    entry = func_entry;
+    uint64_t abbrev_code = 0;
+    entry += dwarf_read_uleb128(entry, &abbrev_code);
+    uint64_t name = 0, form = 0, tag = 0;
+
+    /* Find abbreviation in abbrev section */
+    const uint8_t *abbrev_entry = find_abbrev(addrs, abbrev_offset, abbrev_code, &tag);
+    if (!abbrev_entry) return -E_BAD_DWARF;
+    /* Find low_pc */
+    if (tag == DW_TAG_subprogram) {
+        /* At this point entry points to the beginning of function's DIE attributes
+         * and abbrev_entry points to abbreviation table entry corresponding to this DIE.
+         * Abbreviation table entry consists of pairs of unsigned LEB128 numbers, the first
+         * encodes name of attribute and the second encodes its form. Attribute entry ends
+         * with a pair where both name and form equal zero.
+         * Address of a function is encoded in attribute with name DW_AT_low_pc.
+         * To find it, we need to scan both abbreviation table and attribute values.
+         * You can read unsigned LEB128 number using dwarf_read_uleb128 function.
+         * Attribute value can be obtained using dwarf_read_abbrev_entry function. */
+        uintptr_t low_pc = 0;
+        // LAB 3: Your code here:
+        // cprintf("address_by_fname: at attributes.\n");
+        // Similar to the code from function_by_info, we do what is said above with
+        //   the inspiration from there.
+        // TODO: what is in abbrev entry?
+        do {
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
+            // cprintf("fname = %s, abbrev_entry_name = 0x%" PRIx64 ", abbren_entry_form = 0x%" PRIx64 ".\n", fname, name, form);
+            // cprintf("abbrev entry offset = 0x%zx.\n", (size_t) (abbrev_entry - addrs->abbrev_begin));
+            // cprintf("entry offset = %zx.\n", (size_t) (entry - addrs->info_begin));
+            if (name == DW_AT_low_pc) {
+                entry += dwarf_read_abbrev_entry(entry, form, &low_pc, sizeof(low_pc), address_size);
+                // cprintf("address_by_fname: at DW_AT_low_pc.\n");
+                *offset = low_pc;
+                return 0;
+            } else {
+                // We have to skip an entry of a different type. Does it always has size of address_size?
+                //   TODO: figure out, clarify here.
+                entry += dwarf_read_abbrev_entry(entry, form, NULL, 0, address_size);
+            }
+        } while (name || form);
+        // A function can be present in many compilation units.
+        //   If we've found an entry for it, but it doesn't have an address, we should
+        //   continue to look for entries. For example, such thing happens with "cprintf":
+        //   it's defined in printf.c, but present in both init.c and printf.c in the dwarf debug
+        //   info. The entry in init.c doesn't have DW_AT_low_pc attribute. Maybe because the
+        //   compilation unit only has a declaration, not definition.
+    } else {
+        /* Skip if not a subprogram or label */
+        do {
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
+            abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
+            entry += dwarf_read_abbrev_entry(entry, form, NULL, 0, address_size);
+        } while (name || form);
+    }
+    return -E_NO_ENT;
+}
 
+/* Call fn for every name in .debug_pubnames, stopping at the first nonzero
+ * return value, which is then passed back to the caller. */
+static int
+pubnames_walk(const struct Dwarf_Addrs *addrs,
+              int (*fn)(const struct Dwarf_Addrs *, const char *, Dwarf_Off, Dwarf_Off, void *), void *arg) {
     const uint8_t *pubnames_entry = addrs->pubnames_begin;
     uint32_t count = 0;
     uint64_t len = 0;
@@ -502,6 +749,9 @@ address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *
 
     /* parse pubnames section */
     while (pubnames_entry < addrs->pubnames_end) {
+        /* One name set per compilation unit */
+        preempt_point();
+
         count = dwarf_entry_len(pubnames_entry, &len);
         if (!count) return -E_BAD_DWARF;
         pubnames_entry += count;
@@ -515,11 +765,6 @@ address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *
         count = dwarf_entry_len(pubnames_entry, &len);
         pubnames_entry += count;
 
-        // Pubnames (.debug_pubnames) consist of entries each entry corresponds to a compilation unit.
-        //   Each entry starts with it's size, number of bytes this compilation unit entry takes.
-        //   Then dwarf version. After that there's compilation unit offset in debug_info section,
-        //   which is main section for debugging information. After that there's name table size.
-        //   Each name entry starts with function offset in the compilation unit in the
         //   .debug_info section and after that null-terminated function name follows.
         // Debug info consists of entries corresponding to compilation units. At the start
         //   of entry there are dwarf version and other information (you can see with
@@ -539,110 +784,65 @@ address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *
 
             if (!func_offset) break;
 
-            // At pubnames we have entities and their names.
-            // At pubnames entry at this point we have the
-            //   name of the entity. If the entity we are
-            //   looking at has the name of the function we
-            //   are looking for, we proceed.
-            if (!strcmp(fname, (const char *)pubnames_entry)) {
-                // Now that we've found the function (It's the
-                //   only entity with such name, right? Maybe
-                //   that's guaranteed by the dwarf spec that
-                //   it must be true. But for the kernel we
-                //   know that this is true.)
-                /* Parse compilation unit header */
-                const uint8_t *entry = addrs->info_begin + cu_offset;
-                // In the compilation header there are addresses of the entry in all debug segments.
-                // They have the remaining information about the entry. Dwarf format is like a number
-                //   of segments, in each segment there is a tree with some information about the
-                //   entities? (TODO: CHECK, then replace the question mark with a period).
-                const uint8_t *func_entry = entry + func_offset;
-                entry += count = dwarf_entry_len(entry, &len);
-                if (!count) return -E_BAD_DWARF;
-
-                Dwarf_Half version = get_unaligned(entry, Dwarf_Half);
-                assert(version == 4 || version == 2);
-                entry += sizeof(Dwarf_Half);
-                Dwarf_Off abbrev_offset = get_unaligned(entry, uint32_t);
-                entry += sizeof(uint32_t);
-                const uint8_t *abbrev_entry = addrs->abbrev_begin + abbrev_offset;
-                Dwarf_Small address_size = get_unaligned(entry, Dwarf_Small);
-                assert(address_size == sizeof(uintptr_t));
-
-                entry = func_entry;
-                uint64_t abbrev_code = 0, table_abbrev_code = 0;
-                entry += dwarf_read_uleb128(entry, &abbrev_code);
-                uint64_t name = 0, form = 0, tag = 0;
-
-                /* Find abbreviation in abbrev section */
-                /* UNSAFE Needs to be replaced */
-                while (abbrev_entry < addrs->abbrev_end) {
-                    abbrev_entry += dwarf_read_uleb128(abbrev_entry, &table_abbrev_code);
-                    abbrev_entry += dwarf_read_uleb128(abbrev_entry, &tag);
-                    abbrev_entry += sizeof(Dwarf_Small);
-                    if (table_abbrev_code == abbrev_code) break;
-
-                    /* skip attributes */
-                    do {
-                        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
-                        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
-                        // Abbrev entry has only two fields, otherwise we'd have to skip more fields in here.
-                    } while (name || form);
-                }
-                /* Find low_pc */
-                if (tag == DW_TAG_subprogram) {
-                    /* At this point entry points to the beginning of function's DIE attributes
-                     * and abbrev_entry points to abbreviation table entry corresponding to this DIE.
-                     * Abbreviation table entry consists of pairs of unsigned LEB128 numbers, the first
-                     * encodes name of attribute and the second encodes its form. Attribute entry ends
-                     * with a pair where both name and form equal zero.
-                     * Address of a function is encoded in attribute with name DW_AT_low_pc.
-                     * To find it, we need to scan both abbreviation table and attribute values.
-                     * You can read unsigned LEB128 number using dwarf_read_uleb128 function.
-                     * Attribute value can be obtained using dwarf_read_abbrev_entry function. */
-                    uintptr_t low_pc = 0;
-                    // LAB 3: Your code here:
-                    // cprintf("address_by_fname: at attributes.\n");
-                    // Similar to the code from function_by_info, we do what is said above with
-                    //   the inspiration from there.
-                    // TODO: what is in abbrev entry?
-                    do {
-                        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
-                        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
-                        // cprintf("fname = %s, abbrev_entry_name = 0x%" PRIx64 ", abbren_entry_form = 0x%" PRIx64 ".\n", fname, name, form);
-                        // cprintf("abbrev entry offset = 0x%zx.\n", (size_t) (abbrev_entry - addrs->abbrev_begin));
-                        // cprintf("entry offset = %zx.\n", (size_t) (entry - addrs->info_begin));
-                        if (name == DW_AT_low_pc) {
-                            entry += dwarf_read_abbrev_entry(entry, form, &low_pc, sizeof(low_pc), address_size);
-                            // cprintf("address_by_fname: at DW_AT_low_pc.\n");
-                            *offset = low_pc;
-                            return 0;
-                        } else {
-                            // We have to skip an entry of a different type. Does it always has size of address_size?
-                            //   TODO: figure out, clarify here.
-                            entry += dwarf_read_abbrev_entry(entry, form, NULL, 0, address_size);
-                        }
-                    } while (name || form);
-                    // A function can be present in many compilation units.
-                    //   If we've found an entry for it, but it doesn't have an address, we should
-                    //   continue to look for entries. For example, such thing happens with "cprintf":
-                    //   it's defined in printf.c, but present in both init.c and printf.c in the dwarf debug
-                    //   info. The entry in init.c doesn't have DW_AT_low_pc attribute. Maybe because the
-                    //   compilation unit only has a declaration, not definition.
-                } else {
-                    /* Skip if not a subprogram or label */
-                    do {
-                        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &name);
-                        abbrev_entry += dwarf_read_uleb128(abbrev_entry, &form);
-                        entry += dwarf_read_abbrev_entry(entry, form, NULL, 0, address_size);
-                    } while (name || form);
-                }
-                // If address wasn't found, we should continue to look for an entry with a virtual address.
-            }
+            int res = fn(addrs, (const char *)pubnames_entry, cu_offset, func_offset, arg);
+            if (res) return res;
+
             pubnames_entry += strlen((const char *)pubnames_entry) + 1;
         }
     }
-    return -E_NO_ENT;
+    return 0;
+}
+
+struct fname_query {
+    const char *fname;
+    uintptr_t *offset;
+};
+
+static int
+fname_match(const struct Dwarf_Addrs *addrs, const char *name, Dwarf_Off cu_offset, Dwarf_Off func_offset, void *arg) {
+    struct fname_query *query = arg;
+
+    // At pubnames we have entities and their names. A function can be
+    //   listed by several compilation units, only the one with the
+    //   definition has an address, so keep looking on -E_NO_ENT.
+    if (strcmp(query->fname, name)) return 0;
+    int res = pubname_address(addrs, cu_offset, func_offset, query->offset);
+    return res == -E_NO_ENT ? 0 : (res ? res : 1);
+}
+
+int
+address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintptr_t *offset) {
+    const int flen = strlen(fname);
+    if (!flen) return -E_INVAL;
+
+    struct fname_query query = {fname, offset};
+    int res = pubnames_walk(addrs, fname_match, &query);
+    if (res < 0) return res;
+    return res ? 0 : -E_NO_ENT;
+}
+
+struct pubnames_iter {
+    int (*fn)(const char *name, uintptr_t addr, void *arg);
+    void *arg;
+};
+
+static int
+pubname_resolve(const struct Dwarf_Addrs *addrs, const char *name, Dwarf_Off cu_offset, Dwarf_Off func_offset, void *arg) {
+    struct pubnames_iter *iter = arg;
+    uintptr_t addr = 0;
+
+    int res = pubname_address(addrs, cu_offset, func_offset, &addr);
+    if (res == -E_NO_ENT) return 0;
+    if (res < 0) return res;
+    return iter->fn(name, addr, iter->arg);
+}
+
+/* Call fn(name, address, arg) for every function in .debug_pubnames that has
+ * an address. Used to build lookup indexes in a single pass over the section. */
+int
+pubnames_foreach(const struct Dwarf_Addrs *addrs, int (*fn)(const char *name, uintptr_t addr, void *arg), void *arg) {
+    struct pubnames_iter iter = {fn, arg};
+    return pubnames_walk(addrs, pubname_resolve, &iter);
 }
 
 int
@@ -651,6 +851,8 @@ naive_address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintp
     if (!flen) return -E_INVAL;
 
     for (const uint8_t *entry = addrs->info_begin; (const unsigned char *)entry < addrs->info_end;) {
+        preempt_point();
+
         uint64_t len = 0;
         uint32_t count = dwarf_entry_len(entry, &len);
         entry += count;
@@ -669,8 +871,7 @@ naive_address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintp
         assert(address_size == sizeof(uintptr_t));
 
         /* Parse related DIE's */
-        uint64_t abbrev_code = 0, table_abbrev_code = 0;
-        const uint8_t *abbrev_entry = addrs->abbrev_begin + abbrev_offset;
+        uint64_t abbrev_code = 0;
 
         while (entry < entry_end) {
             /* Read info abbreviation code */
@@ -679,21 +880,9 @@ naive_address_by_fname(const struct Dwarf_Addrs *addrs, const char *fname, uintp
             if (!abbrev_code) continue;
 
             /* Find abbreviation in abbrev section */
-            /* UNSAFE, Needs to be replaced */
-            const uint8_t *curr_abbrev_entry = abbrev_entry;
             uint64_t name = 0, form = 0, tag = 0;
-            while ((const unsigned char *)curr_abbrev_entry < addrs->abbrev_end) {
-                curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &table_abbrev_code);
-                curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &tag);
-                curr_abbrev_entry += sizeof(Dwarf_Small);
-                if (table_abbrev_code == abbrev_code) break;
-
-                /* skip attributes */
-                do {
-                    curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &name);
-                    curr_abbrev_entry += dwarf_read_uleb128(curr_abbrev_entry, &form);
-                } while (name || form);
-            }
+            const uint8_t *curr_abbrev_entry = find_abbrev(addrs, abbrev_offset, abbrev_code, &tag);
+            if (!curr_abbrev_entry) return -E_BAD_DWARF;
             /* parse subprogram or label DIE */
             if (tag == DW_TAG_subprogram || tag == DW_TAG_label) {
                 uintptr_t low_pc = 0;
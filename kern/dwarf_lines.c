@@ -2,6 +2,8 @@
 #include <inc/dwarf.h>
 #include <inc/error.h>
 #include <inc/types.h>
+#include <inc/string.h>
+#include <inc/x86.h>
 
 /* Line Number machine state. Some registers, considered in standard, are omitted:
  *
@@ -30,12 +32,48 @@ struct Line_Number_Info {
     Dwarf_Small *standard_opcode_lengths;
 };
 
+/* Decoded line number table of one compilation unit: rows sorted by address.
+ * A row with line 0 marks the end of a sequence, addresses from it up to the
+ * next row have no line information. */
+struct Line_Row {
+    uintptr_t address;
+    int line;
+};
+
+struct Line_Table {
+    struct Line_Row *rows;
+    size_t count;
+    size_t capacity;
+};
+
+static int
+line_table_push(struct Line_Table *table, const struct Line_Number_State *state) {
+    if (table->count == table->capacity) return -E_NO_MEM;
+
+    struct Line_Row row = {state->address, state->end_sequence ? 0 : state->line};
+
+    /* Rows of a sequence come in address order, so insertion sort only moves
+     * rows when sequences are out of order. End markers sort before rows
+     * with the same address so the sequence starting there wins. */
+    size_t i = table->count++;
+    for (; i; i--) {
+        struct Line_Row *prev = &table->rows[i - 1];
+        if (prev->address < row.address) break;
+        if (prev->address == row.address && (!prev->line || row.line)) break;
+        table->rows[i] = *prev;
+    }
+    table->rows[i] = row;
+    return 0;
+}
+
 /* Execute the Line Number Program, starting at `program_addr` and ending at
  * `end_addr`. Stop when next row of line number table corresponds to address
  * which is greater than `destination_addr`. Last raw, which corresponds to
- * address less or equal `destination_addr`, will be the raw we look for. */
-inline static void
-run_line_number_program(const uint8_t *program_addr, const uint8_t *end_addr, const struct Line_Number_Info *info, struct Line_Number_State *state, uintptr_t destination_addr) {
+ * address less or equal `destination_addr`, will be the raw we look for.
+ * If `table` is given, run the whole program and record every row instead. */
+inline static int
+run_line_number_program(const uint8_t *program_addr, const uint8_t *end_addr, const struct Line_Number_Info *info,
+                        struct Line_Number_State *state, uintptr_t destination_addr, struct Line_Table *table) {
 #ifndef __clang_analyzer__
     struct Line_Number_State last_state;
 #endif
@@ -55,11 +93,12 @@ run_line_number_program(const uint8_t *program_addr, const uint8_t *end_addr, co
             switch (opcode) {
             case DW_LNE_end_sequence:
                 state->end_sequence = true;
+                if (table && line_table_push(table, state) < 0) return -E_NO_MEM;
 #ifndef __clang_analyzer__
-                if (last_state.address <= destination_addr &&
+                if (!table && last_state.address <= destination_addr &&
                     destination_addr < state->address) {
                     *state = last_state;
-                    return;
+                    return 0;
                 }
                 last_state = *state;
 #endif
@@ -99,11 +138,12 @@ run_line_number_program(const uint8_t *program_addr, const uint8_t *end_addr, co
             /* We have a standard opcode. */
             switch (opcode) {
             case DW_LNS_copy:
+                if (table && line_table_push(table, state) < 0) return -E_NO_MEM;
 #ifndef __clang_analyzer__
-                if (last_state.address <= destination_addr &&
+                if (!table && last_state.address <= destination_addr &&
                     destination_addr < state->address) {
                     *state = last_state;
-                    return;
+                    return 0;
                 }
                 last_state = *state;
 #endif
@@ -173,40 +213,25 @@ run_line_number_program(const uint8_t *program_addr, const uint8_t *end_addr, co
             state->address += info->minimum_instruction_length *
                               (op_advance / info->maximum_operations_per_instruction);
             state->discriminator = 0;
+            if (table && line_table_push(table, state) < 0) return -E_NO_MEM;
 #ifndef __clang_analyzer__
-            if (last_state.address <= destination_addr && destination_addr < state->address) {
+            if (!table && last_state.address <= destination_addr && destination_addr < state->address) {
                 *state = last_state;
-                return;
+                return 0;
             }
             last_state = *state;
 #endif
         }
     }
+    return 0;
 }
 
-/* Get line number, corresponding to address `p` and store it to `lineno_store`.
- * `addrs` should contain addresses of .debug_* sections and line_offset should
- * contain an offset in .debug_line of entry associated with compilation unit,
- * in which we search address `p`. This offset can be obtained from .debug_info
- * section, using the `file_name_by_info` function. */
-int
-line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p,
-                 Dwarf_Off line_offset, int *lineno_store) {
-    if (line_offset > addrs->line_end - addrs->line_begin)
-        return -E_INVAL;
-    if (!lineno_store)
-        return -E_INVAL;
-
+/* Parse the Line Number Program Header of the entry at `line_offset` */
+static int
+line_program_header(const struct Dwarf_Addrs *addrs, Dwarf_Off line_offset, struct Line_Number_Info *info,
+                    const uint8_t **program_addr, const uint8_t **unit_end) {
     const void *curr_addr = addrs->line_begin + line_offset;
 
-    struct Line_Number_State current_state = {
-            .address = 0,
-            .line = 1,
-            .column = 0,
-            .end_sequence = false,
-            .discriminator = 0,
-    };
-
     /* Parse Line Number Program Header */
     uint64_t unit_length = 0;
     uint32_t count;
@@ -215,7 +240,7 @@ line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p,
     if (!count)
         return -E_BAD_DWARF;
 
-    const void *unit_end = curr_addr + unit_length;
+    *unit_end = curr_addr + unit_length;
     Dwarf_Half version = get_unaligned(curr_addr, Dwarf_Half);
     curr_addr += sizeof(Dwarf_Half);
     assert(version == 4 || version == 3 || version == 2);
@@ -225,7 +250,7 @@ line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p,
     if (!count)
         return -E_BAD_DWARF;
 
-    const uint8_t *program_addr = curr_addr + header_length;
+    *program_addr = curr_addr + header_length;
     Dwarf_Small minimum_instruction_length =
             get_unaligned(curr_addr, Dwarf_Small);
     assert(minimum_instruction_length == 1);
@@ -252,7 +277,7 @@ line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p,
 
     /* Skip rest of the header, as we don't need include directories and
      * file_names and run line number program */
-    struct Line_Number_Info info = {
+    *info = (struct Line_Number_Info){
             .minimum_instruction_length = minimum_instruction_length,
             .maximum_operations_per_instruction = maximum_operations_per_instruction,
             .line_base = line_base,
@@ -261,7 +286,124 @@ line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p,
             .standard_opcode_lengths = standard_opcode_lengths,
     };
 
-    run_line_number_program(program_addr, unit_end, &info, &current_state, p);
+    return 0;
+}
+
+/* Decoded tables are kept in a small cache sharing one row arena. When
+ * either runs out the whole cache is dropped and refilled. Units with more
+ * rows than the arena holds are always interpreted directly. */
+#define LINE_CACHE_UNITS 16
+#define LINE_CACHE_ROWS  8192
+
+static struct Line_Cache_Entry {
+    const uint8_t *unit; /* Line program this table was decoded from */
+    struct Line_Table table;
+} line_cache[LINE_CACHE_UNITS];
+
+static struct Line_Row line_cache_rows[LINE_CACHE_ROWS];
+static size_t line_cache_used_rows;
+static size_t line_cache_next;
+/* Lookups can come from any CPU and from lock tracing, so instead of a
+ * lock a busy cache is simply bypassed */
+static volatile uint32_t line_cache_busy;
+
+static void
+line_cache_flush(void) {
+    memset(line_cache, 0, sizeof(line_cache));
+    line_cache_used_rows = 0;
+    line_cache_next = 0;
+}
+
+static int
+line_cache_decode(struct Line_Cache_Entry *ent, const struct Line_Number_Info *info,
+                  const uint8_t *program_addr, const uint8_t *unit_end) {
+    ent->table = (struct Line_Table){
+            .rows = line_cache_rows + line_cache_used_rows,
+            .count = 0,
+            .capacity = LINE_CACHE_ROWS - line_cache_used_rows,
+    };
+
+    struct Line_Number_State state = {
+            .address = 0,
+            .line = 1,
+            .column = 0,
+            .end_sequence = false,
+            .discriminator = 0,
+    };
+    return run_line_number_program(program_addr, unit_end, info, &state, 0, &ent->table);
+}
+
+static struct Line_Table *
+line_cache_get(const uint8_t *unit, const struct Line_Number_Info *info,
+               const uint8_t *program_addr, const uint8_t *unit_end) {
+    for (size_t i = 0; i < line_cache_next; i++)
+        if (line_cache[i].unit == unit) return &line_cache[i].table;
+
+    if (line_cache_next == LINE_CACHE_UNITS) line_cache_flush();
+
+    struct Line_Cache_Entry *ent = &line_cache[line_cache_next];
+    if (line_cache_decode(ent, info, program_addr, unit_end) < 0) {
+        /* Too large even for an empty arena */
+        if (!line_cache_used_rows) return NULL;
+
+        line_cache_flush();
+        ent = &line_cache[0];
+        if (line_cache_decode(ent, info, program_addr, unit_end) < 0) return NULL;
+    }
+
+    ent->unit = unit;
+    line_cache_used_rows += ent->table.count;
+    line_cache_next++;
+    return &ent->table;
+}
+
+/* Get line number, corresponding to address `p` and store it to `lineno_store`.
+ * `addrs` should contain addresses of .debug_* sections and line_offset should
+ * contain an offset in .debug_line of entry associated with compilation unit,
+ * in which we search address `p`. This offset can be obtained from .debug_info
+ * section, using the `file_name_by_info` function. */
+int
+line_for_address(const struct Dwarf_Addrs *addrs, uintptr_t p,
+                 Dwarf_Off line_offset, int *lineno_store) {
+    if (line_offset > addrs->line_end - addrs->line_begin)
+        return -E_INVAL;
+    if (!lineno_store)
+        return -E_INVAL;
+
+    struct Line_Number_Info info;
+    const uint8_t *program_addr, *unit_end;
+    int res = line_program_header(addrs, line_offset, &info, &program_addr, &unit_end);
+    if (res < 0) return res;
+
+    if (!xchg(&line_cache_busy, 1)) {
+        struct Line_Table *table = line_cache_get(addrs->line_begin + line_offset, &info, program_addr, unit_end);
+        if (table) {
+            /* Find the last row at or below p */
+            size_t lo = 0, hi = table->count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (table->rows[mid].address <= p) lo = mid + 1;
+                else hi = mid;
+            }
+            int line = lo ? table->rows[lo - 1].line : 0;
+            xchg(&line_cache_busy, 0);
+
+            if (!line) return -E_NO_ENT;
+            *lineno_store = line;
+            return 0;
+        }
+        xchg(&line_cache_busy, 0);
+    }
+
+    struct Line_Number_State current_state = {
+            .address = 0,
+            .line = 1,
+            .column = 0,
+            .end_sequence = false,
+            .discriminator = 0,
+    };
+
+    run_line_number_program(program_addr, unit_end, &info, &current_state, p, NULL);
 
     *lineno_store = current_state.line;
 
@@ -16,26 +16,70 @@
 #include <kern/macro.h>
 #include <kern/pmap.h>
 #include <kern/traceopt.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/ktimer.h>
+#include <kern/fpu.h>
+#include <kern/pmu.h>
+#include <kern/ring.h>
+#include <kern/futex.h>
+#include <kern/uheap.h>
+#include <kern/vsyscall.h>
 
 /* Currently active environment */
 struct Env *curenv = NULL;
 
+/* Scheduler-hot fields all share the cache line of env_id */
+#define ENV_HOT(field) (offsetof(struct Env, field) / 64 == offsetof(struct Env, env_id) / 64)
+static_assert(offsetof(struct Env, env_tf) == 0, "The trap frame is saved at curenv");
+static_assert(ENV_HOT(env_status) && ENV_HOT(env_cpunum) && ENV_HOT(env_weight) && ENV_HOT(env_runq) &&
+                      ENV_HOT(env_link) && ENV_HOT(env_vruntime) && ENV_HOT(env_run_start) &&
+                      ENV_HOT(env_runnable_since),
+              "Scheduler-hot Env fields don't fit a cache line");
+
+/* Kernel mode env stacks of a chunk are one allocation */
+#define ENV_STACKS_CLASS 7
+static_assert(CLASS_SIZE(ENV_STACKS_CLASS) == ENV_CHUNK * PROG_STACK_SIZE, "Env stacks don't fill their page");
+
+/* A chunk of the env table, allocated by env_grow() and never freed */
+struct EnvChunk {
+    struct Env envs[ENV_CHUNK]; /* Has to be the first field, see env_chunk() */
 #ifdef CONFIG_KSPACE
-/* All environments */
-struct Env env_array[NENV];
-struct Env *envs = env_array;
-#else
-/* All environments */
-struct Env *envs = NULL;
+    /* Wakeup events of the envs sleeping in sys_sleep() */
+    struct KTimer sleep_timers[ENV_CHUNK];
+    /* ENV_CHUNK stacks of PROG_STACK_SIZE bytes */
+    uint8_t *stacks;
 #endif
+};
+
+/* All environments */
+struct Env *env_chunks[NENV / ENV_CHUNK];
+size_t nenvs;
 
 /* Free environment list
  * (linked by Env->env_link) */
 static struct Env *env_free_list;
 
+/* Protects env_free_list and allocation/freeing of envs */
+static struct spinlock env_lock = SPINLOCK_INITIALIZER(env_lock, LOCK_ORDER_ENV);
+
 
 /* NOTE: Should be at least LOGNENV */
-#define ENVGENSHIFT 12
+#define ENVGENSHIFT LOG2NENV
+
+static struct EnvChunk *
+env_chunk(size_t i) {
+    return (struct EnvChunk *)env_chunks[i / ENV_CHUNK];
+}
+
+#ifdef CONFIG_KSPACE
+/* Wakeup event of env while it sleeps in sys_sleep() */
+static struct KTimer *
+env_sleep_timer(struct Env *env) {
+    size_t i = ENVX(env->env_id);
+    return &env_chunk(i)->sleep_timers[i % ENV_CHUNK];
+}
+#endif
 
 /* Converts an envid to an env pointer.
  * If checkperm is set, the specified environment must be either the
@@ -59,8 +103,12 @@ envid2env(envid_t envid, struct Env **env_store, bool need_check_perm) {
      * then check the env_id field in that struct Env
      * to ensure that the envid is not stale
      * (i.e., does not refer to a _previous_ environment
-     * that used the same slot in the envs[] array). */
-    env = &envs[ENVX(envid)];
+     * that used the same slot in the env table). */
+    if (ENVX(envid) >= __atomic_load_n(&nenvs, __ATOMIC_ACQUIRE)) {
+        *env_store = NULL;
+        return -E_BAD_ENV;
+    }
+    env = env_at(ENVX(envid));
     if (env->env_status == ENV_FREE || env->env_id != envid) {
         *env_store = NULL;
         return -E_BAD_ENV;
@@ -80,31 +128,65 @@ envid2env(envid_t envid, struct Env **env_store, bool need_check_perm) {
     return 0;
 }
 
-/* Mark all environments in 'envs' as free, set their env_ids to 0,
- * and insert them into the env_free_list.
- * Make sure the environments are in the free list in the same order
- * they are in the envs array (i.e., so that the first call to
- * env_alloc() returns envs[0]).
- */
-void
-env_init(void) {
-    /* Set up envs array */
+/* Address space env runs in.
+ * Kernel mode envs all run in the kernel address space */
+struct AddressSpace *
+env_space(struct Env *env) {
+#ifdef CONFIG_KSPACE
+    return &kspace;
+#else
+    return &env->address_space;
+#endif
+}
 
-    // LAB 3: Your code here
-    for (size_t i = 0; i < NENV; ++i) {
-        struct Env* env = &envs[i];
-        env->env_status = ENV_FREE;
-        env->env_id = 0;
+/* Add a chunk of free envs to the table and to env_free_list,
+ * lowest index first. env_lock has to be held.
+ * Returns -E_NO_FREE_ENV if the table has NENV envs already */
+static int
+env_grow(void) {
+    if (nenvs == NENV) return -E_NO_FREE_ENV;
 
-        if (i < NENV - 1) {
-            env->env_link = &envs[i + 1];
-        } else {
-            env->env_link = NULL;
-        }
+#ifdef CONFIG_KSPACE
+    /* Stacks go first, kernel heap regions can't be given back */
+    void *stacks = kalloc_page(ENV_STACKS_CLASS);
+    if (!stacks) return -E_NO_MEM;
+#endif
 
+    struct EnvChunk *chunk = kzalloc_region(sizeof(*chunk));
+    if (!chunk) {
+#ifdef CONFIG_KSPACE
+        kfree_page(stacks, ENV_STACKS_CLASS);
+#endif
+        return -E_NO_MEM;
     }
-    
-    env_free_list = &envs[0];
+#ifdef CONFIG_KSPACE
+    chunk->stacks = stacks;
+#endif
+
+    for (size_t i = ENV_CHUNK; i--;) {
+        struct Env *env = &chunk->envs[i];
+        env->env_status = ENV_FREE;
+        /* Free slots keep their index in env_id, see env_alloc() */
+        env->env_id = nenvs + i;
+        env->env_runq.next = env->env_runq.prev = &env->env_runq;
+        env->env_futex.next = env->env_futex.prev = &env->env_futex;
+        env->env_futex_space = NULL;
+        env->env_link = env_free_list;
+        env_free_list = env;
+    }
+
+    /* The chunk is complete before envid2env() can see it */
+    env_chunks[nenvs / ENV_CHUNK] = chunk->envs;
+    __atomic_store_n(&nenvs, nenvs + ENV_CHUNK, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* The env table starts empty, it is grown by env_alloc() on demand.
+ * The first call to env_alloc() returns the env in slot 0 */
+void
+env_init(void) {
+    sched_init();
+    futex_init();
 }
 
 /* Allocates and initializes a new environment.
@@ -113,21 +195,29 @@ env_init(void) {
  * Returns
  *     0 on success, < 0 on failure.
  * Errors
- *    -E_NO_FREE_ENV if all NENVS environments are allocated
+ *    -E_NO_FREE_ENV if all NENV environments are allocated
  *    -E_NO_MEM on memory exhaustion
  */
 int
 env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
 
     struct Env *env;
-    if (!(env = env_free_list))
-        return -E_NO_FREE_ENV;
+    spin_lock(&env_lock);
+    if (!env_free_list) {
+        int res = env_grow();
+        if (res < 0) {
+            spin_unlock(&env_lock);
+            return res;
+        }
+    }
+    env = env_free_list;
 
     /* Generate an env_id for this environment */
+    size_t env_index = ENVX(env->env_id);
     int32_t generation = (env->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
     /* Don't create a negative env_id */
     if (generation <= 0) generation = 1 << ENVGENSHIFT;
-    env->env_id = generation | (env - envs);
+    env->env_id = generation | env_index;
 
     /* Set the basic status variables */
     env->env_parent_id = parent_id;
@@ -138,6 +228,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
 #endif
     env->env_status = ENV_RUNNABLE;
     env->env_runs = 0;
+    env->env_cpunum = cpunum();
+    env->env_vruntime = 0;
+    env->env_weight = env->env_type == ENV_TYPE_IDLE ? SCHED_WEIGHT_IDLE : SCHED_WEIGHT_DEFAULT;
+    env->env_ipc_recving = 0;
+    env->env_heap = 0;
+    env->env_user_cycles = env->env_kernel_cycles = env->env_wait_cycles = 0;
+    env->env_nvcsw = env->env_nivcsw = 0;
 
     /* Clear out all the saved register state,
      * to prevent the register values
@@ -160,23 +257,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
     env->env_tf.tf_ss = GD_KD;
     env->env_tf.tf_cs = GD_KT;
 
-    // LAB 3: Your code here:
-    static const uintptr_t STACK_AREA_TOP = 0x2000000;
-    
-    // Check there is space for the stack of the newly created process.
-    // NENV now is 2^10 = 1024. If will be more at some point,
-    // our current memory allocation strategy could be dangerous,
-    // as STACK_AREA could be exausted. Check it won't be for sure.
-    // Otherwise, if it will be possible, return that error has occured.
-    // Or change allocation strategy, I think this is better.
-    assert((NENV - 1) * 2 * PAGE_SIZE < STACK_AREA_TOP);
-    
-    // FIXME: stack may start colliding with the already loaded binaries.
-    //   And loaded binaries in future.
-
-    size_t env_index = (size_t) (env - envs);
-    uintptr_t stack_area_offset = 2 * PAGE_SIZE * env_index;
-    env->env_tf.tf_rsp = STACK_AREA_TOP - stack_area_offset;
+    /* Every slot has its own stack, reused by the envs in it */
+    env->env_tf.tf_rsp = (uintptr_t)(env_chunk(env_index)->stacks + (env_index % ENV_CHUNK + 1) * PROG_STACK_SIZE);
 
 #else
     env->env_tf.tf_ds = GD_UD | 3;
@@ -191,6 +273,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
 
     /* Commit the allocation */
     env_free_list = env->env_link;
+    sched_enqueue(env);
+    spin_unlock(&env_lock);
     *newenv_store = env;
 
     if (trace_envs) cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, env->env_id);
@@ -334,6 +418,7 @@ bind_functions(struct Env *env, uint8_t *binary, size_t size, uintptr_t image_st
         uintptr_t kernel_code_address;
     } ASM_EXPORTED_FUNCTIONS[] = {
         { "sys_yield", (uintptr_t) sys_yield },
+        { "sys_sleep", (uintptr_t) sys_sleep },
         { "sys_exit" , (uintptr_t) sys_exit  }
     };
     static const size_t NUM_EXPORTED_ASM_FUNCTIONS = sizeof(ASM_EXPORTED_FUNCTIONS) / sizeof(struct exported_function);
@@ -462,6 +547,28 @@ bind_functions(struct Env *env, uint8_t *binary, size_t size, uintptr_t image_st
     return 0;
 }
 
+/* Read-only segment can be mapped straight from the embedded image
+ * (and shared by all envs running the program) if its file offset
+ * is congruent with its address and its pages are not shared with
+ * other segments */
+static bool
+segment_is_shareable(uint8_t *binary, struct Proghdr const *ph, struct Proghdr const *phs, size_t phnum) {
+    if (ph->p_type != PT_LOAD || (ph->p_flags & ELF_PROG_FLAG_WRITE)) return 0;
+    if (!ph->p_filesz || ph->p_filesz != ph->p_memsz) return 0;
+    if ((ph->p_va - (uintptr_t)(binary + ph->p_offset)) & (PAGE_SIZE - 1)) return 0;
+
+    uintptr_t start = ROUNDDOWN(ph->p_va, PAGE_SIZE);
+    uintptr_t end = ROUNDUP(ph->p_va + ph->p_memsz, PAGE_SIZE);
+    for (size_t i = 0; i < phnum; i++) {
+        struct Proghdr const *other = &phs[i];
+        if (other == ph || other->p_type != PT_LOAD || !other->p_memsz) continue;
+        if (ROUNDDOWN(other->p_va, PAGE_SIZE) < end &&
+            ROUNDUP(other->p_va + other->p_memsz, PAGE_SIZE) > start) return 0;
+    }
+
+    return 1;
+}
+
 /* Set up the initial program binary, stack, and processor flags
  * for a user process.
  * This function is ONLY called during kernel initialization,
@@ -699,6 +806,14 @@ load_icode(struct Env *env, uint8_t *binary, size_t size/*, size_t* addr_space_s
             if (program_header->p_offset + program_header->p_filesz > size) {
                 return -E_INVALID_EXE;
             }
+            if (segment_is_shareable(binary, program_header, program_headers, elf_header->e_phnum)) {
+                int prot = PROT_R | (program_header->p_flags & ELF_PROG_FLAG_EXEC ? PROT_X : 0);
+                if (map_kernel_image(program_header->p_va, binary + program_header->p_offset,
+                                     program_header->p_filesz, prot) < 0) {
+                    return -E_NO_MEM;
+                }
+                continue;
+            }
             memcpy((void*) (size_t) program_header->p_pa, (void const*) ((char const*) binary + program_header->p_offset), program_header->p_filesz);
         }
     }
@@ -720,6 +835,20 @@ load_icode(struct Env *env, uint8_t *binary, size_t size/*, size_t* addr_space_s
             if (section_header->sh_offset + section_header->sh_size > size) {
                 return -E_INVALID_EXE;
             }
+            // Contents of sections in shared segments are already mapped (read-only).
+            bool shared = false;
+            for (UINT16 segment_index = 0; segment_index < elf_header->e_phnum; ++segment_index) {
+                struct Proghdr const* program_header = &program_headers[segment_index];
+                if (section_header->sh_addr >= program_header->p_va &&
+                    section_header->sh_addr + section_header->sh_size <= program_header->p_va + program_header->p_memsz &&
+                    segment_is_shareable(binary, program_header, program_headers, elf_header->e_phnum)) {
+                    shared = true;
+                    break;
+                }
+            }
+            if (shared) {
+                continue;
+            }
             memcpy((void*) (size_t) section_header->sh_addr, (void const*) ((char const*) binary + section_header->sh_offset), section_header->sh_size);
         }
     }
@@ -788,10 +917,22 @@ env_free(struct Env *env) {
     /* Note the environment's demise. */
     if (trace_envs) cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, env->env_id);
 
+#ifdef CONFIG_KSPACE
+    timer_cancel(env_sleep_timer(env));
+#endif
+    fpu_release(env);
+    pmu_release(env);
+    ring_release(env);
+    futex_release(env);
+    uheap_release(env);
+
     /* Return the environment to the free list */
+    spin_lock(&env_lock);
+    sched_dequeue(env);
     env->env_status = ENV_FREE;
     env->env_link = env_free_list;
     env_free_list = env;
+    spin_unlock(&env_lock);
 }
 
 /* Frees environment env
@@ -835,10 +976,40 @@ csys_exit(void) {
 
 void
 csys_yield(struct Trapframe *tf) {
-    memcpy(&curenv->env_tf, tf, sizeof(struct Trapframe));
+    sched_account(curenv);
+    if (tf != &curenv->env_tf) memcpy(&curenv->env_tf, tf, sizeof(struct Trapframe));
 
     sched_yield();
 }
+
+/* Makes an env put to sleep by csys_sleep() runnable again */
+static void
+env_wakeup(void *arg) {
+    struct Env *env = arg;
+
+    if (env->env_status != ENV_NOT_RUNNABLE) return;
+    env->env_status = ENV_RUNNABLE;
+    sched_enqueue(env);
+}
+
+/* Make the running env not runnable for nsec nanoseconds.
+ * The caller should sched_yield() after this */
+void
+env_sleep(struct Env *env, uint64_t nsec) {
+    if (!nsec) return;
+
+    env->env_status = ENV_NOT_RUNNABLE;
+    timer_add(env_sleep_timer(env), nsec, env_wakeup, env);
+}
+
+void
+csys_sleep(struct Trapframe *tf) {
+    sched_account(curenv);
+    if (tf != &curenv->env_tf) memcpy(&curenv->env_tf, tf, sizeof(struct Trapframe));
+
+    env_sleep(curenv, tf->tf_regs.reg_rdi);
+    sched_yield();
+}
 #endif
 
 /* Restores the register values in the Trapframe with the 'ret' instruction.
@@ -849,12 +1020,43 @@ csys_yield(struct Trapframe *tf) {
 
 _Noreturn void
 env_pop_tf(struct Trapframe *tf) {
-    /* Push RIP on program stack */
-    tf->tf_rsp -= sizeof(uintptr_t);
-    *((uintptr_t *)tf->tf_rsp) = tf->tf_rip;
-    /* Push RFLAGS on program stack */
-    tf->tf_rsp -= sizeof(uintptr_t);
-    *((uintptr_t *)tf->tf_rsp) = tf->tf_rflags;
+    irqstat_exit();
+
+    /* Kernel mode envs run at the same privilege level, so there is
+     * no stack or code segment to switch. Return there with popfq and
+     * ret from the env's own stack instead of the much slower iretq */
+    if (!(tf->tf_cs & 3)) {
+        uintptr_t *rsp = (uintptr_t *)tf->tf_rsp;
+        /* Push RIP on program stack */
+        *--rsp = tf->tf_rip;
+        /* Push RFLAGS on program stack */
+        *--rsp = tf->tf_rflags;
+
+        asm volatile(
+                "movq %0, %%rsp\n"
+                "movq 0(%%rsp), %%r15\n"
+                "movq 8(%%rsp), %%r14\n"
+                "movq 16(%%rsp), %%r13\n"
+                "movq 24(%%rsp), %%r12\n"
+                "movq 32(%%rsp), %%r11\n"
+                "movq 40(%%rsp), %%r10\n"
+                "movq 48(%%rsp), %%r9\n"
+                "movq 56(%%rsp), %%r8\n"
+                "movq 64(%%rsp), %%rsi\n"
+                "movq 72(%%rsp), %%rdi\n"
+                "movq 80(%%rsp), %%rbp\n"
+                "movq 88(%%rsp), %%rdx\n"
+                "movq 96(%%rsp), %%rcx\n"
+                "movq 104(%%rsp), %%rbx\n"
+                "movq 112(%%rsp), %%rax\n"
+                "movw 120(%%rsp), %%es\n"
+                "movw 128(%%rsp), %%ds\n"
+                "movq %c1(%%rsp), %%rsp\n"
+                "subq $16, %%rsp\n"
+                "popfq\n"
+                "ret" ::"g"(tf), "i"(TF_RSP)
+                : "memory");
+    }
 
     asm volatile(
             "movq %0, %%rsp\n"
@@ -916,10 +1118,26 @@ env_run(struct Env *env) {
 
     // LAB 3: Your code here
 
+    /* The same env resumes (e.g. after a timer tick that didn't
+     * preempt it), there is no need for a round trip through
+     * the run queue */
+    if (env == curenv && env->env_status == ENV_RUNNING) {
+        env->env_runs += 1;
+        env->env_run_start = sched_account_run(env, env);
+        fpu_switch(env);
+        pmu_switch(env);
+        vsys_set_env(env);
+        env_pop_tf(&env->env_tf);
+    }
+
+    uint64_t now = sched_account_run(curenv, env);
+
     if (__builtin_expect(curenv != NULL, 1)) {
-        assert(curenv->env_status == ENV_RUNNING || curenv->env_status == ENV_FREE || curenv->env_status == ENV_DYING);
+        assert(curenv->env_status == ENV_RUNNING || curenv->env_status == ENV_FREE ||
+               curenv->env_status == ENV_DYING || curenv->env_status == ENV_NOT_RUNNABLE);
         if (__builtin_expect(curenv->env_status == ENV_RUNNING, 1)) {
             curenv->env_status = ENV_RUNNABLE;
+            sched_enqueue(curenv);
         } else if (curenv->env_status == ENV_FREE) {
             // The task has just exited. No need to do anything.
             (void) 0;
@@ -938,9 +1156,15 @@ env_run(struct Env *env) {
 
     assert(env->env_status == ENV_RUNNABLE || env->env_status == ENV_DYING);
 
+    sched_dequeue(env);
+    env->env_cpunum = cpunum();
     curenv = env;
     curenv->env_status = ENV_RUNNING;
     curenv->env_runs += 1;
+    curenv->env_run_start = now;
+    fpu_switch(curenv);
+    pmu_switch(curenv);
+    vsys_set_env(curenv);
     env_pop_tf(&curenv->env_tf);
 
     while(1) {}
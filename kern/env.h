@@ -7,8 +7,20 @@
 
 #define NCPU 1
 
-/* All environments */
-extern struct Env *envs;
+/* The env table grows by ENV_CHUNK envs at a time, up to NENV.
+ * env_chunks[] is its index by ENVX(envid) / ENV_CHUNK */
+#define ENV_CHUNK 64
+
+extern struct Env *env_chunks[NENV / ENV_CHUNK];
+/* Number of env slots allocated so far, a multiple of ENV_CHUNK */
+extern size_t nenvs;
+
+/* Env in slot i, i has to be below nenvs */
+static inline struct Env *
+env_at(size_t i) {
+    return &env_chunks[i / ENV_CHUNK][i % ENV_CHUNK];
+}
+
 /* Currently active environment */
 extern struct Env *curenv;
 extern struct Segdesc32 gdt[];
@@ -20,12 +32,16 @@ void env_create(uint8_t *binary, size_t size, enum EnvType type);
 void env_destroy(struct Env *env);
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+struct AddressSpace *env_space(struct Env *env);
 _Noreturn void env_run(struct Env *e);
 _Noreturn void env_pop_tf(struct Trapframe *tf);
 
 #ifdef CONFIG_KSPACE
+void env_sleep(struct Env *env, uint64_t nsec);
+
 extern void sys_exit(void);
 extern void sys_yield(void);
+extern void sys_sleep(uint64_t nsec);
 #endif
 
 /* Without this extra macro, we couldn't pass macros like TEST to
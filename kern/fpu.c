@@ -0,0 +1,139 @@
+/* Lazy x87/SSE/AVX state switching */
+
+#include <inc/assert.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/pmap.h>
+
+#define CPUID_ECX_XSAVE    (1 << 26)
+#define CPUID_XSAVE        0xD
+#define CPUID_EAX_XSAVEOPT (1 << 0) /* Leaf 0xD, subleaf 1 */
+
+/* State components enabled in XCR0 if the CPU has them */
+#define XFEATURE_X87    (1 << 0)
+#define XFEATURE_SSE    (1 << 1)
+#define XFEATURE_AVX    (1 << 2)
+#define XFEATURE_AVX512 (7 << 5)
+
+/* Legacy (FXSAVE) area layout */
+#define FXSAVE_SIZE   512
+#define FXSAVE_MXCSR  24
+#define FXSAVE_REGS   32  /* ST0-7 and XMM0-15 follow the control words */
+#define FXSAVE_RSVD   416
+#define MXCSR_DEFAULT 0x1F80
+
+static bool fpu_xsave, fpu_xsaveopt;
+static uint64_t fpu_xcr0;
+
+/* FPU state of an env (Env->env_fpu_state) is page sized,
+ * so that it is aligned for XSAVE and fits all enabled components */
+
+/* Env whose state is in the registers of a CPU,
+ * and whether CR0.TS is set there */
+static struct Env *fpu_owner[NCPU];
+static bool fpu_ts[NCPU];
+
+/* Legacy area of the initial state: after fninit, default MXCSR,
+ * zeroed registers. With XSAVE the rest of a new area is zeroed,
+ * so XRSTOR puts the other components into their init state */
+static uint8_t fpu_init_state[FXSAVE_SIZE] __attribute__((aligned(16)));
+
+void
+fpu_init(void) {
+    uint32_t ecx, eax, ebx;
+
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    fpu_xsave = !!(ecx & CPUID_ECX_XSAVE);
+
+    lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT | (fpu_xsave ? CR4_OSXSAVE : 0));
+    lcr0((rcr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+
+    if (fpu_xsave) {
+        cpuid_count(CPUID_XSAVE, 0, &eax, NULL, NULL, NULL);
+        fpu_xcr0 = eax & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURE_AVX512);
+        xsetbv(0, fpu_xcr0);
+
+        /* Size of the area for the features enabled in XCR0 */
+        cpuid_count(CPUID_XSAVE, 0, NULL, &ebx, NULL, NULL);
+        if (ebx > PAGE_SIZE) panic("XSAVE area of %u bytes doesn't fit a page", ebx);
+
+        cpuid_count(CPUID_XSAVE, 1, &eax, NULL, NULL, NULL);
+        fpu_xsaveopt = !!(eax & CPUID_EAX_XSAVEOPT);
+    }
+
+    asm volatile("fninit");
+    fxsave(fpu_init_state);
+    memset(fpu_init_state + FXSAVE_REGS, 0, FXSAVE_RSVD - FXSAVE_REGS);
+    *(uint32_t *)(fpu_init_state + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+
+    /* No env owns the registers yet */
+    lcr0(rcr0() | CR0_TS);
+    fpu_ts[cpunum()] = 1;
+}
+
+/* Called right before env runs on this CPU. The control register is
+ * only written when TS changes, which is not the case for envs
+ * switching between each other without touching the FPU */
+void
+fpu_switch(struct Env *env) {
+    int cpu = cpunum();
+    bool ts = fpu_owner[cpu] != env;
+
+    if (ts == fpu_ts[cpu]) return;
+    if (ts) lcr0(rcr0() | CR0_TS);
+    else clts();
+    fpu_ts[cpu] = ts;
+}
+
+/* #NM: curenv used the FPU while someone else's state
+ * (or nobody's) is in the registers */
+void
+fpu_trap(void) {
+    int cpu = cpunum();
+    struct Env *owner = fpu_owner[cpu];
+    assert(curenv && owner != curenv);
+
+    clts();
+    fpu_ts[cpu] = 0;
+
+    if (owner) {
+        /* XSAVEOPT skips the components that are in their init state
+         * or weren't modified since owner's state was restored */
+        void *state = owner->env_fpu_state;
+        if (fpu_xsaveopt) xsaveopt(state, fpu_xcr0);
+        else if (fpu_xsave) xsave(state, fpu_xcr0);
+        else fxsave(state);
+        fpu_owner[cpu] = NULL;
+    }
+
+    void **state = &curenv->env_fpu_state;
+    if (!*state) {
+        if (!(*state = kalloc_page(0))) {
+            cprintf("[%08x] no memory for FPU state\n", curenv->env_id);
+            env_destroy(curenv);
+        }
+        memcpy(*state, fpu_init_state, FXSAVE_SIZE);
+        memset((uint8_t *)*state + FXSAVE_SIZE, 0, PAGE_SIZE - FXSAVE_SIZE);
+    }
+
+    if (fpu_xsave) xrstor(*state, fpu_xcr0);
+    else fxrstor(*state);
+    fpu_owner[cpu] = curenv;
+}
+
+/* env is being freed, forget its state */
+void
+fpu_release(struct Env *env) {
+    for (int cpu = 0; cpu < NCPU; cpu++)
+        if (fpu_owner[cpu] == env) fpu_owner[cpu] = NULL;
+
+    void **state = &env->env_fpu_state;
+    if (*state) kfree_page(*state, 0);
+    *state = NULL;
+}
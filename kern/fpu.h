@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+/* Lazily switched x87/SSE/AVX state of envs.
+ *
+ * The registers belong to the last env that used them (the owner) until
+ * another env does. Any other env runs with CR0.TS set, and its first
+ * FPU instruction raises #NM: the owner's state is saved with XSAVEOPT
+ * (or FXSAVE) and the new env's one is restored. An env that never
+ * touches the FPU has no saved state and pays nothing */
+
+void fpu_init(void);
+void fpu_switch(struct Env *env);
+void fpu_trap(void);
+void fpu_release(struct Env *env);
+
+#endif /* !JOS_KERN_FPU_H */
@@ -0,0 +1,273 @@
+/* Function tracer, see kern/ftrace.h.
+ * This file is built without -pg, it must not call traced code
+ * from ftrace_entry() and ftrace_exit() */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/ftrace.h>
+#include <kern/kdebug.h>
+#include <kern/tsc.h>
+
+/* Call site emitted by -pg -mfentry with -mcmodel=large:
+ *   movabs $__fentry__, %r10
+ *   call *%r10
+ * Disabled sites have movabs opcode replaced by a short jump over the call */
+#define FTRACE_SITE_SIZE 13
+#define FTRACE_INSN_ON   0xBA49                          /* movabs ..., %r10 */
+#define FTRACE_INSN_OFF  (0xEB | (FTRACE_SITE_SIZE - 2) << 8) /* jmp . + 13 */
+#define FTRACE_RET_PROBE 8
+
+struct FtraceEvent {
+    uint64_t tsc;
+    uintptr_t site;
+    uint64_t duration; /* TSC ticks spent in the function, exits only */
+    uint32_t depth;
+    bool exit;
+};
+
+/* Return address replaced with ftrace_return */
+struct FtraceRet {
+    uintptr_t *slot; /* NULL if free */
+    uintptr_t orig;
+    uint64_t tsc;
+    uint32_t depth;
+};
+
+/* Accessed by its CPU only, with interrupts disabled */
+struct FtraceCpu {
+    struct FtraceEvent ring[FTRACE_RING_SIZE];
+    uint64_t head; /* Number of events ever logged */
+    struct FtraceRet rets[FTRACE_RET_SLOTS];
+    uint32_t depth;
+    uint64_t lost_exits; /* Entries whose exits were not hooked */
+};
+
+static struct FtraceCpu ftrace_cpu[NCPU];
+static bool ftrace_ready;
+
+extern uintptr_t __mcount_loc_start[], __mcount_loc_end[];
+void __fentry__(void);
+void ftrace_return(void);
+void ftrace_entry(uintptr_t ret, uintptr_t *slot);
+uintptr_t ftrace_exit(uintptr_t *slot);
+
+static inline bool
+ftrace_site_valid(uintptr_t site) {
+    uint8_t *insn = (uint8_t *)site;
+    uint16_t op = *(uint16_t *)insn;
+    return (op == FTRACE_INSN_ON || op == FTRACE_INSN_OFF) &&
+           *(uintptr_t *)(insn + 2) == (uintptr_t)__fentry__ &&
+           insn[10] == 0x41 && insn[11] == 0xFF && insn[12] == 0xD2;
+}
+
+/* Kernel text is mapped read-only, write it with CR0.WP cleared */
+static void
+ftrace_patch(uintptr_t site, uint16_t op) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    uint64_t cr0 = rcr0();
+    lcr0(cr0 & ~CR0_WP);
+    /* Single store, so the site is never half patched */
+    __atomic_store_n((uint16_t *)site, op, __ATOMIC_RELAXED);
+    lcr0(cr0);
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+}
+
+static struct FtraceRet *
+ftrace_ret_lookup(struct FtraceCpu *cpu, uintptr_t *slot, bool alloc) {
+    size_t hash = ((uintptr_t)slot >> 3) * 0x9E3779B97F4A7C15ULL >> 32;
+    struct FtraceRet *free = NULL;
+
+    for (size_t i = 0; i < FTRACE_RET_PROBE; i++) {
+        struct FtraceRet *ret = &cpu->rets[(hash + i) & (FTRACE_RET_SLOTS - 1)];
+        /* A stale entry for the same slot belongs to a frame that
+         * was abandoned (e.g. by a context switch), reuse it */
+        if (ret->slot == slot) return ret;
+        if (!ret->slot && !free) free = ret;
+    }
+
+    return alloc ? free : NULL;
+}
+
+static void
+ftrace_log(struct FtraceCpu *cpu, uint64_t tsc, uintptr_t site, uint64_t duration, uint32_t depth, bool exit) {
+    cpu->ring[cpu->head++ & (FTRACE_RING_SIZE - 1)] = (struct FtraceEvent){
+            .tsc = tsc, .site = site, .duration = duration, .depth = depth, .exit = exit};
+}
+
+/* Called by __fentry__, ret points right after the call site */
+void
+ftrace_entry(uintptr_t ret, uintptr_t *slot) {
+    if (!ftrace_ready) return;
+
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    struct FtraceCpu *cpu = &ftrace_cpu[cpunum()];
+    uintptr_t site = ret - FTRACE_SITE_SIZE;
+    uint64_t tsc = read_tsc();
+
+    struct FtraceRet *hook = ftrace_ret_lookup(cpu, slot, 1);
+    if (hook) {
+        *hook = (struct FtraceRet){.slot = slot, .orig = *slot, .tsc = tsc, .depth = cpu->depth};
+        *slot = (uintptr_t)ftrace_return;
+    } else {
+        cpu->lost_exits++;
+    }
+
+    ftrace_log(cpu, tsc, site, 0, cpu->depth, 0);
+    if (hook) cpu->depth++;
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+}
+
+/* Called by ftrace_return, returns where the traced function
+ * should have returned to */
+uintptr_t
+ftrace_exit(uintptr_t *slot) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    struct FtraceCpu *cpu = &ftrace_cpu[cpunum()];
+    uint64_t tsc = read_tsc();
+
+    struct FtraceRet *hook = ftrace_ret_lookup(cpu, slot, 0);
+    if (!hook) panic("ftrace: lost return address for slot %p", slot);
+
+    uintptr_t orig = hook->orig;
+    cpu->depth = hook->depth;
+    hook->slot = NULL;
+
+    /* Site is not known here, exits are matched with entries when printed */
+    ftrace_log(cpu, tsc, 0, tsc - hook->tsc, cpu->depth, 1);
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+    return orig;
+}
+
+/* Disable all call sites */
+void
+ftrace_init(void) {
+    size_t nsites = 0, bad = 0;
+
+    for (uintptr_t *site = __mcount_loc_start; site < __mcount_loc_end; site++) {
+        if (!ftrace_site_valid(*site)) {
+            bad++;
+            continue;
+        }
+        ftrace_patch(*site, FTRACE_INSN_OFF);
+        nsites++;
+    }
+
+    if (bad) cprintf("ftrace: %zu unknown call sites are left as is\n", bad);
+    if (nsites) ftrace_ready = 1;
+}
+
+/* Enable or disable tracing of function fname */
+int
+ftrace_set(const char *fname, bool on) {
+    uintptr_t addr = find_function(fname);
+    if (!addr) return -E_NO_ENT;
+
+    /* Call site is the first instruction, endbr64 may precede it */
+    for (uintptr_t *site = __mcount_loc_start; site < __mcount_loc_end; site++) {
+        if (*site >= addr && *site < addr + 8 && ftrace_site_valid(*site)) {
+            ftrace_patch(*site, on ? FTRACE_INSN_ON : FTRACE_INSN_OFF);
+            return 0;
+        }
+    }
+
+    /* Not compiled with -pg */
+    return -E_INVAL;
+}
+
+static void
+ftrace_print_site(uintptr_t site) {
+    struct Ripdebuginfo info;
+    if (debuginfo_rip(site, &info) >= 0)
+        cprintf("%.*s", info.rip_fn_namelen, info.rip_fn_name);
+    else
+        cprintf("%lx", (unsigned long)site);
+}
+
+void
+ftrace_list(void) {
+    size_t nsites = __mcount_loc_end - __mcount_loc_start;
+    if (!nsites) {
+        cprintf("Kernel is built without function tracing (CONFIG_FTRACE=y)\n");
+        return;
+    }
+
+    cprintf("%zu call sites, enabled:\n", nsites);
+    for (uintptr_t *site = __mcount_loc_start; site < __mcount_loc_end; site++) {
+        if (*(uint16_t *)*site == FTRACE_INSN_ON) {
+            cprintf("  ");
+            ftrace_print_site(*site);
+            cprintf("\n");
+        }
+    }
+
+    for (int i = 0; i < NCPU; i++)
+        if (ftrace_cpu[i].lost_exits)
+            cprintf("cpu %d: %lu exits not traced\n", i, (unsigned long)ftrace_cpu[i].lost_exits);
+}
+
+/* Print last n events of every CPU */
+void
+ftrace_print(size_t n) {
+    uint64_t freq = tsc_calibrate();
+    if (!freq) freq = 1;
+
+    for (int i = 0; i < NCPU; i++) {
+        struct FtraceCpu *cpu = &ftrace_cpu[i];
+
+        uint64_t rflags = read_rflags();
+        asm volatile("cli" ::: "memory");
+        uint64_t head = cpu->head;
+        if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+
+        n = MIN(n, MIN(head, FTRACE_RING_SIZE));
+        if (!n) continue;
+
+        cprintf("cpu %d:\n", i);
+        uint64_t start = cpu->ring[(head - n) & (FTRACE_RING_SIZE - 1)].tsc;
+
+        /* Sites of open entries at each depth, to name the exits */
+        uintptr_t open[64] = {0};
+
+        for (uint64_t j = head - n; j < head; j++) {
+            struct FtraceEvent *ev = &cpu->ring[j & (FTRACE_RING_SIZE - 1)];
+            uint64_t at = (ev->tsc - start) * 1000000 / freq;
+            uint32_t depth = MIN(ev->depth, 63);
+
+            cprintf("%10lu us %*s", (unsigned long)at, (int)(2 * depth), "");
+            if (!ev->exit) {
+                open[depth] = ev->site;
+                ftrace_print_site(ev->site);
+                cprintf(" {\n");
+            } else {
+                cprintf("} ");
+                if (open[depth]) ftrace_print_site(open[depth]);
+                open[depth] = 0;
+                cprintf(" %lu us\n", (unsigned long)(ev->duration * 1000000 / freq));
+            }
+        }
+    }
+}
+
+void
+ftrace_clear(void) {
+    for (int i = 0; i < NCPU; i++) {
+        uint64_t rflags = read_rflags();
+        asm volatile("cli" ::: "memory");
+        ftrace_cpu[i].head = 0;
+        if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+    }
+}
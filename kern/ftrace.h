@@ -0,0 +1,27 @@
+#ifndef JOS_KERN_FTRACE_H
+#define JOS_KERN_FTRACE_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/* Function tracer.
+ *
+ * With CONFIG_FTRACE=y the kernel is built with -pg -mfentry, so every
+ * function starts with a call to __fentry__ (kern/ftraceentry.S).
+ * Call sites are listed in __mcount_loc and are patched into jumps over
+ * the call at boot. Enabled functions log entries and exits with TSC
+ * timestamps into a per-CPU ring buffer, which is only symbolized
+ * when printed (see the ftrace monitor command) */
+
+#define FTRACE_RING_SIZE 4096 /* Events per CPU, power of 2 */
+#define FTRACE_RET_SLOTS 256  /* Hooked returns per CPU, power of 2 */
+
+void ftrace_init(void);
+int ftrace_set(const char *fname, bool on);
+void ftrace_list(void);
+void ftrace_print(size_t n);
+void ftrace_clear(void);
+
+#endif /* !JOS_KERN_FTRACE_H */
@@ -0,0 +1,114 @@
+/* Futex-style wait queues, see kern/futex.h */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+/* Waiters hashed by key, in the order they started waiting */
+struct FutexBucket {
+    struct spinlock lock;
+    struct List head;
+};
+
+static struct FutexBucket futex_buckets[FUTEX_HASH_SIZE];
+
+#define FUTEX_ENV(list) ((struct Env *)((uint8_t *)(list)-offsetof(struct Env, env_futex)))
+
+static struct FutexBucket *
+futex_bucket(struct AddressSpace *space, uintptr_t addr) {
+    uint64_t key = (uintptr_t)space ^ (addr >> 2);
+    key *= 0x9E3779B97F4A7C15ULL;
+    return &futex_buckets[key >> 58];
+}
+static_assert(FUTEX_HASH_SIZE == 1 << (64 - 58), "Futex hash doesn't match the table size");
+
+void
+futex_init(void) {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spin_initlock(&futex_buckets[i].lock, LOCK_ORDER_FUTEX);
+        futex_buckets[i].head.next = futex_buckets[i].head.prev = &futex_buckets[i].head;
+    }
+}
+
+/* Unlink env from its bucket, the bucket must be locked */
+static void
+futex_unlink(struct Env *env) {
+    env->env_futex.prev->next = env->env_futex.next;
+    env->env_futex.next->prev = env->env_futex.prev;
+    env->env_futex.next = env->env_futex.prev = &env->env_futex;
+    env->env_futex_space = NULL;
+}
+
+/* Block curenv on addr if the word there equals val.
+ * Returns 1 if curenv has been blocked, the caller should sched_yield() then,
+ * and 0 if the value has already changed */
+int
+futex_wait(uintptr_t addr, uint32_t val) {
+    if (addr % sizeof(uint32_t) || addr >= MAX_USER_ADDRESS) return -E_INVAL;
+
+    struct AddressSpace *space = env_space(curenv);
+    struct FutexBucket *bucket = futex_bucket(space, addr);
+    spin_lock(&bucket->lock);
+
+    /* A waker changes the value before it takes the bucket lock,
+     * so it can't slip in between the check and the enqueue.
+     * curenv's address space is the current one */
+    if (*(volatile uint32_t *)addr != val) {
+        spin_unlock(&bucket->lock);
+        return 0;
+    }
+
+    curenv->env_futex_space = space;
+    curenv->env_futex_addr = addr;
+    curenv->env_futex.next = &bucket->head;
+    curenv->env_futex.prev = bucket->head.prev;
+    bucket->head.prev->next = &curenv->env_futex;
+    bucket->head.prev = &curenv->env_futex;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+
+    spin_unlock(&bucket->lock);
+    return 1;
+}
+
+/* Wake up to n envs waiting on addr in space, oldest first.
+ * Returns the number of envs woken up */
+int
+futex_wake(struct AddressSpace *space, uintptr_t addr, int n) {
+    if (addr % sizeof(uint32_t) || addr >= MAX_USER_ADDRESS || n < 0) return -E_INVAL;
+
+    struct FutexBucket *bucket = futex_bucket(space, addr);
+    spin_lock(&bucket->lock);
+
+    int woken = 0;
+    for (struct List *item = bucket->head.next; item != &bucket->head && woken < n;) {
+        struct Env *env = FUTEX_ENV(item);
+        item = item->next;
+        if (env->env_futex_space != space || env->env_futex_addr != addr) continue;
+
+        futex_unlink(env);
+        assert(env->env_status == ENV_NOT_RUNNABLE);
+        env->env_status = ENV_RUNNABLE;
+        sched_enqueue(env);
+        woken++;
+    }
+
+    spin_unlock(&bucket->lock);
+    return woken;
+}
+
+/* env is being freed, take it out of the queue it waits in */
+void
+futex_release(struct Env *env) {
+    struct AddressSpace *space = env->env_futex_space;
+    if (!space) return;
+
+    struct FutexBucket *bucket = futex_bucket(space, env->env_futex_addr);
+    spin_lock(&bucket->lock);
+    if (env->env_futex_space) futex_unlink(env);
+    spin_unlock(&bucket->lock);
+}
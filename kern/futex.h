@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+/* Wait queues keyed by (AddressSpace, user VA).
+ *
+ * futex_wait() blocks an env only if the 32-bit word at the address
+ * still holds the value it expects, futex_wake() makes up to n envs
+ * waiting on an address runnable again. A blocked env is out of the
+ * run queue, so it costs nothing until it is woken up. This is enough
+ * to build mutexes and condition variables in user space, where the
+ * uncontended paths never enter the kernel. */
+
+#define FUTEX_HASH_SIZE 64
+
+void futex_init(void);
+int futex_wait(uintptr_t addr, uint32_t val);
+int futex_wake(struct AddressSpace *space, uintptr_t addr, int n);
+void futex_release(struct Env *env);
+
+#endif /* !JOS_KERN_FUTEX_H */
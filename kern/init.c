@@ -15,17 +15,29 @@
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
+#include <kern/preempt.h>
 #include <kern/kclock.h>
 #include <kern/kdebug.h>
+#include <kern/klog.h>
+#include <kern/ktimer.h>
+#include <kern/vsyscall.h>
+#include <kern/workqueue.h>
+#include <kern/apic.h>
+#include <kern/boottime.h>
 #include <kern/traceopt.h>
+#include <kern/ftrace.h>
 
 void
 timers_init(void) {
+    /* Parse the XSDT once, timers look up their tables in it */
+    acpi_init_tables();
+
     timertab[0] = timer_rtc;
     timertab[1] = timer_pit;
     timertab[2] = timer_acpipm;
     timertab[3] = timer_hpet0;
     timertab[4] = timer_hpet1;
+    timertab[5] = timer_lapic;
 
     for (int i = 0; i < MAX_TIMERS; i++) {
         if (timertab[i].timer_init) {
@@ -52,12 +64,21 @@ timers_schedule(const char *name) {
     panic("Timer %s does not exist\n", name);
 }
 
+/* bootstrap.S reads LOADER_PARAMS.PageTable before anything is set up */
+static_assert(offsetof(LOADER_PARAMS, PageTable) == 8, "LP_PAGE_TABLE in bootstrap.S is out of date");
+
 pde_t *
 alloc_pd_early_boot(void) {
-    /* Assume pde1, pde2 is already used */
-    extern uintptr_t pdefreestart, pdefreeend;
-    static uintptr_t pdefree = (uintptr_t)&pdefreestart;
-
+    /* Assume pde1, pde2 is already used, unless
+     * the kernel runs on the table built by the loader */
+    extern uintptr_t pml4phys, pdefreestart, pdefreeend;
+    static uintptr_t pdefree;
+
+    if (!pdefree) {
+        pdefree = uefi_lp->PageTable == (uintptr_t)&pml4phys ?
+                          (uintptr_t)&pdefreestart :
+                          (uintptr_t)&pml4phys;
+    }
     if (pdefree >= (uintptr_t)&pdefreeend) return NULL;
 
     pde_t *ret = (pde_t *)pdefree;
@@ -65,11 +86,11 @@ alloc_pd_early_boot(void) {
     return ret;
 }
 
-void
-map_addr_early_boot(uintptr_t va, uintptr_t pa, size_t sz) {
-    extern uintptr_t pml4phys;
-
-    pml4e_t *pml4 = &pml4phys;
+/* Map with the extra PTE bits in flags (e.g. PTE_PWT for write-combining, see pat_init()) */
+static void
+map_addr_early_boot_flags(uintptr_t va, uintptr_t pa, size_t sz, pte_t flags) {
+    /* Either pml4phys or the one built by the loader, see bootstrap.S */
+    pml4e_t *pml4 = (pml4e_t *)uefi_lp->PageTable;
     pdpe_t *pdp;
     pde_t *pd;
 
@@ -77,15 +98,41 @@ map_addr_early_boot(uintptr_t va, uintptr_t pa, size_t sz) {
     uintptr_t vend = ROUNDUP(va + sz, HUGE_PAGE_SIZE);
     uintptr_t pstart = ROUNDDOWN(pa, HUGE_PAGE_SIZE);
 
-    pdp = (pdpe_t *)PTE_ADDR(pml4[PML4_INDEX(vstart)]);
     for (; vstart < vend; vstart += HUGE_PAGE_SIZE, pstart += HUGE_PAGE_SIZE) {
+        pdp = (pdpe_t *)PTE_ADDR(pml4[PML4_INDEX(vstart)]);
+        if (!pdp) {
+            pdp = alloc_pd_early_boot();
+            pml4[PML4_INDEX(vstart)] = (uintptr_t)pdp | PTE_P | PTE_W;
+        }
+
+        pdpe_t pdpe = pdp[PDP_INDEX(vstart)];
+        if (pdpe & PTE_PS) {
+            /* The loader mapped a whole 1GB page here,
+             * keep it if it maps the same thing already */
+            if (!flags && PTE_ADDR(pdpe) + (vstart & (1 * GB - 1)) == pstart) continue;
+
+            /* Split it into 2MB pages otherwise */
+            pd = alloc_pd_early_boot();
+            for (size_t i = 0; i < PD_ENTRY_COUNT; i++)
+                pd[i] = (PTE_ADDR(pdpe) + i * HUGE_PAGE_SIZE) | PTE_P | PTE_W | PTE_PS;
+            pdp[PDP_INDEX(vstart)] = (uintptr_t)pd | PTE_P | PTE_W;
+        }
+
         pd = (pde_t *)PTE_ADDR(pdp[PDP_INDEX(vstart)]);
         if (!pd) {
             pd = alloc_pd_early_boot();
             pdp[PDP_INDEX(vstart)] = (uintptr_t)pd | PTE_P | PTE_W;
         }
-        pd[PD_INDEX(vstart)] = pstart | PTE_P | PTE_W | PTE_PS;
+        pd[PD_INDEX(vstart)] = pstart | PTE_P | PTE_W | PTE_PS | flags;
     }
+
+    /* The entries changed might be cached already */
+    lcr3(rcr3());
+}
+
+void
+map_addr_early_boot(uintptr_t va, uintptr_t pa, size_t sz) {
+    map_addr_early_boot_flags(va, pa, sz, 0);
 }
 
 #if defined(SANITIZE_SHADOW_BASE) && LAB >= 6
@@ -104,6 +151,9 @@ extern char end[];
  * uefi_lp, MemMap, KASAN functions. */
 void
 early_boot_pml4_init(void) {
+    /* Before anything is mapped write-combining */
+    pat_init();
+
     map_addr_early_boot((uintptr_t)uefi_lp, (uintptr_t)uefi_lp, sizeof(LOADER_PARAMS));
     map_addr_early_boot((uintptr_t)uefi_lp->MemoryMap, (uintptr_t)uefi_lp->MemoryMap, uefi_lp->MemoryMapSize);
 
@@ -121,20 +171,45 @@ early_boot_pml4_init(void) {
 #endif
 
 #if LAB <= 6
-    map_addr_early_boot(FRAMEBUFFER, uefi_lp->FrameBufferBase, uefi_lp->FrameBufferSize);
+    map_addr_early_boot_flags(FRAMEBUFFER, uefi_lp->FrameBufferBase, uefi_lp->FrameBufferSize, PTE_PWT);
 #endif
 }
 
+/* Word-at-a-time scanners against short, unaligned
+ * and unbounded strings around the word size */
+static void
+check_string(void) {
+    static const char text[] = "0123456789abcdef";
+    for (size_t off = 0; off < 8; off++) {
+        for (size_t len = 0; len <= 9; len++) {
+            char buf[32] __attribute__((aligned(8)));
+            memset(buf, 'x', sizeof(buf));
+            memcpy(buf + off, text, len);
+            buf[off + len] = 0;
+
+            assert(strlen(buf + off) == len);
+            assert(strnlen(buf + off, (size_t)-1) == len);
+            assert(strnlen(buf + off, len) == len);
+            assert(strnlen(buf + off, len + 1) == len);
+            if (len) assert(strnlen(buf + off, len - 1) == len - 1);
+        }
+    }
+}
+
 void
 i386_init(void) {
 
     early_boot_pml4_init();
+    boot_trace("early_boot_pml4_init");
 
     /* Initialize the console.
     * Can't call cprintf until after we do this! */
     cons_init();
+    boot_trace("cons_init");
 
-    tsc_calibrate();
+    check_string();
+
+    ftrace_init();
 
     if (trace_init) {
         cprintf("6828 decimal is %o octal!\n", 6828);
@@ -143,23 +218,48 @@ i386_init(void) {
 
     /* Lab 6 memory management initialization functions */
     init_memory();
+    boot_trace("init_memory");
 
     assert(0);
 
     pic_init();
+    boot_trace("pic_init");
     timers_init();
+    boot_trace("timers_init");
+    /* After timers_init(), so that the HPET can be used for it */
+    tsc_calibrate();
+    boot_trace("tsc_calibrate");
+    ktimer_init();
+    wss_init();
+    /* Needs the TSC frequency and the RTC */
+    vsys_init();
+    serial_intr_init();
+    kbd_intr_init();
+    boot_trace("ktimer_init, vsys_init");
 
     /* Framebuffer init should be done after memory init */
     fb_init();
     if (trace_init) cprintf("Framebuffer initialised\n");
+    boot_trace("fb_init");
 
     /* User environment initialization functions */
     env_init();
+    workqueue_init();
+    boot_trace("env_init");
 
-    /* Choose the timer used for scheduling: hpet or pit */
-    timers_schedule("hpet1");
+    /* Choose the timer used for scheduling: the per-CPU LAPIC timer
+     * if it has TSC-deadline mode, hpet otherwise */
+    timers_schedule(lapic_timer_supported() ? "lapic" : "hpet1");
 
 #ifdef CONFIG_KSPACE
+#if defined(TEST)
+    /* Don't touch -- used by the workload scripts (make bench-progs) */
+#ifndef TEST_COUNT
+#define TEST_COUNT 1
+#endif
+    for (int i = 0; i < TEST_COUNT; i++)
+        ENV_CREATE_KERNEL_TYPE(TEST);
+#else
     /* Touch all you want */
     ENV_CREATE_KERNEL_TYPE(prog_test1);
     ENV_CREATE_KERNEL_TYPE(prog_test2);
@@ -167,6 +267,7 @@ i386_init(void) {
     ENV_CREATE_KERNEL_TYPE(prog_test4);
     ENV_CREATE_KERNEL_TYPE(prog_test5);
     ENV_CREATE_KERNEL_TYPE(prog_test6);
+#endif /* TEST */
 #else
 
 #if LAB >= 10
@@ -186,6 +287,13 @@ i386_init(void) {
     //   Only for lab 5. Needed for testing.
     // assert(false);
 
+    boot_trace("create envs");
+
+    /* From now on the log is drained at idle and on scheduler ticks */
+    klog_async = 1;
+    /* All interrupts have handlers, preempt_point() may take them */
+    preempt_enable();
+
     /* Schedule and run the first user environment! */
     sched_yield();
 }
@@ -169,3 +169,39 @@ rtc_check_status(void) {
 
     return cmos_read8(RTC_CREG);
 }
+
+static unsigned
+rtc_read_field(uint8_t reg, uint8_t status_b) {
+    uint8_t value = cmos_read8(reg);
+    if (!(status_b & RTC_BINARY)) value = (value & 0x0F) + (value >> 4) * 10;
+    return value;
+}
+
+/* Wall clock time from the RTC, seconds since 1970-01-01 00:00 UTC.
+ * The RTC is assumed to run in UTC */
+uint64_t
+rtc_unix_time(void) {
+    /* The fields are only consistent between updates */
+    while (cmos_read8(RTC_AREG) & RTC_UPDATE_IN_PROGRESS) /* nothing */;
+
+    uint8_t status_b = cmos_read8(RTC_BREG);
+    unsigned sec = rtc_read_field(RTC_SEC, status_b);
+    unsigned min = rtc_read_field(RTC_MIN, status_b);
+    uint8_t hour_raw = cmos_read8(RTC_HOUR);
+    unsigned day = rtc_read_field(RTC_DAY, status_b);
+    unsigned mon = rtc_read_field(RTC_MON, status_b);
+    unsigned year = rtc_read_field(RTC_YEAR, status_b) + rtc_read_field(RTC_YEAR_HIGH, status_b) * 100;
+    if (year < 1970) year += 2000;
+
+    /* In 12 hour mode the top bit marks PM */
+    unsigned hour = hour_raw & 0x7F;
+    if (!(status_b & RTC_BINARY)) hour = (hour & 0x0F) + (hour >> 4) * 10;
+    if (!(status_b & RTC_12H)) hour = hour % 12 + (hour_raw & 0x80 ? 12 : 0);
+
+    /* Days since the epoch, March based year so that
+     * the leap day is the last one */
+    unsigned y = year - (mon <= 2), m = mon <= 2 ? mon + 9 : mon - 3;
+    uint64_t days = 365ULL * y + y / 4 - y / 100 + y / 400 + (153 * m + 2) / 5 + day - 1 - 719468;
+
+    return ((days * 24 + hour) * 60 + min) * 60 + sec;
+}
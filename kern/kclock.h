@@ -37,6 +37,7 @@
 
 void rtc_timer_init(void);
 uint8_t rtc_check_status(void);
+uint64_t rtc_unix_time(void);
 
 #define CMOS_START 0xE /* start of CMOS: offset 14 */
 #define CMOS_SIZE  50 /* 50 bytes of CMOS */
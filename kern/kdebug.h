@@ -22,6 +22,32 @@ struct Ripdebuginfo {
     int rip_fn_narg;
 };
 
+/* Compact symbol table generated at build time by kern/ksymtab.py
+ * and linked into the kernel, so that symbolization doesn't need
+ * the DWARF sections. Addresses are offsets from text_start */
+struct KsymFunc {
+    uint32_t addr;
+    uint32_t size; /* 0 if unknown (assembly), up to the next one */
+    uint32_t name; /* Offset in strings */
+};
+
+struct KsymLine {
+    uint32_t addr; /* The line starts here */
+    uint16_t file; /* Index in files */
+    uint16_t line; /* 0 if no line info */
+};
+
+struct Ksymtab {
+    uintptr_t text_start;
+    uint32_t nfuncs, nlines, nfiles;
+    uint32_t hash_size;             /* Power of 2 */
+    const struct KsymFunc *funcs;   /* Sorted by address */
+    const struct KsymLine *lines;   /* Sorted by address */
+    const uint32_t *files;          /* Offsets of file names in strings */
+    const uint32_t *hash;           /* FNV-1a of name -> funcs index + 1, 0 if free */
+    const char *strings;
+};
+
 int debuginfo_rip(uintptr_t eip, struct Ripdebuginfo *info);
 uintptr_t find_function(const char *const fname);
 
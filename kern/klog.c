@@ -0,0 +1,182 @@
+/* Lock-free per-CPU kernel log */
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/console.h>
+#include <kern/cpu.h>
+#include <kern/klog.h>
+#include <kern/workqueue.h>
+
+/* Positions are byte counts since boot, the ring index is pos % KLOG_SIZE.
+ *
+ * Only the owning CPU writes into a ring, so the writers there can
+ * only nest (an exception or NMI during klog_write()). A writer reserves
+ * its bytes with an atomic add on 'reserved', and the outermost writer
+ * publishes everything reserved so far in 'committed' when it is done,
+ * by then all the nested writers have finished copying too.
+ * 'drained' is only touched under console_lock. */
+struct KlogRing {
+    char buf[KLOG_SIZE];
+    volatile uint64_t reserved;
+    volatile uint64_t committed;
+    volatile uint32_t writers;
+    uint64_t drained;
+    uint64_t lost; /* Bytes overwritten before they were drained */
+};
+
+static struct KlogRing klog_rings[NCPU];
+
+bool klog_async = 0;
+
+/* Copy len bytes at position pos of ring, len <= KLOG_SIZE */
+static void
+klog_copy_in(struct KlogRing *ring, uint64_t pos, const char *str, size_t len) {
+    size_t off = pos % KLOG_SIZE;
+    size_t part = MIN(len, KLOG_SIZE - off);
+
+    memcpy(ring->buf + off, str, part);
+    memcpy(ring->buf, str + part, len - part);
+}
+
+void
+klog_write(const char *str, size_t len) {
+    /* Only the tail of a huge write would survive anyway */
+    if (len > KLOG_SIZE) {
+        str += len - KLOG_SIZE;
+        len = KLOG_SIZE;
+    }
+
+    /* Interrupts are disabled so that the writer can't be preempted
+     * and moved to another CPU while it owns a part of this ring */
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    struct KlogRing *ring = &klog_rings[cpunum()];
+
+    __atomic_add_fetch(&ring->writers, 1, __ATOMIC_ACQUIRE);
+    uint64_t pos = __atomic_fetch_add(&ring->reserved, len, __ATOMIC_RELAXED);
+    klog_copy_in(ring, pos, str, len);
+
+    if (!__atomic_sub_fetch(&ring->writers, 1, __ATOMIC_RELEASE)) {
+        /* A nested writer may have published a later position in between */
+        uint64_t end = __atomic_load_n(&ring->reserved, __ATOMIC_RELAXED);
+        uint64_t cur = ring->committed;
+        while (cur < end && !__atomic_compare_exchange_n(&ring->committed, &cur, end, 0,
+                                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            /* nothing */;
+    }
+
+    write_rflags(rflags);
+}
+
+/* Write at most budget bytes of ring to the devices, console_lock is held */
+static size_t
+klog_drain_ring(struct KlogRing *ring, size_t budget) {
+    extern const char *panicstr;
+
+    /* After a panic no writer on the panicked CPU is going to finish,
+     * flush whatever was reserved */
+    uint64_t end = panicstr ? ring->reserved : __atomic_load_n(&ring->committed, __ATOMIC_ACQUIRE);
+
+    if (end - ring->drained > KLOG_SIZE) {
+        ring->lost += end - KLOG_SIZE - ring->drained;
+        ring->drained = end - KLOG_SIZE;
+    }
+
+    size_t len = MIN(end - ring->drained, budget);
+    size_t done = 0;
+    while (done < len) {
+        size_t off = (ring->drained + done) % KLOG_SIZE;
+        size_t part = MIN(len - done, KLOG_SIZE - off);
+        cputs(ring->buf + off, part);
+        done += part;
+    }
+
+    ring->drained += len;
+    return len;
+}
+
+/* Write pending log bytes to the console devices, at most budget
+ * bytes in total, or all of them if budget is 0 */
+void
+klog_drain(size_t budget) {
+    extern const char *panicstr;
+
+    if (!budget) budget = (size_t)-1;
+
+    /* Once panic() has started, the lock may be held by the code that
+     * failed, print anyway rather than deadlock */
+    bool locked = !panicstr;
+    uint64_t rflags = locked ? spin_lock_irqsave(&console_lock) : 0;
+
+    for (int i = 0; i < NCPU && budget; i++)
+        budget -= klog_drain_ring(&klog_rings[i], budget);
+
+    if (locked) spin_unlock_irqrestore(&console_lock, rflags);
+}
+
+static volatile bool klog_drain_queued;
+
+static void
+klog_drain_work(void *arg) {
+    klog_drain_queued = 0;
+    klog_drain(0);
+}
+
+/* Called on every scheduler tick. Pending output is left to the
+ * worker thread, only if there is none a bit of it is written here */
+void
+klog_tick(void) {
+    bool pending = 0;
+    for (int i = 0; i < NCPU; i++) pending |= klog_rings[i].committed != klog_rings[i].drained;
+    if (!pending || klog_drain_queued) return;
+
+    klog_drain_queued = 1;
+    if (queue_work(klog_drain_work, NULL) < 0) {
+        klog_drain_queued = 0;
+        klog_drain(KLOG_TICK_BUDGET);
+    }
+}
+
+/* Replay the retained log of every CPU to the console devices */
+void
+klog_dump(void) {
+    klog_drain(0);
+
+    uint64_t rflags = spin_lock_irqsave(&console_lock);
+
+    for (int i = 0; i < NCPU; i++) {
+        struct KlogRing *ring = &klog_rings[i];
+        /* Bytes within KLOG_SIZE of the newest reservation are intact */
+        uint64_t end = ring->drained;
+        uint64_t reserved = __atomic_load_n(&ring->reserved, __ATOMIC_RELAXED);
+        uint64_t start = reserved > KLOG_SIZE ? reserved - KLOG_SIZE : 0;
+        if (start > end) start = end;
+        if (start == end) continue;
+
+        if (NCPU > 1) {
+            char hdr[32];
+            int n = snprintf(hdr, sizeof(hdr), "--- CPU %d ---\n", i);
+            cputs(hdr, n);
+        }
+
+        for (uint64_t pos = start; pos < end;) {
+            size_t off = pos % KLOG_SIZE;
+            size_t part = MIN(end - pos, KLOG_SIZE - off);
+            cputs(ring->buf + off, part);
+            pos += part;
+        }
+
+        if (ring->lost) {
+            char msg[64];
+            int n = snprintf(msg, sizeof(msg), "--- %lu bytes were never drained ---\n",
+                             (unsigned long)ring->lost);
+            cputs(msg, n);
+        }
+    }
+
+    spin_unlock_irqrestore(&console_lock, rflags);
+}
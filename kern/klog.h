@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+/* Kernel log. Console output is appended to a per-CPU ring buffer
+ * without taking any lock and written to the console devices later,
+ * by klog_drain(). The ring keeps the last KLOG_SIZE bytes of every
+ * CPU for klog_dump(). KLOG_SIZE must be a power of 2 */
+#define KLOG_SIZE 16384
+
+/* Most bytes written to the devices per scheduler tick */
+#define KLOG_TICK_BUDGET 1024
+
+/* Until set, every write is drained before it returns */
+extern bool klog_async;
+
+void klog_write(const char *str, size_t len);
+void klog_drain(size_t budget);
+void klog_tick(void);
+void klog_dump(void);
+
+#endif /* !JOS_KERN_KLOG_H */
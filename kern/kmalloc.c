@@ -0,0 +1,469 @@
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+
+#define KMEM_MAX_CACHES    32
+#define KMEM_MAGAZINE_SIZE 16
+#define KMEM_BATCH         (KMEM_MAGAZINE_SIZE / 2)
+/* Larger slabs are used for objects that fit fewer times than this */
+#define KMEM_MIN_PER_SLAB   8
+#define KMEM_MAX_SLAB_CLASS 4
+
+/* End of slab free list */
+#define SLAB_NONE 0xFFFF
+
+/* Offset of kmalloc() object within a dedicated block */
+#define KMALLOC_LARGE_OFFSET 64
+#define KMALLOC_NCACHES      8 /* KMALLOC_MIN << i for i < KMALLOC_NCACHES */
+
+#ifdef SANITIZE_SHADOW_BASE
+/* Poisoned bytes on both sides of every object */
+#define KMEM_REDZONE 16
+/* Freed objects are kept poisoned for a while before reuse,
+ * so use-after-free is reported instead of corrupting a new object.
+ * Every CPU collects freed objects into a batch, full batches
+ * are queued in FIFO order bounded by total size of objects */
+#define KMEM_QUARANTINE_BATCH   32
+#define KMEM_QUARANTINE_BATCHES 128
+#define KMEM_QUARANTINE_SIZE    (4 * 1024 * 1024)
+#else
+#define KMEM_REDZONE 0
+#endif
+
+/* Slab header, placed at the beginning of slab memory.
+ * It is followed by array of free list links (object indices)
+ * and the objects themselves, so free objects are never
+ * overwritten and keep their constructed state */
+struct Slab {
+    struct KmemCache *cache; /* NULL for large kmalloc() blocks */
+    struct Slab *next;       /* Link in cache->partial */
+    struct Slab **pprev;     /* NULL if not in cache->partial */
+    uint32_t class;          /* Class of slab memory */
+    uint16_t free;           /* First free object index */
+    uint16_t inuse;          /* Allocated objects, including ones in magazines */
+};
+
+/* Per-CPU stack of free objects.
+ * Accessed by its CPU only, with interrupts disabled */
+struct Magazine {
+    uint32_t count;
+    void *objs[KMEM_MAGAZINE_SIZE];
+    uint64_t allocs, frees;
+};
+
+struct KmemCache {
+    const char *name;
+    size_t size;            /* Object size including alignment and redzones */
+    size_t objsize;         /* Usable size of an object */
+    void (*ctor)(void *obj);
+    int class;              /* Class of slab memory */
+    uint32_t per_slab;      /* Number of objects in a slab */
+    uint32_t offset;        /* Offset of the first object in a slab */
+
+    struct spinlock lock;   /* Protects the fields below */
+    struct Slab *partial;   /* Slabs with free objects */
+    uint32_t nslabs;        /* Total number of slabs */
+    uint32_t nempty;        /* Slabs with no allocated objects */
+
+    struct Magazine mag[NCPU];
+};
+
+static struct KmemCache caches[KMEM_MAX_CACHES];
+static size_t ncaches;
+/* Protects caches[] and kmalloc_caches[] */
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER(kmem_lock, LOCK_ORDER_ALLOC);
+
+static struct KmemCache *kmalloc_caches[KMALLOC_NCACHES];
+
+#ifdef SANITIZE_SHADOW_BASE
+struct QuarantineBatch {
+    uint32_t count;
+    size_t bytes;
+    struct KmemCache *caches[KMEM_QUARANTINE_BATCH];
+    void *objs[KMEM_QUARANTINE_BATCH];
+};
+
+/* Accessed by its CPU only, with interrupts disabled */
+static struct QuarantineBatch quarantine_cpu[NCPU];
+
+static struct {
+    struct spinlock lock; /* Protects the fields below */
+    struct QuarantineBatch batches[KMEM_QUARANTINE_BATCHES];
+    size_t head, count;   /* FIFO of full batches */
+    size_t bytes;         /* Size of objects in queued batches */
+} quarantine = {.lock = SPINLOCK_INITIALIZER(quarantine.lock, LOCK_ORDER_ALLOC)};
+#endif
+
+static inline uint16_t *
+slab_links(struct Slab *slab) {
+    return (uint16_t *)(slab + 1);
+}
+
+static inline void *
+slab_obj(struct KmemCache *cache, struct Slab *slab, size_t i) {
+    return (uint8_t *)slab + cache->offset + i * cache->size + KMEM_REDZONE;
+}
+
+static inline struct Slab *
+obj_slab(struct KmemCache *cache, void *obj) {
+    return (struct Slab *)ROUNDDOWN((uintptr_t)obj, CLASS_SIZE(cache->class));
+}
+
+static void
+slab_link(struct KmemCache *cache, struct Slab *slab) {
+    assert(!slab->pprev);
+    slab->next = cache->partial;
+    if (slab->next) slab->next->pprev = &slab->next;
+    slab->pprev = &cache->partial;
+    cache->partial = slab;
+}
+
+static void
+slab_unlink(struct Slab *slab) {
+    assert(slab->pprev);
+    *slab->pprev = slab->next;
+    if (slab->next) slab->next->pprev = slab->pprev;
+    slab->next = NULL;
+    slab->pprev = NULL;
+}
+
+static struct Slab *
+slab_create(struct KmemCache *cache) {
+    struct Slab *slab = kalloc_page(cache->class);
+    if (!slab) return NULL;
+
+    *slab = (struct Slab){.cache = cache, .class = cache->class};
+
+    uint16_t *links = slab_links(slab);
+    for (size_t i = 0; i < cache->per_slab; i++) {
+        links[i] = i + 1 < cache->per_slab ? i + 1 : SLAB_NONE;
+        if (cache->ctor) cache->ctor(slab_obj(cache, slab, i));
+    }
+
+#ifdef SANITIZE_SHADOW_BASE
+    /* Objects are unpoisoned when allocated, slab header stays addressable */
+    platform_asan_poison((uint8_t *)slab_obj(cache, slab, 0) - KMEM_REDZONE, cache->per_slab * cache->size);
+#endif
+
+    return slab;
+}
+
+/* Move up to KMEM_BATCH objects from slabs into the magazine */
+static void
+kmem_refill(struct KmemCache *cache, struct Magazine *mag) {
+    spin_lock(&cache->lock);
+
+    while (mag->count < KMEM_BATCH) {
+        if (!cache->partial) {
+            /* Page allocator lock is ordered before ours */
+            spin_unlock(&cache->lock);
+            struct Slab *slab = slab_create(cache);
+            spin_lock(&cache->lock);
+            if (!slab) break;
+
+            slab_link(cache, slab);
+            cache->nslabs++;
+            cache->nempty++;
+        }
+
+        struct Slab *slab = cache->partial;
+        assert(slab->free != SLAB_NONE);
+        if (!slab->inuse++) cache->nempty--;
+
+        mag->objs[mag->count++] = slab_obj(cache, slab, slab->free);
+        slab->free = slab_links(slab)[slab->free];
+        if (slab->free == SLAB_NONE) slab_unlink(slab);
+    }
+
+    spin_unlock(&cache->lock);
+}
+
+/* Return KMEM_BATCH objects from the magazine to their slabs,
+ * releasing slabs that became empty (one empty slab is kept) */
+static void
+kmem_drain(struct KmemCache *cache, struct Magazine *mag) {
+    struct Slab *release = NULL;
+
+    spin_lock(&cache->lock);
+
+    while (mag->count > KMEM_MAGAZINE_SIZE - KMEM_BATCH) {
+        void *obj = mag->objs[--mag->count];
+        struct Slab *slab = obj_slab(cache, obj);
+        assert(slab->cache == cache && slab->inuse);
+
+        size_t i = ((uint8_t *)obj - (uint8_t *)slab_obj(cache, slab, 0)) / cache->size;
+        assert(slab_obj(cache, slab, i) == obj);
+
+        if (slab->free == SLAB_NONE) slab_link(cache, slab);
+        slab_links(slab)[i] = slab->free;
+        slab->free = i;
+
+        if (!--slab->inuse) {
+            if (cache->nempty) {
+                slab_unlink(slab);
+                slab->next = release;
+                release = slab;
+                cache->nslabs--;
+            } else {
+                cache->nempty++;
+            }
+        }
+    }
+
+    spin_unlock(&cache->lock);
+
+    while (release) {
+        struct Slab *next = release->next;
+        kfree_page(release, cache->class);
+        release = next;
+    }
+}
+
+/* Allocate object with size usable bytes */
+static void *
+kmem_alloc(struct KmemCache *cache, size_t size) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    struct Magazine *mag = &cache->mag[cpunum()];
+    if (!mag->count) kmem_refill(cache, mag);
+
+    void *obj = NULL;
+    if (mag->count) {
+        obj = mag->objs[--mag->count];
+        mag->allocs++;
+    }
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+
+#ifdef SANITIZE_SHADOW_BASE
+    if (obj) platform_asan_alloc((uint8_t *)obj - KMEM_REDZONE, size, cache->objsize, KMEM_REDZONE);
+#endif
+    return obj;
+}
+
+void *
+kmem_cache_alloc(struct KmemCache *cache) {
+    return kmem_alloc(cache, cache->objsize);
+}
+
+/* Return object to the magazine, called with interrupts disabled */
+static void
+kmem_free(struct KmemCache *cache, void *obj) {
+    struct Magazine *mag = &cache->mag[cpunum()];
+    if (mag->count == KMEM_MAGAZINE_SIZE) kmem_drain(cache, mag);
+
+    mag->objs[mag->count++] = obj;
+}
+
+#ifdef SANITIZE_SHADOW_BASE
+/* Queue full batch of this CPU, objects of the oldest
+ * batches are returned to their caches to fit it */
+static void
+quarantine_flush(struct QuarantineBatch *batch) {
+    spin_lock(&quarantine.lock);
+
+    while (quarantine.count && (quarantine.count == KMEM_QUARANTINE_BATCHES ||
+                                quarantine.bytes + batch->bytes > KMEM_QUARANTINE_SIZE)) {
+        struct QuarantineBatch old = quarantine.batches[quarantine.head];
+        quarantine.head = (quarantine.head + 1) % KMEM_QUARANTINE_BATCHES;
+        quarantine.count--;
+        quarantine.bytes -= old.bytes;
+
+        /* Cache locks are of the same order */
+        spin_unlock(&quarantine.lock);
+        for (size_t i = 0; i < old.count; i++) kmem_free(old.caches[i], old.objs[i]);
+        spin_lock(&quarantine.lock);
+    }
+
+    quarantine.batches[(quarantine.head + quarantine.count) % KMEM_QUARANTINE_BATCHES] = *batch;
+    quarantine.count++;
+    quarantine.bytes += batch->bytes;
+
+    spin_unlock(&quarantine.lock);
+
+    batch->count = 0;
+    batch->bytes = 0;
+}
+#endif
+
+void
+kmem_cache_free(struct KmemCache *cache, void *obj) {
+    if (!obj) return;
+
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+#ifdef SANITIZE_SHADOW_BASE
+    platform_asan_free((uint8_t *)obj - KMEM_REDZONE, cache->size);
+
+    struct QuarantineBatch *batch = &quarantine_cpu[cpunum()];
+    batch->caches[batch->count] = cache;
+    batch->objs[batch->count++] = obj;
+    batch->bytes += cache->size;
+    if (batch->count == KMEM_QUARANTINE_BATCH) quarantine_flush(batch);
+#else
+    kmem_free(cache, obj);
+#endif
+    cache->mag[cpunum()].frees++;
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+}
+
+/* Number of objects of given size fitting into slab,
+ * *offset is set to the offset of the first one */
+static size_t
+objs_per_slab(size_t slab_size, size_t size, size_t align, uint32_t *offset) {
+    size_t n = (slab_size - sizeof(struct Slab)) / (size + sizeof(uint16_t));
+    if (n >= SLAB_NONE) n = SLAB_NONE - 1;
+
+    for (; n; n--) {
+        size_t start = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align);
+        if (start + n * size <= slab_size) {
+            *offset = start;
+            break;
+        }
+    }
+
+    return n;
+}
+
+/* Take a cache slot and set it up, kmem_lock must be held */
+static struct KmemCache *
+kmem_cache_init_locked(const char *name, size_t size, void (*ctor)(void *obj), int maxclass) {
+    size_t align = size >= 16 ? 16 : 8;
+    size = ROUNDUP(MAX(size, 1), align);
+    size_t objsize = size;
+    /* Redzones keep alignment of objects */
+    size += 2 * KMEM_REDZONE;
+
+    int class = 0;
+    uint32_t offset = 0;
+    size_t per_slab = 0;
+    for (; class <= maxclass; class++) {
+        per_slab = objs_per_slab(CLASS_SIZE(class), size, align, &offset);
+        if (per_slab >= KMEM_MIN_PER_SLAB) break;
+    }
+    if (class > maxclass) class = maxclass;
+    if (!per_slab) return NULL;
+
+    if (ncaches == KMEM_MAX_CACHES) return NULL;
+    struct KmemCache *cache = &caches[ncaches++];
+
+    cache->name = name;
+    cache->size = size;
+    cache->objsize = objsize;
+    cache->ctor = ctor;
+    cache->class = class;
+    cache->per_slab = per_slab;
+    cache->offset = offset;
+    spin_initlock(&cache->lock, LOCK_ORDER_ALLOC);
+
+    return cache;
+}
+
+static struct KmemCache *
+kmem_cache_init(const char *name, size_t size, void (*ctor)(void *obj), int maxclass) {
+    spin_lock(&kmem_lock);
+    struct KmemCache *cache = kmem_cache_init_locked(name, size, ctor, maxclass);
+    spin_unlock(&kmem_lock);
+    return cache;
+}
+
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj)) {
+    return kmem_cache_init(name, size, ctor, KMEM_MAX_SLAB_CLASS);
+}
+
+static struct KmemCache *
+kmalloc_cache(size_t i) {
+    static const char *names[KMALLOC_NCACHES] = {
+            "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+            "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"};
+
+    struct KmemCache *cache = __atomic_load_n(&kmalloc_caches[i], __ATOMIC_ACQUIRE);
+    if (cache) return cache;
+
+    /* Created under the lock, so that CPUs racing
+     * here don't each take a cache slot */
+    spin_lock(&kmem_lock);
+    cache = kmalloc_caches[i];
+    if (!cache) {
+        /* kfree() finds slabs by page alignment, so these
+         * caches are restricted to single page slabs */
+        cache = kmem_cache_init_locked(names[i], KMALLOC_MIN << i, NULL, 0);
+        if (!cache) panic("Cannot create %s cache\n", names[i]);
+        __atomic_store_n(&kmalloc_caches[i], cache, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&kmem_lock);
+
+    return cache;
+}
+
+void *
+kmalloc(size_t size) {
+    if (size > KMALLOC_MAX) {
+        int class = 0;
+        while (CLASS_SIZE(class) < size + KMALLOC_LARGE_OFFSET) class++;
+
+        struct Slab *block = kalloc_page(class);
+        if (!block) return NULL;
+        *block = (struct Slab){.cache = NULL, .class = class};
+#ifdef SANITIZE_SHADOW_BASE
+        /* Freed block is poisoned by the page allocator */
+        platform_asan_poison((uint8_t *)block + KMALLOC_LARGE_OFFSET + size,
+                             CLASS_SIZE(class) - KMALLOC_LARGE_OFFSET - size);
+#endif
+        return (uint8_t *)block + KMALLOC_LARGE_OFFSET;
+    }
+
+    size_t i = 0;
+    while ((KMALLOC_MIN << i) < size) i++;
+    return kmem_alloc(kmalloc_cache(i), size);
+}
+
+void
+kfree(void *obj) {
+    if (!obj) return;
+
+    struct Slab *slab = (struct Slab *)ROUNDDOWN((uintptr_t)obj, PAGE_SIZE);
+    if (!slab->cache) {
+        assert((uint8_t *)obj == (uint8_t *)slab + KMALLOC_LARGE_OFFSET);
+        kfree_page(slab, slab->class);
+    } else {
+        assert(!slab->cache->class);
+        kmem_cache_free(slab->cache, obj);
+    }
+}
+
+void
+kmem_dump_stats(void) {
+    cprintf("%-16s %6s %6s %6s %10s %10s\n", "cache", "size", "slabs", "objs", "allocs", "frees");
+
+    spin_lock(&kmem_lock);
+    size_t n = ncaches;
+    spin_unlock(&kmem_lock);
+
+    for (size_t i = 0; i < n; i++) {
+        struct KmemCache *cache = &caches[i];
+        uint64_t allocs = 0, frees = 0;
+        for (int cpu = 0; cpu < NCPU; cpu++) {
+            allocs += cache->mag[cpu].allocs;
+            frees += cache->mag[cpu].frees;
+        }
+        cprintf("%-16s %6zu %6u %6u %10lu %10lu\n", cache->name, cache->objsize,
+                cache->nslabs, cache->per_slab, (unsigned long)allocs, (unsigned long)frees);
+    }
+
+#ifdef SANITIZE_SHADOW_BASE
+    spin_lock(&quarantine.lock);
+    size_t batches = quarantine.count, bytes = quarantine.bytes;
+    spin_unlock(&quarantine.lock);
+    cprintf("quarantine: %zu batches, %zu bytes\n", batches, bytes);
+#endif
+}
@@ -0,0 +1,32 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+
+#include <inc/types.h>
+
+/* Kernel object allocator.
+ *
+ * Objects of a cache are carved from slabs, single pages (or larger
+ * power-of-two blocks) taken with kalloc_page(). Every CPU keeps a
+ * small magazine of free objects that is used with interrupts
+ * disabled instead of taking the cache lock.
+ *
+ * If a constructor is given, it is called once per object when
+ * its slab is created, and freed objects are expected to be
+ * returned to the cache in the constructed state. */
+struct KmemCache;
+
+struct KmemCache *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct KmemCache *cache);
+void kmem_cache_free(struct KmemCache *cache, void *obj);
+
+/* General purpose allocation, backed by power-of-two caches.
+ * Requests larger than KMALLOC_MAX get whole pages */
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 2048
+
+void *kmalloc(size_t size);
+void kfree(void *obj);
+
+void kmem_dump_stats(void);
+
+#endif
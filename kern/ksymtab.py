@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+#
+# Usage: ksymtab.py <kernel> > ksymtab.S
+#
+# Generate the compact symbol table of the kernel (struct Ksymtab in
+# kern/kdebug.h) from its ELF symbol table and DWARF 4 .debug_line:
+#
+#   funcs   text symbols sorted by address, as offsets from __text_start
+#   lines   (address, file, line) rows sorted by address, consecutive
+#           rows of the same line are merged
+#   hash    open addressing FNV-1a name -> funcs index + 1, global
+#           symbols take precedence over local ones of the same name
+#
+# The kernel is linked twice: without the table and then with it. The
+# table lives in .rodata, after all of the text, so the addresses it
+# describes don't move.
+
+import struct
+import sys
+
+def read_sections(elf):
+    if elf[:4] != b"\x7fELF" or elf[4] != 2:
+        sys.exit("ksymtab: not an ELF64 file")
+    shoff, = struct.unpack_from("<Q", elf, 0x28)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x3A)
+
+    headers = []
+    for i in range(shnum):
+        name, type, flags, addr, off, size, link, info, align, entsize = \
+            struct.unpack_from("<IIQQQQIIQQ", elf, shoff + i * shentsize)
+        headers.append((name, type, off, size, link, entsize))
+
+    strtab = headers[shstrndx]
+    sections = {}
+    for name, type, off, size, link, entsize in headers:
+        end = elf.index(b"\0", strtab[2] + name)
+        sections[elf[strtab[2] + name:end].decode()] = (off, size, link, entsize)
+    return headers, sections
+
+def cstring(data, off):
+    return data[off:data.index(b"\0", off)].decode(errors="replace")
+
+def read_symbols(elf, headers, sections):
+    off, size, link, entsize = sections[".symtab"]
+    stroff = headers[link][2]
+
+    symbols = []
+    for pos in range(off, off + size, entsize):
+        name, info, other, shndx, value, size = struct.unpack_from("<IBBHQQ", elf, pos)
+        symbols.append((cstring(elf, stroff + name), info >> 4, info & 0xF, shndx, value, size))
+    return symbols
+
+def uleb(data, pos):
+    result = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        result |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            return result, pos
+
+def sleb(data, pos):
+    result = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        result |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            if byte & 0x40:
+                result -= 1 << shift
+            return result, pos
+
+def read_lines(elf, sections):
+    """Returns (address, file name, line) rows of every line program,
+    line 0 marks the end of a sequence"""
+
+    if ".debug_line" not in sections:
+        return []
+    off, size, _, _ = sections[".debug_line"]
+    data = elf[off:off + size]
+
+    rows = []
+    pos = 0
+    while pos < len(data):
+        length, = struct.unpack_from("<I", data, pos)
+        if length >= 0xFFFFFFF0:
+            sys.exit("ksymtab: 64-bit DWARF is not supported")
+        end = pos + 4 + length
+        version, header_length = struct.unpack_from("<HI", data, pos + 4)
+        if version not in (2, 3, 4):
+            sys.exit("ksymtab: DWARF %d line tables are not supported" % version)
+        pos += 10
+        program = pos + header_length
+
+        min_inst = data[pos]
+        pos += 1
+        if version >= 4:
+            pos += 1 # maximum_operations_per_instruction, VLIW only
+        default_is_stmt, line_base, line_range, opcode_base = struct.unpack_from("<BbBB", data, pos)
+        pos += 4
+        opcode_lengths = data[pos:pos + opcode_base - 1]
+        pos += opcode_base - 1
+
+        dirs = []
+        while data[pos]:
+            dirs.append(cstring(data, pos))
+            pos += len(dirs[-1].encode()) + 1
+        pos += 1
+
+        files = []
+        while data[pos]:
+            name = cstring(data, pos)
+            pos += len(name.encode()) + 1
+            dir, pos = uleb(data, pos)
+            _, pos = uleb(data, pos) # mtime
+            _, pos = uleb(data, pos) # length
+            if dir and not name.startswith("/"):
+                name = dirs[dir - 1] + "/" + name
+            files.append(name[2:] if name.startswith("./") else name)
+
+        pos = program
+        addr, file, line = 0, 1, 1
+        while pos < end:
+            op = data[pos]
+            pos += 1
+            if op >= opcode_base:
+                op -= opcode_base
+                addr += (op // line_range) * min_inst
+                line += line_base + op % line_range
+                rows.append((addr, files[file - 1], line))
+            elif op == 0:
+                # Extended opcode
+                n, pos = uleb(data, pos)
+                sub = data[pos]
+                if sub == 1: # DW_LNE_end_sequence
+                    rows.append((addr, "", 0))
+                    addr, file, line = 0, 1, 1
+                elif sub == 2: # DW_LNE_set_address
+                    addr, = struct.unpack_from("<Q", data, pos + 1)
+                elif sub == 3: # DW_LNE_define_file
+                    files.append(cstring(data, pos + 1))
+                pos += n
+            elif op == 1: # DW_LNS_copy
+                rows.append((addr, files[file - 1], line))
+            elif op == 2: # DW_LNS_advance_pc
+                n, pos = uleb(data, pos)
+                addr += n * min_inst
+            elif op == 3: # DW_LNS_advance_line
+                n, pos = sleb(data, pos)
+                line += n
+            elif op == 4: # DW_LNS_set_file
+                file, pos = uleb(data, pos)
+            elif op == 8: # DW_LNS_const_add_pc
+                addr += ((255 - opcode_base) // line_range) * min_inst
+            elif op == 9: # DW_LNS_fixed_advance_pc
+                n, = struct.unpack_from("<H", data, pos)
+                pos += 2
+                addr += n
+            else:
+                # Opcodes without effect on the rows, skip their operands
+                for _ in range(opcode_lengths[op - 1]):
+                    _, pos = uleb(data, pos)
+        pos = end
+    return rows
+
+def fnv1a(name):
+    hash = 2166136261
+    for byte in name.encode():
+        hash = ((hash ^ byte) * 16777619) & 0xFFFFFFFF
+    return hash
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("Usage: ksymtab.py <kernel>")
+    with open(sys.argv[1], "rb") as f:
+        elf = f.read()
+
+    headers, sections = read_sections(elf)
+    symbols = read_symbols(elf, headers, sections)
+    text = {name: value for name, _, _, _, value, _ in symbols
+            if name in ("__text_start", "__text_end")}
+    start, end = text["__text_start"], text["__text_end"]
+
+    # STT_FUNC and STT_NOTYPE (assembly) symbols in the text
+    funcs = {}
+    for name, bind, type, shndx, value, size in symbols:
+        if type not in (0, 2) or not name or not start <= value < end:
+            continue
+        if name.startswith(".L") or name.startswith("__text_"):
+            continue
+        # Prefer sized symbols, then global ones
+        key = (size > 0, bind == 1)
+        if value not in funcs or key > funcs[value][0]:
+            funcs[value] = (key, name, size, bind == 1)
+    funcs = sorted((value, name, size, gbl) for value, (_, name, size, gbl) in funcs.items())
+
+    strings = bytearray()
+    offsets = {}
+    def intern(s):
+        if s not in offsets:
+            offsets[s] = len(strings)
+            strings.extend(s.encode() + b"\0")
+        return offsets[s]
+
+    # Out of line parts (foo.cold, foo.part.0) are shown as foo
+    func_rows = [(value - start, size, intern(name.split(".")[0])) for value, name, size, _ in funcs]
+
+    hash_size = 1
+    while hash_size < 2 * len(funcs):
+        hash_size *= 2
+    hash = [0] * hash_size
+    for gbl in (True, False):
+        for i, (_, name, _, is_gbl) in enumerate(funcs):
+            if is_gbl != gbl or "." in name:
+                continue
+            slot = fnv1a(name) & (hash_size - 1)
+            while hash[slot] and funcs[hash[slot] - 1][1] != name:
+                slot = (slot + 1) & (hash_size - 1)
+            if not hash[slot]:
+                hash[slot] = i + 1
+
+    # The last row of an address is the one describing it
+    rows = {}
+    for addr, file, line in read_lines(elf, sections):
+        if start <= addr < end:
+            rows[addr] = (file, line)
+    files = {}
+    line_rows = []
+    for addr in sorted(rows):
+        file, line = rows[addr]
+        if line and file not in files:
+            files[file] = len(files)
+        index = files[file] if line else 0
+        if line_rows and line_rows[-1][1:] == (index, line):
+            continue
+        line_rows.append((addr - start, index, line))
+    file_names = [intern(name) for name, _ in sorted(files.items(), key=lambda f: f[1])]
+
+    out = sys.stdout
+    out.write("/* Generated by kern/ksymtab.py, do not edit */\n\n")
+    out.write(".section .rodata\n.p2align 3\n.globl ksymtab\nksymtab:\n")
+    out.write("    .quad __text_start\n")
+    out.write("    .long %d, %d, %d, %d\n" % (len(func_rows), len(line_rows), len(file_names), hash_size))
+    out.write("    .quad .Lksym_funcs, .Lksym_lines, .Lksym_files, .Lksym_hash, .Lksym_strings\n")
+
+    out.write("\n.p2align 2\n.Lksym_funcs:\n")
+    for row in func_rows:
+        out.write("    .long %d, %d, %d\n" % row)
+    out.write("\n.Lksym_lines:\n")
+    for addr, file, line in line_rows:
+        out.write("    .long %d\n    .short %d, %d\n" % (addr, file, min(line, 0xFFFF)))
+    out.write("\n.Lksym_files:\n")
+    for name in file_names:
+        out.write("    .long %d\n" % name)
+    out.write("\n.Lksym_hash:\n")
+    for i in range(0, hash_size, 16):
+        out.write("    .long %s\n" % ", ".join(map(str, hash[i:i + 16])))
+    out.write("\n.Lksym_strings:\n")
+    for i in range(0, len(strings), 32):
+        out.write("    .byte %s\n" % ", ".join(map(str, strings[i:i + 32])))
+
+    # Keep the kernel stack non-executable
+    out.write('\n.section .note.GNU-stack,"",@progbits\n')
+
+if __name__ == "__main__":
+    main()
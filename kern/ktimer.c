@@ -0,0 +1,311 @@
+/* Kernel timer events: hierarchical timer wheel and high resolution heap */
+
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/ktimer.h>
+#include <kern/spinlock.h>
+#include <kern/tsc.h>
+
+/* Wheel level l has KTIMER_SLOTS slots of 2^(KTIMER_SLOT_SHIFT * l) base
+ * slots each, a base slot is 2^ktimer_shift TSC cycles. An event is hashed
+ * into the level that covers its distance from ktimer_clock, and moves down
+ * a level (cascades) every time the clock enters its slot there. Events
+ * further away than the whole wheel wait in the last slot of the top level
+ * and get rehashed from there. */
+
+#define KTIMER_LEVEL_SHIFT(l) (KTIMER_SLOT_SHIFT * (l))
+#define KTIMER_WHEEL_SPAN     (1ULL << KTIMER_LEVEL_SHIFT(KTIMER_LEVELS))
+
+static struct spinlock ktimer_lock = SPINLOCK_INITIALIZER(ktimer_lock, LOCK_ORDER_TIMER);
+
+static struct List ktimer_wheel[KTIMER_LEVELS][KTIMER_SLOTS];
+static size_t ktimer_level_len[KTIMER_LEVELS];
+static struct KTimer *ktimer_heap[KTIMER_HEAP_SIZE];
+static size_t ktimer_heap_len;
+
+static uint64_t ktimer_freq;  /* TSC frequency, Hz */
+static unsigned ktimer_shift; /* log2 of the base slot length in TSC cycles */
+static uint64_t ktimer_clock; /* Last base slot the wheel has processed */
+static bool ktimer_ready;
+
+static void
+list_init(struct List *list) {
+    list->next = list->prev = list;
+}
+
+static void
+list_append(struct List *list, struct List *item) {
+    item->next = list;
+    item->prev = list->prev;
+    list->prev->next = item;
+    list->prev = item;
+}
+
+static void
+list_del(struct List *item) {
+    item->prev->next = item->next;
+    item->next->prev = item->prev;
+    list_init(item);
+}
+
+static void
+ktimer_heap_swap(size_t i, size_t j) {
+    struct KTimer *tmp = ktimer_heap[i];
+    ktimer_heap[i] = ktimer_heap[j];
+    ktimer_heap[j] = tmp;
+    ktimer_heap[i]->heap_index = i;
+    ktimer_heap[j]->heap_index = j;
+}
+
+static void
+ktimer_heap_fix(size_t i) {
+    while (i && ktimer_heap[i]->expires < ktimer_heap[(i - 1) / 2]->expires) {
+        ktimer_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < ktimer_heap_len && ktimer_heap[l]->expires < ktimer_heap[min]->expires) min = l;
+        if (r < ktimer_heap_len && ktimer_heap[r]->expires < ktimer_heap[min]->expires) min = r;
+        if (min == i) break;
+        ktimer_heap_swap(i, min);
+        i = min;
+    }
+}
+
+static void
+ktimer_heap_remove(struct KTimer *timer) {
+    size_t i = timer->heap_index;
+    assert(i < ktimer_heap_len && ktimer_heap[i] == timer);
+
+    timer->heap_index = -1;
+    if (i != --ktimer_heap_len) {
+        ktimer_heap[i] = ktimer_heap[ktimer_heap_len];
+        ktimer_heap[i]->heap_index = i;
+        ktimer_heap_fix(i);
+    }
+}
+
+static void
+ktimer_wheel_insert(struct KTimer *timer) {
+    uint64_t slot = timer->expires >> ktimer_shift;
+
+    /* The current slot has already been processed */
+    if (slot <= ktimer_clock) slot = ktimer_clock + 1;
+    if (slot - ktimer_clock >= KTIMER_WHEEL_SPAN) slot = ktimer_clock + KTIMER_WHEEL_SPAN - 1;
+
+    uint64_t delta = slot - ktimer_clock;
+    int level = 0;
+    while (level < KTIMER_LEVELS - 1 && delta >= 1ULL << KTIMER_LEVEL_SHIFT(level + 1)) level++;
+
+    timer->heap_index = -1;
+    timer->level = level;
+    list_append(&ktimer_wheel[level][(slot >> KTIMER_LEVEL_SHIFT(level)) % KTIMER_SLOTS], &timer->link);
+    ktimer_level_len[level]++;
+}
+
+/* Put an armed timer into the heap if it expires before
+ * the next base slot (or if it is already late), into the wheel otherwise */
+static void
+ktimer_insert(struct KTimer *timer, uint64_t now) {
+    if (timer->expires > now && timer->expires - now >= 1ULL << ktimer_shift) {
+        ktimer_wheel_insert(timer);
+    } else if (ktimer_heap_len < KTIMER_HEAP_SIZE) {
+        timer->level = -1;
+        timer->heap_index = ktimer_heap_len;
+        ktimer_heap[ktimer_heap_len++] = timer;
+        ktimer_heap_fix(timer->heap_index);
+    } else {
+        /* Heap is full, run it a bit late */
+        ktimer_wheel_insert(timer);
+    }
+}
+
+static void
+ktimer_wheel_remove(struct KTimer *timer) {
+    list_del(&timer->link);
+    ktimer_level_len[timer->level]--;
+    timer->level = -1;
+}
+
+/* Move every event of the current slot of level 'level' a level down,
+ * or to 'expired' if it is due already */
+static void
+ktimer_cascade(int level, uint64_t now, struct List *expired) {
+    struct List *head = &ktimer_wheel[level][(ktimer_clock >> KTIMER_LEVEL_SHIFT(level)) % KTIMER_SLOTS];
+
+    while (head->next != head) {
+        struct KTimer *timer = (struct KTimer *)head->next;
+        ktimer_wheel_remove(timer);
+        if (timer->expires <= now) {
+            timer->pending = 0;
+            list_append(expired, &timer->link);
+        } else {
+            ktimer_insert(timer, now);
+        }
+    }
+}
+
+/* Advance the wheel up to 'now', collecting expired events */
+static void
+ktimer_advance(uint64_t now, struct List *expired) {
+    uint64_t now_slot = now >> ktimer_shift;
+
+    while (ktimer_clock < now_slot) {
+        size_t queued = 0;
+        for (int level = 0; level < KTIMER_LEVELS; level++) queued += ktimer_level_len[level];
+        if (!queued) {
+            ktimer_clock = now_slot;
+            break;
+        }
+
+        /* Nothing can expire before the next level 1 slot */
+        if (!ktimer_level_len[0]) {
+            ktimer_clock = MIN(now_slot, ktimer_clock | (KTIMER_SLOTS - 1));
+            if (ktimer_clock == now_slot) break;
+        }
+
+        ktimer_clock++;
+        for (int level = 1; level < KTIMER_LEVELS; level++) {
+            if (ktimer_clock & ((1ULL << KTIMER_LEVEL_SHIFT(level)) - 1)) break;
+            ktimer_cascade(level, now, expired);
+        }
+        ktimer_cascade(0, now, expired);
+    }
+}
+
+static uint64_t
+ktimer_ns2cycles(uint64_t nsec) {
+    return nsec / 1000000000 * ktimer_freq + nsec % 1000000000 * ktimer_freq / 1000000000;
+}
+
+static uint64_t
+ktimer_cycles2ns(uint64_t cycles) {
+    return cycles / ktimer_freq * 1000000000 + cycles % ktimer_freq * 1000000000 / ktimer_freq;
+}
+
+void
+ktimer_init(void) {
+    ktimer_freq = tsc_calibrate();
+    if (!ktimer_freq) panic("Can't calibrate TSC for kernel timers");
+
+    /* Base slot is the largest power of two not longer than a millisecond */
+    uint64_t per_ms = MAX(ktimer_freq / 1000, 1);
+    ktimer_shift = 63 - __builtin_clzll(per_ms);
+
+    for (int level = 0; level < KTIMER_LEVELS; level++)
+        for (int i = 0; i < KTIMER_SLOTS; i++)
+            list_init(&ktimer_wheel[level][i]);
+
+    ktimer_clock = read_tsc() >> ktimer_shift;
+    ktimer_ready = 1;
+}
+
+/* Arm 'timer' to call fn(arg) nsec nanoseconds from now.
+ * An already pending timer is re-armed */
+void
+timer_add(struct KTimer *timer, uint64_t nsec, void (*fn)(void *), void *arg) {
+    assert(ktimer_ready);
+
+    uint64_t rflags = spin_lock_irqsave(&ktimer_lock);
+    uint64_t now = read_tsc();
+
+    if (timer->pending) {
+        if (timer->heap_index >= 0) ktimer_heap_remove(timer);
+        else ktimer_wheel_remove(timer);
+    }
+
+    timer->expires = now + ktimer_ns2cycles(nsec);
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->pending = 1;
+    ktimer_insert(timer, now);
+
+    spin_unlock_irqrestore(&ktimer_lock, rflags);
+}
+
+/* Disarm 'timer'. Returns whether it was still pending */
+bool
+timer_cancel(struct KTimer *timer) {
+    uint64_t rflags = spin_lock_irqsave(&ktimer_lock);
+
+    bool pending = timer->pending;
+    if (pending) {
+        if (timer->heap_index >= 0) ktimer_heap_remove(timer);
+        else ktimer_wheel_remove(timer);
+        timer->pending = 0;
+    }
+
+    spin_unlock_irqrestore(&ktimer_lock, rflags);
+    return pending;
+}
+
+/* Whether any timer event is armed */
+bool
+timer_pending(void) {
+    size_t queued = ktimer_heap_len;
+    for (int level = 0; level < KTIMER_LEVELS; level++) queued += ktimer_level_len[level];
+    return queued > 0;
+}
+
+/* Run expired timer events. Called on every scheduling timer interrupt */
+void
+ktimer_run(void) {
+    if (!ktimer_ready) return;
+
+    struct List expired;
+    list_init(&expired);
+
+    uint64_t rflags = spin_lock_irqsave(&ktimer_lock);
+    uint64_t now = read_tsc();
+
+    ktimer_advance(now, &expired);
+    while (ktimer_heap_len && ktimer_heap[0]->expires <= now) {
+        struct KTimer *timer = ktimer_heap[0];
+        ktimer_heap_remove(timer);
+        timer->pending = 0;
+        list_append(&expired, &timer->link);
+    }
+
+    spin_unlock_irqrestore(&ktimer_lock, rflags);
+
+    /* A callback may re-arm its own timer, so it is unlinked first */
+    while (expired.next != &expired) {
+        struct KTimer *timer = (struct KTimer *)expired.next;
+        list_del(&timer->link);
+        timer->fn(timer->arg);
+    }
+}
+
+/* Time in nanoseconds until the nearest pending kernel timer event,
+ * 0 if there is none. For the wheel this is the start of the nearest
+ * non-empty slot, so the CPU may wake up a bit early and find
+ * that there is nothing to run yet */
+uint64_t
+timer_next_deadline(void) {
+    if (!ktimer_ready) return 0;
+
+    uint64_t rflags = spin_lock_irqsave(&ktimer_lock);
+    uint64_t now = read_tsc();
+    uint64_t deadline = ktimer_heap_len ? ktimer_heap[0]->expires : 0;
+
+    for (int level = 0; level < KTIMER_LEVELS; level++) {
+        if (!ktimer_level_len[level]) continue;
+
+        unsigned shift = KTIMER_LEVEL_SHIFT(level);
+        for (uint64_t block = (ktimer_clock >> shift) + 1; block <= (ktimer_clock >> shift) + KTIMER_SLOTS; block++) {
+            struct List *head = &ktimer_wheel[level][block % KTIMER_SLOTS];
+            if (head->next == head) continue;
+
+            uint64_t start = (block << shift) << ktimer_shift;
+            if (!deadline || start < deadline) deadline = start;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&ktimer_lock, rflags);
+
+    if (!deadline) return 0;
+    return deadline > now ? MAX(ktimer_cycles2ns(deadline - now), 1) : 1;
+}
@@ -0,0 +1,40 @@
+#ifndef JOS_KERN_KTIMER_H
+#define JOS_KERN_KTIMER_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+/* Kernel timer events.
+ *
+ * Deadlines are kept in TSC cycles. Events further than one wheel slot
+ * (about a millisecond) away go into a hierarchical hashed timer wheel
+ * with O(1) insert and cancel, the rest go into a small heap ordered
+ * by the exact deadline. Expired events are run from the scheduling
+ * timer interrupt, with interrupts disabled and no locks held. */
+
+#define KTIMER_LEVELS     4
+#define KTIMER_SLOT_SHIFT 6
+#define KTIMER_SLOTS      (1 << KTIMER_SLOT_SHIFT)
+#define KTIMER_HEAP_SIZE  64
+
+struct KTimer {
+    struct List link;      /* Wheel slot list, or the list of expired events */
+    uint64_t expires;      /* Deadline, TSC value */
+    void (*fn)(void *arg); /* Called once the deadline has passed */
+    void *arg;
+    int heap_index;        /* Position in the heap, -1 if in the wheel */
+    int level;             /* Wheel level, -1 if in the heap */
+    bool pending;          /* Armed and not yet run or cancelled */
+};
+
+void ktimer_init(void);
+void timer_add(struct KTimer *timer, uint64_t nsec, void (*fn)(void *), void *arg);
+bool timer_cancel(struct KTimer *timer);
+bool timer_pending(void);
+void ktimer_run(void);
+uint64_t timer_next_deadline(void);
+
+#endif /* !JOS_KERN_KTIMER_H */
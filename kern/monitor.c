@@ -5,6 +5,7 @@
 #include <inc/string.h>
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/env.h>
 #include <inc/x86.h>
 
@@ -19,6 +20,19 @@
 #include <kern/monitor.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
+#include <kern/kmalloc.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/prof.h>
+#include <kern/bench.h>
+#include <kern/klog.h>
+#include <kern/boottime.h>
+#include <kern/ftrace.h>
+#include <kern/pftrace.h>
+#include <kern/pmu.h>
+#ifdef SAN_ENABLE_KUBSAN
+#include <llvm/ubsan/ubsan.h>
+#endif
 
 #define WHITESPACE "\t\r\n "
 #define MAXARGS    16
@@ -35,6 +49,23 @@ int mon_timer_frequency(int argc, char **argv, struct Trapframe *tf);
 int mon_memory(int argc, char **argv, struct Trapframe *tf);
 int mon_pagetable(int argc, char **argv, struct Trapframe *tf);
 int mon_virt(int argc, char **argv, struct Trapframe *tf);
+int mon_sched_stats(int argc, char **argv, struct Trapframe *tf);
+int mon_sched_class(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_kmemstat(int argc, char **argv, struct Trapframe *tf);
+int mon_prof(int argc, char **argv, struct Trapframe *tf);
+int mon_bench(int argc, char **argv, struct Trapframe *tf);
+int mon_dmesg(int argc, char **argv, struct Trapframe *tf);
+int mon_ps(int argc, char **argv, struct Trapframe *tf);
+int mon_top(int argc, char **argv, struct Trapframe *tf);
+int mon_boottime(int argc, char **argv, struct Trapframe *tf);
+int mon_ubsan(int argc, char **argv, struct Trapframe *tf);
+int mon_ftrace(int argc, char **argv, struct Trapframe *tf);
+int mon_wss(int argc, char **argv, struct Trapframe *tf);
+int mon_ksm(int argc, char **argv, struct Trapframe *tf);
+int mon_perf(int argc, char **argv, struct Trapframe *tf);
+int mon_irqstat(int argc, char **argv, struct Trapframe *tf);
+int mon_pftrace(int argc, char **argv, struct Trapframe *tf);
 
 struct Command {
     const char *name;
@@ -54,6 +85,24 @@ static struct Command commands[] = {
     {"timer_freq", "Starts timer ...", mon_timer_frequency},
     {"dump_page_table", "Dumps active page table", mon_pagetable},
     {"dump_virtual_tree", "Dumps active virtual tree", mon_virt},
+    {"memory", "Print memory statistics: memory [-v] (-v dumps free lists)", mon_memory},
+    {"sched_stats", "Print average scheduling decision cost", mon_sched_stats},
+    {"sched_class", "Select scheduling class: sched_class rr|fair", mon_sched_class},
+    {"lockstat", "Print spinlock contention statistics", mon_lockstat},
+    {"kmemstat", "Print kernel object cache statistics", mon_kmemstat},
+    {"prof", "Sampling profiler: prof start [ticks]|stop|top [n]", mon_prof},
+    {"bench", "Run microbenchmarks: bench [name|all] [iterations]", mon_bench},
+    {"dmesg", "Replay the kernel log", mon_dmesg},
+    {"ps", "List envs with their CPU accounting", mon_ps},
+    {"top", "Busiest envs and scheduling latency: top [n]", mon_top},
+    {"boottime", "Print how long each boot phase took", mon_boottime},
+    {"ubsan", "Print triggered UBSAN check sites with hit counts", mon_ubsan},
+    {"ftrace", "Function tracer: ftrace on|off <function>|list|show [n]|clear", mon_ftrace},
+    {"wss", "Print working set size of envs", mon_wss},
+    {"ksm", "Same page merging: ksm on|off|stat", mon_ksm},
+    {"perf", "Performance counters: perf stat <command>|envs|rdpmc on|off", mon_perf},
+    {"irqstat", "Per-vector trap counts and handler latency: irqstat [reset]", mon_irqstat},
+    {"pftrace", "Page fault tracer: pftrace on|off|show [n]|clear", mon_pftrace},
 };
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
@@ -205,10 +254,17 @@ mon_timer_frequency(int argc, char **argv, struct Trapframe *tf) {
 
 /* Implement memory (mon_memory) command.
  * This command should call dump_memory_lists()
+ * (Prints a summary, free lists are dumped with -v)
  */
 // LAB 6: Your code here
 int mon_memory(int argc, char **argv, struct Trapframe *tf) {
-    dump_memory_lists();
+    if (argc == 2 && !strcmp(argv[1], "-v")) {
+        dump_memory_lists();
+    } else if (argc == 1) {
+        dump_memory_stats();
+    } else {
+        cprintf("Usage: %s [-v]\n", argv[0]);
+    }
     return 0;
 }
 
@@ -240,6 +296,141 @@ int mon_virt(int argc, char **argv, struct Trapframe *tf) {
     return 0;
 }
 
+int
+mon_sched_stats(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    sched_dump_stats();
+    return 0;
+}
+
+int
+mon_sched_class(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc != 2 || (strcmp(argv[1], "rr") && strcmp(argv[1], "fair"))) {
+        cprintf("Usage: %s rr|fair\n", argv[0]);
+        return 0;
+    }
+
+    sched_set_class(!strcmp(argv[1], "fair") ? SCHED_CLASS_FAIR : SCHED_CLASS_RR);
+    return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    spin_dump_stats();
+    return 0;
+}
+
+int
+mon_kmemstat(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    kmem_dump_stats();
+    return 0;
+}
+
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "start")) {
+        unsigned interval = argc == 3 ? strtol(argv[2], NULL, 0) : 1;
+        prof_start(interval);
+        cprintf("Sampling every %u scheduler tick(s)\n", interval ? interval : 1);
+    } else if (argc == 2 && !strcmp(argv[1], "stop")) {
+        prof_stop();
+    } else if (argc >= 2 && argc <= 3 && !strcmp(argv[1], "top")) {
+        prof_dump_top(argc == 3 ? strtol(argv[2], NULL, 0) : 20);
+    } else {
+        cprintf("Usage: %s start [ticks]|stop|top [n]\n", argv[0]);
+    }
+    return 0;
+}
+
+int
+mon_bench(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc < 2 || argc > 3) {
+        cprintf("Usage: %s name|all [iterations]\nBenchmarks:\n", argv[0]);
+        bench_list();
+        return 0;
+    }
+
+    size_t iters = argc == 3 ? strtol(argv[2], NULL, 0) : BENCH_DEFAULT_ITERS;
+    int res = bench_run(argv[1], iters);
+    if (res == -E_INVAL) cprintf("Iterations must be in [1, %d]\n", BENCH_MAX_ITERS);
+    if (res == -E_NO_ENT) cprintf("No benchmark '%s', run %s without arguments for a list\n", argv[1], argv[0]);
+    return 0;
+}
+
+int
+mon_dmesg(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    klog_dump();
+    return 0;
+}
+
+int
+mon_ps(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    sched_dump_envs(nenvs, 0);
+    return 0;
+}
+
+int
+mon_top(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc > 2) {
+        cprintf("Usage: %s [n]\n", argv[0]);
+        return 0;
+    }
+    sched_dump_envs(argc == 2 ? strtol(argv[1], NULL, 0) : 10, 1);
+    sched_dump_latency();
+    return 0;
+}
+
+int
+mon_boottime(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    boot_timeline_print();
+    return 0;
+}
+
+int
+mon_ubsan(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+#ifdef SAN_ENABLE_KUBSAN
+    ubsan_dump_sites();
+#else
+    cprintf("Kernel is built without UBSAN (KUBSAN=1)\n");
+#endif
+    return 0;
+}
+
 /* Kernel monitor command interpreter */
 
 static int
@@ -288,3 +479,107 @@ monitor(struct Trapframe *tf) {
     do buf = readline("K> ");
     while (!buf || runcmd(buf, tf) >= 0);
 }
+
+int
+mon_ftrace(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc == 3 && (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+        int res = ftrace_set(argv[2], !strcmp(argv[1], "on"));
+        if (res == -E_NO_ENT) cprintf("No function '%s'\n", argv[2]);
+        if (res == -E_INVAL) cprintf("Function '%s' cannot be traced\n", argv[2]);
+    } else if (argc == 2 && !strcmp(argv[1], "list")) {
+        ftrace_list();
+    } else if ((argc == 2 || argc == 3) && !strcmp(argv[1], "show")) {
+        ftrace_print(argc == 3 ? strtol(argv[2], NULL, 0) : 50);
+    } else if (argc == 2 && !strcmp(argv[1], "clear")) {
+        ftrace_clear();
+    } else {
+        cprintf("Usage: %s on|off <function>|list|show [n]|clear\n", argv[0]);
+    }
+    return 0;
+}
+
+int
+mon_wss(int argc, char **argv, struct Trapframe *tf) {
+    (void) argc;
+    (void) argv;
+    (void) tf;
+
+    dump_working_sets();
+    return 0;
+}
+
+int
+mon_ksm(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc == 2 && (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+        ksm_set(!strcmp(argv[1], "on"));
+    } else if (argc == 2 && !strcmp(argv[1], "stat")) {
+        dump_ksm_stats();
+    } else {
+        cprintf("Usage: %s on|off|stat\n", argv[0]);
+    }
+    return 0;
+}
+
+int
+mon_perf(int argc, char **argv, struct Trapframe *tf) {
+    if (argc >= 3 && !strcmp(argv[1], "stat")) {
+        for (size_t i = 0; i < NCOMMANDS; i++) {
+            if (strcmp(argv[2], commands[i].name)) continue;
+
+            struct PmuCounts start, end;
+            pmu_read(&start);
+            int res = commands[i].func(argc - 2, argv + 2, tf);
+            pmu_read(&end);
+
+            for (int j = 0; j < PMU_NEVENTS; j++)
+                end.count[j] -= start.count[j];
+            cprintf("Performance counters for '%s':\n", argv[2]);
+            pmu_print(&end);
+            return res;
+        }
+        cprintf("Unknown command '%s'\n", argv[2]);
+    } else if (argc == 2 && !strcmp(argv[1], "envs")) {
+        pmu_dump_envs();
+    } else if (argc == 3 && !strcmp(argv[1], "rdpmc") &&
+               (!strcmp(argv[2], "on") || !strcmp(argv[2], "off"))) {
+        if (pmu_set_user_rdpmc(!strcmp(argv[2], "on")) < 0)
+            cprintf("No performance counters\n");
+    } else {
+        cprintf("Usage: %s stat <command> [args]|envs|rdpmc on|off\n", argv[0]);
+    }
+    return 0;
+}
+
+int
+mon_irqstat(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc == 1) {
+        irqstat_print();
+    } else if (argc == 2 && !strcmp(argv[1], "reset")) {
+        irqstat_reset();
+    } else {
+        cprintf("Usage: %s [reset]\n", argv[0]);
+    }
+    return 0;
+}
+
+int
+mon_pftrace(int argc, char **argv, struct Trapframe *tf) {
+    (void) tf;
+
+    if (argc == 2 && (!strcmp(argv[1], "on") || !strcmp(argv[1], "off"))) {
+        pftrace_enabled = !strcmp(argv[1], "on");
+    } else if ((argc == 2 || argc == 3) && !strcmp(argv[1], "show")) {
+        pftrace_print(argc == 3 ? strtol(argv[2], NULL, 0) : 50);
+    } else if (argc == 2 && !strcmp(argv[1], "clear")) {
+        pftrace_clear();
+    } else {
+        cprintf("Usage: %s on|off|show [n]|clear\n", argv[0]);
+    }
+    return 0;
+}
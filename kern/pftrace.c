@@ -0,0 +1,98 @@
+/* Page fault tracer, see kern/pftrace.h */
+
+#include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/pftrace.h>
+#include <kern/pmap.h>
+#include <kern/traceopt.h>
+#include <kern/tsc.h>
+
+struct PfEvent {
+    uint64_t tsc;
+    uintptr_t va;
+    envid_t env;
+    uint32_t cycles; /* From trap entry until the fault is resolved */
+    uint16_t err;    /* Page fault error code */
+    uint8_t kind;    /* enum FaultKind */
+};
+
+/* Accessed by its CPU only, with interrupts disabled */
+struct PfCpu {
+    struct PfEvent ring[PFTRACE_RING_SIZE];
+    uint64_t head; /* Number of events ever logged */
+};
+
+static struct PfCpu pftrace_cpu[NCPU];
+
+bool pftrace_enabled = trace_pagefaults;
+
+/* Called from the page fault handler */
+void
+pftrace_record(envid_t env, uintptr_t va, uint32_t err, int kind, uint64_t cycles) {
+    struct PfCpu *cpu = &pftrace_cpu[cpunum()];
+
+    cpu->ring[cpu->head++ & (PFTRACE_RING_SIZE - 1)] = (struct PfEvent){
+            .tsc = read_tsc(), .va = va, .env = env,
+            .cycles = MIN(cycles, (uint64_t)UINT32_MAX), .err = err, .kind = kind};
+}
+
+static const char *
+pftrace_kind(int kind) {
+    static const char *const names[] = {
+            [FAULT_NONE] = "fatal",
+            [FAULT_MAP] = "map",
+            [FAULT_ZERO] = "zero",
+            [FAULT_COPY] = "copy",
+    };
+
+    return kind < sizeof(names) / sizeof(*names) ? names[kind] : "?";
+}
+
+/* Print last n events of every CPU, oldest first */
+void
+pftrace_print(size_t n) {
+    uint64_t freq = tsc_calibrate();
+    if (!freq) freq = 1;
+
+    for (int i = 0; i < NCPU; i++) {
+        struct PfCpu *cpu = &pftrace_cpu[i];
+
+        uint64_t rflags = read_rflags();
+        asm volatile("cli" ::: "memory");
+        uint64_t head = cpu->head;
+        if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+
+        size_t count = MIN(n, MIN(head, PFTRACE_RING_SIZE));
+        cprintf("cpu %d: %lu faults", i, (unsigned long)head);
+        if (!count) {
+            cprintf("\n");
+            continue;
+        }
+        cprintf(", last %zu:\n", count);
+
+        uint64_t start = cpu->ring[(head - count) & (PFTRACE_RING_SIZE - 1)].tsc;
+        cprintf("%12s %8s %18s %4s %5s %10s\n", "us", "env", "va", "err", "kind", "cycles");
+        for (uint64_t j = head - count; j < head; j++) {
+            struct PfEvent *ev = &cpu->ring[j & (PFTRACE_RING_SIZE - 1)];
+            cprintf("%12lu %08x %18lx %c%c%c%c %5s %10u\n",
+                    (unsigned long)((ev->tsc - start) * 1000000 / freq), ev->env,
+                    (unsigned long)ev->va,
+                    ev->err & FEC_U ? 'u' : 'k', ev->err & FEC_W ? 'w' : 'r',
+                    ev->err & FEC_P ? 'p' : '-', ev->err & FEC_I ? 'x' : '-',
+                    pftrace_kind(ev->kind), ev->cycles);
+        }
+    }
+}
+
+void
+pftrace_clear(void) {
+    for (int i = 0; i < NCPU; i++) {
+        uint64_t rflags = read_rflags();
+        asm volatile("cli" ::: "memory");
+        pftrace_cpu[i].head = 0;
+        if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_PFTRACE_H
+#define JOS_KERN_PFTRACE_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+/* Page fault tracer.
+ *
+ * Every page fault taken while tracing is on is stored into a per-CPU
+ * ring buffer as a fixed-size binary record, nothing is printed from
+ * the fault path. Records are decoded by the pftrace monitor command.
+ * Tracing starts enabled if the kernel is built with trace_pagefaults */
+
+#define PFTRACE_RING_SIZE 1024 /* Events per CPU, power of 2 */
+
+extern bool pftrace_enabled;
+
+void pftrace_record(envid_t env, uintptr_t va, uint32_t err, int kind, uint64_t cycles);
+void pftrace_print(size_t n);
+void pftrace_clear(void);
+
+#endif /* !JOS_KERN_PFTRACE_H */
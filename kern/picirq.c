@@ -4,6 +4,7 @@
 #include <inc/trap.h>
 
 #include <kern/picirq.h>
+#include <kern/apic.h>
 
 /* Current IRQ mask.
  * Initial IRQ mask has interrupt 2 enabled (for slave 8259A) */
@@ -69,15 +70,25 @@ pic_init(void) {
 
     pic_initilalized = 1;
 
-    if (irq_mask_8259A != 0xFFFF)
+    if (apic_init()) {
+        /* The 8259s stay fully masked, the IO-APIC gets the IRQs enabled so far */
+        for (uint8_t irq = 0; irq < MAX_IRQS; irq++) {
+            if (irq != IRQ_SLAVE && !(irq_mask_8259A & (1 << irq)))
+                ioapic_set_mask(irq, 0);
+        }
+        cprintf("Interrupts are delivered through the IO-APIC\n");
+    } else if (irq_mask_8259A != 0xFFFF) {
         set_irq_mask(irq_mask_8259A);
+    }
     print_irq_mask(irq_mask_8259A);
 }
 
 void
 pic_irq_mask(uint8_t irq) {
     irq_mask_8259A |= (1 << irq);
-    if (pic_initilalized) {
+    if (apic_enabled) {
+        ioapic_set_mask(irq, 1);
+    } else if (pic_initilalized) {
         set_irq_mask(irq_mask_8259A);
         print_irq_mask(irq_mask_8259A);
     }
@@ -86,7 +97,9 @@ pic_irq_mask(uint8_t irq) {
 void
 pic_irq_unmask(uint8_t irq) {
     irq_mask_8259A &= ~(1 << irq);
-    if (pic_initilalized) {
+    if (apic_enabled) {
+        ioapic_set_mask(irq, 0);
+    } else if (pic_initilalized) {
         set_irq_mask(irq_mask_8259A);
         print_irq_mask(irq_mask_8259A);
     }
@@ -94,6 +107,10 @@ pic_irq_unmask(uint8_t irq) {
 
 void
 pic_send_eoi(uint8_t irq) {
+    if (apic_enabled) {
+        lapic_eoi();
+        return;
+    }
     if (irq > 7) outb(IO_PIC2_CMND, PIC_EOI);
     outb(IO_PIC1_CMND, PIC_EOI);
 }
@@ -7,9 +7,14 @@
 #include <inc/uefi.h>
 #include <inc/x86.h>
 
+#include <kern/cpu.h>
 #include <kern/env.h>
 #include <kern/kclock.h>
+#include <kern/ktimer.h>
 #include <kern/pmap.h>
+#include <kern/preempt.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
 #include <kern/traceopt.h>
 #include <kern/trap.h>
 
@@ -21,13 +26,55 @@
  * by struct Page
  */
 
-/* for O(1) page allocation */
-static struct List free_classes[MAX_CLASS];
+/* NUMA nodes.
+ * Proximity domains and their memory ranges come from ACPI SRAT,
+ * distances from SLIT (init_numa()). Without them all memory
+ * is node 0. Free pages never span two nodes, init_numa() splits
+ * the ones that do and page_unref_one() does not merge them back */
+#define NUMA_MAX_NODES  8
+#define NUMA_MAX_RANGES 32
+#define NUMA_LOCAL_DISTANCE  10
+#define NUMA_REMOTE_DISTANCE 20
+struct NumaRange {
+    physaddr_t start, end;
+    uint8_t node;
+};
+static struct NumaRange numa_ranges[NUMA_MAX_RANGES];
+static size_t numa_nranges;
+static size_t numa_nnodes = 1;
+static uint32_t numa_domains[NUMA_MAX_NODES];
+static uint8_t numa_distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+/* Nodes ordered by distance from each node, starting with itself */
+static uint8_t numa_order[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t cpu_node[NCPU];
+
+/* for O(1) page allocation
+ * (free pages starting below BOOT_MEM_SIZE are kept
+ * in boot_free_classes, so pools are found without scanning)
+ * Every NUMA node has its own set of lists */
+static struct List free_classes[NUMA_MAX_NODES][MAX_CLASS];
+static struct List boot_free_classes[NUMA_MAX_NODES][MAX_CLASS];
+/* Bit N is set if corresponding free list might be non-empty,
+ * bits of emptied lists are cleared lazily by free_class_next() */
+static uint64_t free_class_mask[NUMA_MAX_NODES], boot_free_class_mask[NUMA_MAX_NODES];
 /* List of descriptor pools */
 static struct PagePool *first_pool;
 /* List of free descriptors */
 static struct List free_descriptors;
+/* Number of free descriptors, including ones held by per-CPU caches */
 static size_t free_desc_count;
+
+#define DESC_CACHE_SIZE  64
+#define DESC_CACHE_BATCH (DESC_CACHE_SIZE / 2)
+
+/* Per-CPU magazines of free descriptors.
+ * Refilled from and drained to free_descriptors
+ * in batches of DESC_CACHE_BATCH entries */
+struct DescCache {
+    size_t count;
+    struct Page *desc[DESC_CACHE_SIZE];
+};
+static struct DescCache desc_cache[NCPU];
 /* Physical memory size */
 size_t max_memory_map_addr;
 /* Kernel address space */
@@ -38,6 +85,55 @@ struct AddressSpace *current_space;
 struct Page root;
 /* Top address for page pools mappings */
 static uintptr_t metaheaptop;
+/* Protects the page trees, free lists, descriptor pools
+ * and metaheaptop. Taken by the exported functions only */
+static struct spinlock page_lock = SPINLOCK_INITIALIZER(page_lock, LOCK_ORDER_PAGE);
+
+/* Pools of pre-zeroed pages.
+ * Refilled by refill_zero_pool() when CPU is idle and consumed
+ * by alloc_page() with ALLOC_ZERO, so zeroing is not done on
+ * the page fault path. Pooled pages hold one reference,
+ * so they are never merged with their free buddies */
+struct ZeroPool {
+    int class;
+    size_t count, cap;
+    struct Page *pages[64];
+};
+static struct ZeroPool zero_pools[] = {
+        {.class = 0, .cap = 64},                   /* 256KB of 4KB pages */
+        {.class = MAX_ALLOCATION_CLASS, .cap = 4}, /* 8MB of 2MB pages */
+};
+#define NZERO_POOLS (sizeof(zero_pools) / sizeof(*zero_pools))
+
+#define PT_CACHE_SIZE 32
+#define PT_CACHE_LOW  16
+
+/* Per-CPU caches of zeroed page table pages.
+ * alloc_pt() takes from them first and remove_pt() gives emptied
+ * tables back. refill_zero_pool() tops them up to PT_CACHE_LOW
+ * when CPU is idle. Cached pages hold one reference like pooled ones
+ * and are within BOOT_MEM_SIZE, as required for page tables */
+struct PtCache {
+    size_t count;
+    struct Page *pages[PT_CACHE_SIZE];
+};
+static struct PtCache pt_cache[NCPU];
+
+#define ALLOC_LATENCY_BUCKETS 12
+#define ALLOC_LATENCY_MIN     7 /* First bucket is below 2^(7+1) TSC cycles */
+
+/* Memory subsystem counters, see dump_memory_stats() */
+static struct {
+    size_t pt_pages;       /* Page table pages in use, PML4s included */
+    uint64_t cow_faults;   /* Lazy pages resolved with a copy */
+    uint64_t demand_faults; /* Lazy pages resolved without copying */
+    uint64_t tlb_full;     /* Full TLB flushes */
+    uint64_t tlb_invlpg;   /* Pages invalidated one by one */
+    /* alloc_page() calls by log2 of TSC cycles taken */
+    uint64_t alloc_latency[ALLOC_LATENCY_BUCKETS];
+} mem_stats;
+/* 2MB ranges promoted by promote_pt() */
+static size_t thp_promotions;
 
 // TODO Test these properly via cpuid
 
@@ -45,11 +141,17 @@ static uintptr_t metaheaptop;
 static bool nx_supported = 1;
 /* 1GB pages are supported */
 static bool has_1gb_pages = 1;
+/* TLB entries are tagged with PCID (CR4_PCIDE is set) */
+static bool pcid_enabled = 0;
 
 /* Kernel executable end virtual address */
 extern char end[];
 extern char pfstacktop[], pfstack[];
 
+/* CPUID.01H:ECX Process-context identifiers */
+#define CPUID_ECX_PCID (1 << 17)
+#define CPUID_EDX_PAT  (1 << 16)
+
 /* Those are internal flags for map_page function */
 #define ALLOC_POOL 0x10000
 /* Allocate but don't remove from free lists */
@@ -64,6 +166,9 @@ extern char pfstacktop[], pfstack[];
 #define LOOKUP_ALLOC    1
 #define LOOKUP_PRESERVE 0
 
+/* Class of subtrees remembered by page_lookup_virtual() */
+#define LOOKUP_CACHE_CLASS 9
+
 #define PAGE_IS_FREE(p) (!(p)->refc && !(p)->left && !(p)->right)
 #define PAGE_IS_UNIQ(p) ((p)->refc == 1 && !(p)->left && !(p)->right)
 
@@ -71,9 +176,15 @@ extern char pfstacktop[], pfstack[];
 
 #define ABSDIFF(x, y) ((x) > (y) ? (x) - (y) : (y) - (x))
 
+/* map_region() takes interrupts after every piece of this size */
+#define MAP_PREEMPT_CHUNK (1 * GB)
+
 #define assert_physical(n) ({ if (trace_memory_more) _assert_root(__FILE__, __LINE__, n, 1); assert(((n)->state & NODE_TYPE_MASK) >= PARTIAL_NODE); })
 #define assert_virtual(n)  ({if (trace_memory_more) _assert_root(__FILE__, __LINE__, n, 0); assert(((n)->state & NODE_TYPE_MASK) < PARTIAL_NODE); })
 
+/* Descriptors used before the first pool is allocated */
+static struct Page initial_buffer[INIT_DESCR];
+
 inline static bool __attribute__((always_inline))
 list_empty(struct List *list) {
     return list->next == list;
@@ -112,6 +223,7 @@ list_del(struct List *list) {
 }
 
 static struct Page *alloc_page(int class, int flags);
+static void tlb_invalidate(struct AddressSpace *spc, uintptr_t start, uintptr_t end, size_t step);
 
 void
 ensure_free_desc(size_t count) {
@@ -125,11 +237,27 @@ ensure_free_desc(size_t count) {
     assert(!list_empty(&free_descriptors));
 }
 
+/* Pool containing descriptor or NULL for initial_buffer */
+static struct PagePool *
+desc_pool(struct Page *desc) {
+    if (desc >= initial_buffer && desc < initial_buffer + INIT_DESCR) return NULL;
+    return (struct PagePool *)ROUNDDOWN((uintptr_t)desc, CLASS_SIZE(POOL_CLASS));
+}
+
 static struct Page *
 alloc_descriptor(enum PageState state) {
     ensure_free_desc(1);
 
-    struct Page *new = (struct Page *)list_del(free_descriptors.next);
+    struct DescCache *cache = &desc_cache[cpunum()];
+    if (!cache->count) {
+        while (cache->count < DESC_CACHE_BATCH && !list_empty(&free_descriptors))
+            cache->desc[cache->count++] = (struct Page *)list_del(free_descriptors.next);
+        assert(cache->count);
+    }
+
+    struct Page *new = cache->desc[--cache->count];
+    struct PagePool *pool = desc_pool(new);
+    if (pool) pool->nfree--;
 
     memset(new, 0, sizeof *new);
     list_init((struct List *)new);
@@ -142,8 +270,94 @@ alloc_descriptor(enum PageState state) {
 static void
 free_descriptor(struct Page *page) {
     list_del((struct List *)page);
-    list_append(&free_descriptors, (struct List *)page);
+
+    struct DescCache *cache = &desc_cache[cpunum()];
+    if (cache->count == DESC_CACHE_SIZE) {
+        while (cache->count > DESC_CACHE_SIZE - DESC_CACHE_BATCH)
+            list_append(&free_descriptors, (struct List *)cache->desc[--cache->count]);
+    }
+
+    cache->desc[cache->count++] = page;
     free_desc_count++;
+
+    struct PagePool *pool = desc_pool(page);
+    if (pool) pool->nfree++;
+}
+
+static void page_unref(struct Page *page);
+
+/* Return fully free descriptor pools to the physical allocator,
+ * keeping at least one pool worth of free descriptors.
+ * Called after large unmaps, when mapping pressure drops */
+static void
+shrink_pools(void) {
+    const size_t ndesc = POOL_ENTRIES_FOR_SIZE(CLASS_SIZE(POOL_CLASS));
+
+    struct PagePool **pp = &first_pool;
+    while (*pp && free_desc_count >= 2 * ndesc) {
+        struct PagePool *pool = *pp;
+        if (pool->nfree != ndesc) {
+            pp = &pool->next;
+            continue;
+        }
+        *pp = pool->next;
+
+        /* Cached descriptors are not linked into free_descriptors */
+        for (size_t cpu = 0; cpu < NCPU; cpu++) {
+            struct DescCache *cache = &desc_cache[cpu];
+            size_t n = 0;
+            for (size_t i = 0; i < cache->count; i++)
+                if (desc_pool(cache->desc[i]) != pool) cache->desc[n++] = cache->desc[i];
+            cache->count = n;
+        }
+        for (size_t i = 0; i < ndesc; i++)
+            list_del((struct List *)&pool->data[i]);
+        free_desc_count -= ndesc;
+
+        if (trace_memory_more) cprintf("Released pool at %p\n", pool);
+        page_unref(pool->peer);
+    }
+}
+
+/* Node of physical range [pa, pa + size), -1 if it spans several */
+static int
+numa_node(physaddr_t pa, size_t size) {
+    for (size_t i = 0; i < numa_nranges; i++) {
+        struct NumaRange *range = &numa_ranges[i];
+        if (pa >= range->end || pa + size <= range->start) continue;
+        return pa >= range->start && pa + size <= range->end ? range->node : -1;
+    }
+    /* Memory not described by SRAT belongs to node 0,
+     * ranges are sorted, so check it does not reach the next one */
+    for (size_t i = 0; i < numa_nranges; i++)
+        if (pa < numa_ranges[i].start && pa + size > numa_ranges[i].start) return -1;
+    return 0;
+}
+
+static void
+free_class_add(struct Page *page) {
+    bool boot = page2pa(page) < BOOT_MEM_SIZE;
+    int node = numa_node(page2pa(page), CLASS_SIZE(page->class));
+    if (node < 0) node = 0; /* Only before init_numa() splits it */
+    struct List *lists = boot ? boot_free_classes[node] : free_classes[node];
+
+    list_append(&lists[page->class], (struct List *)page);
+    *(boot ? &boot_free_class_mask[node] : &free_class_mask[node]) |= 1ULL << page->class;
+}
+
+/* Smallest class >= class with non-empty free list or MAX_CLASS */
+static int
+free_class_next(struct List *lists, uint64_t *mask, int class) {
+    uint64_t candidates = *mask & ~((1ULL << class) - 1);
+
+    while (candidates) {
+        int pclass = __builtin_ctzll(candidates);
+        if (!list_empty(&lists[pclass])) return pclass;
+        *mask &= ~(1ULL << pclass);
+        candidates &= candidates - 1;
+    }
+
+    return MAX_CLASS;
 }
 
 static void
@@ -153,11 +367,23 @@ _assert_root(const char *file, int line, struct Page *p, bool phy) {
         _panic(file, line, "Page %p (phy %p) should%s be physical\n", p, (void *)PADDR(p), phy ? "" : "n't");
 }
 
+/* Trees are at most MAX_CLASS levels deep, so walks below keep
+ * pending right children on a small explicit stack
+ * instead of recursing on the kernel stack */
+#define TREE_STACK_SIZE (MAX_CLASS + 2)
+
 static void
 free_desc_rec(struct Page *p) {
-    while (p) {
+    struct Page *stack[TREE_STACK_SIZE];
+    size_t top = 0;
+
+    while (p || top) {
+        if (!p) p = stack[--top];
         assert(!p->refc);
-        free_desc_rec(p->right);
+        if (p->right) {
+            assert(top < TREE_STACK_SIZE);
+            stack[top++] = p->right;
+        }
         struct Page *tmp = p->left;
         free_descriptor(p);
         p = tmp;
@@ -229,12 +455,14 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
     assert(!(addr & CLASS_MASK(class)));
     assert(node);
 
+    /* Reserve descriptors for the whole descent at once */
+    if (alloc && node->class > class) ensure_free_desc((node->class - class + 1) * 2);
+
     while (node && node->class > class) {
         assert(class >= 0);
         bool right = addr & CLASS_SIZE(node->class - 1);
 
         if (alloc) {
-            ensure_free_desc((node->class - class + 1) * 2);
             bool was_free = node->state == ALLOCATABLE_NODE && PAGE_IS_FREE(node);
             if (!node->left) alloc_child(node, 0);
             if (!node->right) alloc_child(node, 1);
@@ -244,7 +472,7 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
                 struct Page *other = !right ? node->right : node->left;
                 assert(other->state == ALLOCATABLE_NODE);
                 list_del((struct List *)node);
-                list_append(&free_classes[node->class - 1], (struct List *)other);
+                free_class_add(other);
             }
 
             if (type != PARTIAL_NODE && node->state != type)
@@ -269,7 +497,7 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
 
         /* We cannot change RESERVED_NODE memory to ALLOCATABLE_NODE */
         if (type != PARTIAL_NODE && node->state != RESERVED_NODE) node->state = type;
-        if (node->state == ALLOCATABLE_NODE) list_append(&free_classes[node->class], (struct List *)node);
+        if (node->state == ALLOCATABLE_NODE) free_class_add(node);
 
         if (trace_memory) cprintf("Attaching page (%x) at %p class=%d\n", node->state, (void *)page2pa(node), (int)node->class);
     }
@@ -281,13 +509,20 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
 
 static void
 page_ref(struct Page *node) {
-    if (!node) return;
+    struct Page *stack[TREE_STACK_SIZE];
+    size_t top = 0;
 
     /* If parent is allocated
      * all of its children are allocated too,
      * so need to reference them recursively
-     * when refc transitions from 0 to 1 */
-    if (!node->refc++) {
+     * when refc transitions from 0 to 1.
+     * Only subtrees of such nodes are visited */
+    while (node || top) {
+        if (!node) node = stack[--top];
+        if (node->refc++) {
+            node = NULL;
+            continue;
+        }
         // Если узел ещё не удален, но ссылок нет, то прежде чем увеличивать его счетчик, пересоздадим его.
         // Рекурсивно увеличим счетчики детям. Для этого у нас в list_init для parent с
         //   количеством ссылок 0 для детей количество ссылок 0. Правда, зачем их
@@ -295,36 +530,77 @@ page_ref(struct Page *node) {
         //   при удалении их не удаляем?
         list_del((struct List *)node);
         list_init((struct List *)node);
-        page_ref(node->left);
-        page_ref(node->right);
+        if (node->right) {
+            assert(top < TREE_STACK_SIZE);
+            stack[top++] = node->right;
+        }
+        node = node->left;
     }
 }
 
+static void page_unref_one(struct Page *page);
+
 static void
 page_unref(struct Page *page) {
-    if (!page) return;
-    assert_physical(page);
-    assert(page->refc);
+    /* Post-order walk: node is released only after its children,
+     * children_done marks nodes whose children are already pushed */
+    struct {
+        struct Page *page;
+        bool children_done;
+    } stack[2 * TREE_STACK_SIZE];
+    size_t top = 0;
 
-    /* NOTE Decrementing refc after
-     * this if statement is important
-     * to prevent double frees */
+    if (!page) return;
+    stack[top].page = page;
+    stack[top++].children_done = 0;
+
+    while (top) {
+        page = stack[top - 1].page;
+        assert_physical(page);
+        assert(page->refc);
+
+        /* NOTE Decrementing refc after
+         * children are released is important
+         * to prevent double frees */
+        if (page->refc == 1 && !stack[top - 1].children_done) {
+            stack[top - 1].children_done = 1;
+            struct Page *children[] = {page->right, page->left};
+            for (size_t i = 0; i < 2; i++) {
+                if (!children[i]) continue;
+                assert(top < 2 * TREE_STACK_SIZE);
+                stack[top].page = children[i];
+                stack[top++].children_done = 0;
+            }
+            continue;
+        }
 
-    if (page->refc == 1) {
-        page_unref(page->left);
-        page_unref(page->right);
+        top--;
+        page_unref_one(page);
     }
+}
 
+static void
+page_unref_one(struct Page *page) {
     page->refc--;
 
-    /* Try to merge free page with adjacent */
+    /* Try to merge free page with adjacent.
+     * Parent that became PARTIAL_NODE when part of it was
+     * retyped is merged too once both halves are free and
+     * of the same type again, so free blocks coalesce back
+     * into larger classes instead of staying split forever */
     if (PAGE_IS_FREE(page)) {
         while (page != &root) {
             struct Page *par = page->parent;
             assert_physical(par);
-            if (par->state == page->state &&
+            if ((par->state == page->state || par->state == PARTIAL_NODE) &&
+                (numa_nnodes == 1 || numa_node(page2pa(par), CLASS_SIZE(par->class)) >= 0) &&
                 PAGE_IS_FREE(par->left) &&
-                PAGE_IS_FREE(par->right)) {
+                PAGE_IS_FREE(par->right) &&
+                par->left->state == page->state &&
+                par->right->state == page->state &&
+                page->state != PARTIAL_NODE) {
+                par->state = page->state;
+
                 free_descriptor(par->left);
                 par->left = NULL;
 
@@ -333,7 +609,7 @@ page_unref(struct Page *page) {
 
                 if (par->state == ALLOCATABLE_NODE) {
                     assert(list_empty((struct List *)par));
-                    list_append(&free_classes[par->class], (struct List *)par);
+                    free_class_add(par);
                 }
                 page = par;
             } else
@@ -341,7 +617,7 @@ page_unref(struct Page *page) {
         }
         list_del((struct List *)page);
         if (page->state == ALLOCATABLE_NODE)
-            list_append(&free_classes[page->class], (struct List *)page);
+            free_class_add(page);
 
 #if SANITIZE_SHADOW_BASE
         if (current_space) {
@@ -389,14 +665,17 @@ check_virtual_class(struct Page *node, int class) {
     assert(class == MAX_CLASS);
 }
 
-/* Lookup virtual address space mapping node with given address and class */
+/* Lookup virtual address space mapping node with given address and class
+ * starting from node of class nclass. Node of LOOKUP_CACHE_CLASS
+ * passed on the way is stored to *subtree */
 static struct Page *
-page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
+do_page_lookup_virtual(struct Page *node, int nclass, uintptr_t addr, int class, int alloc, struct Page **subtree) {
     assert(class >= 0);
     assert_virtual(node);
 
+    /* Reserve descriptors for the whole descent at once */
+    if (alloc) ensure_free_desc((nclass - class + 1) * 2);
 
-    int nclass = MAX_CLASS;
     // Идём по дереву, спускаемся. При каждом спуске класс уменьшается
     //   на единицу.
     while (nclass > class) {
@@ -415,7 +694,6 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
         if (!*next) {
             if (!alloc) break;
             if (!node->phy && alloc == LOOKUP_SPLIT) break;
-            ensure_free_desc((nclass - class + 1) * 2);
 
             assert(nclass);
             if (node->phy) {
@@ -445,6 +723,7 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
         }
         node = *next;
         nclass--;
+        if (nclass == LOOKUP_CACHE_CLASS && subtree) *subtree = node;
     }
 
     if (node && (alloc == LOOKUP_ALLOC || (alloc == LOOKUP_SPLIT && node->phy)) && trace_memory_more) {
@@ -454,6 +733,27 @@ page_lookup_virtual(struct Page *node, uintptr_t addr, int class, int alloc) {
     return node;
 }
 
+/* Lookup virtual address space mapping node with given address and class.
+ * Neighbouring lookups usually hit the same subtree, so the last
+ * visited node of LOOKUP_CACHE_CLASS is remembered in the address space
+ * and the descent starts from it when the address falls inside.
+ * unmap_page() drops remembered node when it removes its range */
+static struct Page *
+page_lookup_virtual(struct AddressSpace *spc, uintptr_t addr, int class, int alloc) {
+    uintptr_t base = ROUNDDOWN(addr, CLASS_SIZE(LOOKUP_CACHE_CLASS));
+
+    if (class <= LOOKUP_CACHE_CLASS && spc->lookup_node && spc->lookup_addr == base)
+        return do_page_lookup_virtual(spc->lookup_node, LOOKUP_CACHE_CLASS, addr, class, alloc, NULL);
+
+    struct Page *subtree = NULL;
+    struct Page *res = do_page_lookup_virtual(spc->root, MAX_CLASS, addr, class, alloc, &subtree);
+    if (subtree) {
+        spc->lookup_node = subtree;
+        spc->lookup_addr = base;
+    }
+    return res;
+}
+
 static void
 attach_region(uintptr_t start, uintptr_t end, enum PageState type) {
     if (trace_memory_more) cprintf("Attaching memory region [%08lX, %08lX] with type %d\n", start, end - 1, type);
@@ -508,20 +808,106 @@ unmap_page_remove(struct Page *node) {
     free_descriptor(node);
 }
 
+/* Free page table page, which has all its entries cleared */
+static void
+free_pt(pte_t *pt) {
+    struct Page *page = page_lookup(NULL, (uintptr_t)PADDR(pt), 0, PARTIAL_NODE, 0);
+    struct PtCache *cache = &pt_cache[cpunum()];
+
+    mem_stats.pt_pages--;
+    if (page->refc == 1 && cache->count < PT_CACHE_SIZE) {
+        cache->pages[cache->count++] = page;
+        return;
+    }
+    page_unref(page);
+}
+
+/* Page table walkers are specialized for every level, so entry sizes,
+ * shifts and masks are constants in each of them. remove_pt() and
+ * alloc_fill_pt() only dispatch to them by step (which is a constant
+ * at every call site) and are inlined away */
+
+/* Clear present leaf entries [i0, i1) of a table with entry size step,
+ * va is the address of entry i0. Runs of present entries are
+ * invalidated as one range */
+static inline __attribute__((always_inline)) void
+clear_leaves(struct AddressSpace *spc, pte_t *table, uintptr_t va, size_t step, size_t i0, size_t i1) {
+    uintptr_t run = va;
+    for (size_t i = i0; i < i1; i++, va += step) {
+        if (!(table[i] & PTE_P)) {
+            if (run != va) tlb_invalidate(spc, run, va, step);
+            run = va + step;
+            continue;
+        }
+        table[i] = 0;
+    }
+    if (run != va) tlb_invalidate(spc, run, va, step);
+}
+
+static void
+clear_pt(struct AddressSpace *spc, pte_t *pt, uintptr_t va, size_t i0, size_t i1) {
+    clear_leaves(spc, pt, va, 4 * KB, i0, i1);
+}
+
+static void
+clear_pd(struct AddressSpace *spc, pde_t *pd, uintptr_t va, size_t i0, size_t i1) {
+    for (size_t i = i0; i < i1; i++, va += 2 * MB) {
+        if (!(pd[i] & PTE_P)) continue;
+
+        if (pd[i] & PTE_PS) {
+            tlb_invalidate(spc, va, va + 2 * MB, 2 * MB);
+        } else {
+            pte_t *pt = KADDR(PTE_ADDR(pd[i]));
+            clear_pt(spc, pt, va, 0, PT_ENTRY_COUNT);
+            /* Entries that are not present are always zero,
+             * so pt is clean now */
+            free_pt(pt);
+        }
+        pd[i] = 0;
+    }
+}
+
 static void
-remove_pt(pte_t *pt, pte_t base, size_t step, uintptr_t i0, uintptr_t i1) {
-    assert(step == 1 * GB || step == 2 * MB || step == 4 * KB || step == 512 * GB);
-    for (size_t i = i0; i < i1; i++) {
-        if (!(pt[i] & PTE_P)) continue;
-        assert(!(pt[i] & PTE_PS) || (step == 1 * GB || step == 2 * MB));
-
-        if (!(pt[i] & PTE_PS) && step > 4 * KB) {
-            pte_t *pt2 = KADDR(PTE_ADDR(pt[i]));
-            remove_pt(pt2, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
-            page_unref(page_lookup(NULL, (uintptr_t)PADDR(pt2), 0, PARTIAL_NODE, 0));
+clear_pdp(struct AddressSpace *spc, pdpe_t *pdp, uintptr_t va, size_t i0, size_t i1) {
+    for (size_t i = i0; i < i1; i++, va += 1 * GB) {
+        if (!(pdp[i] & PTE_P)) continue;
+
+        if (pdp[i] & PTE_PS) {
+            tlb_invalidate(spc, va, va + 1 * GB, 1 * GB);
+        } else {
+            pde_t *pd = KADDR(PTE_ADDR(pdp[i]));
+            clear_pd(spc, pd, va, 0, PD_ENTRY_COUNT);
+            free_pt(pd);
         }
+        pdp[i] = 0;
+    }
+}
+
+static void
+clear_pml4(struct AddressSpace *spc, pml4e_t *pml4, uintptr_t va, size_t i0, size_t i1) {
+    for (size_t i = i0; i < i1; i++, va += 512 * GB) {
+        if (!(pml4[i] & PTE_P)) continue;
+        assert(!(pml4[i] & PTE_PS));
+
+        pdpe_t *pdp = KADDR(PTE_ADDR(pml4[i]));
+        clear_pdp(spc, pdp, va, 0, PDP_ENTRY_COUNT);
+        /* Kernel pdps are shared by all spaces and are never freed */
+        if (i >= NUSERPML4) continue;
+        free_pt(pdp);
+        pml4[i] = 0;
+    }
+}
 
-        pt[i] = 0;
+/* Remove entries [i0, i1) of table pt with entry size step
+ * together with the tables below them, base is the address of entry i0 */
+static inline __attribute__((always_inline)) void
+remove_pt(struct AddressSpace *spc, pte_t *pt, uintptr_t base, size_t step, uintptr_t i0, uintptr_t i1) {
+    switch (step) {
+    case 512 * GB: clear_pml4(spc, pt, base, i0, i1); break;
+    case 1 * GB: clear_pdp(spc, pt, base, i0, i1); break;
+    case 2 * MB: clear_pd(spc, pt, base, i0, i1); break;
+    case 4 * KB: clear_pt(spc, pt, base, i0, i1); break;
+    default: panic("Bad page table step %zx", step);
     }
 }
 
@@ -589,8 +975,9 @@ check_physical_tree(struct Page *page) {
     if (!page->refc) {
         assert(page->head.next && page->head.prev);
         if (!list_empty((struct List *)page)) {
+            int node = MAX(numa_node(page2pa(page), CLASS_SIZE(page->class)), 0);
             for (struct List *n = page->head.next;
-                 n != &free_classes[page->class]; n = n->next) {
+                 n != &free_classes[node][page->class] && n != &boot_free_classes[node][page->class]; n = n->next) {
                 assert(n != &page->head);
             }
         }
@@ -716,22 +1103,28 @@ dump_memory_lists(void) {
     static const int SKIP = 10;
 
     for (int class = 0; class < MAX_CLASS; ++class) {
-        struct List *list = &free_classes[class];
-
+        /* Every class is a separate snapshot, timer
+         * ticks are taken in between */
+        preempt_point();
+        spin_lock(&page_lock);
         cprintf("Class[%d] size(%0llx) {", class, CLASS_SIZE(class));
 
         int i = 0;
-        for (struct List *cur_node = list->next; cur_node != list; cur_node = cur_node->next, ++i) {
-            if (i % SKIP == 0) {
-                cprintf("\n    ");
-            }
+        for (size_t j = 0; j < 2 * numa_nnodes; j++) {
+            struct List *list = j & 1 ? &free_classes[j / 2][class] : &boot_free_classes[j / 2][class];
+            for (struct List *cur_node = list->next; cur_node != list; cur_node = cur_node->next, ++i) {
+                if (i % SKIP == 0) {
+                    cprintf("\n    ");
+                }
 
-            struct Page *page = (struct Page*) cur_node;
+                struct Page *page = (struct Page*) cur_node;
 
-            cprintf("0x%08zx ", (uintptr_t) page->addr << CLASS_BASE);
+                cprintf("0x%08zx ", (uintptr_t) page->addr << CLASS_BASE);
+            }
         }
 
         cprintf("\n}\n");
+        spin_unlock(&page_lock);
 
         if (i == 0) {
             break;
@@ -739,6 +1132,58 @@ dump_memory_lists(void) {
     }
 }
 
+/* Compact summary of memory subsystem state and counters */
+void
+dump_memory_stats(void) {
+    spin_lock(&page_lock);
+
+    cprintf("Free memory by class:");
+    uint64_t total = 0, node_free[NUMA_MAX_NODES] = {0};
+    for (int class = 0; class < MAX_CLASS; class++) {
+        size_t count = 0;
+        for (size_t node = 0; node < numa_nnodes; node++) {
+            size_t n = 0;
+            struct List *lists[] = {&boot_free_classes[node][class], &free_classes[node][class]};
+            for (size_t j = 0; j < sizeof(lists) / sizeof(*lists); j++)
+                for (struct List *li = lists[j]->next; li != lists[j]; li = li->next) n++;
+            node_free[node] += n * CLASS_SIZE(class);
+            count += n;
+        }
+        if (count) cprintf(" %d:%zu", class, count);
+        total += count * CLASS_SIZE(class);
+    }
+    cprintf("\nFree: %lu KB", (unsigned long)(total / KB));
+    if (numa_nnodes > 1)
+        for (size_t node = 0; node < numa_nnodes; node++)
+            cprintf(", node %zu: %lu KB", node, (unsigned long)(node_free[node] / KB));
+    cprintf("\n");
+
+    size_t npools = 0, ndesc = INIT_DESCR;
+    for (struct PagePool *pool = first_pool; pool; pool = pool->next, npools++)
+        ndesc += POOL_ENTRIES_FOR_SIZE(CLASS_SIZE(pool->peer->class));
+    cprintf("Descriptors: %zu used, %zu free, %zu pools\n", ndesc - free_desc_count, free_desc_count, npools);
+
+    cprintf("Page tables: %zu pages, %zu/%d cached\n", mem_stats.pt_pages, pt_cache[cpunum()].count, PT_CACHE_SIZE);
+    for (size_t i = 0; i < NZERO_POOLS; i++)
+        cprintf("Zeroed pool class %d: %zu/%zu pages\n", zero_pools[i].class, zero_pools[i].count, zero_pools[i].cap);
+    cprintf("Faults: %lu COW, %lu demand, %lu avoided in kspace (window %u/%u), %lu THP promotions\n",
+            (unsigned long)mem_stats.cow_faults, (unsigned long)mem_stats.demand_faults,
+            (unsigned long)kspace.faults_avoided, kspace.fault_window, kspace.fault_around,
+            (unsigned long)thp_promotions);
+    cprintf("TLB: %lu full flushes, %lu invlpg\n", (unsigned long)mem_stats.tlb_full, (unsigned long)mem_stats.tlb_invlpg);
+
+    cprintf("alloc_page latency (TSC cycles):");
+    for (size_t i = 0; i < ALLOC_LATENCY_BUCKETS; i++) {
+        if (!mem_stats.alloc_latency[i]) continue;
+        cprintf(" %s%lu:%lu", i == ALLOC_LATENCY_BUCKETS - 1 ? ">=" : "<",
+                1UL << (ALLOC_LATENCY_MIN + i + (i != ALLOC_LATENCY_BUCKETS - 1)),
+                (unsigned long)mem_stats.alloc_latency[i]);
+    }
+    cprintf("\n");
+
+    spin_unlock(&page_lock);
+}
+
 
 static const unsigned int PAGE_LEVEL_PML4 = 0;
 static const unsigned int PAGE_LEVEL_PDP  = 1;
@@ -830,10 +1275,21 @@ inline static int
 alloc_pt(pte_t *dst) {
     // Page is not present or page size it's a "big page" (page size == 1).
     if ((*dst & PTE_P) == 0 || (*dst & PTE_PS) != 0) {
+        /* Cached pages are referenced and zeroed already */
+        struct PtCache *cache = &pt_cache[cpunum()];
+        mem_stats.pt_pages++;
+        if (cache->count) {
+            *dst = page2pa(cache->pages[--cache->count]) | PTE_U | PTE_W | PTE_P;
+            return 0;
+        }
+
         // Then we allocate a physical memory page.
         struct Page *page = alloc_page(0, ALLOC_BOOTMEM);
         assert_physical(page); // Assert the comment above;
-        if (!page) return -E_NO_MEM;
+        if (!page) {
+            mem_stats.pt_pages--;
+            return -E_NO_MEM;
+        }
 #ifdef SANITIZE_SHADOW_BASE
         assert(page2pa(page) + CLASS_SIZE(page->class) <= BOOT_MEM_SIZE);
 #endif
@@ -857,113 +1313,268 @@ alloc_pt(pte_t *dst) {
     return 0;
 }
 
-static void
-propagate_one_pml4(struct AddressSpace *dst, struct AddressSpace *src) {
-    /* Reference level 3 page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (src->pml4[i] & PTE_P && i != PML4_INDEX(UVPT))
-            page_ref(page_lookup(NULL, PTE_ADDR(src->pml4[i]), 0, PARTIAL_NODE, 0));
-    }
+/* Write leaf entries [i0, i1) of a table with entry size step
+ * mapping contiguous physical memory starting at base, in one pass */
+static inline __attribute__((always_inline)) void
+fill_leaves(pte_t *table, pte_t base, size_t step, size_t i0, size_t i1) {
+    assert(!(PTE_ADDR(base) & (step - 1)));
+    if (trace_memory_more) dump_entry(base, step, i1 - i0);
 
-    /* Dereference old level 3 page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (dst->pml4[i] & PTE_P && i != PML4_INDEX(UVPT))
-            page_ref(page_lookup(NULL, PTE_ADDR(dst->pml4[i]), 0, PARTIAL_NODE, 0));
-    }
+    for (size_t i = i0; i < i1; i++, base += step)
+        table[i] = base;
+}
 
-    pte_t uvpt = dst->pml4[PML4_INDEX(UVPT)];
-    memcpy(dst->pml4 + NUSERPML4, src->pml4 + NUSERPML4,
-           PAGE_SIZE - NUSERPML4 * sizeof(pml4e_t));
-    dst->pml4[PML4_INDEX(UVPT)] = uvpt;
+static int
+fill_pt(pte_t *pt, pte_t base, size_t i0, size_t i1) {
+    fill_leaves(pt, base, 4 * KB, i0, i1);
+    return 0;
 }
 
-static void
-propagate_pml4(struct AddressSpace *spc) {
-    if (!current_space) return;
+static int
+fill_pd(pde_t *pd, pte_t base, size_t i0, size_t i1) {
+    fill_leaves(pd, base | PTE_PS, 2 * MB, i0, i1);
+    return 0;
+}
+
+static int
+fill_pdp(pdpe_t *pdp, pte_t base, size_t i0, size_t i1) {
+    if (has_1gb_pages) {
+        fill_leaves(pdp, base | PTE_PS, 1 * GB, i0, i1);
+        return 0;
+    }
 
-    if (spc != &kspace) propagate_one_pml4(&kspace, spc);
-    for (size_t i = 0; i < NENV; i++) {
-        if (envs[i].env_status != ENV_FREE && &envs[i].address_space != spc)
-            propagate_one_pml4(&envs[i].address_space, spc);
+    if (trace_memory_more) dump_entry(base, 1 * GB, i1 - i0);
+    for (size_t i = i0; i < i1; i++, base += 1 * GB) {
+        int res = alloc_pt(pdp + i);
+        if (res < 0) return res;
+        res = fill_pd(KADDR(PTE_ADDR(pdp[i])), base, 0, PD_ENTRY_COUNT);
+        if (res < 0) return res;
     }
+    return 0;
 }
 
-inline static int
+static int
+fill_pml4(pml4e_t *pml4, pte_t base, size_t i0, size_t i1) {
+    if (trace_memory_more) dump_entry(base, 512 * GB, i1 - i0);
+    for (size_t i = i0; i < i1; i++, base += 512 * GB) {
+        int res = alloc_pt(pml4 + i);
+        if (res < 0) return res;
+        res = fill_pdp(KADDR(PTE_ADDR(pml4[i])), base, 0, PDP_ENTRY_COUNT);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+/* Map entries [i0, i1) of table dst with entry size step to contiguous
+ * physical memory starting at base, allocating tables below if needed */
+static inline __attribute__((always_inline)) int
 alloc_fill_pt(pte_t *dst, pte_t base, size_t step, size_t i0, size_t i1) {
     assert(i0 != i1);
-    bool need_recur = step > 1 * GB || (step == 1 * GB && !has_1gb_pages);
-    if (!need_recur && step != 4 * KB) {
-        base |= PTE_PS;
+    switch (step) {
+    case 512 * GB: return fill_pml4(dst, base, i0, i1);
+    case 1 * GB: return fill_pdp(dst, base, i0, i1);
+    case 2 * MB: return fill_pd(dst, base, i0, i1);
+    case 4 * KB: return fill_pt(dst, base, i0, i1);
+    default: panic("Bad page table step %zx", step);
     }
+}
 
-    if (trace_memory_more) dump_entry(base, step, i1 - i0);
+/* Copy size bytes of physical memory at pa to the memory
+ * mapped at [va, va + size) in dst.
+ *
+ * Both sides are accessed through the linear physical memory
+ * mapping at KERN_BASE_ADDR (via KADDR), so there is no need to
+ * switch to dst (and flush TLB) or to disable write protection
+ * for read-only destinations. Destination may consist of several
+ * physical pages, each of them is copied in one go */
+static void
+memcpy_pages(struct AddressSpace *dst, uintptr_t va, physaddr_t pa, size_t size) {
+    assert(dst != NULL);
 
-    for (size_t i = i0; i < i1; i++, base += step) {
-        if (need_recur) {
-            int res = alloc_pt(dst + i);
-            if (res < 0) return res;
-            res = alloc_fill_pt(dst + i, base, step / PT_ENTRY_COUNT, 0, PT_ENTRY_COUNT);
-            if (res < 0) return res;
-        } else {
-            if ((PTE_ADDR(base) & (step - 1))) cprintf("%08lX %08lX\n", (long)PTE_ADDR(base), step);
-            assert(!(PTE_ADDR(base) & (step - 1)));
-            dst[i] = base;
-        }
-    }
+    for (uintptr_t end = va + size; va < end;) {
+        struct Page *node = page_lookup_virtual(dst, va, 0, LOOKUP_PRESERVE);
+        assert(node && node->phy && !(node->state & PROT_LAZY));
 
+        size_t offset = va & CLASS_MASK(node->phy->class);
+        size_t chunk = MIN(CLASS_SIZE(node->phy->class) - offset, end - va);
+        nosan_memcpy(KADDR(page2pa(node->phy) + offset), KADDR(pa), chunk);
 
-    return 0;
+        va += chunk;
+        pa += chunk;
+    }
 }
 
-/* Copy physical page contents to some virtual address
- *
- * To copy physical address you can use linear
- * physical memeory mapping to KERN_BASE_ADDR
- * (via KADDR).
- *
- * You need temporaly switch to dst address space and
- * restore previous address space afterwards.
- *
- * Don't forget to disable write protection, since
- * destination page might be read-only
- *
- * TIP: switch_address_space, nosan_memcpy, and set_wp are used here
- */
+/* Copy physical page contents to some virtual address */
 static void
 memcpy_page(struct AddressSpace *dst, uintptr_t va, struct Page *page) {
-    assert(current_space != NULL);
-    assert(dst != NULL);
     assert_physical(page);
+    memcpy_pages(dst, va, page2pa(page), CLASS_SIZE(page->class));
+}
 
-    // LAB 7: Your code here
-    // Let's switch address space first.
-    struct AddressSpace* prev_space = switch_address_space(dst);
+/* PCID allocation.
+ *
+ * kspace always uses PCID 0, other spaces get one lazily on switch.
+ * A PCID keeps its TLB entries across switches, so they have to be
+ * flushed whenever the PCID changes hands: CR3 is loaded without the
+ * no-flush bit the first time a space runs with a newly assigned PCID.
+ * Dropping PCIDs of all spaces (pcid_flush_all()) is done by bumping
+ * pcid_generation, every space then gets a fresh PCID on next switch. */
+#define NPCID (CR3_PCID_MASK + 1)
+static struct AddressSpace *pcid_owner[NPCID];
+static uint16_t pcid_next = 1;
+static uint32_t pcid_generation = 1;
+/* Some space other than kspace got a PCID since the last pcid_flush_all() */
+static bool pcid_assigned;
+
+/* Forget PCID of spc, its TLB entries will be flushed
+ * when the PCID is given to some space next time */
+static void
+pcid_release(struct AddressSpace *spc) {
+    if (spc->pcid && spc->pcid_gen == pcid_generation && pcid_owner[spc->pcid] == spc)
+        pcid_owner[spc->pcid] = NULL;
+    spc->pcid = 0;
+}
 
-    // Better to restore write protection back, but it's a TODO.
-    // Disable write protection for the time being.
-    set_wp(false);
+/* Invalidate TLB entries of every PCID */
+static void
+pcid_flush_all(void) {
+    if (!pcid_enabled) return;
+    pcid_generation++;
+    memset(pcid_owner, 0, sizeof pcid_owner);
+    pcid_next = 1;
+    pcid_assigned = 0;
+    /* Non-current PCIDs are dropped lazily, flush the loaded one now */
+    lcr3(rcr3() & ~CR3_NOFLUSH);
+}
+
+/* CR3 value to load spc with, assigns PCID if needed */
+static uint64_t
+pcid_cr3(struct AddressSpace *spc) {
+    if (spc == &kspace) return spc->cr3;
+
+    if (spc->pcid && spc->pcid_gen == pcid_generation && pcid_owner[spc->pcid] == spc)
+        return spc->cr3 | spc->pcid | CR3_NOFLUSH;
 
-    // Copy through kernel high addresses.
-    nosan_memcpy((void*) va, KADDR(page2pa(page)), CLASS_SIZE(page->class));
+    /* Take the next PCID round-robin evicting its owner */
+    uint16_t pcid = pcid_next;
+    pcid_next = pcid_next + 1 < NPCID ? pcid_next + 1 : 1;
+    if (pcid_owner[pcid]) pcid_owner[pcid]->pcid = 0;
 
-    switch_address_space(prev_space);
+    pcid_owner[pcid] = spc;
+    pcid_assigned = 1;
+    spc->pcid = pcid;
+    spc->pcid_gen = pcid_generation;
+
+    /* Loading without CR3_NOFLUSH drops entries left by the previous owner */
+    return spc->cr3 | pcid;
 }
 
+/* TLB invalidation batching.
+ *
+ * Page table updates record the hardware pages they removed with
+ * tlb_invalidate(). Between tlb_batch_begin() and tlb_batch_end()
+ * the ranges are only collected, and the end of the outermost batch
+ * does one flush choosing between invlpg per hardware page and
+ * a full TLB reload, whichever is cheaper.
+ * This is protected by page_lock (and will be the unit of work
+ * for cross-CPU shootdowns) */
+#define TLB_BATCH_RANGES 16
+/* invlpg count after which reloading CR3 is cheaper */
+#define TLB_FLUSH_ALL_THRESHOLD 64
+
+struct TlbRange {
+    uintptr_t start, end;
+    size_t step; /* Hardware page size within the range */
+};
+
+static struct {
+    int depth;
+    struct AddressSpace *spc;
+    size_t nranges;
+    size_t npages;  /* invlpg needed to flush recorded ranges */
+    bool flush_all; /* Too many ranges, reload CR3 */
+    struct TlbRange ranges[TLB_BATCH_RANGES];
+} tlb_batch;
+
 static void
-tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
+tlb_flush(struct AddressSpace *spc, struct TlbRange *ranges, size_t nranges, bool flush_all) {
+    /* With PCIDs entries of inactive spaces survive in TLB too.
+     * Kernel part is cached under every PCID */
+    if (pcid_enabled && pcid_assigned && spc == &kspace && current_space) {
+        pcid_flush_all();
+        mem_stats.tlb_full++;
+        return;
+    }
+    if (pcid_enabled && spc != current_space && current_space) {
+        pcid_release(spc);
+        return;
+    }
+
     if (current_space == spc || !current_space) {
         /* If we need to invalidate a lot of memory, just flush whole cache */
-        if (start - end > 512 * GB)
-            lcr3(rcr3());
-        else {
-            while (start < end) {
-                invlpg((void *)start);
-                start += PAGE_SIZE;
+        if (flush_all) {
+            lcr3(rcr3() & ~CR3_NOFLUSH);
+            mem_stats.tlb_full++;
+            return;
+        }
+        for (size_t i = 0; i < nranges; i++) {
+            for (uintptr_t va = ranges[i].start; va < ranges[i].end; va += ranges[i].step) {
+                invlpg((void *)va);
+                mem_stats.tlb_invlpg++;
             }
         }
     }
 }
 
+static void
+tlb_batch_flush(void) {
+    if (tlb_batch.spc && (tlb_batch.nranges || tlb_batch.flush_all))
+        tlb_flush(tlb_batch.spc, tlb_batch.ranges, tlb_batch.nranges,
+                  tlb_batch.flush_all || tlb_batch.npages > TLB_FLUSH_ALL_THRESHOLD);
+    tlb_batch.spc = NULL;
+    tlb_batch.nranges = tlb_batch.npages = 0;
+    tlb_batch.flush_all = 0;
+}
+
+static void
+tlb_batch_begin(void) {
+    tlb_batch.depth++;
+}
+
+static void
+tlb_batch_end(void) {
+    assert(tlb_batch.depth > 0);
+    if (!--tlb_batch.depth) tlb_batch_flush();
+}
+
+/* Invalidate [start, end) of spc mapped with hardware pages of size step */
+static void
+tlb_invalidate(struct AddressSpace *spc, uintptr_t start, uintptr_t end, size_t step) {
+    size_t npages = (end - start) / step;
+    if (!tlb_batch.depth) {
+        struct TlbRange range = {start, end, step};
+        tlb_flush(spc, &range, 1, npages > TLB_FLUSH_ALL_THRESHOLD);
+        return;
+    }
+
+    if (tlb_batch.spc != spc) {
+        tlb_batch_flush();
+        tlb_batch.spc = spc;
+    }
+    tlb_batch.npages += npages;
+    if (tlb_batch.flush_all) return;
+
+    /* Adjacent pages of the same size are merged */
+    struct TlbRange *last = tlb_batch.nranges ? &tlb_batch.ranges[tlb_batch.nranges - 1] : NULL;
+    if (last && last->end == start && last->step == step) {
+        last->end = end;
+    } else if (tlb_batch.nranges < TLB_BATCH_RANGES) {
+        tlb_batch.ranges[tlb_batch.nranges++] = (struct TlbRange){start, end, step};
+    } else {
+        tlb_batch.flush_all = 1;
+    }
+}
+
 // Убирает отображение (из дерева страниц ядра и аппаратных таблиц страниц)
 //   виртуальной страницы по адресу в адресном пространстве, переданном в
 //   качестве аргумента. Нужен ещё и класс страницы (размер условно,
@@ -978,22 +1589,24 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     assert((addr & CLASS_MASK(class)) == 0);
 
     // Ищем страницу по адресному пространству, виртуальному адресу и классу.
-    struct Page *node = page_lookup_virtual(spc->root, addr, class, LOOKUP_ALLOC);
+    struct Page *node = page_lookup_virtual(spc, addr, class, LOOKUP_ALLOC);
 
 
     if (node) unmap_page_remove(node);
+    /* Remembered subtree is freed only if it is removed as a whole */
+    if (class >= LOOKUP_CACHE_CLASS && spc->lookup_node &&
+        spc->lookup_addr >= addr && spc->lookup_addr < addr + CLASS_SIZE(class))
+        spc->lookup_node = NULL;
     /* Disallow root node deallocation */
     if (node == spc->root) {
         spc->root = alloc_descriptor(INTERMEDIATE_NODE);
     }
 
     uintptr_t end = addr + CLASS_SIZE(class);
-    uintptr_t inval_start = addr, inval_end = end;
 
     size_t pml4i0 = PML4_INDEX(addr), pml4i1 = PML4_INDEX(end);
     if (class >= 27) {
-        remove_pt(spc->pml4, addr, 512 * GB, pml4i0, pml4i1);
-        if (pml4i1 - 1 >= NUSERPML4) propagate_pml4(spc);
+        remove_pt(spc, spc->pml4, addr, 512 * GB, pml4i0, pml4i1);
         goto finish;
     }
 
@@ -1014,7 +1627,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
      * is >= than 1*GB */
 
     if (class >= 18) {
-        remove_pt(pdp, addr, 1 * GB, pdpi0, pdpi1);
+        remove_pt(spc, pdp, addr, 1 * GB, pdpi0, pdpi1);
         goto finish;
     }
 
@@ -1030,8 +1643,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
         assert(!res);
         pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
         res = alloc_fill_pt(pd, old & ~PTE_PS, 2 * MB, 0, PT_ENTRY_COUNT);
-        inval_start = ROUNDDOWN(inval_start, 1 * GB);
-        inval_end = ROUNDUP(inval_end, 1 * GB);
+        tlb_invalidate(spc, ROUNDDOWN(addr, 1 * GB), ROUNDDOWN(addr, 1 * GB) + 1 * GB, 1 * GB);
         assert(!res);
     }
     pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
@@ -1058,7 +1670,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     //   if size of virtual page is >= than 2MB. A page
     //   table covers 2MB region.
     if (class >= 9) {
-        remove_pt(pd, addr, 2 * MB, pdi0, pdi1);
+        remove_pt(spc, pd, addr, 2 * MB, pdi0, pdi1);
         goto finish;
     }
 
@@ -1073,8 +1685,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
         assert(res == 0);
         pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
         res = alloc_fill_pt(pt, old & ~PTE_PS, 4 * KB, 0, PT_ENTRY_COUNT);
-        inval_start = ROUNDDOWN(inval_start, 2 * MB);
-        inval_end = ROUNDUP(inval_end, 2 * MB);
+        tlb_invalidate(spc, ROUNDDOWN(addr, 2 * MB), ROUNDDOWN(addr, 2 * MB) + 2 * MB, 2 * MB);
         assert(res == 0);
     }
 
@@ -1090,7 +1701,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     size_t pti0 = PT_INDEX(addr), pti1 = PT_INDEX(end);
     if (pti0 > pti1) pti1 = PT_ENTRY_COUNT;
     if (class >= 0) {
-        remove_pt(pt, addr, 4 * KB, pti0, pti1);
+        remove_pt(spc, pt, addr, 4 * KB, pti0, pti1);
         goto finish;
     }
 
@@ -1098,7 +1709,45 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     assert(0);
 
 finish:
-    tlb_invalidate_range(spc, inval_start, inval_end);
+    /* remove_pt() has recorded removed pages for invalidation */
+    return;
+}
+
+/* Transparent huge page promotion.
+ *
+ * Mapping 4KB pages one by one (e.g. by demand allocation) leaves
+ * 2MB ranges covered by a full page table even if they map physically
+ * contiguous memory. When every entry of the page table *pde points to
+ * consecutive 4KB pages of a 2MB aligned physical range with identical
+ * attributes, replace it with a single 2MB PDE.
+ * Only page tables are changed, virtual tree keeps small mappings, and
+ * unmap_page() splits 2MB entry back when part of it is unmapped */
+
+static void
+promote_pt(struct AddressSpace *spc, pde_t *pde, uintptr_t va) {
+    const pte_t ignored = PTE_A | PTE_D;
+
+    if (!(*pde & PTE_P) || (*pde & PTE_PS)) return;
+    pte_t *pt = KADDR(PTE_ADDR(*pde));
+
+    /* Tables are usually filled in ascending order,
+     * so check the last entry first */
+    if (!(pt[PT_ENTRY_COUNT - 1] & PTE_P) || !(pt[0] & PTE_P)) return;
+    if (PTE_ADDR(pt[0]) & (2 * MB - 1)) return;
+
+    pte_t first = pt[0] & ~ignored, accessed = 0;
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++) {
+        if ((pt[i] & ~ignored) != first + i * 4 * KB) return;
+        accessed |= pt[i] & ignored;
+    }
+
+    *pde = first | accessed | PTE_PS;
+    page_unref(page_lookup(NULL, (uintptr_t)PADDR(pt), 0, PARTIAL_NODE, 0));
+    mem_stats.pt_pages--;
+    tlb_invalidate(spc, va, va + 2 * MB, 4 * KB);
+    thp_promotions++;
+
+    if (trace_memory) cprintf("<%p> Promoted [%08lX, %08lX] to 2MB page\n", spc, (unsigned long)va, (unsigned long)(va + 2 * MB - 1));
 }
 
 // Map page of physical memory into an address space at address
@@ -1109,7 +1758,7 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
     // assert(!(flags & PROT_LAZY) | !(flags & PROT_SHARE));
     // This is hard to read in my opinion, I would not do that
     //   at work, but here I'll change that.
-    assert((flags & PROT_LAZY) == 0 && (flags & PROT_SHARE) == 0);
+    assert(!(flags & PROT_LAZY) || !(flags & PROT_SHARE));
     assert(page != NULL && spc != NULL);
     assert_physical(page);
     // assert(!(addr & CLASS_MASK(page->class)));
@@ -1124,11 +1773,11 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
 
         page_ref(page);
         unmap_page(spc, addr, page->class);
-        struct Page *mapping = page_lookup_virtual(spc->root, addr, page->class, LOOKUP_ALLOC);
+        struct Page *mapping = page_lookup_virtual(spc, addr, page->class, LOOKUP_ALLOC);
         if (!mapping) return -E_NO_MEM;
 
         mapping->phy = page;
-        mapping->state = (PAGE_PROT(flags) & ~PROT_COMBINE) | MAPPING_NODE;
+        mapping->state = (PAGE_PROT(flags) & ~(PROT_COMBINE | PAGE_AGE_MASK)) | MAPPING_NODE;
         list_append((struct List *)page, (struct List *)mapping);
     }
 
@@ -1158,9 +1807,7 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
         //   all their subentries recursively. That's what
         //   this function will do. 
 
-        int res = alloc_fill_pt(spc->pml4, base, 512 * GB, pml4i0, pml4i1);
-        if (pml4i1 - 1 >= NUSERPML4) propagate_pml4(spc);
-        return res;
+        return alloc_fill_pt(spc->pml4, base, 512 * GB, pml4i0, pml4i1);
     }
 
     // Otherwise, class size is less and all pages reside
@@ -1184,9 +1831,9 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
 
     /* Allocate empty pdp in pml table if required */
     // If it wasn't there, basically. We have to have it.
+    // Kernel pdps are always there, see init_kspace().
     if ((spc->pml4[pml4i0] & PTE_P) == 0) {
         if (alloc_pt(spc->pml4 + pml4i0) < 0) return -E_NO_MEM;
-        if (pml4i0 >= NUSERPML4) propagate_pml4(spc);
     }
     assert((spc->pml4[pml4i0] & PTE_PS) == 0); /* There's (yet) no support for 512GB pages in x86 arch */
     pdpe_t *pdp = KADDR(PTE_ADDR(spc->pml4[pml4i0]));
@@ -1309,7 +1956,9 @@ map_page(struct AddressSpace *spc, uintptr_t addr, struct Page *page, int flags)
     /* Fill PT range if page size is larger than 4KB */
     if (page->class >= 0) {
         // TODO: explain, why we do this.
-        return alloc_fill_pt(pt, base, 4 * KB, pti0, pti1);
+        int res = alloc_fill_pt(pt, base, 4 * KB, pti0, pti1);
+        if (!res) promote_pt(spc, pd + pdi0, ROUNDDOWN(addr, 2 * MB));
+        return res;
     }
 
 
@@ -1321,6 +1970,9 @@ void
 unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
     int class = 0;
 
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+
     uintptr_t start = ROUNDDOWN(dst, 1ULL << CLASS_BASE);
     uintptr_t end = ROUNDUP(dst + size, 1ULL << CLASS_BASE);
 
@@ -1337,32 +1989,177 @@ unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
             start += CLASS_SIZE(class);
         }
     }
+
+    tlb_batch_end();
+    shrink_pools();
+    spin_unlock(&page_lock);
 }
 
-/* Just allocate page, without mapping it */
 static struct Page *
-alloc_page(int class, int flags) {
+zero_pool_take(int class) {
+    for (size_t i = 0; i < NZERO_POOLS; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        if (pool->class != class || !pool->count) continue;
+
+        /* Ownership goes to the caller, which expects
+         * unreferenced page, like the one from free lists */
+        struct Page *page = pool->pages[--pool->count];
+        assert(page->refc == 1 && !page->left && !page->right);
+        page->refc = 0;
+        return page;
+    }
+    return NULL;
+}
+
+/* Return pooled pages to the free lists under memory pressure */
+static bool
+zero_pool_drain(void) {
+    bool drained = 0;
+    for (size_t i = 0; i < NZERO_POOLS; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        drained |= !!pool->count;
+        while (pool->count) page_unref(pool->pages[--pool->count]);
+    }
+    for (size_t i = 0; i < NCPU; i++) {
+        struct PtCache *cache = &pt_cache[i];
+        drained |= !!cache->count;
+        while (cache->count) page_unref(cache->pages[--cache->count]);
+    }
+    return drained;
+}
+
+/* Take an unused page for a pool and reference it, NULL if
+ * full (count >= cap) or out of memory. Zeroing is done by
+ * the caller without page_lock, which keeps other allocators
+ * from waiting for up to a 2MB memset */
+static struct Page *
+zero_pool_grab(int class, int flags, size_t count, size_t cap) {
+    if (count >= cap) return NULL;
+    struct Page *page = alloc_page(class, flags);
+    if (page) page_ref(page);
+    return page;
+}
+
+static void
+zero_pool_clear(struct Page *page, int class) {
+    void *va = KADDR(page2pa(page));
+#ifdef SANITIZE_SHADOW_BASE
+    platform_asan_unpoison(va, CLASS_SIZE(class));
+#endif
+    nosan_memset(va, 0, CLASS_SIZE(class));
+}
+
+/* Called from the idle loop. Pooled pages are handed out to ALLOC_ZERO
+ * allocations, which write faults on lazily zeroed mappings reach
+ * through force_alloc_page() (see trap_dispatch()) */
+void
+refill_zero_pool(void) {
+    for (size_t i = 0; i < NZERO_POOLS; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        /* Zero at most one page per pool at a time to keep idle exit latency low */
+        spin_lock(&page_lock);
+        struct Page *page = zero_pool_grab(pool->class, 0, pool->count, pool->cap);
+        spin_unlock(&page_lock);
+        if (!page) continue;
+
+        zero_pool_clear(page, pool->class);
+
+        spin_lock(&page_lock);
+        if (pool->count < pool->cap)
+            pool->pages[pool->count++] = page;
+        else
+            page_unref(page);
+        spin_unlock(&page_lock);
+    }
+
+    /* The cache is per-CPU, but drained by other CPUs under page_lock */
+    struct PtCache *cache = &pt_cache[cpunum()];
+    spin_lock(&page_lock);
+    struct Page *page = zero_pool_grab(0, ALLOC_BOOTMEM, cache->count, PT_CACHE_LOW);
+    spin_unlock(&page_lock);
+    if (!page) return;
+
+    zero_pool_clear(page, 0);
+
+    spin_lock(&page_lock);
+    if (cache->count < PT_CACHE_SIZE)
+        cache->pages[cache->count++] = page;
+    else
+        page_unref(page);
+    spin_unlock(&page_lock);
+}
+
+/* First free page of node's boot lists whose leading class-sized
+ * part ends within BOOT_MEM_SIZE. The head of a list may cross the
+ * limit while other pages of the same or larger classes still fit */
+static struct Page *
+boot_free_fit(int node, int class) {
+    struct List *lists = boot_free_classes[node];
+    uint64_t *mask = &boot_free_class_mask[node];
+
+    for (int pclass = free_class_next(lists, mask, class); pclass < MAX_CLASS;
+         pclass = free_class_next(lists, mask, pclass + 1)) {
+        for (struct List *li = lists[pclass].next; li != &lists[pclass]; li = li->next) {
+            struct Page *peer = (struct Page *)li;
+            if (page2pa(peer) + CLASS_SIZE(class) <= BOOT_MEM_SIZE) return peer;
+        }
+    }
+
+    return NULL;
+}
+
+static struct Page *
+do_alloc_page(int class, int flags) {
     struct List *li = NULL;
     struct Page *peer = NULL;
 
+    if ((flags & ALLOC_ZERO) && !(flags & (ALLOC_POOL | ALLOC_BOOTMEM))) {
+        struct Page *page = zero_pool_take(class);
+        if (page) return page;
+
+        page = do_alloc_page(class, flags & ~ALLOC_ZERO);
+        if (page) {
+            void *va = KADDR(page2pa(page));
+#ifdef SANITIZE_SHADOW_BASE
+            if (current_space) platform_asan_unpoison(va, CLASS_SIZE(class));
+#endif
+            nosan_memset(va, 0, CLASS_SIZE(class));
+        }
+        return page;
+    }
+
     if (flags & ALLOC_POOL) flags |= ALLOC_BOOTMEM;
 #ifndef SANITIZE_SHADOW_BASE
     if (current_space) flags &= ~ALLOC_BOOTMEM;
 #endif
 
     /* Find page that is not smaller than requested
-     * (Pool memory should also be within BOOT_MEM_SIZE) */
-    for (int pclass = class; pclass < MAX_CLASS; pclass++, li = NULL) {
-        for (li = free_classes[pclass].next; li != &free_classes[pclass]; li = li->next) {
-            peer = (struct Page *)li;
-            assert(peer->state == ALLOCATABLE_NODE);
-            assert_physical(peer);
-            if (!(flags & ALLOC_BOOTMEM) || page2pa(peer) + CLASS_SIZE(class) < BOOT_MEM_SIZE) goto found;
+     * (Pool memory should also be within BOOT_MEM_SIZE),
+     * taking it from the nearest node that has one */
+    for (size_t i = 0; i < numa_nnodes && !peer; i++) {
+        int node = numa_order[cpu_node[cpunum()]][i];
+        if (flags & ALLOC_BOOTMEM) {
+            peer = boot_free_fit(node, class);
+            continue;
         }
+
+        struct List *lists = boot_free_classes[node];
+        int pclass = free_class_next(lists, &boot_free_class_mask[node], class);
+        /* Prefer high memory on ties to keep boot memory for pools */
+        int hclass = free_class_next(free_classes[node], &free_class_mask[node], class);
+        if (hclass <= pclass) lists = free_classes[node], pclass = hclass;
+        if (pclass < MAX_CLASS) peer = (struct Page *)lists[pclass].next;
     }
-    return NULL;
+    if (!peer) {
+        /* Pre-zeroed pages are the first to give back */
+        if (zero_pool_drain()) return do_alloc_page(class, flags);
+        return NULL;
+    }
+
+    li = (struct List *)peer;
+    assert(peer->state == ALLOCATABLE_NODE);
+    assert_physical(peer);
 
-found:
     list_del(li);
 
     size_t ndesc = 0;
@@ -1380,6 +2177,7 @@ found:
         for (size_t i = 0; i < ndesc; i++)
             list_append(&free_descriptors, (struct List *)&newpool->data[i]);
         newpool->next = first_pool;
+        newpool->nfree = ndesc;
         first_pool = newpool;
         free_desc_count += ndesc;
         if (trace_memory_more) cprintf("Allocated pool of size %zu at [%08lX, %08lX]\n",
@@ -1407,21 +2205,117 @@ found:
     return new;
 }
 
-int
-region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size) {
-    uintptr_t start = ROUNDDOWN(addr, PAGE_SIZE);
-    uintptr_t end = ROUNDUP(addr + size, PAGE_SIZE);
-    int res = 0;
-    while (start < end) {
-        struct Page *page = page_lookup_virtual(spc->root, start, 0, LOOKUP_PRESERVE);
-        if (page && page->phy) {
-            res = MAX(res, page->phy->refc + (page->phy->left || page->phy->right));
-            start += CLASS_SIZE(page->phy->class);
-        } else
-            start += CLASS_SIZE(0);
-    }
-    return res;
-}
+/* Just allocate page, without mapping it
+ * (with ALLOC_ZERO page is filled with zeroes) */
+static struct Page *
+alloc_page(int class, int flags) {
+    uint64_t start = read_tsc();
+    struct Page *page = do_alloc_page(class, flags);
+    uint64_t cycles = read_tsc() - start;
+
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) - ALLOC_LATENCY_MIN : 0;
+    mem_stats.alloc_latency[MIN(MAX(bucket, 0), ALLOC_LATENCY_BUCKETS - 1)]++;
+    return page;
+}
+
+/* Call fn for every mapping that intersects [start, end) in the subtree
+ * of node, which covers [base, base + CLASS_SIZE(class)). A mapping is
+ * visited once at its own node whatever its class is, and a missing
+ * subtree is passed to fn whole as a NULL node, so the cost is that of
+ * the nodes on the boundary of the range plus the mappings inside of
+ * it, not of the pages. Stops at the first nonzero result of fn.
+ * page_lock should be held */
+static int
+walk_virtual_range(struct Page *node, int class, uintptr_t base, uintptr_t start, uintptr_t end,
+                   int (*fn)(struct Page *node, uintptr_t va, int class, void *arg), void *arg) {
+    if (!node || node->phy || !class) return fn(node, base, class, arg);
+
+    uintptr_t mid = base + CLASS_SIZE(class - 1);
+    int res = 0;
+    if (start < mid) res = walk_virtual_range(node->left, class - 1, base, start, end, fn, arg);
+    if (!res && end > mid) res = walk_virtual_range(node->right, class - 1, mid, start, end, fn, arg);
+    return res;
+}
+
+static int
+maxref_visit(struct Page *node, uintptr_t va, int class, void *arg) {
+    int *res = arg;
+    if (node && node->phy)
+        *res = MAX(*res, node->phy->refc + (node->phy->left || node->phy->right));
+    return 0;
+}
+
+int
+region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size) {
+    uintptr_t start = ROUNDDOWN(addr, PAGE_SIZE);
+    uintptr_t end = ROUNDUP(addr + size, PAGE_SIZE);
+    int res = 0;
+    spin_lock(&page_lock);
+    if (start < end) walk_virtual_range(spc->root, MAX_CLASS, 0, start, end, maxref_visit, &res);
+    spin_unlock(&page_lock);
+    return res;
+}
+
+struct MemCheck {
+    uintptr_t start;
+    int perm;
+    uintptr_t next;  /* End of what has passed so far */
+    uintptr_t fault; /* First address that doesn't pass */
+};
+
+static int
+mem_check_visit(struct Page *node, uintptr_t va, int class, void *arg) {
+    struct MemCheck *check = arg;
+    if (node && node->phy && (node->state & check->perm) == check->perm) {
+        check->next = va + CLASS_SIZE(class);
+        return 0;
+    }
+    check->fault = MAX(va, check->start);
+    return -E_FAULT;
+}
+
+/* Check that env may access [va, va + len) with permissions perm,
+ * PROT_USER_ is always required. On failure *fault (if not NULL)
+ * is set to the first address it may not access */
+int
+user_mem_check(struct Env *env, const void *va, size_t len, int perm, uintptr_t *fault) {
+    struct MemCheck check = {.start = (uintptr_t)va, .perm = perm | PROT_USER_};
+    if (!len) return 0;
+
+    /* Checked before rounding, so that va + len can't wrap around */
+    if ((uintptr_t)va >= MAX_USER_ADDRESS || len > MAX_USER_ADDRESS - (uintptr_t)va) {
+        if (fault) *fault = MAX((uintptr_t)va, MAX_USER_ADDRESS);
+        return -E_FAULT;
+    }
+
+    uintptr_t start = ROUNDDOWN((uintptr_t)va, PAGE_SIZE);
+    uintptr_t end = ROUNDUP((uintptr_t)va + len, PAGE_SIZE);
+    check.next = start;
+
+    spin_lock(&page_lock);
+    int res = walk_virtual_range(env_space(env)->root, MAX_CLASS, 0, start, end, mem_check_visit, &check);
+    spin_unlock(&page_lock);
+
+    /* A walk that didn't cover the whole range is not a pass */
+    if (!res && check.next < end) {
+        check.fault = MAX(check.next, check.start);
+        res = -E_FAULT;
+    }
+
+    if (res < 0 && fault) *fault = check.fault;
+    return res;
+}
+
+/* Destroy env if it may not access [va, va + len) with
+ * permissions perm. Does not return in that case if env is curenv */
+void
+user_mem_assert(struct Env *env, const void *va, size_t len, int perm) {
+    uintptr_t fault;
+    if (user_mem_check(env, va, len, perm, &fault) < 0) {
+        cprintf("[%08x] user_mem_check assertion failure for va %08lx\n", env->env_id, (unsigned long)fault);
+        env_destroy(env);
+    }
+}
 
 inline static int
 addr_common_class(uintptr_t addr1, uintptr_t addr2) {
@@ -1486,7 +2380,7 @@ alloc_composite_page(struct AddressSpace *spc, uintptr_t addr, int class, int fl
 
     struct Page *page = alloc_page(class, flags);
     if (page) {
-        res = map_page(spc, addr, page, flags);
+        res = map_page(spc, addr, page, flags & ~ALLOC_ZERO);
     } else if (class) {
         /* If bigger page is not found try
          * to compose page from smaller pages recursively */
@@ -1498,13 +2392,14 @@ alloc_composite_page(struct AddressSpace *spc, uintptr_t addr, int class, int fl
     return res;
 }
 
-int
-force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
+/* Resolve lazy mapping containing va,
+ * *next is set to the end of resolved range
+ * and *kind (if not NULL) to how it was resolved */
+static int
+resolve_lazy_page(struct AddressSpace *spc, uintptr_t va, int maxclass, uintptr_t *next, enum FaultKind *kind) {
     int res = -E_FAULT;
-    /* FIXME We need to propagate kernel PML4E
-     * changes to every AddressSpace or just use KPTI
-     * (now it's ok since kernel does not map huge chunks of memory (>= 512GB)
-     * to higher part of address space after initiallization) */
+    /* Kernel PML4 entries never change after init_kspace(),
+     * so kernel mappings are seen by every AddressSpace */
 
     static_assert(!(MAX_USER_ADDRESS & (HUGE_PAGE_SIZE * 512 * 512 - 1)), "MAX_USER_ADDRESS should be alligned on 512GiB");
 
@@ -1517,17 +2412,20 @@ force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
 
     /* Lookup page mapping such that it's class it not larger than MAX_ALLOCATION_CLASS */
     struct Page *page;
-    if (!(page = page_lookup_virtual(spc->root, va, maxclass, LOOKUP_SPLIT))) goto fault;
-    if (!(page = page_lookup_virtual(spc->root, va, 0, LOOKUP_PRESERVE))) goto fault;
+    if (!(page = page_lookup_virtual(spc, va, maxclass, LOOKUP_SPLIT))) goto fault;
+    if (!(page = page_lookup_virtual(spc, va, 0, LOOKUP_PRESERVE))) goto fault;
     if (!(page->state & PROT_LAZY)) goto fault;
 
     va &= ~CLASS_MASK(page->phy->class);
+    *next = va + CLASS_SIZE(page->phy->class);
 
     if (PAGE_IS_UNIQ(page->phy)) {
         /* If we have the only reference to the page and
          * and its mapping to itself we can actually just
          * disable lazy flag and not bother copying */
         res = map_page(spc, va, page->phy, page->state & ~PROT_LAZY);
+        mem_stats.demand_faults++;
+        if (kind) *kind = FAULT_MAP;
     } else {
         if (trace_memory) {
             cprintf("<%p> Allocating new page [%08lX, %08lX] flags=%x\n", spc,
@@ -1535,15 +2433,74 @@ force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
         }
 
         struct Page *phy = page->phy;
+        /* Zero page copies are taken pre-zeroed, no need to copy */
+        bool zero = page2pa(phy) >= PADDR(zero_page_raw) &&
+                    page2pa(phy) < PADDR(zero_page_raw) + HUGE_PAGE_SIZE;
         page_ref(phy);
-        res = alloc_composite_page(spc, va, phy->class, page->state & PROT_ALL & ~PROT_LAZY);
-        if (!res) memcpy_page(spc, va, phy);
+        res = alloc_composite_page(spc, va, phy->class, (page->state & PROT_ALL & ~PROT_LAZY) | (zero ? ALLOC_ZERO : 0));
+        if (!res && !zero) memcpy_page(spc, va, phy);
         page_unref(phy);
+        if (zero)
+            mem_stats.demand_faults++;
+        else
+            mem_stats.cow_faults++;
+        if (kind) *kind = zero ? FAULT_ZERO : FAULT_COPY;
     }
 
 fault:
     switch_address_space(old);
+    return res;
+}
+
+/* Fault-around.
+ * Sequential faults double the window up to spc->fault_around,
+ * any other fault resets it. Lazy mappings following the faulting
+ * one are resolved right away, so a linear pass over memory
+ * does not take a fault per page */
+static void
+fault_around(struct AddressSpace *spc, uintptr_t va, uintptr_t next, int maxclass) {
+    if (va == spc->fault_next)
+        spc->fault_window = MIN(MAX(spc->fault_window * 2, 1), spc->fault_around);
+    else
+        spc->fault_window = 0;
+
+    uintptr_t limit = va < MAX_USER_ADDRESS ? MAX_USER_ADDRESS : 0;
+    for (size_t i = 0; i < spc->fault_window && (!limit || next < limit); i++) {
+        struct Page *page = page_lookup_virtual(spc, next, 0, LOOKUP_PRESERVE);
+        if (!page || !page->phy || !(page->state & PROT_LAZY)) break;
+
+        uintptr_t end = next;
+        if (resolve_lazy_page(spc, next, maxclass, &end, NULL) < 0) break;
+        spc->faults_avoided++;
+        next = end;
+    }
+
+    spc->fault_next = next;
+}
+
+static int
+do_force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass, enum FaultKind *kind) {
+    uintptr_t next = va;
+    int res = resolve_lazy_page(spc, va, maxclass, &next, kind);
+
+    if (va > MAX_USER_ADDRESS) spc = &kspace;
+    if (!res && spc->fault_around) fault_around(spc, ROUNDDOWN(va, PAGE_SIZE), next, maxclass);
+
+    return res;
+}
 
+int
+force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass, enum FaultKind *kind) {
+    if (kind) *kind = FAULT_NONE;
+
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+    int res = do_force_alloc_page(spc, va, maxclass, kind);
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+
+    /* env_destroy() does not return, so it's called without page_lock */
+    if (va > MAX_USER_ADDRESS) spc = &kspace;
     if (res == -E_NO_MEM) {
         if (spc != &kspace) {
             struct Env *env = (void *)((uint8_t *)spc - offsetof(struct Env, address_space));
@@ -1594,10 +2551,12 @@ do_map_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *ssp
     /* Lock page so it cannot be deallocated during copying/mapping */
     if (!(flags & PROT_LAZY) && (oldflags & PROT_LAZY)) {
         int class = phy->class;
-        res = force_alloc_page(sspace, src, MAX_CLASS);
+        /* Out of memory is reported to map_region() caller */
+        uintptr_t next;
+        res = resolve_lazy_page(sspace, src, MAX_CLASS, &next, NULL);
         if (res < 0 || (sspace == dspace && src == dst)) return res;
 
-        struct Page *newv = page_lookup_virtual(sspace->root, src, class, LOOKUP_PRESERVE);
+        struct Page *newv = page_lookup_virtual(sspace, src, class, LOOKUP_PRESERVE);
         check_virtual_class(newv, class);
         assert(newv && newv->phy);
         phy = newv->phy;
@@ -1687,7 +2646,7 @@ do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct Addres
             }
         }
     } else {
-        struct Page *page1 = page_lookup_virtual(sspace->root, src, class, LOOKUP_ALLOC);
+        struct Page *page1 = page_lookup_virtual(sspace, src, class, LOOKUP_ALLOC);
         assert(page1);
         if (page1->phy && page1->phy->class > class) {
             /* We need to split physical page if part of it is remapped */
@@ -1704,8 +2663,8 @@ do_map_region_one_page(struct AddressSpace *dspace, uintptr_t dst, struct Addres
     return res;
 }
 
-int
-map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags) {
+static int
+do_map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags) {
     if (src & CLASS_MASK(0) || (!sspace && !(flags & (ALLOC_ZERO | ALLOC_ONE)))) return -E_INVAL;
     if (dst & CLASS_MASK(0) || !dspace) return -E_INVAL;
     if (size & CLASS_MASK(0) || !size) return -E_INVAL;
@@ -1737,31 +2696,515 @@ map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspa
     return 0;
 }
 
+int
+map_region(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, uintptr_t size, int flags) {
+    /* Huge regions are mapped in MAP_PREEMPT_CHUNK pieces with
+     * preemption points in between. Remapping within one space
+     * may overlap, it is done at once */
+    int res = 0;
+    while (!res && size) {
+        uintptr_t piece = size;
+        if (sspace != dspace)
+            piece = MIN(size, ROUNDDOWN(dst + MAP_PREEMPT_CHUNK, MAP_PREEMPT_CHUNK) - dst);
+
+        spin_lock(&page_lock);
+        tlb_batch_begin();
+        res = do_map_region(dspace, dst, sspace, src, piece, flags);
+        tlb_batch_end();
+        spin_unlock(&page_lock);
+
+        dst += piece, src += piece, size -= piece;
+        if (size) preempt_point();
+    }
+    return res;
+}
+
+int
+init_address_space(struct AddressSpace *space) {
+    spin_lock(&page_lock);
+    int res = alloc_pt(&space->cr3);
+    if (res < 0) {
+        spin_unlock(&page_lock);
+        return res;
+    }
+
+    space->cr3 = PTE_ADDR(space->cr3);
+    space->pml4 = KADDR(space->cr3);
+    space->root = alloc_descriptor(INTERMEDIATE_NODE);
+    /* Kernel pdps are pinned by kspace, they are shared without references */
+    memcpy(space->pml4 + NUSERPML4, kspace.pml4 + NUSERPML4,
+           PAGE_SIZE - NUSERPML4 * sizeof(pml4e_t));
+    space->pml4[PML4_INDEX(UVPT)] = space->cr3 | PTE_P | PTE_U;
+    space->fault_around = FAULT_AROUND_DEFAULT;
+    spin_unlock(&page_lock);
+
+    return 0;
+}
+
+/* Create address space dst as a copy-on-write duplicate
+ * of the user part of src.
+ *
+ * Private mappings are shared with PROT_LAZY at the class they
+ * are mapped with, so nothing is copied up front. PROT_SHARE
+ * mappings stay shared. Write faults should be resolved with
+ * force_alloc_page(spc, va, COW_FAULT_CLASS): shared large page
+ * is split lazily and only the touched 4KB page is copied */
+int
+fork_address_space(struct AddressSpace *dst, struct AddressSpace *src) {
+    int res = init_address_space(dst);
+    if (res < 0) return res;
+
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+    res = do_map_region(dst, 0, src, 0, MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE);
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+
+    if (res < 0) release_address_space(dst);
+    return res;
+}
+
+/* Fork an address space with one written page and resolve
+ * write faults on both sides the way the #PF handler does.
+ * The copy gets its own page, the original keeps its data.
+ * User memory has no KASAN shadow, so it's accessed with nosan_memcpy() */
+static uint64_t
+check_fork_read(void *va) {
+    uint64_t val;
+    nosan_memcpy(&val, va, sizeof val);
+    return val;
+}
+
+static void
+check_fork_address_space(void) {
+    static struct AddressSpace src, dst;
+    uint64_t data = 0x1234, other = 0x5678;
+    enum FaultKind kind;
+
+    assert(!init_address_space(&src));
+    assert(!map_region(&src, (uintptr_t)UTEMP, NULL, 0, PAGE_SIZE, PROT_R | PROT_W | PROT_USER_ | ALLOC_ZERO));
+    assert(!force_alloc_page(&src, (uintptr_t)UTEMP, COW_FAULT_CLASS, &kind) && kind == FAULT_ZERO);
+    struct AddressSpace *old = switch_address_space(&src);
+    nosan_memcpy(UTEMP, &data, sizeof data);
+
+    assert(!fork_address_space(&dst, &src));
+    switch_address_space(&dst);
+    assert(check_fork_read(UTEMP) == data);
+    assert(!force_alloc_page(&dst, (uintptr_t)UTEMP, COW_FAULT_CLASS, &kind) && kind == FAULT_COPY);
+    assert(check_fork_read(UTEMP) == data);
+    nosan_memcpy(UTEMP, &other, sizeof other);
+
+    switch_address_space(&src);
+    assert(check_fork_read(UTEMP) == data);
+
+    switch_address_space(old);
+    release_address_space(&dst);
+    release_address_space(&src);
+}
+
+/* Working set scanner.
+ *
+ * Every WSS_SCAN_INTERVAL the user part of the virtual tree of every
+ * address space is walked. For each mapping the accessed bits of its
+ * hardware entries are sampled and cleared: the age of the mapping is
+ * reset if any was set and grows otherwise. Mappings younger than
+ * WSS_WINDOW scans make up the working set */
+
+static struct KTimer wss_timer;
+
+/* Hardware entry mapping va in spc, or the missing entry above it,
+ * *step is set to the size it covers */
+static pte_t *
+leaf_pte(struct AddressSpace *spc, uintptr_t va, size_t *step) {
+    pte_t *pte = &spc->pml4[PML4_INDEX(va)];
+    *step = 512 * GB;
+    if (!(*pte & PTE_P)) return pte;
+
+    pte = (pdpe_t *)KADDR(PTE_ADDR(*pte)) + PDP_INDEX(va);
+    *step = 1 * GB;
+    if (!(*pte & PTE_P) || (*pte & PTE_PS)) return pte;
+
+    pte = (pde_t *)KADDR(PTE_ADDR(*pte)) + PD_INDEX(va);
+    *step = 2 * MB;
+    if (!(*pte & PTE_P) || (*pte & PTE_PS)) return pte;
+
+    *step = 4 * KB;
+    return (pte_t *)KADDR(PTE_ADDR(*pte)) + PT_INDEX(va);
+}
+
+/* Test and clear accessed bits of the hardware
+ * entries mapping [va, va + CLASS_SIZE(class)) */
+static bool
+wss_sample(struct AddressSpace *spc, uintptr_t va, int class) {
+    uintptr_t end = va + CLASS_SIZE(class);
+    bool accessed = 0;
+
+    while (va < end) {
+        size_t step;
+        pte_t *pte = leaf_pte(spc, va, &step);
+
+        uintptr_t start = ROUNDDOWN(va, step);
+        if ((*pte & PTE_P) && (*pte & PTE_A)) {
+            *pte &= ~PTE_A;
+            accessed = 1;
+            /* Otherwise cached translation would not set it again */
+            tlb_invalidate(spc, start, start + step, step);
+        }
+        va = start + step;
+    }
+
+    return accessed;
+}
+
+static void
+wss_scan_node(struct AddressSpace *spc, struct Page *node, uintptr_t addr, int class) {
+    if (!node || addr >= MAX_USER_ADDRESS) return;
+
+    if (node->phy) {
+        unsigned age = PAGE_AGE(node->state);
+        if (wss_sample(spc, addr, class))
+            age = 0;
+        else if (age < PAGE_AGE_MAX)
+            age++;
+        node->state = (node->state & ~PAGE_AGE_MASK) | age << PAGE_AGE_SHIFT;
+
+        size_t size = CLASS_SIZE(class);
+        spc->ws_mapped += size;
+        if (age < WSS_WINDOW) spc->ws_size += size;
+        return;
+    }
+
+    wss_scan_node(spc, node->left, addr, class - 1);
+    wss_scan_node(spc, node->right, addr + CLASS_SIZE(class - 1), class - 1);
+}
+
+static void
+wss_scan(struct AddressSpace *spc) {
+    spc->ws_mapped = spc->ws_size = 0;
+    wss_scan_node(spc, spc->root, 0, MAX_CLASS);
+}
+
+/* Called from the timer interrupt */
+static void
+wss_tick(void *arg) {
+    bool kspace_done = 0;
+
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+    for (size_t i = 0; i < nenvs; i++) {
+        if (env_at(i)->env_status == ENV_FREE) continue;
+
+        /* Kernel mode envs share kspace */
+        struct AddressSpace *spc = env_space(env_at(i));
+        if (spc == &kspace) {
+            if (kspace_done) continue;
+            kspace_done = 1;
+        }
+        wss_scan(spc);
+    }
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+
+    timer_add(&wss_timer, WSS_SCAN_INTERVAL, wss_tick, NULL);
+}
+
+/* Start periodic working set scans, needs ktimer_init() */
 void
-release_address_space(struct AddressSpace *space) {
-    /* NOTE: This function should not be called for kspace */
+wss_init(void) {
+    timer_add(&wss_timer, WSS_SCAN_INTERVAL, wss_tick, NULL);
+}
 
-    /* Manually unref level 3 kernel page tables */
-    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
-        if (kspace.pml4[i] & PTE_P && i != UVPT_INDEX)
-            page_unref(page_lookup(NULL, PTE_ADDR(kspace.pml4[i]), 0, PARTIAL_NODE, 0));
+void
+dump_working_sets(void) {
+    cprintf("ENV      MAPPED_KB     WSS_KB\n");
+    for (size_t i = 0; i < nenvs; i++) {
+        struct Env *env = env_at(i);
+        if (env->env_status == ENV_FREE) continue;
+
+        struct AddressSpace *spc = env_space(env);
+        cprintf("%08x %9lu %10lu\n", env->env_id,
+                (unsigned long)(spc->ws_mapped / KB), (unsigned long)(spc->ws_size / KB));
+    }
+}
+
+/* Same page merging.
+ *
+ * When enabled, ksm_scan() walks 4KB private mappings of all address
+ * spaces from the idle loop, KSM_BUDGET of them per call. A page is
+ * stable if it was not written since the previous pass (its dirty bit
+ * is sampled and cleared). Stable pages are hashed into ksm_table,
+ * and a page with the same hash and content as the one already there
+ * is replaced with it. Both mappings become PROT_LAZY, so the merged
+ * page is read shared and the first write to it makes a private copy
+ * (see resolve_lazy_page()) */
+#define KSM_TABLE_SIZE 1024
+#define KSM_BUDGET     64
+
+struct KsmEntry {
+    uint64_t hash;
+    struct AddressSpace *spc; /* Where phy was found, it is not referenced */
+    uintptr_t va;
+    struct Page *phy;
+};
+
+static struct KsmEntry ksm_table[KSM_TABLE_SIZE];
+static bool ksm_enabled;
+static size_t ksm_env;  /* Cursor: env slot */
+static uintptr_t ksm_va; /* and address in its space */
+
+static struct {
+    uint64_t scanned;
+    uint64_t merged;
+    uint64_t passes;
+} ksm_stats;
+
+static uint64_t
+ksm_hash(const uint64_t *data) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(*data); i++)
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+/* Leftmost mapping of the tree rooted at node (of class at addr)
+ * whose range ends after from */
+static struct Page *
+ksm_next_mapping(struct Page *node, uintptr_t addr, int class, uintptr_t from, uintptr_t *va, int *vclass) {
+    if (!node || addr + CLASS_SIZE(class) <= from || addr >= MAX_USER_ADDRESS) return NULL;
+
+    if (node->phy) {
+        *va = addr;
+        *vclass = class;
+        return node;
+    }
+
+    struct Page *res = ksm_next_mapping(node->left, addr, class - 1, from, va, vclass);
+    if (res) return res;
+    return ksm_next_mapping(node->right, addr + CLASS_SIZE(class - 1), class - 1, from, va, vclass);
+}
+
+/* Space of env i, kspace is only returned for the first env using it */
+static struct AddressSpace *
+ksm_space(size_t i) {
+    if (env_at(i)->env_status == ENV_FREE) return NULL;
+
+    struct AddressSpace *spc = env_space(env_at(i));
+    if (spc == &kspace) {
+        for (size_t j = 0; j < i; j++)
+            if (env_at(j)->env_status != ENV_FREE) return NULL;
+    }
+    return spc;
+}
+
+/* Merge mapping node at va of spc into entry */
+static void
+ksm_merge(struct KsmEntry *entry, struct AddressSpace *spc, uintptr_t va, struct Page *node) {
+    /* Entry mapping may be gone since it was recorded */
+    struct Page *owner = entry->spc->root ? page_lookup_virtual(entry->spc, entry->va, 0, LOOKUP_PRESERVE) : NULL;
+    if (!owner || owner->phy != entry->phy || (owner->state & PROT_SHARE)) {
+        *entry = (struct KsmEntry){.hash = entry->hash, .spc = spc, .va = va, .phy = node->phy};
+        return;
+    }
+
+    if (memcmp(KADDR(page2pa(entry->phy)), KADDR(page2pa(node->phy)), PAGE_SIZE)) return;
+
+    struct Page *phy = entry->phy;
+    int flags = (node->state & PROT_ALL) | PROT_LAZY;
+    if (!(owner->state & PROT_LAZY) &&
+        map_page(entry->spc, entry->va, phy, (owner->state & PROT_ALL) | PROT_LAZY) < 0) return;
+    /* Old page of node is freed with its last mapping */
+    if (map_page(spc, va, phy, flags) < 0) return;
+
+    ksm_stats.merged++;
+    if (trace_memory) cprintf("<%p> Merged page at %08lX with <%p> %08lX\n", spc, (unsigned long)va, entry->spc, (unsigned long)entry->va);
+}
+
+static void
+ksm_page(struct AddressSpace *spc, uintptr_t va, struct Page *node) {
+    ksm_stats.scanned++;
+
+    if (node->state & PROT_SHARE) return;
+    if (!(node->state & PROT_LAZY) && !PAGE_IS_UNIQ(node->phy)) return;
+
+    /* Promoted 2MB entries are left alone */
+    size_t step;
+    pte_t *pte = leaf_pte(spc, va, &step);
+    if (!(*pte & PTE_P) || step != 4 * KB) return;
+    if (*pte & PTE_D) {
+        *pte &= ~PTE_D;
+        tlb_invalidate(spc, va, va + step, step);
+        return;
     }
 
-    /* Unmap all memory from the space
+    uint64_t hash = ksm_hash(KADDR(page2pa(node->phy)));
+    struct KsmEntry *entry = &ksm_table[hash % KSM_TABLE_SIZE];
+    if (entry->phy == node->phy) return;
+
+    if (entry->phy && entry->hash == hash)
+        ksm_merge(entry, spc, va, node);
+    else
+        *entry = (struct KsmEntry){.hash = hash, .spc = spc, .va = va, .phy = node->phy};
+}
+
+static void
+do_ksm_scan(size_t budget) {
+    if (!nenvs) return;
+
+    while (budget--) {
+        if (ksm_env >= nenvs) {
+            ksm_env = 0;
+            ksm_stats.passes++;
+        }
+
+        struct AddressSpace *spc = ksm_space(ksm_env);
+        uintptr_t va = 0;
+        int class = 0;
+        struct Page *node = spc && spc->root ? ksm_next_mapping(spc->root, 0, MAX_CLASS, ksm_va, &va, &class) : NULL;
+        if (!node) {
+            ksm_env++;
+            ksm_va = 0;
+            continue;
+        }
+
+        ksm_va = va + CLASS_SIZE(class);
+        if (!class) ksm_page(spc, va, node);
+    }
+}
+
+/* Continue merging pages if enabled, called when CPU is idle */
+void
+ksm_scan(void) {
+    if (!ksm_enabled) return;
+
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+    do_ksm_scan(KSM_BUDGET);
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+}
+
+void
+ksm_set(bool on) {
+    spin_lock(&page_lock);
+    ksm_enabled = on;
+    /* Entries are not referenced, drop them while nobody checks them */
+    if (!on) memset(ksm_table, 0, sizeof ksm_table);
+    spin_unlock(&page_lock);
+}
+
+void
+dump_ksm_stats(void) {
+    cprintf("Same page merging: %s\n", ksm_enabled ? "on" : "off");
+    cprintf("Scanned pages: %lu in %lu passes\n", (unsigned long)ksm_stats.scanned, (unsigned long)ksm_stats.passes);
+    cprintf("Merged pages: %lu\n", (unsigned long)ksm_stats.merged);
+}
+
+/* Deferred address space teardown.
+ *
+ * release_address_space() only detaches the virtual tree and
+ * page tables of a space into one of reclaim_spaces, so the space
+ * itself can be reused right away. reclaim_address_spaces() then
+ * removes them in steps of at most RECLAIM_BUDGET subtrees with
+ * no more than 2MB each (LOOKUP_CACHE_CLASS), from the idle loop */
+#define RECLAIM_SLOTS  8
+#define RECLAIM_BUDGET 16
+/* Class of the range mapped by one PML4 entry, 512GB */
+#define PML4E_CLASS (PML4_SHIFT - CLASS_BASE)
+static struct AddressSpace reclaim_spaces[RECLAIM_SLOTS];
+static size_t reclaim_head, reclaim_count;
+
+/* Remove up to *budget subtrees of spc,
+ * returns whether spc is gone completely */
+static bool
+reclaim_space(struct AddressSpace *spc, size_t *budget) {
+    for (; *budget; (*budget)--) {
+        /* Find the leftmost subtree small enough to be removed at once */
+        struct Page *node = spc->root;
+        uintptr_t addr = 0;
+        int class = MAX_CLASS;
+        while (!node->phy && class > LOOKUP_CACHE_CLASS && (node->left || node->right)) {
+            if (!node->left) addr += CLASS_SIZE(class - 1);
+            node = node->left ? node->left : node->right;
+            class--;
+        }
+
+        if (node == spc->root && !node->phy && !node->left && !node->right) break;
+
+        if (class >= PML4E_CLASS && !node->phy) {
+            /* Empty node above PML4 entry level only has the
+             * descriptor, its range spans the kernel part too */
+            assert(!node->left && !node->right);
+            *(node->parent->left == node ? &node->parent->left : &node->parent->right) = NULL;
+            free_descriptor(node);
+        } else {
+            unmap_page(spc, addr, class);
+        }
+    }
+    if (!*budget) return 0;
+
+    /* Tables of the user part and PML4 itself are not in the tree */
+    remove_pt(spc, spc->pml4, 0, 512 * GB, 0, NUSERPML4);
+    page_unref(page_lookup(NULL, spc->cr3, 0, PARTIAL_NODE, 0));
+    mem_stats.pt_pages--;
+    free_descriptor(spc->root);
+    memset(spc, 0, sizeof *spc);
+    return 1;
+}
+
+static void
+do_reclaim_address_spaces(size_t budget) {
+    tlb_batch_begin();
+    while (reclaim_count && budget) {
+        if (!reclaim_space(&reclaim_spaces[reclaim_head], &budget)) break;
+        reclaim_head = (reclaim_head + 1) % RECLAIM_SLOTS;
+        reclaim_count--;
+    }
+    tlb_batch_end();
+}
+
+/* Continue teardown of released address spaces, called when CPU is idle */
+void
+reclaim_address_spaces(void) {
+    spin_lock(&page_lock);
+    if (reclaim_count) {
+        do_reclaim_address_spaces(RECLAIM_BUDGET);
+        shrink_pools();
+    }
+    spin_unlock(&page_lock);
+}
+
+void
+release_address_space(struct AddressSpace *space) {
+    /* NOTE: This function should not be called for kspace
      * (kernel is cheating and does not store
      *  metadata for upper part of address space (privileged)
      *  in tree and only in page tables for user address spaces,
      *  so unmapping is safe) */
-    unmap_page(space, 0, MAX_CLASS);
+    assert(space != &kspace && space != current_space);
+
+    spin_lock(&page_lock);
+    pcid_release(space);
+
+    /* All slots are busy, finish the oldest one first.
+     * Only that one, the rest is left to the idle loop */
+    if (reclaim_count == RECLAIM_SLOTS) {
+        size_t budget = SIZE_MAX;
+        tlb_batch_begin();
+        bool done = reclaim_space(&reclaim_spaces[reclaim_head], &budget);
+        tlb_batch_end();
+        assert(done);
+        reclaim_head = (reclaim_head + 1) % RECLAIM_SLOTS;
+        reclaim_count--;
+    }
 
-    /* Also unmap PML4 itself since it is never deallocated by page_uname*/
-    page_unref(page_lookup(NULL, space->cr3, 0, PARTIAL_NODE, 0));
+    struct AddressSpace *dying = &reclaim_spaces[(reclaim_head + reclaim_count++) % RECLAIM_SLOTS];
+    *dying = (struct AddressSpace){.pml4 = space->pml4, .cr3 = space->cr3, .root = space->root};
 
     /* Zero-out metadata */
     memset(space, 0, sizeof *space);
+    spin_unlock(&page_lock);
 }
 
-
 /*
  * This function is used for switch address spaces
  *
@@ -1810,7 +3253,7 @@ switch_address_space(struct AddressSpace *space) {
     // Check the definition of AddressSpace struct: physical address of
     //   pml4 (cr3) is stored in cr3 field there.
     // Use inc/x86.h function to set cr3.
-    lcr3(current_space->cr3);
+    lcr3(pcid_enabled ? pcid_cr3(current_space) : current_space->cr3);
 
     return old_space;
 }
@@ -1822,6 +3265,53 @@ __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t zero_page_raw[HUGE_PAGE_SIZE];
 __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t one_page_raw[HUGE_PAGE_SIZE];
 
 
+/* UEFI memory map entries, classified, sorted and merged before they
+ * are attached. Firmware maps often have hundreds of small adjacent
+ * entries of the same kind, and every attach_region() call descends
+ * the tree and splits descriptors for its unaligned ends */
+#define MEMMAP_MAX_REGIONS 512
+
+struct MemmapRegion {
+    uintptr_t start, end;
+    enum PageState type;
+};
+
+static struct MemmapRegion memmap_regions[MEMMAP_MAX_REGIONS];
+
+/* Insert [start, end) into the sorted memmap_regions, merging it with
+ * its neighbours if they are adjacent and of the same type.
+ * Returns the new number of regions, or 0 if there is no space left */
+static size_t
+memmap_insert(size_t count, uintptr_t start, uintptr_t end, enum PageState type) {
+    /* Maps are mostly sorted already, so this is usually the last slot */
+    size_t i = count;
+    while (i > 0 && memmap_regions[i - 1].start > start) i--;
+
+    struct MemmapRegion *prev = i > 0 ? &memmap_regions[i - 1] : NULL;
+    struct MemmapRegion *next = i < count ? &memmap_regions[i] : NULL;
+    bool join_prev = prev && prev->end == start && prev->type == type;
+    bool join_next = next && next->start == end && next->type == type;
+
+    if (join_prev && join_next) {
+        prev->end = next->end;
+        memmove(next, next + 1, (count - i - 1) * sizeof(*next));
+        return count - 1;
+    }
+    if (join_prev) {
+        prev->end = end;
+        return count;
+    }
+    if (join_next) {
+        next->start = start;
+        return count;
+    }
+
+    if (count == MEMMAP_MAX_REGIONS) return 0;
+    memmove(&memmap_regions[i + 1], &memmap_regions[i], (count - i) * sizeof(*next));
+    memmap_regions[i] = (struct MemmapRegion){start, end, type};
+    return count + 1;
+}
+
 /*
  * This function initialized physical memory tree
  * with either UEFI memory map or CMOS contents.
@@ -1848,6 +3338,7 @@ detect_memory(void) {
     if (uefi_lp && uefi_lp->MemoryMap) {
         EFI_MEMORY_DESCRIPTOR *start = (void *)uefi_lp->MemoryMap;
         EFI_MEMORY_DESCRIPTOR *end = (void *)(uefi_lp->MemoryMap + uefi_lp->MemoryMapSize);
+        size_t ndesc = 0, nregions = 0;
         while (start < end) {
             enum PageState type;
             switch (start->Type) {
@@ -1866,13 +3357,24 @@ detect_memory(void) {
             max_memory_map_addr = MAX(start->NumberOfPages * EFI_PAGE_SIZE + start->PhysicalStart, max_memory_map_addr);
 
             /* Attach memory described by memory map entry described by start
-             * of type type*/
+             * of type type. Entries don't overlap, so they can be attached
+             * in any order, collect them in a sorted and merged list first.
+             * If it overflows, the entry is attached on its own */
             // LAB 6: Your code here
-            attach_region(start->PhysicalStart, start->NumberOfPages * EFI_PAGE_SIZE + start->PhysicalStart, type);
+            uintptr_t region_end = start->NumberOfPages * EFI_PAGE_SIZE + start->PhysicalStart;
+            size_t count = memmap_insert(nregions, start->PhysicalStart, region_end, type);
+            if (count) nregions = count;
+            else attach_region(start->PhysicalStart, region_end, type);
+            ndesc++;
 
             start = (void *)((uint8_t *)start + uefi_lp->MemoryMapDescriptorSize);
         }
 
+        for (size_t i = 0; i < nregions; i++)
+            attach_region(memmap_regions[i].start, memmap_regions[i].end, memmap_regions[i].type);
+
+        if (trace_memory) cprintf("Memory map: %zu entries merged into %zu regions\n", ndesc, nregions);
+
         basemem = MIN(max_memory_map_addr, IOPHYSMEM);
         extmem = max_memory_map_addr - basemem;
     } else {
@@ -1908,13 +3410,15 @@ detect_memory(void) {
 
 static void
 init_allocator(void) {
-    static struct Page initial_buffer[INIT_DESCR];
-
     metaheaptop = KERN_HEAP_START + ROUNDUP(uefi_lp->FrameBufferSize, PAGE_SIZE);
 
     /* Initiallize lists */
-    for (size_t i = 0; i < MAX_CLASS; i++)
-        list_init(&free_classes[i]);
+    for (size_t node = 0; node < NUMA_MAX_NODES; node++) {
+        for (size_t i = 0; i < MAX_CLASS; i++) {
+            list_init(&free_classes[node][i]);
+            list_init(&boot_free_classes[node][i]);
+        }
+    }
 
     /* Initiallize first pool */
 
@@ -1931,18 +3435,60 @@ init_allocator(void) {
     root.state = PARTIAL_NODE;
 }
 
+/* Map kernel memory at kva to va in kspace without copying.
+ * Used to share read-only segments of embedded program images,
+ * pages are referenced by every such mapping */
+int
+map_kernel_image(uintptr_t va, const void *kva, size_t size, int flags) {
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+    int res = map_physical_region(&kspace, va, PADDR((void *)kva), size, flags);
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+    return res;
+}
+
+/* Allocate CLASS_SIZE(class) bytes of physically
+ * contiguous memory for kernel objects (see kern/kmalloc.c).
+ * Memory is accessed through the physical memory mapping */
+void *
+kalloc_page(int class) {
+    spin_lock(&page_lock);
+    struct Page *page = alloc_page(class, 0);
+    if (page) page_ref(page);
+    spin_unlock(&page_lock);
+    if (!page) return NULL;
+
+    void *va = KADDR(page2pa(page));
+#ifdef SANITIZE_SHADOW_BASE
+    if (current_space) platform_asan_unpoison(va, CLASS_SIZE(class));
+#endif
+    return va;
+}
+
+void
+kfree_page(void *va, int class) {
+    spin_lock(&page_lock);
+    page_unref(page_lookup(NULL, PADDR(va), class, PARTIAL_NODE, 0));
+    spin_unlock(&page_lock);
+}
+
 void *
 kzalloc_region(size_t size) {
     assert(current_space);
 
     size = ROUNDUP(size, PAGE_SIZE);
 
+    spin_lock(&page_lock);
+    /* Checked under the lock, two callers could both pass it otherwise */
     if (metaheaptop + size > KERN_HEAP_END) panic("Kernel heap overflow\n");
-
     uintptr_t res = metaheaptop;
     metaheaptop += size;
 
-    int r = map_region(&kspace, res, NULL, 0, size, PROT_R | PROT_W | ALLOC_ZERO);
+    tlb_batch_begin();
+    int r = do_map_region(&kspace, res, NULL, 0, size, PROT_R | PROT_W | ALLOC_ZERO);
+    tlb_batch_end();
+    spin_unlock(&page_lock);
     if (r < 0) panic("kzalloc_region: %i\n", r);
 
 #ifdef SANITIZE_SHADOW_BASE
@@ -1956,33 +3502,136 @@ kzalloc_region(size_t size) {
     return (void *)res;
 }
 
-static uintptr_t prev_mmio;
-void *
-mmio_map_region(physaddr_t addr, size_t size) {
+/* Program the PAT the way prot2pte() uses it. Only entry 1 differs from
+ * the power-on value: PTE_PWT alone (PROT_WC) selects write-combining
+ * instead of write-through, PCD|PWT (PROT_CD) stays uncached */
+void
+pat_init(void) {
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    if (!(edx & CPUID_EDX_PAT)) return;
+
+    uint64_t pat = PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WC) |
+                   PAT_ENTRY(2, PAT_UC_MINUS) | PAT_ENTRY(3, PAT_UC) |
+                   PAT_ENTRY(4, PAT_WB) | PAT_ENTRY(5, PAT_WT) |
+                   PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC);
+    if (rdmsr(PAT_MSR) == pat) return;
+
+    /* Lines cached under the old types must not survive the change */
+    asm volatile("wbinvd" ::: "memory");
+    wrmsr(PAT_MSR, pat);
+    asm volatile("wbinvd" ::: "memory");
+    tlbflush();
+}
+
+/* Device regions mapped so far, a repeated map of the same
+ * physical range with the same caching type reuses its VA */
+#define MMIO_REGIONS 32
+
+struct MmioRegion {
+    physaddr_t start, end; /* Page aligned, empty if free */
+    uintptr_t va;
+    int prot;
+};
+
+static struct MmioRegion mmio_regions[MMIO_REGIONS];
+
+static struct MmioRegion *
+mmio_lookup(physaddr_t start, physaddr_t end, int prot) {
+    for (size_t i = 0; i < MMIO_REGIONS; i++) {
+        struct MmioRegion *reg = &mmio_regions[i];
+        if (reg->start <= start && end <= reg->end && reg->prot == prot) return reg;
+    }
+    return NULL;
+}
+
+/* VA for [start, end) with the same offset within the largest page
+ * that fits into the region, so map_physical_region() uses it */
+static uintptr_t
+mmio_place(physaddr_t start, physaddr_t end) {
+    size_t sizes[] = {1 * GB, 2 * MB};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        size_t step = sizes[i];
+        if (step == 1 * GB && !has_1gb_pages) continue;
+        if (ROUNDUP(start, step) + step > end) continue;
+
+        uintptr_t va = metaheaptop + ((start - metaheaptop) & (step - 1));
+        if (va + (end - start) <= KERN_HEAP_END) return va;
+    }
+    return metaheaptop;
+}
+
+static void *
+do_mmio_map_region(physaddr_t addr, size_t size, int prot) {
     assert(current_space == &kspace);
-    uintptr_t start = ROUNDDOWN(addr, PAGE_SIZE);
-    uintptr_t end = ROUNDUP(addr + size, PAGE_SIZE);
+    physaddr_t start = ROUNDDOWN(addr, PAGE_SIZE);
+    physaddr_t end = ROUNDUP(addr + size, PAGE_SIZE);
 
-    prev_mmio = metaheaptop;
-    metaheaptop += end - start;
+    struct MmioRegion *reg = mmio_lookup(start, end, prot);
+    if (reg) return (void *)(reg->va + addr - reg->start);
 
-    if (map_physical_region(&kspace, prev_mmio, start, end - start, PROT_R | PROT_W | PROT_CD) < 0)
+    uintptr_t va = mmio_place(start, end);
+    if (va + (end - start) > KERN_HEAP_END) panic("Kernel heap overflow\n");
+    metaheaptop = va + (end - start);
+
+    if (map_physical_region(&kspace, va, start, end - start, PROT_R | PROT_W | prot) < 0)
         panic("Cannot map physical region at %p of size %zd", (void *)addr, size);
 
-    return (void *)(prev_mmio + addr - start);
+    /* Regions are never unmapped, when the table is full
+     * new regions are just not cached */
+    reg = mmio_lookup(0, 0, 0);
+    if (reg) *reg = (struct MmioRegion){.start = start, .end = end, .va = va, .prot = prot};
+
+    return (void *)(va + addr - start);
 }
 
+/* Map device memory uncached */
 void *
-mmio_remap_last_region(physaddr_t addr, void *oldva, size_t oldsz, size_t size) {
-    uintptr_t start = ROUNDDOWN(addr, PAGE_SIZE);
-    uintptr_t end = ROUNDUP(addr + size, PAGE_SIZE);
+mmio_map_region(physaddr_t addr, size_t size) {
+    return mmio_map_region_prot(addr, size, PROT_CD);
+}
 
-    if (prev_mmio + addr - start != (uintptr_t)oldva &&
-        (prev_mmio + end - start != metaheaptop))
-        panic("Trying to remap non-last MMIO region!\n");
+/* Map device memory with caching type prot (PROT_CD or PROT_WC) */
+void *
+mmio_map_region_prot(physaddr_t addr, size_t size, int prot) {
+    assert(prot == PROT_CD || prot == PROT_WC);
+
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+    void *res = do_mmio_map_region(addr, size, prot);
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+    return res;
+}
 
-    metaheaptop = prev_mmio;
-    return mmio_map_region(addr, size);
+/* Grow the uncached mapping at oldva to size bytes. The region is
+ * extended in place if it is the last one mapped, otherwise a bigger
+ * mapping is made (or found) and the old one stays valid */
+void *
+mmio_remap_last_region(physaddr_t addr, void *oldva, size_t oldsz, size_t size) {
+    physaddr_t start = ROUNDDOWN(addr, PAGE_SIZE);
+    physaddr_t end = ROUNDUP(addr + size, PAGE_SIZE);
+
+    spin_lock(&page_lock);
+    tlb_batch_begin();
+
+    void *res;
+    struct MmioRegion *reg = mmio_lookup(start, ROUNDUP(addr + oldsz, PAGE_SIZE), PROT_CD);
+    if (reg && reg->va + (reg->end - reg->start) == metaheaptop && end > reg->end &&
+        metaheaptop + (end - reg->end) <= KERN_HEAP_END) {
+        assert((uintptr_t)oldva == reg->va + addr - reg->start);
+        if (map_physical_region(&kspace, metaheaptop, reg->end, end - reg->end, PROT_R | PROT_W | PROT_CD) < 0)
+            panic("Cannot map physical region at %p of size %zd", (void *)addr, size);
+        metaheaptop += end - reg->end;
+        reg->end = end;
+        res = oldva;
+    } else {
+        res = do_mmio_map_region(addr, size, PROT_CD);
+    }
+
+    tlb_batch_end();
+    spin_unlock(&page_lock);
+    return res;
 }
 
 static void
@@ -1993,10 +3642,68 @@ init_kspace(void) {
     kspace.cr3 = page2pa(page);
     memset(kspace.pml4, 0, CLASS_SIZE(0));
     kspace.pml4[PML4_INDEX(UVPT)] = kspace.cr3 | PTE_P | PTE_U;
+
+    /* Preallocate all kernel pdps, so kernel PML4 entries never change
+     * and are copied once into every new AddressSpace. They are
+     * referenced once here and are never freed (see remove_pt()) */
+    for (size_t i = NUSERPML4; i < PML4_ENTRY_COUNT; i++) {
+        if (i == PML4_INDEX(UVPT)) continue;
+        if (alloc_pt(kspace.pml4 + i) < 0) panic("Out of memory for kernel page tables");
+    }
+
     kspace.root = alloc_descriptor(INTERMEDIATE_NODE);
+    kspace.fault_around = FAULT_AROUND_DEFAULT;
 }
 
 #ifdef SANITIZE_SHADOW_BASE
+/* Hardware page table entry mapping va in kspace */
+static pte_t
+shadow_pte(uintptr_t va) {
+    pte_t pte = kspace.pml4[PML4_INDEX(va)];
+    if (!(pte & PTE_P)) return 0;
+    pte = ((pdpe_t *)KADDR(PTE_ADDR(pte)))[PDP_INDEX(va)];
+    if (!(pte & PTE_P) || (pte & PTE_PS)) return pte;
+    pte = ((pde_t *)KADDR(PTE_ADDR(pte)))[PD_INDEX(va)];
+    if (!(pte & PTE_P) || (pte & PTE_PS)) return pte;
+    return ((pte_t *)KADDR(PTE_ADDR(pte)))[PT_INDEX(va)];
+}
+
+/* Shadow memory is mapped lazily to one_page,
+ * which reads as poisoned, and gets its own pages
+ * only when some memory it covers is unpoisoned.
+ * Returns whether the shadow page containing shadow
+ * can be written, poisoning of shared one_page
+ * is not needed and is skipped.
+ * Called from ASAN runtime with or without page_lock */
+bool
+populate_shadow(uintptr_t shadow, bool unpoison) {
+    /* Early boot shadow is writable */
+    if (!current_space) return 1;
+
+    pte_t pte = shadow_pte(shadow);
+    if ((pte & (PTE_P | PTE_W)) == (PTE_P | PTE_W)) return 1;
+
+    physaddr_t pa = PTE_ADDR(pte);
+    if (!unpoison && (pte & PTE_P) &&
+        pa >= PADDR(one_page_raw) && pa < PADDR(one_page_raw) + HUGE_PAGE_SIZE) return 0;
+
+    /* Allocation of the shadow page unpoisons page itself
+     * so this nests when called with page_lock held */
+    bool locked = spin_holding(&page_lock);
+    if (!locked) spin_lock(&page_lock);
+
+    uintptr_t next;
+    int res = resolve_lazy_page(&kspace, ROUNDDOWN(shadow, PAGE_SIZE), 0, &next, NULL);
+    /* Shadow is written right away, so stale read-only
+     * mapping cannot wait for the batch to end */
+    tlb_batch_flush();
+
+    if (!locked) spin_unlock(&page_lock);
+
+    if (res == -E_NO_MEM) panic("Out of memory for shadow\n");
+    return !res;
+}
+
 static void
 unpoison_meta(struct Page *node) {
     while (node) {
@@ -2015,19 +3722,13 @@ static void
 init_shadow_pre(void) {
     int res;
 
-    /* Map shadow memory as filled with 0xFFs */
+    /* Map shadow memory as filled with 0xFFs,
+     * pages are allocated on first unpoison (see populate_shadow()) */
     res = map_region(&kspace, SANITIZE_SHADOW_BASE - 1 * GB, NULL, 0, MIN(SANITIZE_SHADOW_SIZE, max_memory_map_addr >> 3) + 1 * GB, PROT_R | PROT_W | ALLOC_ONE);
     assert(!res);
 
-    /* Force allocation of first (at most) 128MB of shadow memory
-     * which descriptors and page tables are allocated from */
-    int prealloc_class = 0;
-    size_t minpre = MIN(max_memory_map_addr, BOOT_MEM_SIZE);
-    if (minpre & (minpre - 1)) minpre += minpre;
-    while (CLASS_SIZE(prealloc_class) < minpre) prealloc_class++;
-    res = alloc_composite_page(&kspace, SANITIZE_SHADOW_BASE, MAX(prealloc_class - 3, 0), PROT_R | PROT_W);
-    assert(!res);
-
+    /* Stack redzones are written by instrumented code directly,
+     * so shadow of kernel stacks is allocated upfront */
     res = alloc_composite_page(&kspace, SANITIZE_SHADOW_BASE - CLASS_SIZE(3), 3, PROT_R | PROT_W);
     assert(!res);
 
@@ -2045,6 +3746,148 @@ init_shadow_pre(void) {
 }
 #endif
 
+/* Dense node number of SRAT proximity domain, -1 if there are too many */
+static int
+numa_domain_node(uint32_t domain) {
+    for (size_t i = 0; i < numa_nnodes; i++)
+        if (numa_domains[i] == domain) return i;
+    if (numa_nnodes == NUMA_MAX_NODES) return -1;
+    numa_domains[numa_nnodes] = domain;
+    return numa_nnodes++;
+}
+
+static void
+numa_add_range(physaddr_t start, physaddr_t end, int node) {
+    if (numa_nranges == NUMA_MAX_RANGES) {
+        cprintf("NUMA: too many memory ranges, [%08lX, %08lX) is node 0\n", (long)start, (long)end);
+        return;
+    }
+
+    /* Keep ranges sorted by address */
+    size_t i = numa_nranges++;
+    for (; i && numa_ranges[i - 1].start > start; i--)
+        numa_ranges[i] = numa_ranges[i - 1];
+    numa_ranges[i] = (struct NumaRange){start, end, node};
+}
+
+/* Put free page into its node lists, splitting it
+ * until no part of it spans several nodes */
+static void
+numa_place(struct Page *page) {
+    if (numa_node(page2pa(page), CLASS_SIZE(page->class)) >= 0) {
+        free_class_add(page);
+        return;
+    }
+
+    alloc_child(page, 0);
+    alloc_child(page, 1);
+    numa_place(page->left);
+    numa_place(page->right);
+}
+
+/* Move free pages, which all are in node 0 lists so far,
+ * to their nodes. Returns 0 if some page was split and
+ * lists have to be scanned again */
+static bool
+numa_sort_free_lists(void) {
+    for (size_t class = 0; class < MAX_CLASS; class++) {
+        struct List *lists[] = {&boot_free_classes[0][class], &free_classes[0][class]};
+        for (size_t i = 0; i < sizeof(lists) / sizeof(*lists); i++) {
+            for (struct List *n = lists[i]->next, *next; n != lists[i]; n = next) {
+                next = n->next;
+                struct Page *page = (struct Page *)n;
+                int node = numa_node(page2pa(page), CLASS_SIZE(page->class));
+                if (!node) continue;
+
+                list_del(n);
+                if (node > 0) {
+                    free_class_add(page);
+                } else {
+                    /* Splitting might allocate descriptors and change lists */
+                    numa_place(page);
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/* Detect NUMA topology from ACPI SRAT and SLIT and
+ * distribute free memory between node lists.
+ * Called once ACPI tables can be mapped */
+static void
+init_numa(void) {
+    SRAT *srat = get_srat();
+    if (!srat) return;
+
+    numa_nnodes = 0;
+    uint32_t apic_id;
+    cpuid(1, NULL, &apic_id, NULL, NULL);
+    apic_id >>= 24;
+
+    uint8_t *entry = srat->Entries, *end = (uint8_t *)srat + srat->h.Length;
+    for (; entry + sizeof(SRATEntry) <= end; entry += ((SRATEntry *)entry)->Length) {
+        SRATEntry *e = (SRATEntry *)entry;
+        if (e->Length < sizeof(SRATEntry) || entry + e->Length > end) break;
+
+        if (e->Type == SRAT_MEMORY && e->Length >= sizeof(SRATMemory)) {
+            SRATMemory *mem = (SRATMemory *)e;
+            if (!(mem->Flags & SRAT_ENABLED) || !mem->Length) continue;
+            int node = numa_domain_node(mem->Domain);
+            if (node >= 0) numa_add_range(mem->Base, mem->Base + mem->Length, node);
+        } else if (e->Type == SRAT_LAPIC && e->Length >= sizeof(SRATLapic)) {
+            SRATLapic *cpu = (SRATLapic *)e;
+            uint32_t domain = cpu->DomainLow | cpu->DomainHigh[0] << 8 |
+                              cpu->DomainHigh[1] << 16 | (uint32_t)cpu->DomainHigh[2] << 24;
+            int node = numa_domain_node(domain);
+            if ((cpu->Flags & SRAT_ENABLED) && cpu->ApicId == apic_id && node >= 0)
+                cpu_node[cpunum()] = node;
+        } else if (e->Type == SRAT_X2APIC && e->Length >= sizeof(SRATX2Apic)) {
+            SRATX2Apic *cpu = (SRATX2Apic *)e;
+            int node = numa_domain_node(cpu->Domain);
+            if ((cpu->Flags & SRAT_ENABLED) && cpu->X2ApicId == apic_id && node >= 0)
+                cpu_node[cpunum()] = node;
+        }
+    }
+    if (!numa_nnodes) numa_nnodes = 1;
+
+    /* Distances default to local/remote if SLIT is absent or
+     * does not describe some domain */
+    SLIT *slit = get_slit();
+    for (size_t i = 0; i < numa_nnodes; i++) {
+        for (size_t j = 0; j < numa_nnodes; j++) {
+            uint64_t di = numa_domains[i], dj = numa_domains[j];
+            if (slit && di < slit->Localities && dj < slit->Localities &&
+                sizeof(SLIT) + slit->Localities * slit->Localities <= slit->h.Length)
+                numa_distance[i][j] = slit->Entries[di * slit->Localities + dj];
+            else
+                numa_distance[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    /* Fallback order, nearest first, the node itself is the nearest */
+    for (size_t i = 0; i < numa_nnodes; i++) {
+        for (size_t j = 0; j < numa_nnodes; j++) {
+            size_t k = j;
+            for (; k && (j == i || (numa_order[i][k - 1] != i &&
+                                    numa_distance[i][numa_order[i][k - 1]] > numa_distance[i][j])); k--)
+                numa_order[i][k] = numa_order[i][k - 1];
+            numa_order[i][k] = j;
+        }
+    }
+
+    spin_lock(&page_lock);
+    while (!numa_sort_free_lists())
+        ;
+    spin_unlock(&page_lock);
+
+    if (trace_init) {
+        cprintf("NUMA: %zu nodes, %zu memory ranges, boot CPU on node %d\n",
+                numa_nnodes, numa_nranges, cpu_node[cpunum()]);
+    }
+}
+
 void
 init_memory(void) {
     init_allocator();
@@ -2184,6 +4027,14 @@ init_memory(void) {
 
     switch_address_space(&kspace);
 
+    /* kspace is loaded with PCID 0, as required for setting CR4_PCIDE */
+    uint32_t ecx;
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    if (ecx & CPUID_ECX_PCID) {
+        lcr4(rcr4() | CR4_PCIDE);
+        pcid_enabled = 1;
+    }
+
     /* One page is a page filled with 0xFF values -- ASAN poison */
     nosan_memset(one_page_raw, 0xFF, CLASS_SIZE(MAX_ALLOCATION_CLASS));
 
@@ -2320,6 +4171,7 @@ init_memory(void) {
         panic("mm: failed to map kernel pagefault stack to 32-bit region (virtual_start = %p, physical_start = %p, size = %zx).", (void*) region_va_start, (void*) region_pa_start, region_size);
     }
 
+    init_numa();
 
     if (trace_memory_more) dump_page_table(kspace.pml4);
 
@@ -2328,4 +4180,7 @@ init_memory(void) {
 
     check_virtual_tree(kspace.root, MAX_CLASS);
     if (trace_init) cprintf("Kernel virutal memory tree is correct\n");
+
+    check_fork_address_space();
+    if (trace_init) cprintf("Copy-on-write fork is correct\n");
 }
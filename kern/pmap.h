@@ -20,6 +20,10 @@
 /* asan unpoison routine used for whitelisting regions. */
 void platform_asan_unpoison(void *, size_t);
 void platform_asan_poison(void *, size_t);
+/* Heap objects: slot holds left redzone, object of objsize bytes,
+ * with size of them addressable, and right redzone */
+void platform_asan_alloc(void *slot, size_t size, size_t objsize, size_t redzone);
+void platform_asan_free(void *, size_t);
 /* not sanitized memset allows us to access "invalid" areas for extra poisoning. */
 void __nosan_memset(void *, int, size_t);
 void __nosan_memcpy(void *, void *, size_t);
@@ -44,6 +48,18 @@ void __nosan_memmove(void *, void *, size_t);
 
 #define PAGE_PROT(p) ((p) & ~NODE_TYPE_MASK)
 
+/* Age of a mapping node, in working set scans since its pages
+ * were last accessed (see wss_scan()), kept in unused state bits */
+#define PAGE_AGE_SHIFT 24
+#define PAGE_AGE_MAX   15
+#define PAGE_AGE_MASK  (PAGE_AGE_MAX << PAGE_AGE_SHIFT)
+#define PAGE_AGE(p)    (((p) & PAGE_AGE_MASK) >> PAGE_AGE_SHIFT)
+
+/* Working set scanner period and the number of
+ * scans a mapping counts in the working set after an access */
+#define WSS_SCAN_INTERVAL 100000000 /* nsec */
+#define WSS_WINDOW        4
+
 /* map_region() source override flags */
 #define ALLOC_ZERO 0x100000 /* Allocate memory filled with 0x00 */
 #define ALLOC_ONE  0x200000 /* Allocate memory filled with 0xFF */
@@ -66,6 +82,21 @@ void __nosan_memmove(void *, void *, size_t);
 /* Maximal size of page allocated on pagefault */
 #define MAX_ALLOCATION_CLASS 9
 
+/* Lazy mappings resolved after a fault by default (AddressSpace.fault_around) */
+#define FAULT_AROUND_DEFAULT 16
+
+/* Class passed to force_alloc_page() on copy-on-write faults,
+ * shared pages are split down to it before copying */
+#define COW_FAULT_CLASS 0
+
+/* How force_alloc_page() resolved a fault */
+enum FaultKind {
+    FAULT_NONE, /* Not a lazy mapping */
+    FAULT_MAP,  /* The only reference, just made not lazy */
+    FAULT_ZERO, /* Pre-zeroed copy of the zero page */
+    FAULT_COPY, /* Copied, e.g. copy-on-write after fork */
+};
+
 enum PageState {
     MAPPING_NODE = 0x100000,      /* Memory mapping (part of virtual tree) */ /* Virtual address mapped somewhere, a leaf in the tree (TODO: check!) */
     INTERMEDIATE_NODE = 0x200000, /* Intermediate node of virtual memory tree */ /* Intermediate node in the tree of virtual memory segments, not the leaf, and because of that not the actual mapping */
@@ -78,16 +109,23 @@ enum PageState {
 extern __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t zero_page_raw[HUGE_PAGE_SIZE];
 extern __attribute__((aligned(HUGE_PAGE_SIZE))) uint8_t one_page_raw[HUGE_PAGE_SIZE];
 
+/* Page descriptor, a node of physical or virtual memory tree.
+ *
+ * refc is kept next to state instead of inside the union,
+ * so both share one 8-byte word and the whole union is 8 bytes:
+ * the descriptor takes 56 bytes instead of 64.
+ * Fully split physical tree needs about 2 descriptors per 4KB page,
+ * which is 28MB of pools per GB managed (was 32MB) */
 struct Page {
     struct List head; /* This should be first member */
     struct Page *left, *right, *parent;
     enum PageState state;
+    /* Number of references (physical page)
+     * Child nodes always have class
+     * smaller by 1 than their parents */
+    uint32_t refc;
     union {
         struct /* physical page */ {
-            /* Number of references
-             * Child nodes always have class
-             * smaller by 1 than their parents */
-            uint32_t refc;
             uintptr_t class : CLASS_BASE;                        /* = log2(size)-CLASS_BASE */
             uintptr_t addr : sizeof(uintptr_t) * 8 - CLASS_BASE; /* = address >> CLASS_BASE */
         };
@@ -95,10 +133,12 @@ struct Page {
         struct Page *phy; /* If phy == NULL this is intemediate page */
     };
 };
+static_assert(sizeof(struct Page) == 56, "Page descriptor layout changed");
 
 struct PagePool {
     struct Page *peer;     /* Page from which memory is taken */
     struct PagePool *next; /* Next pool link */
+    size_t nfree;          /* Free descriptors in data[] */
     struct Page data[];    /* Page descriptors storage */
 };
 
@@ -108,11 +148,14 @@ void init_memory(void);
 void release_address_space(struct AddressSpace *space);
 struct AddressSpace *switch_address_space(struct AddressSpace *space);
 int init_address_space(struct AddressSpace *space);
+int fork_address_space(struct AddressSpace *dst, struct AddressSpace *src);
+int user_mem_check(struct Env *env, const void *va, size_t len, int perm, uintptr_t *fault);
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
 int region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size);
-int force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass);
+int force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass, enum FaultKind *kind);
 void dump_page_table(pte_t *pml4);
 void dump_memory_lists(void);
+void dump_memory_stats(void);
 
 static const int VIRT_TREE_DIR_ROOT        = 0;
 static const int VIRT_TREE_DIR_LEFT_CHILD  = 1;
@@ -120,8 +163,20 @@ static const int VIRT_TREE_DIR_RIGHT_CIHLD = 2;
 void dump_virtual_tree(struct Page *node, int class, unsigned int padding, int tree_direction);
 
 void *kzalloc_region(size_t size);
-
+int map_kernel_image(uintptr_t va, const void *kva, size_t size, int flags);
+void *kalloc_page(int class);
+void kfree_page(void *va, int class);
+void refill_zero_pool(void);
+void reclaim_address_spaces(void);
+void wss_init(void);
+void dump_working_sets(void);
+void ksm_scan(void);
+void ksm_set(bool on);
+void dump_ksm_stats(void);
+
+void pat_init(void);
 void *mmio_map_region(physaddr_t addr, size_t size);
+void *mmio_map_region_prot(physaddr_t addr, size_t size, int prot);
 void *mmio_remap_last_region(physaddr_t addr, void *oldva, size_t oldsz, size_t size);
 
 extern struct AddressSpace kspace;
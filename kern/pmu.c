@@ -0,0 +1,218 @@
+/* Hardware performance counters, see kern/pmu.h */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmu.h>
+
+#define CPUID_PMU            0xA
+#define CPUID_PMU_VERSION(a) ((a)&0xFF)
+#define CPUID_PMU_NGP(a)     (((a) >> 8) & 0xFF)
+#define CPUID_PMU_EBXLEN(a)  (((a) >> 24) & 0xFF)
+#define CPUID_PMU_NFIXED(d)  ((d)&0x1F)
+
+#define PMU_MAX_GP 8
+
+/* Where an event is counted */
+enum PmuCounter {
+    PMU_NONE,
+    PMU_FIXED,
+    PMU_GP,
+};
+
+struct PmuEventDesc {
+    const char *name;
+    uint8_t event, umask;
+    int8_t unavail_bit; /* Bit of CPUID.0xA:EBX set if not available, -1 if not architectural */
+    int8_t fixed;       /* Fixed counter counting it, -1 if none */
+};
+
+static const struct PmuEventDesc pmu_events[PMU_NEVENTS] = {
+        [PMU_CYCLES] = {"cycles", 0x3C, 0x00, 0, 1},
+        [PMU_INSTRUCTIONS] = {"instructions", 0xC0, 0x00, 1, 0},
+        [PMU_LLC_MISSES] = {"llc-misses", 0x2E, 0x41, 4, -1},
+        /* DTLB_LOAD_MISSES.WALK_COMPLETED, family 6 only */
+        [PMU_DTLB_MISSES] = {"dtlb-misses", 0x08, 0x0E, -1, -1},
+        [PMU_BRANCH_MISSES] = {"branch-misses", 0xC5, 0x00, 6, -1},
+};
+
+static struct {
+    enum PmuCounter kind;
+    int index;
+} pmu_map[PMU_NEVENTS];
+
+static unsigned pmu_version;
+static uint64_t pmu_global_ctrl;
+
+/* Env whose counts are in the counters of a CPU */
+static struct Env *pmu_owner[NCPU];
+
+static bool
+pmu_family6_intel(void) {
+    uint32_t ebx, ecx, edx, eax;
+    cpuid(0, NULL, &ebx, &ecx, &edx);
+    /* "GenuineIntel" */
+    if (ebx != 0x756E6547 || edx != 0x49656E69 || ecx != 0x6C65746E) return 0;
+    cpuid(1, &eax, NULL, NULL, NULL);
+    return ((eax >> 8) & 0xF) == 6;
+}
+
+void
+pmu_init(void) {
+    uint32_t eax, ebx, edx, max;
+    cpuid(0, &max, NULL, NULL, NULL);
+    if (max < CPUID_PMU) return;
+
+    cpuid(CPUID_PMU, &eax, &ebx, NULL, &edx);
+    pmu_version = CPUID_PMU_VERSION(eax);
+    if (!pmu_version) return;
+
+    unsigned ngp = MIN(CPUID_PMU_NGP(eax), PMU_MAX_GP);
+    unsigned nfixed = pmu_version >= 2 ? CPUID_PMU_NFIXED(edx) : 0;
+    unsigned ebxlen = CPUID_PMU_EBXLEN(eax);
+    unsigned gp = 0;
+    uint64_t fixed_ctrl = 0;
+
+    for (int i = 0; i < PMU_NEVENTS; i++) {
+        const struct PmuEventDesc *desc = &pmu_events[i];
+        pmu_map[i].kind = PMU_NONE;
+
+        if (desc->unavail_bit < 0 ? !pmu_family6_intel() :
+                                    desc->unavail_bit >= (int)ebxlen || (ebx & (1 << desc->unavail_bit)))
+            continue;
+
+        if (desc->fixed >= 0 && desc->fixed < (int)nfixed) {
+            pmu_map[i].kind = PMU_FIXED;
+            pmu_map[i].index = desc->fixed;
+            fixed_ctrl |= FIXED_CTR_CTRL_ALL(desc->fixed);
+            pmu_global_ctrl |= 1ULL << (32 + desc->fixed);
+            wrmsr(FIXED_CTR_MSR(desc->fixed), 0);
+        } else if (gp < ngp) {
+            pmu_map[i].kind = PMU_GP;
+            pmu_map[i].index = gp;
+            pmu_global_ctrl |= 1ULL << gp;
+            wrmsr(PERFEVTSEL_MSR(gp), 0);
+            wrmsr(PMC_MSR(gp), 0);
+            wrmsr(PERFEVTSEL_MSR(gp), desc->event | desc->umask << 8 |
+                                              PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+            gp++;
+        }
+    }
+
+    if (fixed_ctrl) wrmsr(FIXED_CTR_CTRL_MSR, fixed_ctrl);
+    if (pmu_version >= 2) wrmsr(PERF_GLOBAL_CTRL_MSR, pmu_global_ctrl);
+}
+
+static uint64_t
+pmu_read_counter(int event) {
+    switch (pmu_map[event].kind) {
+    case PMU_FIXED: return rdmsr(FIXED_CTR_MSR(pmu_map[event].index));
+    case PMU_GP: return rdmsr(PMC_MSR(pmu_map[event].index));
+    default: return 0;
+    }
+}
+
+static void
+pmu_reset(void) {
+    for (int i = 0; i < PMU_NEVENTS; i++) {
+        if (pmu_map[i].kind == PMU_FIXED) wrmsr(FIXED_CTR_MSR(pmu_map[i].index), 0);
+        if (pmu_map[i].kind == PMU_GP) wrmsr(PMC_MSR(pmu_map[i].index), 0);
+    }
+}
+
+/* Current values of the counters of this CPU,
+ * events that are not counted read as 0 */
+void
+pmu_read(struct PmuCounts *counts) {
+    for (int i = 0; i < PMU_NEVENTS; i++)
+        counts->count[i] = pmu_read_counter(i);
+}
+
+/* Totals of env, including its running time so far */
+void
+pmu_env_counts(struct Env *env, struct PmuCounts *counts) {
+    memcpy(counts->count, env->env_pmc, sizeof counts->count);
+    if (pmu_owner[cpunum()] != env) return;
+
+    for (int i = 0; i < PMU_NEVENTS; i++)
+        counts->count[i] += pmu_read_counter(i);
+}
+
+/* Called when env is about to run on this CPU */
+void
+pmu_switch(struct Env *env) {
+    struct Env *owner = pmu_owner[cpunum()];
+    if (!pmu_version || owner == env) return;
+
+    if (owner) {
+        for (int i = 0; i < PMU_NEVENTS; i++)
+            owner->env_pmc[i] += pmu_read_counter(i);
+    }
+    pmu_reset();
+    pmu_owner[cpunum()] = env;
+}
+
+/* Forget env when it is freed, its counts are dropped */
+void
+pmu_release(struct Env *env) {
+    for (int i = 0; i < NCPU; i++)
+        if (pmu_owner[i] == env) pmu_owner[i] = NULL;
+    memset(env->env_pmc, 0, sizeof env->env_pmc);
+}
+
+/* Allow or forbid RDPMC in user mode */
+int
+pmu_set_user_rdpmc(bool on) {
+    if (!pmu_version) return -E_NO_ENT;
+    lcr4(on ? rcr4() | CR4_PCE : rcr4() & ~CR4_PCE);
+    return 0;
+}
+
+/* Print num * scale / den with two decimals */
+static void
+pmu_print_ratio(const char *name, uint64_t num, uint64_t den, uint64_t scale) {
+    if (!den) return;
+    uint64_t r = num * scale * 100 / den;
+    cprintf("  %-16s %lu.%02lu\n", name, (unsigned long)(r / 100), (unsigned long)(r % 100));
+}
+
+void
+pmu_print(const struct PmuCounts *counts) {
+    if (!pmu_version) {
+        cprintf("No architectural performance counters\n");
+        return;
+    }
+
+    for (int i = 0; i < PMU_NEVENTS; i++) {
+        if (pmu_map[i].kind == PMU_NONE)
+            cprintf("  %-16s %16s\n", pmu_events[i].name, "<not counted>");
+        else
+            cprintf("  %-16s %16lu\n", pmu_events[i].name, (unsigned long)counts->count[i]);
+    }
+
+    const uint64_t *c = counts->count;
+    pmu_print_ratio("IPC", c[PMU_INSTRUCTIONS], c[PMU_CYCLES], 1);
+    if (pmu_map[PMU_DTLB_MISSES].kind != PMU_NONE)
+        pmu_print_ratio("dTLB MPKI", c[PMU_DTLB_MISSES], c[PMU_INSTRUCTIONS], 1000);
+    if (pmu_map[PMU_BRANCH_MISSES].kind != PMU_NONE)
+        pmu_print_ratio("branch MPKI", c[PMU_BRANCH_MISSES], c[PMU_INSTRUCTIONS], 1000);
+}
+
+void
+pmu_dump_envs(void) {
+    for (size_t i = 0; i < nenvs; i++) {
+        struct Env *env = env_at(i);
+        if (env->env_status == ENV_FREE) continue;
+
+        struct PmuCounts counts;
+        pmu_env_counts(env, &counts);
+        cprintf("env %08x:\n", env->env_id);
+        pmu_print(&counts);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef JOS_KERN_PMU_H
+#define JOS_KERN_PMU_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/assert.h>
+#include <inc/types.h>
+#include <inc/env.h>
+
+/* Hardware performance counters.
+ *
+ * Architectural PMU (CPUID leaf 0xA) counts the events below in ring 0
+ * and 3. Instructions and cycles use fixed counters when there are any,
+ * the rest take general purpose ones. Counters are zeroed when an env
+ * is switched in and added to its env_pmc[] when it is switched out,
+ * so with user RDPMC enabled (CR4.PCE) an env reads its counts since
+ * it was last scheduled */
+
+enum PmuEvent {
+    PMU_CYCLES,
+    PMU_INSTRUCTIONS,
+    PMU_LLC_MISSES,
+    PMU_DTLB_MISSES,
+    PMU_BRANCH_MISSES,
+};
+
+static_assert(PMU_BRANCH_MISSES + 1 == PMU_NEVENTS, "PMU_NEVENTS is out of date");
+
+struct PmuCounts {
+    uint64_t count[PMU_NEVENTS];
+};
+
+void pmu_init(void);
+void pmu_read(struct PmuCounts *counts);
+void pmu_env_counts(struct Env *env, struct PmuCounts *counts);
+void pmu_switch(struct Env *env);
+void pmu_release(struct Env *env);
+int pmu_set_user_rdpmc(bool on);
+void pmu_print(const struct PmuCounts *counts);
+void pmu_dump_envs(void);
+
+#endif /* !JOS_KERN_PMU_H */
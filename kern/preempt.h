@@ -0,0 +1,39 @@
+#ifndef JOS_KERN_PREEMPT_H
+#define JOS_KERN_PREEMPT_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+/* Kernel preemption points.
+ *
+ * The kernel runs with interrupts disabled and a trap never returns
+ * to the kernel code it has interrupted, so an env can't be switched
+ * away from in the middle of a system call. Long operations (mapping
+ * huge regions, walking DWARF info) call preempt_point() instead
+ * between steps. Pending interrupts are handled there, the same way
+ * as in trap_wait(), and a timer tick only sets need_resched, so the
+ * env is rescheduled right when the current trap returns.
+ *
+ * Spinlocks disable preemption points while held, an interrupt handler
+ * may take the same lock. They are also disabled during boot, until
+ * every interrupt has its handler. */
+
+extern int preempt_count[NCPU];
+extern bool need_resched[NCPU];
+
+static inline void
+preempt_disable(void) {
+    preempt_count[cpunum()]++;
+}
+
+static inline void
+preempt_enable(void) {
+    preempt_count[cpunum()]--;
+}
+
+void preempt_point(void);
+
+#endif /* JOS_KERN_PREEMPT_H */
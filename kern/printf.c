@@ -1,21 +1,27 @@
 /* Simple implementation of cprintf console output for the kernel,
- * based on printfmt() and the kernel console's cputchar() */
+ * based on printfmt() and the kernel log, see kern/klog.c */
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/klog.h>
 
 static void
-putch(int ch, int *cnt) {
-    cputchar(ch);
-    (*cnt)++;
+putstr(const char *str, size_t len, int *cnt) {
+    klog_write(str, len);
+    *cnt += len;
 }
 
 int
 vcprintf(const char *fmt, va_list ap) {
     int count = 0;
 
-    vprintfmt((void *)putch, &count, fmt, ap);
+    vprintfmt_puts((void *)putstr, &count, fmt, ap);
+
+    /* The devices are written to later, unless no one is going to
+     * drain the log (early boot, panic) */
+    extern const char *panicstr;
+    if (!klog_async || panicstr) klog_drain(0);
 
     return count;
 }
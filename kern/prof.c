@@ -0,0 +1,177 @@
+#include <inc/assert.h>
+#include <inc/memlayout.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/trap.h>
+
+#include <kern/cpu.h>
+#include <kern/kdebug.h>
+#include <kern/prof.h>
+
+struct ProfSample {
+    uintptr_t rip;
+    uintptr_t stack[PROF_DEPTH]; /* Return addresses, 0-terminated if shorter */
+};
+
+/* Written only by its CPU from the timer interrupt */
+struct ProfRing {
+    struct ProfSample samples[PROF_RING];
+    uint64_t total; /* Samples taken, the ring keeps the last PROF_RING */
+    unsigned ticks;
+};
+
+static struct ProfRing prof_rings[NCPU];
+
+static volatile bool prof_running;
+static unsigned prof_interval = 1;
+
+void
+prof_start(unsigned interval) {
+    prof_running = 0;
+    memset(prof_rings, 0, sizeof(prof_rings));
+    prof_interval = interval ? interval : 1;
+    prof_running = 1;
+}
+
+void
+prof_stop(void) {
+    prof_running = 0;
+}
+
+/* Stack the interrupted code was running on. Walking stops at its
+ * top, so a bogus %rbp can't make us read unmapped memory. */
+static uintptr_t
+prof_stack_top(uintptr_t rsp) {
+    if (rsp >= KERN_STACK_TOP - KERN_STACK_SIZE && rsp < KERN_STACK_TOP)
+        return KERN_STACK_TOP;
+#ifdef CONFIG_KSPACE
+    /* Kernel-space programs get PROG_STACK_SIZE aligned stacks, see env_alloc() */
+    if (rsp < MAX_USER_READABLE)
+        return ROUNDUP(rsp + 1, PROG_STACK_SIZE);
+#endif
+    return 0;
+}
+
+void
+prof_sample(const struct Trapframe *tf) {
+    if (!prof_running) return;
+
+    struct ProfRing *ring = &prof_rings[cpunum()];
+    if (++ring->ticks < prof_interval) return;
+    ring->ticks = 0;
+
+    struct ProfSample *sample = &ring->samples[ring->total++ % PROF_RING];
+    memset(sample, 0, sizeof(*sample));
+    sample->rip = tf->tf_rip;
+
+    /* User mode stacks may be lazily mapped, only walk kernel mode ones */
+    if (tf->tf_cs & 3) return;
+
+    uintptr_t lo = tf->tf_rsp, hi = prof_stack_top(tf->tf_rsp);
+    uintptr_t rbp = tf->tf_regs.reg_rbp;
+    for (int i = 0; i < PROF_DEPTH; i++) {
+        if (rbp < lo || rbp + 2 * sizeof(uintptr_t) > hi || rbp % sizeof(uintptr_t)) break;
+        const uintptr_t *frame = (const uintptr_t *)rbp;
+        sample->stack[i] = frame[1];
+        /* Frames only go up the stack */
+        lo = rbp + 2 * sizeof(uintptr_t);
+        rbp = frame[0];
+    }
+}
+
+#define PROF_MAX_FUNCS 128
+
+struct ProfFunc {
+    uintptr_t addr; /* Function start, 0 for addresses without debug info */
+    uint64_t self;
+    uint64_t total;
+    char name[32];
+};
+
+static struct ProfFunc prof_funcs[PROF_MAX_FUNCS];
+
+static struct ProfFunc *
+prof_func(uintptr_t pc, size_t *nfuncs) {
+    uintptr_t addr = 0;
+    const char *name = "<no debug info>";
+    int namelen = strlen(name);
+
+    struct Ripdebuginfo info;
+    if (pc >= MAX_USER_READABLE && debuginfo_rip(pc, &info) >= 0) {
+        addr = info.rip_fn_addr;
+        name = info.rip_fn_name;
+        namelen = info.rip_fn_namelen;
+    }
+
+    for (size_t i = 0; i < *nfuncs; i++)
+        if (prof_funcs[i].addr == addr) return &prof_funcs[i];
+    if (*nfuncs == PROF_MAX_FUNCS) return NULL;
+
+    struct ProfFunc *func = &prof_funcs[(*nfuncs)++];
+    memset(func, 0, sizeof(*func));
+    func->addr = addr;
+    strncpy(func->name, name, MIN((size_t)namelen, sizeof(func->name) - 1));
+    return func;
+}
+
+/* Aggregate recorded samples by function and print the
+ * limit functions with the most samples of their own */
+void
+prof_dump_top(size_t limit) {
+    bool running = prof_running;
+    prof_running = 0;
+
+    size_t nfuncs = 0, nsamples = 0, lost = 0;
+    uint64_t taken = 0;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct ProfRing *ring = &prof_rings[cpu];
+        size_t n = MIN(ring->total, PROF_RING);
+        taken += ring->total;
+
+        for (size_t i = 0; i < n; i++) {
+            struct ProfSample *sample = &ring->samples[i];
+            struct ProfFunc *self = prof_func(sample->rip, &nfuncs);
+            if (!self) {
+                lost++;
+                continue;
+            }
+            self->self++;
+            self->total++;
+            nsamples++;
+
+            /* Count a function once per sample even if it recurses.
+             * Return addresses point after the call, look up the call itself */
+            struct ProfFunc *seen[PROF_DEPTH + 1] = {self};
+            for (int j = 0; j < PROF_DEPTH && sample->stack[j]; j++) {
+                struct ProfFunc *func = prof_func(sample->stack[j] - 1, &nfuncs);
+                bool dup = !func;
+                for (int k = 0; k <= j && !dup; k++) dup = seen[k] == func;
+                seen[j + 1] = func;
+                if (!dup) func->total++;
+            }
+        }
+    }
+
+    /* Selection sort by self samples, the table is tiny */
+    for (size_t i = 0; i < nfuncs; i++) {
+        size_t best = i;
+        for (size_t j = i + 1; j < nfuncs; j++)
+            if (prof_funcs[j].self > prof_funcs[best].self) best = j;
+        struct ProfFunc tmp = prof_funcs[i];
+        prof_funcs[i] = prof_funcs[best];
+        prof_funcs[best] = tmp;
+    }
+
+    cprintf("%lu samples taken, %lu in buffers", (unsigned long)taken, (unsigned long)(nsamples + lost));
+    if (lost) cprintf(", %lu not shown (function table full)", (unsigned long)lost);
+    cprintf("\n%8s %6s %8s %6s  %-18s %s\n", "self", "%", "total", "%", "address", "function");
+    for (size_t i = 0; i < MIN(limit, nfuncs); i++) {
+        struct ProfFunc *func = &prof_funcs[i];
+        cprintf("%8lu %5lu%% %8lu %5lu%%  %018lx %s\n",
+                (unsigned long)func->self, (unsigned long)(func->self * 100 / nsamples),
+                (unsigned long)func->total, (unsigned long)(func->total * 100 / nsamples),
+                (unsigned long)func->addr, func->name);
+    }
+
+    prof_running = running;
+}
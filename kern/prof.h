@@ -0,0 +1,24 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Trapframe;
+
+/* Sampling profiler. While running, every prof_interval-th scheduler
+ * tick records the interrupted rip and up to PROF_DEPTH return
+ * addresses from its %rbp chain into a per-CPU ring buffer. */
+#define PROF_DEPTH 4
+#define PROF_RING  1024
+
+void prof_start(unsigned interval);
+void prof_stop(void);
+void prof_sample(const struct Trapframe *tf);
+void prof_dump_top(size_t limit);
+
+#endif /* !JOS_KERN_PROF_H */
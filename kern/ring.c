@@ -0,0 +1,163 @@
+/* Shared memory rings between environments, see inc/ring.h */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ring.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+/* The kernel only keeps track of who may wait on a ring and who is
+ * waiting. The data never goes through it */
+struct KRing {
+    envid_t env[2];   /* Creator and peer, 0 once one has gone */
+    uintptr_t va[2];  /* Where each of them has the ring mapped */
+    bool waiting[2];  /* Blocked in ring_wait() */
+};
+
+static struct KRing rings[NRINGS];
+static struct spinlock ring_lock = SPINLOCK_INITIALIZER(ring_lock, LOCK_ORDER_RING);
+
+/* Side of the ring curenv is, -1 if none. ring_lock must be held */
+static int
+ring_side(int id) {
+    if (id < 0 || id >= NRINGS) return -1;
+    if (rings[id].env[0] == curenv->env_id) return 0;
+    if (rings[id].env[1] == curenv->env_id) return 1;
+    return -1;
+}
+
+static void
+ring_wakeup(struct KRing *ring, int side) {
+    if (!ring->waiting[side]) return;
+    ring->waiting[side] = 0;
+
+    struct Env *env;
+    if (envid2env(ring->env[side], &env, 0) < 0 || env->env_status != ENV_NOT_RUNNABLE) return;
+    env->env_status = ENV_RUNNABLE;
+    sched_enqueue(env);
+}
+
+/* Create a ring with size bytes of data shared between curenv,
+ * which gets it at va, and peer, which gets it at peer_va. Envs that
+ * share the address space both use va. Returns the ring id, which
+ * peer needs for ring_attach() */
+int
+ring_create(envid_t peer, uintptr_t va, uintptr_t peer_va, size_t size) {
+    const int prot = PROT_R | PROT_W | PROT_USER_ | PROT_SHARE;
+    size_t total = RING_DATA_OFFSET + size;
+
+    if (!size || size & (size - 1) || PAGE_OFFSET(size)) return -E_INVAL;
+    if (PAGE_OFFSET(va) || va >= MAX_USER_ADDRESS || total > MAX_USER_ADDRESS - va) return -E_INVAL;
+
+    struct Env *env;
+    int res = envid2env(peer, &env, 0);
+    if (res < 0) return res;
+    if (env == curenv) return -E_INVAL;
+
+    bool same_space = env_space(env) == env_space(curenv);
+    if (same_space) peer_va = va;
+    if (PAGE_OFFSET(peer_va) || peer_va >= MAX_USER_ADDRESS || total > MAX_USER_ADDRESS - peer_va) return -E_INVAL;
+
+    /* Reserve a slot, nobody can wait on it before it is set up */
+    spin_lock(&ring_lock);
+    int id = 0;
+    while (id < NRINGS && (rings[id].env[0] || rings[id].env[1])) id++;
+    if (id < NRINGS) rings[id].env[0] = curenv->env_id;
+    spin_unlock(&ring_lock);
+    if (id == NRINGS) return -E_NO_MEM;
+
+    res = map_region(env_space(curenv), va, NULL, 0, total, prot | ALLOC_ZERO);
+    if (!res && !same_space) {
+        res = map_region(env_space(env), peer_va, env_space(curenv), va, total, prot);
+        if (res < 0) unmap_region(env_space(curenv), va, total);
+    }
+    if (res < 0) {
+        spin_lock(&ring_lock);
+        rings[id].env[0] = 0;
+        spin_unlock(&ring_lock);
+        return res;
+    }
+
+    /* curenv's address space is the current one */
+    ((struct RingHeader *)va)->size = size;
+
+    spin_lock(&ring_lock);
+    rings[id] = (struct KRing){.env = {curenv->env_id, peer}, .va = {va, peer_va}};
+    spin_unlock(&ring_lock);
+    return id;
+}
+
+/* Address at which curenv has the ring 'id' mapped */
+int64_t
+ring_attach(int id) {
+    spin_lock(&ring_lock);
+    int side = ring_side(id);
+    int64_t res = side < 0 ? -E_INVAL : (int64_t)rings[id].va[side];
+    spin_unlock(&ring_lock);
+    return res;
+}
+
+/* Block curenv on the ring until the other side calls ring_wake(),
+ * if the 64-bit word at 'word' in curenv's ring header still holds
+ * 'expected'. The check is done under the same lock as the wakeup,
+ * so an update made before ring_wake() is never missed.
+ * The caller should sched_yield() if this returns 1 */
+int
+ring_wait(int id, uintptr_t word, uint64_t expected) {
+    spin_lock(&ring_lock);
+
+    int res, side = ring_side(id);
+    if (side < 0) {
+        res = -E_INVAL;
+    } else if (!rings[id].env[!side]) {
+        /* Nobody is left to wake us up */
+        res = -E_BAD_ENV;
+    } else if (word % sizeof(uint64_t) || word < rings[id].va[side] ||
+               word >= rings[id].va[side] + sizeof(struct RingHeader)) {
+        res = -E_INVAL;
+    } else if (*(volatile uint64_t *)word != expected) {
+        res = 0;
+    } else {
+        rings[id].waiting[side] = 1;
+        curenv->env_status = ENV_NOT_RUNNABLE;
+        res = 1;
+    }
+
+    spin_unlock(&ring_lock);
+    return res;
+}
+
+/* Make the other side of the ring runnable if it is waiting */
+int
+ring_wake(int id) {
+    spin_lock(&ring_lock);
+
+    int side = ring_side(id);
+    if (side >= 0) ring_wakeup(&rings[id], !side);
+
+    spin_unlock(&ring_lock);
+    return side < 0 ? -E_INVAL : 0;
+}
+
+/* env is being freed, so it leaves all of its rings.
+ * The pages stay mapped in the other side until it goes too */
+void
+ring_release(struct Env *env) {
+    spin_lock(&ring_lock);
+
+    for (int id = 0; id < NRINGS; id++) {
+        for (int side = 0; side < 2; side++) {
+            if (rings[id].env[side] != env->env_id) continue;
+            rings[id].env[side] = 0;
+            rings[id].waiting[side] = 0;
+            /* Let the other side find out */
+            if (rings[id].env[!side]) ring_wakeup(&rings[id], !side);
+        }
+    }
+
+    spin_unlock(&ring_lock);
+}
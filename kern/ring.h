@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_RING_H
+#define JOS_KERN_RING_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+#include <inc/ring.h>
+
+/* Rings that may exist at the same time */
+#define NRINGS 64
+
+int ring_create(envid_t peer, uintptr_t va, uintptr_t peer_va, size_t size);
+int64_t ring_attach(int id);
+int ring_wait(int id, uintptr_t word, uint64_t expected);
+int ring_wake(int id);
+void ring_release(struct Env *env);
+
+#endif /* !JOS_KERN_RING_H */
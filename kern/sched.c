@@ -1,20 +1,350 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
 #include <kern/env.h>
+#include <kern/klog.h>
+#include <kern/ktimer.h>
+#include <kern/cpu.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/preempt.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
+#include <kern/picirq.h>
 
 
 struct Taskstate cpu_ts;
 _Noreturn void sched_halt(void);
 
+/* Per-CPU run queue of ENV_RUNNABLE environments, linked by Env->env_runq.
+ * Environments are appended to the tail of the queue of the CPU they
+ * last ran on (Env->env_cpunum) and taken from the head, which gives the
+ * same round-robin order as scanning the env table circularly, but in O(1).
+ * In the fair class the queue is kept ordered by Env->env_vruntime instead,
+ * so the head is still the env to run next */
+struct Runqueue {
+    struct spinlock lock;
+    struct List head;
+    size_t nr_runnable;
+    uint64_t min_vruntime; /* Monotonic lower bound of queued vruntimes */
+    uint64_t steals; /* Envs this CPU took from other CPUs' queues */
+    /* Scheduling latency: bucket i counts waits in the run queue
+     * of [2^i, 2^(i+1)) TSC cycles */
+    uint64_t latency_hist[64];
+};
+
+static struct Runqueue runqueues[NCPU];
+
+enum SchedClass sched_class = SCHED_CLASS_RR;
+
+/* Stop the scheduler tick while the CPU is idle */
+bool sched_tickless = 1;
+/* The tick of timer_for_schedule is currently stopped */
+static bool tick_stopped;
+
+/* Scheduling decision statistics, see sched_dump_stats() */
+static uint64_t sched_decisions;
+static uint64_t sched_decision_cycles;
+
+#define RUNQ_ENV(list) ((struct Env *)((uint8_t *)(list)-offsetof(struct Env, env_runq)))
+
+void
+sched_init(void) {
+    for (int i = 0; i < NCPU; i++) {
+        spin_initlock(&runqueues[i].lock, LOCK_ORDER_SCHED);
+        runqueues[i].head.next = runqueues[i].head.prev = &runqueues[i].head;
+        runqueues[i].nr_runnable = 0;
+        runqueues[i].min_vruntime = 0;
+        runqueues[i].steals = 0;
+    }
+}
+
+/* Unlink env from the queue rq, rq must be locked */
+static void
+runq_remove(struct Runqueue *rq, struct Env *env) {
+    env->env_runq.prev->next = env->env_runq.next;
+    env->env_runq.next->prev = env->env_runq.prev;
+    env->env_runq.next = env->env_runq.prev = &env->env_runq;
+    rq->nr_runnable--;
+}
+
+/* How far a waking env's vruntime may lag behind the queue, in TSC cycles */
+static uint64_t
+sched_wakeup_slack(void) {
+    static uint64_t slack;
+    if (!slack) slack = tsc_calibrate() / 1000000 * SCHED_WAKEUP_SLACK_US;
+    return slack;
+}
+
+/* Link env into rq, rq must be locked.
+ * In the fair class the position is searched from the tail: an env
+ * that has just run usually has the largest vruntime in the queue,
+ * so this is O(1) in the common case. Equal vruntimes keep FIFO order */
+static void
+runq_insert(struct Runqueue *rq, struct Env *env) {
+    struct List *prev = rq->head.prev;
+    if (sched_class == SCHED_CLASS_FAIR) {
+        while (prev != &rq->head && RUNQ_ENV(prev)->env_vruntime > env->env_vruntime)
+            prev = prev->prev;
+    }
+
+    env->env_runq.next = prev->next;
+    env->env_runq.prev = prev;
+    prev->next->prev = &env->env_runq;
+    prev->next = &env->env_runq;
+    rq->nr_runnable++;
+}
+
+/* Append env to the run queue of the CPU it last ran on */
+void
+sched_enqueue(struct Env *env) {
+    assert(env->env_status == ENV_RUNNABLE);
+    assert(env->env_runq.next == &env->env_runq);
+    assert(env->env_cpunum >= 0 && env->env_cpunum < NCPU);
+
+    struct Runqueue *rq = &runqueues[env->env_cpunum];
+    spin_lock(&rq->lock);
+    /* Don't let a new env, or one that has been sleeping for long,
+     * monopolize the CPU until it catches up with the others.
+     * A waking env keeps a small credit for the time it slept */
+    uint64_t floor = rq->min_vruntime;
+    if (env->env_runs) floor = floor > sched_wakeup_slack() ? floor - sched_wakeup_slack() : 0;
+    if (env->env_vruntime < floor) env->env_vruntime = floor;
+    env->env_runnable_since = read_tsc();
+    runq_insert(rq, env);
+    spin_unlock(&rq->lock);
+}
+
+/* Remove env from its run queue.
+ * Does nothing if env is not queued */
+void
+sched_dequeue(struct Env *env) {
+    struct Runqueue *rq = &runqueues[env->env_cpunum];
+    spin_lock(&rq->lock);
+    if (env->env_runq.next != &env->env_runq)
+        runq_remove(rq, env);
+    spin_unlock(&rq->lock);
+}
+
+/* Charge env for the TSC cycles it consumed since it was last
+ * charged, scaled by its weight. Called on every entry to the kernel
+ * from a running env */
+void
+sched_account(struct Env *env) {
+    uint64_t now = read_tsc();
+    uint64_t delta = now - env->env_run_start;
+
+    env->env_run_start = now;
+    env->env_user_cycles += delta;
+    env->env_vruntime += delta * SCHED_WEIGHT_DEFAULT / env->env_weight;
+}
+
+/* Called by env_run() before it switches from prev (curenv, may be NULL
+ * or already gone) to next, or resumes next == prev. prev has been in the
+ * kernel since it was last charged by sched_account(), and is preempted
+ * if it is still running after an interrupt. Returns the current TSC */
+uint64_t
+sched_account_run(struct Env *prev, struct Env *next) {
+    uint64_t now = read_tsc();
+
+    if (prev && (prev->env_status == ENV_RUNNING || prev->env_status == ENV_NOT_RUNNABLE)) {
+        prev->env_kernel_cycles += now - prev->env_run_start;
+
+        if (prev != next) {
+            uint64_t trapno = prev->env_tf.tf_trapno;
+            if (prev->env_status == ENV_RUNNING && trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + MAX_IRQS)
+                prev->env_nivcsw++;
+            else
+                prev->env_nvcsw++;
+        }
+    }
+
+    if (prev != next) {
+        uint64_t wait = now - next->env_runnable_since;
+        next->env_wait_cycles += wait;
+        runqueues[cpunum()].latency_hist[wait ? 63 - __builtin_clzll(wait) : 0]++;
+    }
+
+    return now;
+}
+
+static const char *
+sched_status_name(unsigned status) {
+    static const char *const names[] = {"FREE", "DYING", "RUNNABLE", "RUNNING", "NOT_RUNNABLE"};
+    return status < sizeof(names) / sizeof(*names) ? names[status] : "?";
+}
+
+/* Microseconds in TSC cycles */
+static unsigned long
+sched_cycles2us(uint64_t cycles) {
+    uint64_t freq = tsc_calibrate();
+    return cycles / freq * 1000000 + cycles % freq * 1000000 / freq;
+}
+
+static void
+sched_print_env(struct Env *env) {
+    cprintf("%08x %-12s %8u %10lu %10lu %6u %6u %8lu\n", env->env_id,
+            sched_status_name(env->env_status), env->env_runs,
+            sched_cycles2us(env->env_user_cycles), sched_cycles2us(env->env_kernel_cycles),
+            env->env_nvcsw, env->env_nivcsw,
+            env->env_runs ? sched_cycles2us(env->env_wait_cycles / env->env_runs) : 0UL);
+}
+
+/* Print CPU accounting of existing envs. If 'top' is set,
+ * only the 'limit' envs with the most CPU time, busiest first */
+void
+sched_dump_envs(size_t limit, bool top) {
+    cprintf("ENV      STATUS           RUNS    USER_US    KERN_US   VCSW  IVCSW  WAIT_US\n");
+
+    if (!top) {
+        for (size_t i = 0; i < nenvs; i++)
+            if (env_at(i)->env_status != ENV_FREE) sched_print_env(env_at(i));
+        return;
+    }
+
+    /* Selection by repeated scans, ties broken by the index,
+     * so that no buffer is needed */
+    uint64_t last = ~0ULL;
+    size_t last_index = 0;
+    for (size_t n = 0; n < limit; n++) {
+        struct Env *best = NULL;
+        uint64_t best_total = 0;
+        for (size_t i = 0; i < nenvs; i++) {
+            struct Env *env = env_at(i);
+            if (env->env_status == ENV_FREE) continue;
+
+            uint64_t total = env->env_user_cycles + env->env_kernel_cycles;
+            if (total > last || (total == last && i <= last_index && n)) continue;
+            if (!best || total > best_total) best = env, best_total = total;
+        }
+        if (!best) break;
+
+        sched_print_env(best);
+        last = best_total;
+        last_index = ENVX(best->env_id);
+    }
+}
+
+/* Print the scheduling latency histogram of all CPUs */
+void
+sched_dump_latency(void) {
+    uint64_t hist[64] = {0}, total = 0;
+    for (int i = 0; i < NCPU; i++)
+        for (int b = 0; b < 64; b++) hist[b] += runqueues[i].latency_hist[b];
+    for (int b = 0; b < 64; b++) total += hist[b];
+
+    cprintf("Scheduling latency, TSC cycles:\n");
+    if (!total) return;
+
+    uint64_t max = 0;
+    for (int b = 0; b < 64; b++) max = MAX(max, hist[b]);
+    for (int b = 0; b < 64; b++) {
+        if (!hist[b]) continue;
+        cprintf("  2^%-2d %10lu |", b, (unsigned long)hist[b]);
+        for (uint64_t i = 0; i < (hist[b] * 40 + max - 1) / max; i++) cprintf("#");
+        cprintf("\n");
+    }
+}
+
+/* Take the next env to run from this CPU's queue.
+ * In the fair class the running env 'cur' competes with the queued ones,
+ * and NULL is returned if it should keep running */
+static struct Env *
+runq_pop(int cpu, struct Env *cur) {
+    struct Runqueue *rq = &runqueues[cpu];
+    struct Env *env = NULL;
+
+    spin_lock(&rq->lock);
+    if (rq->head.next != &rq->head) {
+        env = RUNQ_ENV(rq->head.next);
+        if (sched_class == SCHED_CLASS_FAIR && cur && cur->env_vruntime < env->env_vruntime) env = NULL;
+    }
+    if (env) {
+        runq_remove(rq, env);
+        if (env->env_vruntime > rq->min_vruntime)
+            rq->min_vruntime = env->env_vruntime;
+    }
+    spin_unlock(&rq->lock);
+    return env;
+}
+
+/* Steal an env from the busiest peer of 'cpu'.
+ * Envs are always queued on the CPU they last ran on, so migration
+ * only happens here. The env at the head of the victim's queue is
+ * about to run there, take the one from the tail which is the least
+ * likely to still be hot in the victim's caches */
+static struct Env *
+runq_steal(int cpu) {
+    struct Runqueue *victim = NULL;
+    for (int i = 0; i < NCPU; i++) {
+        if (i == cpu || !runqueues[i].nr_runnable) continue;
+        if (!victim || runqueues[i].nr_runnable > victim->nr_runnable)
+            victim = &runqueues[i];
+    }
+    if (!victim) return NULL;
+
+    struct Env *env = NULL;
+    spin_lock(&victim->lock);
+    if (victim->head.prev != &victim->head) {
+        env = RUNQ_ENV(victim->head.prev);
+        runq_remove(victim, env);
+    }
+    spin_unlock(&victim->lock);
+
+    if (env) runqueues[cpu].steals++;
+    return env;
+}
+
+/* Switch the scheduling class. Run queues are in round-robin order
+ * when switching to the fair class, so they are reordered by vruntime */
+void
+sched_set_class(enum SchedClass class) {
+    sched_class = class;
+    if (class != SCHED_CLASS_FAIR) return;
+
+    for (int i = 0; i < NCPU; i++) {
+        struct Runqueue *rq = &runqueues[i];
+        spin_lock(&rq->lock);
+
+        struct List *item = rq->head.next;
+        rq->head.next = rq->head.prev = &rq->head;
+        rq->nr_runnable = 0;
+        while (item != &rq->head) {
+            struct List *next = item->next;
+            runq_insert(rq, RUNQ_ENV(item));
+            item = next;
+        }
+
+        spin_unlock(&rq->lock);
+    }
+}
+
+void
+sched_dump_stats(void) {
+    cprintf("Scheduling class: %s\n", sched_class == SCHED_CLASS_FAIR ? "fair" : "rr");
+    cprintf("Scheduling decisions: %lu\n", (unsigned long)sched_decisions);
+    if (sched_decisions) {
+        cprintf("Average decision cost: %lu TSC cycles\n",
+                (unsigned long)(sched_decision_cycles / sched_decisions));
+    }
+    for (int i = 0; i < NCPU; i++) {
+        cprintf("CPU %d: %lu runnable, %lu stolen\n", i,
+                (unsigned long)runqueues[i].nr_runnable,
+                (unsigned long)runqueues[i].steals);
+    }
+}
+
 /* Choose a user environment to run and run it */
 _Noreturn void
 sched_yield(void) {
     /* Implement simple round-robin scheduling.
      *
-     * Search through 'envs' for an ENV_RUNNABLE environment in
-     * circular fashion starting just after the env was
-     * last running.  Switch to the first such environment found.
+     * Take the first ENV_RUNNABLE environment from this CPU's run queue.
+     * The environment that was last running is put to the tail of
+     * the queue by env_run(), so every runnable env gets its turn.
+     * In the fair class the env with the smallest virtual runtime
+     * is chosen instead, see sched_account().
      *
      * If no envs are runnable, but the environment previously
      * running is still ENV_RUNNING, it's okay to
@@ -26,19 +356,22 @@ sched_yield(void) {
 
     // LAB 3: Your code here:
 
-    size_t prev_env_idx = (size_t) (curenv - envs);
-    for (size_t i = prev_env_idx + 1; i < NENV; ++i) {
-        if (envs[i].env_status == ENV_RUNNABLE) {
-            env_run(&envs[i]);
-        }
-    }
-    for (size_t i = 0; i < prev_env_idx; ++i) {
-        if (envs[i].env_status == ENV_RUNNABLE) {
-            env_run(&envs[i]);
+    need_resched[cpunum()] = 0;
+
+    uint64_t start = read_tsc();
+    struct Env *running = curenv && curenv->env_status == ENV_RUNNING ? curenv : NULL;
+    struct Env *next = runq_pop(cpunum(), running);
+
+    if (!next) next = running;
+
+    if (next) {
+        sched_decision_cycles += read_tsc() - start;
+        sched_decisions++;
+        if (tick_stopped) {
+            timer_for_schedule->resume_periodic();
+            tick_stopped = 0;
         }
-    }
-    if (envs[prev_env_idx].env_status == ENV_RUNNING) {
-        env_run(&envs[prev_env_idx]);
+        env_run(next);
     }
 
     cprintf("Halt\n");
@@ -53,13 +386,17 @@ sched_yield(void) {
 _Noreturn void
 sched_halt(void) {
 
+    /* Before going idle try to take some work from other CPUs */
+    struct Env *stolen = runq_steal(cpunum());
+    if (stolen) env_run(stolen);
+
     /* For debugging and testing purposes, if there are no runnable
-     * environments in the system, then drop into the kernel monitor */
+     * environments in the system and none of them sleeps waiting
+     * for a timer, then drop into the kernel monitor */
     int i;
-    for (i = 0; i < NENV; i++)
-        if (envs[i].env_status == ENV_RUNNABLE ||
-            envs[i].env_status == ENV_RUNNING) break;
-    if (i == NENV) {
+    for (i = 0; i < NCPU; i++)
+        if (runqueues[i].nr_runnable) break;
+    if (i == NCPU && !timer_pending() && (!curenv || curenv->env_status != ENV_RUNNING)) {
         cprintf("No runnable environments in the system!\n");
         for (;;) monitor(NULL);
     }
@@ -67,6 +404,21 @@ sched_halt(void) {
     /* Mark that no environment is running on CPU */
     curenv = NULL;
 
+    /* Use idle time to prepare zeroed pages for page faults,
+     * to finish teardown of released address spaces,
+     * to merge identical pages and to write out the kernel log */
+    refill_zero_pool();
+    reclaim_address_spaces();
+    ksm_scan();
+    klog_drain(0);
+
+    /* Nothing to preempt, so there is no need for the periodic tick.
+     * Only wake up for the nearest timer event, if any */
+    if (sched_tickless && timer_for_schedule && timer_for_schedule->set_oneshot) {
+        timer_for_schedule->set_oneshot(timer_next_deadline());
+        tick_stopped = 1;
+    }
+
     /* Reset stack pointer, enable interrupts and then halt */
     asm volatile(
             "movq $0, %%rbp\n"
@@ -6,6 +6,38 @@
 #error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
+/* Scheduling classes */
+enum SchedClass {
+    SCHED_CLASS_RR,   /* Round-robin over the run queue */
+    SCHED_CLASS_FAIR, /* Smallest weighted virtual runtime first */
+};
+
+/* Weight of a normal env in the fair class,
+ * idle envs only get the CPU when nothing else wants it */
+#define SCHED_WEIGHT_DEFAULT 1024
+#define SCHED_WEIGHT_IDLE    1
+
+/* Credit of vruntime a waking env keeps over the envs
+ * that stayed runnable, in microseconds */
+#define SCHED_WAKEUP_SLACK_US 3000
+
+extern enum SchedClass sched_class;
+extern bool sched_tickless;
+
 _Noreturn void sched_yield(void);
 
+void sched_init(void);
+void sched_enqueue(struct Env *env);
+void sched_dequeue(struct Env *env);
+void sched_account(struct Env *env);
+void sched_set_class(enum SchedClass class);
+uint64_t sched_account_run(struct Env *prev, struct Env *next);
+void sched_dump_envs(size_t limit, bool top);
+void sched_dump_latency(void);
+void sched_dump_stats(void);
+
 #endif /* !JOS_KERN_SCHED_H */
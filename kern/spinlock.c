@@ -8,15 +8,20 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 #include <kern/traceopt.h>
+#include <kern/cpu.h>
+#include <kern/preempt.h>
 
-/* The big kernel lock */
-struct spinlock kernel_lock = {
 #if trace_spinlock
-        .name = "kernel_lock"
-#endif
-};
+/* Locks currently held by each CPU, in acquisition order */
+#define MAX_HELD_LOCKS 16
+static struct spinlock *held_locks[NCPU][MAX_HELD_LOCKS];
+static int nheld_locks[NCPU];
+
+/* Every lock that was ever acquired, for spin_dump_stats() */
+#define MAX_STAT_LOCKS 64
+static struct spinlock *stat_locks[MAX_STAT_LOCKS];
+static uint32_t nstat_locks;
 
-#if trace_spinlock
 /* Record the current call stack in pcs[] by following the %rbp chain. */
 static void
 get_caller_pcs(uint64_t pcs[]) {
@@ -31,18 +36,54 @@ get_caller_pcs(uint64_t pcs[]) {
     while (i < 10) pcs[i++] = 0;
 }
 
-/* Check whether this CPU is holding the lock. */
-static int
-holding(struct spinlock *lock) {
-    return lock->locked;
+static void
+print_pcs(uintptr_t pcs[]) {
+    for (int i = 0; i < 10 && pcs[i]; i++) {
+        struct Ripdebuginfo info;
+        if (debuginfo_rip(pcs[i], &info) >= 0) {
+            cprintf("  %08lx %s:%d: %.*s+%lx\n", pcs[i],
+                    info.rip_file, info.rip_line,
+                    info.rip_fn_namelen, info.rip_fn_name,
+                    pcs[i] - info.rip_fn_addr);
+        } else {
+            cprintf("  %08lx\n", pcs[i]);
+        }
+    }
+}
+
+/* Panic if taking lk now would violate the lock ordering */
+static void
+check_lock_order(struct spinlock *lk) {
+    int cpu = cpunum();
+    if (!lk->order) return;
+
+    for (int i = 0; i < nheld_locks[cpu]; i++) {
+        struct spinlock *held = held_locks[cpu][i];
+        if (held->order && held->order >= lk->order) {
+            cprintf("Lock order violation: acquiring %s (order %d) while holding %s (order %d)\n",
+                    lk->name, lk->order, held->name, held->order);
+            cprintf("%s acquired at:\n", held->name);
+            print_pcs(held->pcs);
+            panic("spin_lock");
+        }
+    }
 }
 #endif
 
+/* Check whether this CPU is holding the lock.
+ * Only the holder sets cpu to its own number, so another
+ * CPU's hold is never mistaken for ours */
+bool
+spin_holding(struct spinlock *lock) {
+    return __atomic_load_n(&lock->cpu, __ATOMIC_RELAXED) == (uint32_t)cpunum() + 1;
+}
+
 void
-__spin_initlock(struct spinlock *lk, char *name) {
-    lk->locked = 0;
+__spin_initlock(struct spinlock *lk, char *name, int order) {
+    lk->next = lk->owner = lk->cpu = 0;
 #if trace_spinlock
     lk->name = name;
+    lk->order = order;
 #endif
 }
 
@@ -52,18 +93,45 @@ __spin_initlock(struct spinlock *lk, char *name) {
  * other CPUs to waste time spinning to acquire it. */
 void
 spin_lock(struct spinlock *lk) {
+    preempt_disable();
+
 #if trace_spinlock
-    if (holding(lk)) panic("Cannot acquire %s: already holding", lk->name);
+    if (spin_holding(lk)) panic("Cannot acquire %s: already holding", lk->name);
+    check_lock_order(lk);
 #endif
 
-    /* The xchg is atomic.
-     * It also serializes, so that reads after acquire are not
-     * reordered before it. */
-    while (xchg(&lk->locked, 1)) asm volatile("pause");
+    /* Take a ticket and wait for it to be served.
+     * The atomic add serializes, and acquire ordering on the owner
+     * load keeps reads of the critical section after it. */
+    uint32_t ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_ACQ_REL);
+
+#if trace_spinlock
+    uint64_t spin_start = 0;
+    bool contended = __atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket;
+    if (contended) spin_start = read_tsc();
+#endif
+
+    while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket) asm volatile("pause");
+    lk->cpu = cpunum() + 1;
 
         /* Record info about lock acquisition for debugging. */
 #if trace_spinlock
+    lk->hold_start = read_tsc();
+    lk->acquisitions++;
+    if (contended) {
+        lk->contended++;
+        lk->spin_cycles += lk->hold_start - spin_start;
+    }
+    if (!lk->registered) {
+        lk->registered = 1;
+        uint32_t slot = __atomic_fetch_add(&nstat_locks, 1, __ATOMIC_RELAXED);
+        if (slot < MAX_STAT_LOCKS) stat_locks[slot] = lk;
+    }
+
     get_caller_pcs(lk->pcs);
+    int cpu = cpunum();
+    if (nheld_locks[cpu] < MAX_HELD_LOCKS)
+        held_locks[cpu][nheld_locks[cpu]++] = lk;
 #endif
 }
 
@@ -71,36 +139,58 @@ spin_lock(struct spinlock *lk) {
 void
 spin_unlock(struct spinlock *lk) {
 #if trace_spinlock
-    if (!holding(lk)) {
+    if (!spin_holding(lk)) {
         uintptr_t pcs[10];
         /* Nab the acquiring EIP chain before it gets released */
         memmove(pcs, lk->pcs, sizeof pcs);
         cprintf("Cannot release %s\nAcquired at:", lk->name);
-        for (int i = 0; i < 10 && pcs[i]; i++) {
-            struct Ripdebuginfo info;
-            if (debuginfo_rip(pcs[i], &info) >= 0) {
-                cprintf("  %08lx %s:%d: %.*s+%lx\n", pcs[i],
-                        info.rip_file, info.rip_line,
-                        info.rip_fn_namelen, info.rip_fn_name,
-                        pcs[i] - info.rip_fn_addr);
-            } else {
-                cprintf("  %08lx\n", pcs[i]);
-            }
-        }
+        print_pcs(pcs);
         panic("spin_unlock");
     }
 
     lk->pcs[0] = 0;
+
+    uint64_t hold = read_tsc() - lk->hold_start;
+    if (hold > lk->max_hold) lk->max_hold = hold;
+
+    /* Locks are not necessarily released in LIFO order */
+    int cpu = cpunum();
+    for (int i = 0; i < nheld_locks[cpu]; i++) {
+        if (held_locks[cpu][i] == lk) {
+            memmove(&held_locks[cpu][i], &held_locks[cpu][i + 1],
+                    (nheld_locks[cpu] - i - 1) * sizeof(held_locks[cpu][0]));
+            nheld_locks[cpu]--;
+            break;
+        }
+    }
 #endif
 
-    /* The xchg serializes, so that reads before release are
-     * not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-     * 7.2) says reads can be carried out speculatively and in
-     * any order, which implies we need to serialize here.
-     * But the 2007 Intel 64 Architecture Memory Ordering White
-     * Paper says that Intel 64 and IA-32 will not move a load
-     * after a store. So lock->locked = 0 would work here.
-     * The xchg being asm volatile ensures gcc emits it after
-     * the above assignments (and after the critical section). */
-    xchg(&lk->locked, 0);
+    lk->cpu = 0;
+
+    /* Serve the next ticket. Only the holder writes owner, so a plain
+     * increment is enough; release ordering keeps the critical section
+     * before the store (x86 never moves a store before earlier loads
+     * or stores, the builtin mostly stops gcc from doing it). */
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+
+    preempt_enable();
+}
+
+/* Print contention statistics of every lock acquired so far */
+void
+spin_dump_stats(void) {
+#if trace_spinlock
+    uint32_t n = MIN(nstat_locks, MAX_STAT_LOCKS);
+    cprintf("%-24s %12s %12s %16s %12s\n", "lock", "acquired", "contended", "spin cycles", "max hold");
+    for (uint32_t i = 0; i < n; i++) {
+        struct spinlock *lk = stat_locks[i];
+        cprintf("%-24s %12lu %12lu %16lu %12lu\n", lk->name ? lk->name : "?",
+                (unsigned long)lk->acquisitions, (unsigned long)lk->contended,
+                (unsigned long)lk->spin_cycles, (unsigned long)lk->max_hold);
+    }
+    if (nstat_locks > MAX_STAT_LOCKS)
+        cprintf("%u more locks are not shown\n", nstat_locks - MAX_STAT_LOCKS);
+#else
+    cprintf("Lock statistics are only collected with trace_spinlock enabled\n");
+#endif
 }
@@ -2,42 +2,103 @@
 #define JOS_INC_SPINLOCK_H
 
 #include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
 #include <kern/traceopt.h>
 
-/* Mutual exclusion lock */
+/* Lock ordering.
+ *
+ * Locks may only be acquired in increasing order, so a CPU holding
+ * the page tree lock may print (console lock), but must never try
+ * to take an env table or a run queue lock. Locks of the same order
+ * (e.g. two run queues) are never held at the same time.
+ *
+ *   LOCK_ORDER_ENV      env_lock, env table and its free list (kern/env.c)
+ *   LOCK_ORDER_RING     ring_lock, shared memory ring waiters (kern/ring.c)
+ *   LOCK_ORDER_FUTEX    futex wait queue buckets (kern/futex.c)
+ *   LOCK_ORDER_UHEAP    uheap_lock, user heap windows (kern/uheap.c)
+ *   LOCK_ORDER_WORK     per-CPU deferred work queues (kern/workqueue.c)
+ *   LOCK_ORDER_SCHED    per-CPU run queue locks (kern/sched.c)
+ *   LOCK_ORDER_PAGE     page_lock, physical/virtual page trees (kern/pmap.c)
+ *   LOCK_ORDER_ALLOC    alloc_lock, test_alloc() arena (kern/alloc.c),
+ *                       object cache locks and KASAN quarantine
+ *                       (kern/kmalloc.c)
+ *   LOCK_ORDER_TIMER    ktimer_lock, kernel timer events (kern/ktimer.c)
+ *   LOCK_ORDER_CONSOLE  console_lock, console output (kern/console.c)
+ *
+ * With trace_spinlock enabled every acquisition is checked
+ * against the locks already held by this CPU. */
+enum LockOrder {
+    LOCK_ORDER_NONE = 0, /* Not checked */
+    LOCK_ORDER_ENV,
+    LOCK_ORDER_RING,
+    LOCK_ORDER_FUTEX,
+    LOCK_ORDER_UHEAP,
+    LOCK_ORDER_WORK,
+    LOCK_ORDER_SCHED,
+    LOCK_ORDER_PAGE,
+    LOCK_ORDER_ALLOC,
+    LOCK_ORDER_TIMER,
+    LOCK_ORDER_CONSOLE,
+};
+
+/* Mutual exclusion lock.
+ * This is a ticket lock: every CPU takes a ticket and waits until
+ * it is served, so the lock is granted in FIFO order.
+ * The lock is free when next == owner */
 struct spinlock {
-    unsigned locked; /* Is the lock held? */
+    volatile uint32_t next;  /* Next ticket to hand out */
+    volatile uint32_t owner; /* Ticket currently holding the lock */
+    volatile uint32_t cpu;   /* cpunum() + 1 of the holder, 0 if free */
 
 #if trace_spinlock
     /* For debugging: */
     char *name;        /* Name of lock */
+    int order;         /* Position in lock ordering, see enum LockOrder */
     uintptr_t pcs[10]; /* The call stack (an array of program counters)
                         * that locked the lock */
+
+    /* Contention statistics, see spin_dump_stats() */
+    bool registered;        /* Lock is in the statistics table */
+    uint64_t acquisitions;  /* Total number of acquisitions */
+    uint64_t contended;     /* Acquisitions that had to wait */
+    uint64_t spin_cycles;   /* TSC cycles spent waiting */
+    uint64_t max_hold;      /* Longest hold time in TSC cycles */
+    uint64_t hold_start;    /* TSC value at the last acquisition */
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+#if trace_spinlock
+#define SPINLOCK_INITIALIZER(lock, ord) \
+    { .name = #lock, .order = (ord) }
+#else
+#define SPINLOCK_INITIALIZER(lock, ord) \
+    { 0 }
+#endif
+
+void __spin_initlock(struct spinlock *lk, char *name, int order);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+bool spin_holding(struct spinlock *lk);
+void spin_dump_stats(void);
 
-#define spin_initlock(lock) __spin_initlock(lock, #lock)
+#define spin_initlock(lock, order) __spin_initlock(lock, #lock, order)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void) {
-    spin_lock(&kernel_lock);
+/* Variants for locks that are also taken from trap handlers.
+ * Interrupts stay disabled while the lock is held, so the
+ * holder can't be preempted by code that tries to take it again */
+static inline uint64_t
+spin_lock_irqsave(struct spinlock *lk) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+    spin_lock(lk);
+    return rflags;
 }
 
 static inline void
-unlock_kernel(void) {
-    spin_unlock(&kernel_lock);
-
-    /* Normally we wouldn't need to do this, but QEMU only runs
-     * one CPU at a time and has a long time-slice.  Without the
-     * pause, this CPU is likely to reacquire the lock before
-     * another CPU has even been given a chance to acquire it. */
-    asm volatile("pause");
+spin_unlock_irqrestore(struct spinlock *lk, uint64_t rflags) {
+    spin_unlock(lk);
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
 }
 
 #endif
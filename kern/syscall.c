@@ -0,0 +1,290 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ring.h>
+#include <kern/futex.h>
+#include <kern/uheap.h>
+#include <kern/sched.h>
+#include <kern/syscall.h>
+#include <kern/trap.h>
+
+/* Print a string to the system console.
+ * Kernel mode envs share the kernel address space,
+ * so the string is checked only for user envs */
+static int64_t
+syscall_cputs(uint64_t s, uint64_t len, uint64_t a3, uint64_t a4, uint64_t a5) {
+#ifndef CONFIG_KSPACE
+    user_mem_assert(curenv, (const void *)s, len, PROT_R);
+#endif
+    cprintf("%.*s", (int)len, (const char *)s);
+    return 0;
+}
+
+static int64_t
+syscall_getenvid(uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return curenv->env_id;
+}
+
+static int64_t
+syscall_yield(uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    sched_yield();
+}
+
+/* Sleep for a1 nanoseconds */
+static int64_t
+syscall_sleep(uint64_t nsec, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    env_sleep(curenv, nsec);
+    sched_yield();
+}
+
+static int64_t
+syscall_exit(uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    env_destroy(curenv);
+    sched_yield();
+}
+
+/* Synchronous IPC.
+ *
+ * A receiver blocks in ipc_recv() as ENV_NOT_RUNNABLE with env_ipc_recving
+ * set. A sender that finds it there puts the message right into its saved
+ * registers and hands the rest of its own timeslice over with env_run(),
+ * without going through the run queue. The receiver's system call
+ * returns 0 with
+ *   %rdi - env id of the sender,
+ *   %rsi - message word,
+ *   %rdx - size of the pages mapped at its dstva, 0 if none,
+ *   %r10 - protection of these pages.
+ * Larger payloads are passed as whole pages, mapped into the receiver
+ * with PROT_SHARE, so the data is shared rather than copied.
+ *
+ * ipc_call() sends a request and waits for the answer, and ipc_reply_recv()
+ * answers and waits for the next request, both in one system call. So a
+ * client and a server never find each other not receiving, and every round
+ * trip is just two direct switches. Answers carry no pages, a server writes
+ * its results into the pages the request has shared with it instead */
+
+/* Block curenv until a message arrives */
+static void
+ipc_wait(uintptr_t dstva, size_t maxsize) {
+    curenv->env_ipc_recving = 1;
+    curenv->env_ipc_dstva = dstva;
+    curenv->env_ipc_maxsz = maxsize;
+    curenv->env_status = ENV_NOT_RUNNABLE;
+}
+
+/* Deliver a message to the receiving env 'envid' and make it runnable.
+ * Pages are passed only if both srcva and the receiver's dstva
+ * are below MAX_USER_ADDRESS */
+static int
+ipc_deliver(envid_t envid, uint64_t value, uintptr_t srcva, size_t size, int perm, struct Env **env_store) {
+    struct Env *env;
+    int res = envid2env(envid, &env, 0);
+    if (res < 0) return res;
+    if (!env->env_ipc_recving) return -E_IPC_NOT_RECV;
+
+    if (srcva < MAX_USER_ADDRESS && env->env_ipc_dstva < MAX_USER_ADDRESS && env->env_ipc_maxsz) {
+        if (PAGE_OFFSET(srcva) || PAGE_OFFSET(size) || !size) return -E_INVAL;
+        if (size > MAX_USER_ADDRESS - srcva || perm & ~PROT_RWX) return -E_INVAL;
+
+        size = MIN(size, env->env_ipc_maxsz);
+        res = map_region(env_space(env), env->env_ipc_dstva,
+                         env_space(curenv), srcva, size, perm | PROT_USER_ | PROT_SHARE);
+        if (res < 0) return res;
+    } else {
+        size = perm = 0;
+    }
+
+    struct PushRegs *regs = &env->env_tf.tf_regs;
+    regs->reg_rax = 0;
+    regs->reg_rdi = curenv->env_id;
+    regs->reg_rsi = value;
+    regs->reg_rdx = size;
+    regs->reg_r10 = perm;
+
+    env->env_ipc_recving = 0;
+    env->env_status = ENV_RUNNABLE;
+    *env_store = env;
+    return 0;
+}
+
+static int
+ipc_check_dstva(uintptr_t dstva, size_t maxsize) {
+    if (dstva >= MAX_USER_ADDRESS) return 0;
+    if (PAGE_OFFSET(dstva) || PAGE_OFFSET(maxsize) || maxsize > MAX_USER_ADDRESS - dstva) return -E_INVAL;
+    return 0;
+}
+
+/* Wait for a message, its pages are mapped at dstva (up to maxsize bytes) */
+static int64_t
+syscall_ipc_recv(uint64_t dstva, uint64_t maxsize, uint64_t a3, uint64_t a4, uint64_t a5) {
+    int res = ipc_check_dstva(dstva, maxsize);
+    if (res < 0) return res;
+
+    ipc_wait(dstva, maxsize);
+    sched_yield();
+}
+
+/* Send value and the pages [srcva, srcva + size) to the receiving env 'envid'
+ * and run it right away */
+static int64_t
+syscall_ipc_send(uint64_t envid, uint64_t value, uint64_t srcva, uint64_t size, uint64_t perm) {
+    struct Env *env;
+    int res = ipc_deliver(envid, value, srcva, size, perm, &env);
+    if (res < 0) return res;
+
+    env_run(env);
+}
+
+/* Same as ipc_send(), then wait for the answer */
+static int64_t
+syscall_ipc_call(uint64_t envid, uint64_t value, uint64_t srcva, uint64_t size, uint64_t perm) {
+    struct Env *env;
+    int res = ipc_deliver(envid, value, srcva, size, perm, &env);
+    if (res < 0) return res;
+
+    ipc_wait(MAX_USER_ADDRESS, 0);
+    env_run(env);
+}
+
+/* Answer the env 'envid' waiting in ipc_call() and wait for the next message.
+ * If the answer can't be delivered, returns the error without waiting */
+static int64_t
+syscall_ipc_reply_recv(uint64_t envid, uint64_t value, uint64_t dstva, uint64_t maxsize, uint64_t a5) {
+    struct Env *env;
+    int res = ipc_check_dstva(dstva, maxsize);
+    if (res < 0) return res;
+    res = ipc_deliver(envid, value, MAX_USER_ADDRESS, 0, 0, &env);
+    if (res < 0) return res;
+
+    ipc_wait(dstva, maxsize);
+    env_run(env);
+}
+
+/* Shared memory rings, see kern/ring.c */
+static int64_t
+syscall_ring_create(uint64_t peer, uint64_t va, uint64_t peer_va, uint64_t size, uint64_t a5) {
+    return ring_create(peer, va, peer_va, size);
+}
+
+static int64_t
+syscall_ring_attach(uint64_t id, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return ring_attach(id);
+}
+
+static int64_t
+syscall_ring_wait(uint64_t id, uint64_t word, uint64_t expected, uint64_t a4, uint64_t a5) {
+    int res = ring_wait(id, word, expected);
+    if (res <= 0) return res;
+
+    sched_yield();
+}
+
+static int64_t
+syscall_ring_wake(uint64_t id, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return ring_wake(id);
+}
+
+/* Block until woken up if the 32-bit word at addr equals val,
+ * return 0 right away otherwise */
+static int64_t
+syscall_futex_wait(uint64_t addr, uint64_t val, uint64_t a3, uint64_t a4, uint64_t a5) {
+    int res = futex_wait(addr, val);
+    if (res <= 0) return res;
+
+    sched_yield();
+}
+
+/* Wake up to n envs waiting on addr */
+static int64_t
+syscall_futex_wake(uint64_t addr, uint64_t n, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return futex_wake(env_space(curenv), addr, MIN(n, (uint64_t)NENV));
+}
+
+/* User heap window, see kern/uheap.c */
+static int64_t
+syscall_heap_attach(uint64_t size, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return uheap_attach(size);
+}
+
+static int64_t
+syscall_heap_map(uint64_t va, uint64_t size, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return uheap_map(va, size);
+}
+
+static int64_t
+syscall_heap_unmap(uint64_t va, uint64_t size, uint64_t a3, uint64_t a4, uint64_t a5) {
+    return uheap_unmap(va, size);
+}
+
+static int64_t (*const syscalls[NSYSCALLS])(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) = {
+        [SYS_cputs] = syscall_cputs,
+        [SYS_getenvid] = syscall_getenvid,
+        [SYS_yield] = syscall_yield,
+        [SYS_sleep] = syscall_sleep,
+        [SYS_exit] = syscall_exit,
+        [SYS_ipc_recv] = syscall_ipc_recv,
+        [SYS_ipc_send] = syscall_ipc_send,
+        [SYS_ipc_call] = syscall_ipc_call,
+        [SYS_ipc_reply_recv] = syscall_ipc_reply_recv,
+        [SYS_ring_create] = syscall_ring_create,
+        [SYS_ring_attach] = syscall_ring_attach,
+        [SYS_ring_wait] = syscall_ring_wait,
+        [SYS_ring_wake] = syscall_ring_wake,
+        [SYS_futex_wait] = syscall_futex_wait,
+        [SYS_futex_wake] = syscall_futex_wake,
+        [SYS_heap_attach] = syscall_heap_attach,
+        [SYS_heap_map] = syscall_heap_map,
+        [SYS_heap_unmap] = syscall_heap_unmap,
+};
+
+/* Dispatch the system call saved in curenv's trap frame.
+ * Calls that switch to another env return 0 once it resumes */
+void
+syscall_dispatch(struct Trapframe *tf) {
+    struct PushRegs *regs = &tf->tf_regs;
+    uint64_t num = regs->reg_rax;
+
+    regs->reg_rax = 0;
+    if (num >= NSYSCALLS || !syscalls[num]) {
+        regs->reg_rax = -E_NO_SYS;
+        return;
+    }
+    regs->reg_rax = syscalls[num](regs->reg_rdi, regs->reg_rsi, regs->reg_rdx, regs->reg_r10, regs->reg_r8);
+}
+
+/* Entry from the SYSCALL instruction, see syscall_entry in kern/entry.S.
+ * The trap frame is already in curenv->env_tf */
+_Noreturn void
+syscall(struct Trapframe *tf) {
+    assert(curenv && tf == &curenv->env_tf);
+
+    irqstat_enter(T_FASTCALL);
+    sched_account(curenv);
+    syscall_dispatch(tf);
+
+    if (curenv && curenv->env_status == ENV_RUNNING) env_run(curenv);
+    sched_yield();
+}
+
+/* Set up the SYSCALL instruction on this CPU.
+ * SYSCALL loads CS from STAR[47:32] and SS from the next descriptor.
+ * SYSRET is not used, kspace envs run in ring 0 and return through
+ * env_pop_tf() as after any other trap, STAR[63:48] only keeps the
+ * layout SYSRET expects (GD_UD right below GD_UT). Interrupts are
+ * disabled on entry, as in all the other kernel entry points */
+void
+syscall_init(void) {
+    extern void syscall_entry(void);
+
+    wrmsr(STAR_MSR, ((uint64_t)((GD_UD - 8) | 3) << 48) | ((uint64_t)GD_KT << 32));
+    wrmsr(LSTAR_MSR, (uintptr_t)syscall_entry);
+    wrmsr(FMASK_MSR, FL_IF | FL_DF | FL_TF | FL_AC);
+    wrmsr(EFER_MSR, rdmsr(EFER_MSR) | EFER_SCE);
+}
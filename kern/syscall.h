@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_SYSCALL_H
+#define JOS_KERN_SYSCALL_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/syscall.h>
+#include <inc/trap.h>
+
+void syscall_init(void);
+void syscall_dispatch(struct Trapframe *tf);
+_Noreturn void syscall(struct Trapframe *tf);
+
+#endif /* !JOS_KERN_SYSCALL_H */
@@ -18,6 +18,10 @@
 #define Peta      (kilo * Tera)
 #define ULONG_MAX ~0UL
 
+/* Target precision and time limit of hpet_tsc_calibrate() */
+#define HPET_CALIBRATE_PPM    100
+#define HPET_CALIBRATE_MAX_MS 10
+
 #if LAB <= 6
 /* Early variant of memory mapping that does 1:1 aligned area mapping
  * in 2MB pages. You will need to reimplement this code with proper
@@ -49,6 +53,8 @@ struct Timer timer_hpet0 = {
         .get_cpu_freq = hpet_cpu_frequency,
         .enable_interrupts = hpet_enable_interrupts_tim0,
         .handle_interrupts = hpet_handle_interrupts_tim0,
+        .set_oneshot = hpet_set_oneshot_tim0,
+        .resume_periodic = hpet_resume_periodic_tim0,
 };
 
 struct Timer timer_hpet1 = {
@@ -57,6 +63,8 @@ struct Timer timer_hpet1 = {
         .get_cpu_freq = hpet_cpu_frequency,
         .enable_interrupts = hpet_enable_interrupts_tim1,
         .handle_interrupts = hpet_handle_interrupts_tim1,
+        .set_oneshot = hpet_set_oneshot_tim1,
+        .resume_periodic = hpet_resume_periodic_tim1,
 };
 
 struct Timer timer_acpipm = {
@@ -115,15 +123,40 @@ acpi_verify_sdt_header(ACPISDTHeader const* sdt_header, char const* signature) {
     return true;
 }
 
-// TODO: use mmio_map_region, mmio_remap_last_region
-static void *
-acpi_find_table(const char *signature, size_t header_size) {
+/* Directory of the ACPI tables listed in the XSDT. It is built once,
+ * every table stays mapped with its whole length, so lookups neither
+ * walk the XSDT nor remap anything. Open addressing on the signature */
+#define ACPI_MAX_TABLES 64
+
+struct AcpiTable {
+    uint32_t signature; /* 0 for an empty entry */
+    physaddr_t pa;
+    uint32_t length;
+    void *va;
+};
+
+static struct AcpiTable acpi_tables[ACPI_MAX_TABLES];
+static bool acpi_tables_ready;
+
+static uint32_t
+acpi_signature(const char *signature) {
+    uint32_t sig;
+    memcpy(&sig, signature, sizeof sig);
+    return sig;
+}
+
+static struct AcpiTable *
+acpi_table_slot(uint32_t sig) {
+    size_t i = (sig * 0x9E3779B1u) % ACPI_MAX_TABLES;
+    while (acpi_tables[i].signature && acpi_tables[i].signature != sig)
+        i = (i + 1) % ACPI_MAX_TABLES;
+    return &acpi_tables[i];
+}
+
+/* Map and checksum every table of the XSDT once */
+void
+acpi_init_tables(void) {
     /*
-     * This function performs lookup of ACPI table by its signature
-     * and returns valid pointer to the table mapped somewhere.
-     *
-     * It is a good idea to checksum tables before using them.
-     *
      * HINT: Use mmio_map_region/mmio_remap_last_region
      * before accessing table addresses
      * (Why mmio_remap_last_region is required?)
@@ -133,6 +166,10 @@ acpi_find_table(const char *signature, size_t header_size) {
 
     // LAB 5: Your code here
 
+    if (acpi_tables_ready) return;
+    // Even if tables are broken, we don't look at them twice.
+    acpi_tables_ready = true;
+
     // Map region before usage, so that
     //   to not hit a page fault.
     RSDP* rsdp = (RSDP*) mmio_map_region(uefi_lp->ACPIRoot, sizeof(RSDP));
@@ -148,7 +185,7 @@ acpi_find_table(const char *signature, size_t header_size) {
         checksum += byte;
     }
     if (checksum != 0) {
-        return NULL;
+        return;
     }
 
     uint8_t extended_checksum = 0;
@@ -158,12 +195,12 @@ acpi_find_table(const char *signature, size_t header_size) {
         extended_checksum += byte;
     }
     if (extended_checksum != 0) {
-        return NULL;
+        return;
     }
 
     // Check signature.
     if (strncmp(rsdp->Signature, "RSD PTR ", 8) != 0) {
-        return NULL;
+        return;
     }
 
     // Both rsdt and xsdt are present (we expect acpi 2.0 and higher),
@@ -179,56 +216,72 @@ acpi_find_table(const char *signature, size_t header_size) {
     // Map region before usage, so that
     //   to not hit a page fault.
     XSDT* xsdt = (XSDT*) mmio_map_region(rsdp->XsdtAddress, sizeof(XSDT));
+    // The pointer array follows the header, map all of it.
+    xsdt = (XSDT*) mmio_remap_last_region(rsdp->XsdtAddress, xsdt, sizeof(XSDT), xsdt->h.Length);
 
     if (!acpi_verify_sdt_header((ACPISDTHeader const*) xsdt, "XSDT")) {
-        return NULL;
+        return;
     }
     
     size_t num_tables = (xsdt->h.Length - sizeof(xsdt->h)) / sizeof(uint64_t);
-    // Find the right table.
-    ACPISDTHeader* sdt_header = NULL;
+    // Keep a free entry in the directory, so that lookups of missing
+    //   tables stop at it. Real firmware has a couple dozen tables.
+    if (num_tables > ACPI_MAX_TABLES - 1) {
+        warn("xsdt lists %u tables, only the first %u are used.", (unsigned int) num_tables, ACPI_MAX_TABLES - 1);
+        num_tables = ACPI_MAX_TABLES - 1;
+    }
+
     for (size_t i = 0; i < num_tables; ++i) {
         uint64_t table_address = xsdt->PointerToOtherSDT[i];
 
-        // Map region before usage, so that
-        //   to not hit a page fault.
-        // Remap previously mapped region.
-        //   So that we don't exhaust mmio
-        //   area.
-        // ACPISDTHeader* sdt_header = NULL;
-        if (i == 0) {
-            // First region is mapped.
-            sdt_header = (ACPISDTHeader*) mmio_map_region(table_address, sizeof(ACPISDTHeader));
-        } else {
-            // Remap last region.
-            sdt_header = (ACPISDTHeader*) mmio_remap_last_region(table_address, sdt_header, sizeof(ACPISDTHeader), sizeof(ACPISDTHeader));            
-        }
-        if (strncmp(sdt_header->Signature, signature, sizeof(sdt_header->Signature)) != 0) {
+        // Map the header first, we don't know the table size yet.
+        //   Then expand this region to the whole table. It's the
+        //   last region mapped, so it can be expanded, and it's
+        //   never remapped after that.
+        ACPISDTHeader* sdt_header = (ACPISDTHeader*) mmio_map_region(table_address, sizeof(ACPISDTHeader));
+        uint32_t length = sdt_header->Length;
+        if (length < sizeof(ACPISDTHeader)) {
+            warn("acpi table at 0x%lx is too short.", (unsigned long) table_address);
             continue;
         }
+        sdt_header = (ACPISDTHeader*) mmio_remap_last_region(table_address, sdt_header, sizeof(ACPISDTHeader), length);
 
-        // Signature is verified already :)
         if (!acpi_verify_sdt_header(sdt_header, NULL)) {
-            // Maybe there's another table with the right checksum?
-            //   Continue the loop, but it shouldn't be there, it's unlikely.
-            //   Maybe it's even out of spec.
+            // Maybe there's another table with the same signature
+            //   and the right checksum? It's unlikely, maybe it's even
+            //   out of spec, but nothing is lost to keep looking.
             continue;
         }
 
-        // Remap to real size of structure, we looked at some number
-        //   of sizeof(ACPISDTHeader) first bytes (we didn't know
-        //   if memory is correct, map what's needed).
-        // Expand this region. It's great it's
-        //   the last region (and we don't have
-        //   SMP in that sense).
-        return mmio_remap_last_region(table_address, sdt_header, sizeof(ACPISDTHeader), header_size);
+        uint32_t sig = acpi_signature(sdt_header->Signature);
+        struct AcpiTable *table = acpi_table_slot(sig);
+        // Only the first valid table with a signature is used (as before).
+        if (table->signature) continue;
+
+        table->signature = sig;
+        table->pa = table_address;
+        table->length = length;
+        table->va = sdt_header;
     }
-    // Didn't find the table, but used a mmio region.
-    //   Not a problem, because we use functions
-    //   like get_fadt, they won't call us anymore
-    //   for that table.
+}
+
+/* Returns the table with this signature, mapped for at least
+ * header_size bytes (or its whole length if header_size is 0),
+ * NULL if the firmware doesn't provide it */
+static void *
+acpi_find_table(const char *signature, size_t header_size) {
+    acpi_init_tables();
+
+    struct AcpiTable *table = acpi_table_slot(acpi_signature(signature));
+    if (!table->signature) return NULL;
+
+    // Some structures are the newest revision of a table, while the
+    //   firmware may provide an older and shorter one. Map the
+    //   whole typedef anyway, that's what the callers read.
+    //   This is rare and happens only once, get_* functions cache it.
+    if (header_size > table->length) return mmio_map_region(table->pa, header_size);
 
-    return NULL;
+    return table->va;
 }
 
 /* Obtain and map FADT ACPI table address. */
@@ -300,6 +353,46 @@ get_hpet(void) {
     return khpet;
 }
 
+/* Obtain and map the whole MADT ACPI table, NULL if there is none. */
+MADT *
+get_madt(void) {
+    static bool tried_to_find = false;
+    static MADT *kmadt = NULL;
+    if (kmadt == NULL && !tried_to_find) {
+        // Signature of MADT is "APIC".
+        kmadt = acpi_find_table("APIC", 0);
+        tried_to_find = true;
+    }
+
+    return kmadt;
+}
+
+/* Obtain and map the whole SRAT ACPI table, NULL if there is none. */
+SRAT *
+get_srat(void) {
+    static bool tried_to_find = false;
+    static SRAT *ksrat = NULL;
+    if (ksrat == NULL && !tried_to_find) {
+        ksrat = acpi_find_table("SRAT", 0);
+        tried_to_find = true;
+    }
+
+    return ksrat;
+}
+
+/* Obtain and map the whole SLIT ACPI table, NULL if there is none. */
+SLIT *
+get_slit(void) {
+    static bool tried_to_find = false;
+    static SLIT *kslit = NULL;
+    if (kslit == NULL && !tried_to_find) {
+        kslit = acpi_find_table("SLIT", 0);
+        tried_to_find = true;
+    }
+
+    return kslit;
+}
+
 /* Getting physical HPET timer address from its table. */
 HPETRegister *
 hpet_register(void) {
@@ -345,6 +438,8 @@ static volatile HPETRegister *hpetReg;
 static uint64_t hpetFemto = 0;
 /* HPET timer frequency */
 static uint64_t hpetFreq = 0;
+/* Periods of timers 0 and 1 in HPET ticks, set by hpet_enable_interrupts_tim* */
+static uint64_t hpetPeriod[2];
 
 /* HPET timer initialization */
 void
@@ -411,7 +506,8 @@ hpet_enable_interrupts_tim0(void) {
     hpetReg->TIM0_CONF |= HPET_TN_TYPE_CNF;
     hpetReg->TIM0_CONF |= HPET_TN_INT_ENB_CNF;
     hpetReg->TIM0_CONF |= HPET_TN_VAL_SET_CNF;
-    hpetReg->TIM0_COMP = (hpetFemto / (hpetReg->GCAP_ID >> 32));
+    hpetPeriod[0] = (hpetFemto / (hpetReg->GCAP_ID >> 32));
+    hpetReg->TIM0_COMP = hpetPeriod[0];
 
     hpetReg->GEN_CONF |= HPET_ENABLE_CNF;
 
@@ -434,7 +530,8 @@ hpet_enable_interrupts_tim1(void) {
     hpetReg->TIM0_CONF |= HPET_TN_TYPE_CNF;
     hpetReg->TIM0_CONF |= HPET_TN_INT_ENB_CNF;
     hpetReg->TIM0_CONF |= HPET_TN_VAL_SET_CNF;
-    hpetReg->TIM1_COMP = 3 * (hpetFemto / (hpetReg->GCAP_ID >> 32)) / 2;
+    hpetPeriod[1] = 3 * (hpetFemto / (hpetReg->GCAP_ID >> 32)) / 2;
+    hpetReg->TIM1_COMP = hpetPeriod[1];
 
     hpetReg->GEN_CONF |= HPET_ENABLE_CNF;
 
@@ -451,6 +548,51 @@ hpet_handle_interrupts_tim1(void) {
     pic_send_eoi(IRQ_CLOCK);
 }
 
+/* Switch comparator to non-periodic mode and arm it to fire once
+ * nsec nanoseconds from now. With nsec == 0 just mask its interrupt,
+ * so an idle CPU is only woken up by other interrupt sources. */
+static void
+hpet_set_oneshot(volatile uint64_t *conf, volatile uint64_t *comp, uint64_t nsec) {
+    *conf &= ~(HPET_TN_TYPE_CNF | HPET_TN_INT_ENB_CNF);
+    if (!nsec) return;
+
+    /* hpetFemto is the tick length in femtoseconds */
+    uint64_t ticks = nsec / hpetFemto * Mega + (nsec % hpetFemto) * Mega / hpetFemto;
+    *comp = hpetReg->MAIN_CNT + (ticks ? ticks : 1);
+    *conf |= HPET_TN_INT_ENB_CNF;
+}
+
+/* Restore periodic mode with the period programmed at enable time.
+ * With VAL_SET_CNF the first comparator write sets the next
+ * expiration and the second one sets the period. */
+static void
+hpet_resume_periodic(volatile uint64_t *conf, volatile uint64_t *comp, uint64_t period) {
+    *conf |= HPET_TN_TYPE_CNF | HPET_TN_VAL_SET_CNF;
+    *comp = hpetReg->MAIN_CNT + period;
+    *comp = period;
+    *conf |= HPET_TN_INT_ENB_CNF;
+}
+
+void
+hpet_set_oneshot_tim0(uint64_t nsec) {
+    hpet_set_oneshot(&hpetReg->TIM0_CONF, &hpetReg->TIM0_COMP, nsec);
+}
+
+void
+hpet_set_oneshot_tim1(uint64_t nsec) {
+    hpet_set_oneshot(&hpetReg->TIM1_CONF, &hpetReg->TIM1_COMP, nsec);
+}
+
+void
+hpet_resume_periodic_tim0(void) {
+    hpet_resume_periodic(&hpetReg->TIM0_CONF, &hpetReg->TIM0_COMP, hpetPeriod[0]);
+}
+
+void
+hpet_resume_periodic_tim1(void) {
+    hpet_resume_periodic(&hpetReg->TIM1_CONF, &hpetReg->TIM1_COMP, hpetPeriod[1]);
+}
+
 /* Calculate CPU frequency in Hz with the help with HPET timer.
  * HINT Use hpet_get_main_cnt function and do not forget about
  * about pause instruction. */
@@ -486,6 +628,37 @@ hpet_cpu_frequency(void) {
     return cpu_freq;
 }
 
+/* Measure TSC frequency in Hz against the HPET main counter, for
+ * about a millisecond: until the uncertainty of the two counter reads
+ * plus one HPET tick is below HPET_CALIBRATE_PPM of the window or
+ * HPET_CALIBRATE_MAX_MS pass. Returns 0 if the HPET is not initialized */
+uint64_t
+hpet_tsc_calibrate(uint64_t *error_ppm) {
+    if (!hpetReg) return 0;
+
+    uint64_t t0 = read_tsc();
+    uint64_t h0 = hpetReg->MAIN_CNT;
+    uint64_t t1 = read_tsc();
+    uint64_t max_ticks = hpetFreq * HPET_CALIBRATE_MAX_MS / 1000;
+
+    for (;;) {
+        uint64_t t2 = read_tsc();
+        uint64_t h1 = hpetReg->MAIN_CNT;
+        uint64_t t3 = read_tsc();
+
+        if (h1 <= h0) continue;
+        uint64_t ticks = h1 - h0;
+        uint64_t cycles = (t2 + t3) / 2 - (t0 + t1) / 2;
+        uint64_t error = ((t1 - t0) + (t3 - t2)) / 2 + cycles / ticks;
+
+        if (error * 1000000 <= cycles * HPET_CALIBRATE_PPM || ticks >= max_ticks) {
+            *error_ppm = error * 1000000 / cycles;
+            return cycles * hpetFreq / ticks;
+        }
+        asm volatile("pause");
+    }
+}
+
 uint32_t
 pmtimer_get_timeval(void) {
     FADT *fadt = get_fadt();
@@ -15,9 +15,14 @@ struct Timer {
     uint64_t (*get_cpu_freq)(void);  /* Get CPU frequency */
     void (*enable_interrupts)(void); /* Init timer interrupts */
     void (*handle_interrupts)(void);
+
+    /* Tickless idle support, both are optional */
+    void (*set_oneshot)(uint64_t nsec); /* Stop periodic interrupts and arm a single
+                                         * one nsec from now, 0 leaves timer disarmed */
+    void (*resume_periodic)(void);      /* Go back to periodic interrupts */
 };
 
-#define MAX_TIMERS 5
+#define MAX_TIMERS 6
 
 extern struct Timer timertab[MAX_TIMERS];
 
@@ -26,6 +31,7 @@ extern struct Timer timer_rtc;
 extern struct Timer timer_hpet0;
 extern struct Timer timer_hpet1;
 extern struct Timer timer_acpipm;
+extern struct Timer timer_lapic;
 extern struct Timer *timer_for_schedule;
 
 #pragma pack(push, 1)
@@ -175,12 +181,123 @@ typedef struct {
     uint8_t Reserved3[3];
 } FADT;
 
+/* Multiple APIC Description Table, followed by variable-length entries */
+typedef struct {
+    ACPISDTHeader h;
+    uint32_t LocalApicAddress;
+    uint32_t Flags;
+    uint8_t Entries[];
+} MADT;
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_ISO            2 /* Interrupt source override */
+#define MADT_LAPIC_OVERRIDE 5
+
+#define MADT_LAPIC_ENABLED 0x1
+
+typedef struct {
+    uint8_t Type;
+    uint8_t Length;
+} MADTEntry;
+
+typedef struct {
+    MADTEntry e;
+    uint8_t ProcessorId;
+    uint8_t ApicId;
+    uint32_t Flags;
+} MADTLapic;
+
+typedef struct {
+    MADTEntry e;
+    uint8_t IoApicId;
+    uint8_t Reserved;
+    uint32_t IoApicAddress;
+    uint32_t GsiBase;
+} MADTIoApic;
+
+typedef struct {
+    MADTEntry e;
+    uint8_t Bus;
+    uint8_t Source;
+    uint32_t Gsi;
+    uint16_t Flags; /* MPS INTI flags */
+} MADTIso;
+
+typedef struct {
+    MADTEntry e;
+    uint16_t Reserved;
+    uint64_t LapicAddress;
+} MADTLapicOverride;
+
+/* System Resource Affinity Table, followed by variable-length entries */
+typedef struct {
+    ACPISDTHeader h;
+    uint32_t Reserved1;
+    uint64_t Reserved2;
+    uint8_t Entries[];
+} SRAT;
+
+#define SRAT_LAPIC  0
+#define SRAT_MEMORY 1
+#define SRAT_X2APIC 2
+
+#define SRAT_ENABLED 0x1
+
+typedef struct {
+    uint8_t Type;
+    uint8_t Length;
+} SRATEntry;
+
+typedef struct {
+    SRATEntry e;
+    uint8_t DomainLow;
+    uint8_t ApicId;
+    uint32_t Flags;
+    uint8_t Sapic;
+    uint8_t DomainHigh[3];
+    uint32_t ClockDomain;
+} SRATLapic;
+
+typedef struct {
+    SRATEntry e;
+    uint32_t Domain;
+    uint16_t Reserved1;
+    uint64_t Base;
+    uint64_t Length;
+    uint32_t Reserved2;
+    uint32_t Flags;
+    uint64_t Reserved3;
+} SRATMemory;
+
+typedef struct {
+    SRATEntry e;
+    uint16_t Reserved1;
+    uint32_t Domain;
+    uint32_t X2ApicId;
+    uint32_t Flags;
+    uint32_t ClockDomain;
+    uint32_t Reserved2;
+} SRATX2Apic;
+
+/* System Locality Distance Information Table,
+ * Entries is a Localities x Localities matrix */
+typedef struct {
+    ACPISDTHeader h;
+    uint64_t Localities;
+    uint8_t Entries[];
+} SLIT;
+
 #pragma pack(pop)
 
 void acpi_enable(void);
 RSDP *get_rsdp(void);
+void acpi_init_tables(void);
 FADT *get_fadt(void);
 HPET *get_hpet(void);
+MADT *get_madt(void);
+SRAT *get_srat(void);
+SLIT *get_slit(void);
 
 void hpet_print_struct(void);
 void hpet_init(void);
@@ -188,8 +305,13 @@ void hpet_print_reg(void);
 void hpet_enable_interrupts_tim0(void);
 void hpet_enable_interrupts_tim1(void);
 uint64_t hpet_cpu_frequency(void);
+uint64_t hpet_tsc_calibrate(uint64_t *error_ppm);
 void hpet_handle_interrupts_tim0(void);
 void hpet_handle_interrupts_tim1(void);
+void hpet_set_oneshot_tim0(uint64_t nsec);
+void hpet_set_oneshot_tim1(uint64_t nsec);
+void hpet_resume_periodic_tim0(void);
+void hpet_resume_periodic_tim1(void);
 
 uint32_t pmtimer_get_timeval(void);
 uint64_t pmtimer_cpu_frequency(void);
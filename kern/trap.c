@@ -2,6 +2,7 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -12,6 +13,14 @@
 #include <kern/kclock.h>
 #include <kern/picirq.h>
 #include <kern/timer.h>
+#include <kern/prof.h>
+#include <kern/klog.h>
+#include <kern/ktimer.h>
+#include <kern/syscall.h>
+#include <kern/fpu.h>
+#include <kern/pmu.h>
+#include <kern/pftrace.h>
+#include <kern/preempt.h>
 #include <kern/traceopt.h>
 
 static struct Taskstate ts;
@@ -21,6 +30,12 @@ static struct Taskstate ts;
  * additional information in the latter case */
 static struct Trapframe *last_tf;
 
+/* The entry code in kern/entry.S saves trap frames into curenv->env_tf */
+static_assert(sizeof(struct Trapframe) == TRAPFRAME_SIZE, "Trapframe layout changed");
+static_assert(offsetof(struct Trapframe, tf_trapno) == TF_TRAPNO, "Trapframe layout changed");
+static_assert(offsetof(struct Trapframe, tf_rsp) == TF_RSP, "Trapframe layout changed");
+static_assert(offsetof(struct Env, env_tf) == 0, "env_tf should be the first field of struct Env");
+
 /* Interrupt descriptor table  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records) */
 struct Gatedesc idt[256] = {{0}};
@@ -51,10 +66,10 @@ struct Segdesc32 gdt[2 * NCPU + 7] = {
         [GD_KT32 >> 3] = SEG32(STA_X | STA_R, 0x0, 0xFFFFFFFF, 0),
         /* 0x20 - kernel data segment 32bit */
         [GD_KD32 >> 3] = SEG32(STA_W, 0x0, 0xFFFFFFFF, 0),
-        /* 0x28 - user code segment */
-        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xFFFFFFFF, 3),
-        /* 0x30 - user data segment */
+        /* 0x28 - user data segment */
         [GD_UD >> 3] = SEG64(STA_W, 0x0, 0xFFFFFFFF, 3),
+        /* 0x30 - user code segment */
+        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xFFFFFFFF, 3),
         /* Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
      * in trap_init_percpu() */
         [GD_TSS0 >> 3] = SEG_NULL,
@@ -88,7 +103,7 @@ trapname(int trapno) {
             "SIMD Floating-Point Exception"};
 
     if (trapno < sizeof(excnames) / sizeof(excnames[0])) return excnames[trapno];
-    if (trapno == T_SYSCALL) return "System call";
+    if (trapno == T_SYSCALL || trapno == T_FASTCALL) return "System call";
     if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16) return "Hardware Interrupt";
 
     return "(unknown trap)";
@@ -117,6 +132,21 @@ trap_init(void) {
     extern void timer_thdlr();
     idt[IRQ_OFFSET + IRQ_TIMER] = GATE(0, GD_KT, &timer_thdlr, 0);
 
+    extern void serial_thdlr();
+    idt[IRQ_OFFSET + IRQ_SERIAL] = GATE(0, GD_KT, &serial_thdlr, 0);
+
+    extern void kbd_thdlr();
+    idt[IRQ_OFFSET + IRQ_KBD] = GATE(0, GD_KT, &kbd_thdlr, 0);
+
+    /* First FPU use of an env that doesn't own the registers */
+    extern void nm_thdlr();
+    idt[T_DEVICE] = GATE(0, GD_KT, &nm_thdlr, 0);
+
+    /* System calls through int, callable from user mode, the faster
+     * SYSCALL instruction entry is set up by syscall_init() */
+    extern void syscall_thdlr();
+    idt[T_SYSCALL] = GATE(0, GD_KT, &syscall_thdlr, 3);
+
     /* Per-CPU setup */
     trap_init_percpu();
 }
@@ -163,6 +193,13 @@ trap_init_percpu(void) {
 
     /* Load the IDT */
     lidt(&idt_pd);
+
+    /* Fast system call entry */
+    syscall_init();
+
+    /* Lazy FPU switching, all the envs start without FPU state */
+    fpu_init();
+    pmu_init();
 }
 
 void
@@ -236,9 +273,41 @@ trap_dispatch(struct Trapframe *tf) {
         // LAB 4: Your code here
         // Lab 4 would have rtc_timer_pic_handle(); here.
         // LAB 5: Your code here
+        prof_sample(tf);
+        klog_tick();
         timer_for_schedule->handle_interrupts();
+        ktimer_run();
         sched_yield();
         return;
+    case T_DEVICE:
+        fpu_trap();
+        return;
+    case T_PGFLT: {
+        uintptr_t va = rcr2();
+        enum FaultKind kind = FAULT_NONE;
+        /* Write to a copy-on-write mapping, e.g. a merged page */
+        int res = (tf->tf_err & (FEC_P | FEC_W)) == (FEC_P | FEC_W) ?
+                          force_alloc_page(env_space(curenv), va, COW_FAULT_CLASS, &kind) :
+                          -E_FAULT;
+        if (pftrace_enabled)
+            pftrace_record(curenv ? curenv->env_id : 0, va, tf->tf_err, kind,
+                           read_tsc() - trap_entry_tsc);
+        if (!res) return;
+        print_trapframe(tf);
+        if (!(tf->tf_cs & 3))
+            panic("Unhandled trap in kernel");
+        env_destroy(curenv);
+        return;
+    }
+    case T_SYSCALL:
+        syscall_dispatch(tf);
+        return;
+    case IRQ_OFFSET + IRQ_SERIAL:
+        serial_irq();
+        return;
+    case IRQ_OFFSET + IRQ_KBD:
+        kbd_irq();
+        return;
     default:
         print_trapframe(tf);
         if (!(tf->tf_cs & 3))
@@ -247,6 +316,152 @@ trap_dispatch(struct Trapframe *tf) {
     }
 }
 
+/* Per-vector interrupt statistics, see irqstat_print().
+ * Only its CPU updates them, with interrupts disabled, so accounting
+ * a trap is a counter increment, a rdtsc and a histogram increment */
+#define IRQSTAT_VECTORS 256
+#define IRQSTAT_BUCKETS 16
+#define IRQSTAT_MIN     8 /* First bucket is below 2^(8+1) TSC cycles */
+
+struct IrqStat {
+    uint64_t count[IRQSTAT_VECTORS];
+    uint32_t latency[IRQSTAT_VECTORS][IRQSTAT_BUCKETS];
+    int current; /* Vector being handled plus one, 0 if none */
+};
+
+static struct IrqStat irq_stats[NCPU];
+
+/* Written by save_trapframe in kern/entry.S */
+uint64_t trap_entry_tsc;
+
+void
+irqstat_enter(int vector) {
+    struct IrqStat *stat = &irq_stats[cpunum()];
+    vector &= IRQSTAT_VECTORS - 1;
+    stat->count[vector]++;
+    stat->current = vector + 1;
+}
+
+/* Called by env_pop_tf(). Traps that end up idle in sched_halt()
+ * are counted, but their duration is not */
+void
+irqstat_exit(void) {
+    struct IrqStat *stat = &irq_stats[cpunum()];
+    if (!stat->current) return;
+
+    uint64_t cycles = read_tsc() - trap_entry_tsc;
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) - IRQSTAT_MIN : 0;
+    stat->latency[stat->current - 1][MIN(MAX(bucket, 0), IRQSTAT_BUCKETS - 1)]++;
+    stat->current = 0;
+}
+
+void
+irqstat_print(void) {
+    for (int i = 0; i < NCPU; i++) {
+        struct IrqStat *stat = &irq_stats[i];
+
+        cprintf("cpu %d:\n  vec %-20s %10s  latency, TSC cycles:count\n", i, "name", "count");
+        for (int vec = 0; vec < IRQSTAT_VECTORS; vec++) {
+            if (!stat->count[vec]) continue;
+
+            cprintf("  %3d %-20s %10lu ", vec, trapname(vec), (unsigned long)stat->count[vec]);
+            for (int j = 0; j < IRQSTAT_BUCKETS; j++) {
+                if (!stat->latency[vec][j]) continue;
+                cprintf(" %s%lu:%u", j == IRQSTAT_BUCKETS - 1 ? ">=" : "<",
+                        1UL << (IRQSTAT_MIN + j + (j != IRQSTAT_BUCKETS - 1)),
+                        stat->latency[vec][j]);
+            }
+            cprintf("\n");
+        }
+    }
+}
+
+void
+irqstat_reset(void) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    for (int i = 0; i < NCPU; i++) {
+        memset(irq_stats[i].count, 0, sizeof(irq_stats[i].count));
+        memset(irq_stats[i].latency, 0, sizeof(irq_stats[i].latency));
+    }
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+}
+
+/* Set while the CPU is halted in trap_wait(), read by save_trapframe
+ * in kern/entry.S. There is only one CPU, so it is not per-CPU */
+bool trap_waiting;
+
+/* Halt until the next interrupt, which is handled and then returns
+ * here instead of switching to an env. For kernel code that waits
+ * for a device, such as console input, without polling it */
+void
+trap_wait(void) {
+    uint64_t rflags = read_rflags();
+    asm volatile("cli" ::: "memory");
+
+    /* Interrupts are only taken right at hlt and before cli,
+     * an interrupt pending already wakes it up immediately */
+    trap_waiting = 1;
+    asm volatile("sti\n"
+                 "hlt\n"
+                 "cli" ::
+                         : "memory");
+    trap_waiting = 0;
+
+    if (rflags & FL_IF) asm volatile("sti" ::: "memory");
+}
+
+/* Boot runs with preemption points disabled, see i386_init() */
+int preempt_count[NCPU] = {[0 ... NCPU - 1] = 1};
+bool need_resched[NCPU];
+
+/* Take interrupts pending right now and continue, see kern/preempt.h.
+ * Does nothing under a spinlock, while waiting for an interrupt,
+ * after a panic or if interrupts are enabled anyway */
+void
+preempt_point(void) {
+    extern char *panicstr;
+    if (preempt_count[cpunum()] || trap_waiting || panicstr ||
+        (read_rflags() & FL_IF)) return;
+
+    /* sti takes effect after the next instruction, so pending
+     * interrupts are taken right at nop, before cli */
+    trap_waiting = 1;
+    asm volatile("sti\n"
+                 "nop\n"
+                 "cli" ::
+                         : "memory");
+    trap_waiting = 0;
+}
+
+/* An interrupt that woke up trap_wait() or came at preempt_point().
+ * The timer tick doesn't reschedule, the interrupted code is resumed
+ * with env_pop_tf() and curenv is rescheduled when its trap returns */
+static _Noreturn void
+trap_wake(struct Trapframe *tf) {
+    switch (tf->tf_trapno) {
+    case IRQ_OFFSET + IRQ_TIMER:
+    case IRQ_OFFSET + IRQ_CLOCK:
+        klog_tick();
+        timer_for_schedule->handle_interrupts();
+        ktimer_run();
+        if (curenv) need_resched[cpunum()] = 1;
+        break;
+    case IRQ_OFFSET + IRQ_SPURIOUS:
+    case IRQ_OFFSET + IRQ_SERIAL:
+    case IRQ_OFFSET + IRQ_KBD:
+        trap_dispatch(tf);
+        break;
+    default:
+        print_trapframe(tf);
+        panic("Unexpected trap while waiting for an interrupt");
+    }
+
+    env_pop_tf(tf);
+}
+
 _Noreturn void
 trap(struct Trapframe *tf) {
     /* The environment may have set DF and some versions
@@ -263,15 +478,29 @@ trap(struct Trapframe *tf) {
      * the interrupt path */
     assert(!(read_rflags() & FL_IF));
 
+    irqstat_enter(tf->tf_trapno);
+
     if (trace_traps) cprintf("Incoming TRAP[%ld] frame at %p\n", tf->tf_trapno, tf);
     if (trace_traps_more) print_trapframe(tf);
 
+    /* An interrupt that woke up trap_wait() */
+    if (trap_waiting) trap_wake(tf);
+
+    /* An interrupt that woke up an idle CPU, see sched_halt() */
+    if (!curenv && tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS) {
+        trap_dispatch(tf);
+        sched_yield();
+    }
+
     assert(curenv);
 
-    /* Copy trap frame (which is currently on the stack)
-     * into 'curenv->env_tf', so that running the environment
-     * will restart at the trap point */
-    curenv->env_tf = *tf;
+    /* Charge the env for the time it has just run */
+    sched_account(curenv);
+
+    /* The entry code saves the trap frame right into 'curenv->env_tf',
+     * so that running the environment will restart at the trap point.
+     * Copy it there if it ended up anywhere else */
+    if (tf != &curenv->env_tf) curenv->env_tf = *tf;
     /* The trapframe on the stack should be ignored from here on */
     tf = &curenv->env_tf;
 
@@ -284,8 +513,8 @@ trap(struct Trapframe *tf) {
 
     /* If we made it to this point, then no other environment was
      * scheduled, so we should return to the current environment
-     * if doing so makes sense */
-    if (curenv && curenv->env_status == ENV_RUNNING)
+     * if doing so makes sense and no timer tick came in the meantime */
+    if (curenv && curenv->env_status == ENV_RUNNING && !need_resched[cpunum()])
         env_run(curenv);
     else
         sched_yield();
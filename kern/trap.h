@@ -15,10 +15,19 @@ extern struct Pseudodesc idt_pd;
 
 extern bool in_page_fault;
 
+/* TSC at entry of the trap being handled */
+extern uint64_t trap_entry_tsc;
+
 void clock_idt_init(void);
 void trap_init(void);
 void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
+void trap_wait(void);
+
+void irqstat_enter(int vector);
+void irqstat_exit(void);
+void irqstat_print(void);
+void irqstat_reset(void);
 
 #endif /* JOS_KERN_TRAP_H */
@@ -6,12 +6,19 @@
 
 #include <kern/tsc.h>
 #include <kern/timer.h>
+#include <kern/traceopt.h>
 
 /* The clock frequency of the i8253/i8254 PIT */
 #define PIT_TICK_RATE 1193182ul
 #define DEFAULT_FREQ  2500000
 #define TIMES         100
 
+#define CPUID_ECX_HYPERVISOR (1u << 31)
+#define CPUID_HV_BASE        0x40000000
+#define CPUID_HV_TIMING      0x40000010 /* TSC frequency in kHz in eax */
+#define CPUID_TSC_CRYSTAL    0x15
+#define CPUID_FREQ           0x16
+
 struct Timer timer_pit = {
         .timer_name = "pit",
         .get_cpu_freq = tsc_calibrate};
@@ -87,7 +94,7 @@ pit_expect_msb(unsigned char val, uint64_t *tscp, unsigned long *deltap) {
 #define MAX_QUICK_PIT_ITERATIONS (MAX_QUICK_PIT_MS * PIT_TICK_RATE / 1000 / 256)
 
 static unsigned long
-quick_pit_calibrate(void) {
+quick_pit_calibrate(uint64_t *error_ppm) {
     int i;
     uint64_t tsc, delta;
     unsigned long d1, d2;
@@ -153,6 +160,8 @@ success:
      * kHz = ((t2 - t1) * PIT_TICK_RATE) / (I * 256 * 1000)
      */
 
+    *error_ppm = (d1 + d2) * 1000000 / delta;
+
     delta += (long)(d2 - d1) / 2;
     delta *= PIT_TICK_RATE;
     delta /= i * 256 * 1000;
@@ -160,22 +169,87 @@ success:
     return delta;
 }
 
+/* Where tsc_calibrate() got the frequency from */
+static const char *tsc_source;
+static uint64_t tsc_error_ppm;
+
+/* TSC frequency in Hz as reported by CPUID, 0 if it isn't.
+ * Under a hypervisor its timing leaf is the most precise source,
+ * otherwise leaf 0x15 gives the exact TSC/crystal ratio, and
+ * leaf 0x16 only the nominal base frequency in MHz */
+static uint64_t
+cpuid_tsc_freq(uint64_t *error_ppm) {
+    uint32_t max, eax, ebx, ecx;
+
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    if (ecx & CPUID_ECX_HYPERVISOR) {
+        cpuid(CPUID_HV_BASE, &max, NULL, NULL, NULL);
+        if (max >= CPUID_HV_TIMING) {
+            cpuid(CPUID_HV_TIMING, &eax, NULL, NULL, NULL);
+            if (eax) {
+                tsc_source = "hypervisor cpuid";
+                *error_ppm = 1000000 / eax;
+                return eax * 1000ULL;
+            }
+        }
+    }
+
+    cpuid(0, &max, NULL, NULL, NULL);
+    if (max >= CPUID_TSC_CRYSTAL) {
+        /* eax/ebx is the TSC/crystal ratio, ecx is crystal frequency */
+        cpuid(CPUID_TSC_CRYSTAL, &eax, &ebx, &ecx, NULL);
+        if (eax && ebx && ecx) {
+            tsc_source = "cpuid 0x15";
+            *error_ppm = 0;
+            return (uint64_t)ecx * ebx / eax;
+        }
+    }
+    if (max >= CPUID_FREQ) {
+        cpuid(CPUID_FREQ, &eax, NULL, NULL, NULL);
+        eax &= 0xFFFF;
+        if (eax) {
+            tsc_source = "cpuid 0x16";
+            *error_ppm = 1000000 / eax;
+            return eax * 1000000ULL;
+        }
+    }
+
+    return 0;
+}
+
+/* TSC frequency in Hz. The first call calibrates it: CPUID is free,
+ * a short HPET window is used if the HPET is already initialized,
+ * and the PIT is the last resort, as it takes tens of milliseconds */
 uint64_t
 tsc_calibrate(void) {
     static uint64_t cpu_freq;
 
     if (!cpu_freq) {
-        int i = TIMES;
-        while (--i > 0) {
-            if ((cpu_freq = quick_pit_calibrate())) break;
-        }
-        if (!i) {
-            cpu_freq = DEFAULT_FREQ;
-            cprintf("Can't calibrate pit timer. Using default frequency\n");
+        if ((cpu_freq = cpuid_tsc_freq(&tsc_error_ppm))) {
+            /* tsc_source is set by cpuid_tsc_freq() */
+        } else if ((cpu_freq = hpet_tsc_calibrate(&tsc_error_ppm))) {
+            tsc_source = "hpet";
+        } else {
+            int i = TIMES;
+            while (--i > 0) {
+                if ((cpu_freq = quick_pit_calibrate(&tsc_error_ppm))) break;
+            }
+            if (!i) {
+                cpu_freq = DEFAULT_FREQ;
+                tsc_error_ppm = 1000000;
+                cprintf("Can't calibrate pit timer. Using default frequency\n");
+            }
+            tsc_source = i ? "pit" : "default";
+            cpu_freq *= 1000;
         }
+
+        if (trace_init)
+            cprintf("TSC: %lu.%03lu MHz from %s, error %lu ppm\n",
+                    (unsigned long)(cpu_freq / 1000000), (unsigned long)(cpu_freq / 1000 % 1000),
+                    tsc_source, (unsigned long)tsc_error_ppm);
     }
 
-    return cpu_freq * 1000;
+    return cpu_freq;
 }
 
 void
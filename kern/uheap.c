@@ -0,0 +1,93 @@
+/* User heap windows, see kern/uheap.h */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/uheap.h>
+#include <kern/vsyscall.h>
+
+static_assert(UHEAP_BASE + UHEAP_WINDOWS * UHEAP_WINDOW_SIZE <= MAX_USER_ADDRESS, "Heap windows don't fit");
+#ifdef SANITIZE_USER_SHADOW_BASE
+static_assert(UHEAP_BASE + UHEAP_WINDOWS * UHEAP_WINDOW_SIZE <= SANITIZE_USER_SHADOW_BASE, "Heap windows overlap the shadow");
+#endif
+
+/* Owner of every window, 0 if it is free */
+static envid_t uheap_owner[UHEAP_WINDOWS];
+static struct spinlock uheap_lock = SPINLOCK_INITIALIZER(uheap_lock, LOCK_ORDER_UHEAP);
+
+/* Base address of curenv's heap window, it gets one on the
+ * first call with the first size bytes mapped, so that the
+ * allocator has where to keep its state */
+int64_t
+uheap_attach(size_t size) {
+    if (curenv->env_heap) return curenv->env_heap;
+    if (PAGE_OFFSET(size) || size > UHEAP_WINDOW_SIZE) return -E_INVAL;
+
+    spin_lock(&uheap_lock);
+    int i = 0;
+    while (i < UHEAP_WINDOWS && uheap_owner[i]) i++;
+    if (i < UHEAP_WINDOWS) uheap_owner[i] = curenv->env_id;
+    spin_unlock(&uheap_lock);
+    if (i == UHEAP_WINDOWS) return -E_NO_MEM;
+
+    uintptr_t base = UHEAP_BASE + (uintptr_t)i * UHEAP_WINDOW_SIZE;
+    int res = size ? map_region(env_space(curenv), base, NULL, 0, size,
+                                PROT_R | PROT_W | PROT_USER_ | PROT_SHARE | ALLOC_ZERO) :
+                     0;
+    if (res < 0) {
+        unmap_region(env_space(curenv), base, size);
+        spin_lock(&uheap_lock);
+        uheap_owner[i] = 0;
+        spin_unlock(&uheap_lock);
+        return res;
+    }
+
+    curenv->env_heap = base;
+    vsys_set_env(curenv);
+    return base;
+}
+
+/* [va, va + size) is a page aligned range in curenv's window */
+static bool
+uheap_check(uintptr_t va, size_t size) {
+    uintptr_t base = curenv->env_heap;
+    if (!base || !size || PAGE_OFFSET(va) || PAGE_OFFSET(size)) return 0;
+    return va >= base && va - base < UHEAP_WINDOW_SIZE && size <= UHEAP_WINDOW_SIZE - (va - base);
+}
+
+/* Back [va, va + size) of curenv's window with zeroed pages.
+ * Kernel mode envs don't take page faults, so the memory is
+ * allocated right away rather than on the first write */
+int
+uheap_map(uintptr_t va, size_t size) {
+    if (!uheap_check(va, size)) return -E_INVAL;
+    return map_region(env_space(curenv), va, NULL, 0, size,
+                      PROT_R | PROT_W | PROT_USER_ | PROT_SHARE | ALLOC_ZERO);
+}
+
+/* Give pages of curenv's window back, the range stays its own */
+int
+uheap_unmap(uintptr_t va, size_t size) {
+    if (!uheap_check(va, size)) return -E_INVAL;
+    unmap_region(env_space(curenv), va, size);
+    return 0;
+}
+
+/* env is being freed, so is its window. Pointers other envs
+ * may still have into it are dangling from now on */
+void
+uheap_release(struct Env *env) {
+    uintptr_t base = env->env_heap;
+    if (!base) return;
+
+    unmap_region(env_space(env), base, UHEAP_WINDOW_SIZE);
+    env->env_heap = 0;
+
+    spin_lock(&uheap_lock);
+    uheap_owner[(base - UHEAP_BASE) / UHEAP_WINDOW_SIZE] = 0;
+    spin_unlock(&uheap_lock);
+}
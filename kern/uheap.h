@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_UHEAP_H
+#define JOS_KERN_UHEAP_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+/* Heap windows of user programs.
+ *
+ * An env that wants a heap gets a UHEAP_WINDOW_SIZE range of VA of its
+ * own with uheap_attach(), only its first pages are mapped. The allocator
+ * in lib/malloc.c maps and unmaps pages inside of the window as it
+ * needs them, and the window with everything still mapped goes away
+ * when the env is freed. Kernel mode envs all share kspace, that is
+ * why the windows are handed out by the kernel instead of being at a
+ * fixed address. The current env's window is also in the vsys page,
+ * so the allocator finds it without a system call. */
+
+int64_t uheap_attach(size_t size);
+int uheap_map(uintptr_t va, size_t size);
+int uheap_unmap(uintptr_t va, size_t size);
+void uheap_release(struct Env *env);
+
+#endif /* !JOS_KERN_UHEAP_H */
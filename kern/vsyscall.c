@@ -0,0 +1,72 @@
+/* Read-only kernel data page for user programs, see inc/vsyscall.h */
+
+#include <inc/assert.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/kclock.h>
+#include <kern/pmap.h>
+#include <kern/tsc.h>
+#include <kern/vsyscall.h>
+
+#define CPUID_EXT_EDX_RDTSCP (1 << 27)
+
+static_assert(sizeof(struct VsysPage) <= UVSYS_SIZE, "Vsys page overflow");
+static_assert(NCPU <= VSYS_CPUS, "Not enough per-CPU slots in the vsys page");
+
+/* Writable kernel alias of the page at UVSYS */
+static struct VsysPage *vsys_page;
+
+void
+vsys_init(void) {
+    if (!(vsys_page = kalloc_page(0))) panic("Out of memory for the vsys page");
+    memset(vsys_page, 0, UVSYS_SIZE);
+
+    /* Kernel mode envs all run in kspace */
+    int res = map_kernel_image(UVSYS, vsys_page, UVSYS_SIZE, PROT_R | PROT_USER_);
+    if (res < 0) panic("Can't map the vsys page: %i", res);
+
+    uint32_t max_ext, edx = 0;
+    cpuid(0x80000000, &max_ext, NULL, NULL, NULL);
+    if (max_ext >= 0x80000001) cpuid(0x80000001, NULL, NULL, NULL, &edx);
+    vsys_page->rdtscp = !!(edx & CPUID_EXT_EDX_RDTSCP);
+
+    vsys_init_percpu();
+
+    uint64_t tsc = read_tsc();
+    vsys_set_time(rtc_unix_time() * 1000000000, tsc, tsc_calibrate());
+}
+
+/* Tell RDTSCP in user programs which CPU they run on */
+void
+vsys_init_percpu(void) {
+    if (vsys_page->rdtscp) wrmsr(TSC_AUX_MSR, cpunum());
+}
+
+/* The wall clock time was time_ns when the TSC read tsc.
+ * Callers serialize among themselves */
+void
+vsys_set_time(uint64_t time_ns, uint64_t tsc, uint64_t tsc_freq) {
+    volatile struct VsysPage *page = vsys_page;
+
+    /* Volatile stores keep their order, and x86
+     * doesn't reorder stores with each other either */
+    page->seq++;
+    page->tsc_freq = tsc_freq;
+    page->tsc_base = tsc;
+    page->boot_time_ns = time_ns;
+    page->seq++;
+}
+
+/* env is about to run on this CPU */
+void
+vsys_set_env(struct Env *env) {
+    if (!vsys_page) return;
+
+    int cpu = cpunum();
+    vsys_page->cpu[cpu].env_id = env->env_id;
+    vsys_page->cpu[cpu].env_runs = env->env_runs;
+    vsys_page->cpu[cpu].env_heap = env->env_heap;
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_VSYSCALL_H
+#define JOS_KERN_VSYSCALL_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/vsyscall.h>
+
+void vsys_init(void);
+void vsys_init_percpu(void);
+void vsys_set_time(uint64_t time_ns, uint64_t tsc, uint64_t tsc_freq);
+void vsys_set_env(struct Env *env);
+
+#endif /* !JOS_KERN_VSYSCALL_H */
@@ -0,0 +1,143 @@
+/* Kernel threads and deferred work queues, see kern/workqueue.h */
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/workqueue.h>
+
+struct Work {
+    void (*fn)(void *);
+    void *arg;
+};
+
+/* Circular buffer of calls, head and tail grow without wrapping */
+struct WorkQueue {
+    struct spinlock lock;
+    struct Work items[WORK_QUEUE_SIZE];
+    size_t head, tail;
+    struct Env *worker;
+    bool sleeping; /* Worker is blocked waiting for work */
+};
+
+static struct WorkQueue work_queues[NCPU];
+
+#ifdef CONFIG_KSPACE
+/* Start a kernel thread running fn(arg) on a stack of its own.
+ * For now kernel threads are not expected to return,
+ * if one does it exits through sys_exit() */
+int
+kthread_create(void (*fn)(void *), void *arg, struct Env **env_store) {
+    struct Env *env;
+    int res = env_alloc(&env, 0, ENV_TYPE_KERNEL);
+    if (res < 0) return res;
+
+    uintptr_t *stack = kalloc_page(KTHREAD_STACK_CLASS);
+    if (!stack) {
+        env_free(env);
+        return -E_NO_MEM;
+    }
+
+    /* As if fn had been called from sys_exit() */
+    uintptr_t *top = (uintptr_t *)((uint8_t *)stack + CLASS_SIZE(KTHREAD_STACK_CLASS));
+    *--top = (uintptr_t)sys_exit;
+
+    env->env_tf.tf_rsp = (uintptr_t)top;
+    env->env_tf.tf_rip = (uintptr_t)fn;
+    env->env_tf.tf_regs.reg_rdi = (uintptr_t)arg;
+
+    *env_store = env;
+    return 0;
+}
+
+static _Noreturn void
+worker_main(void *arg) {
+    struct WorkQueue *wq = arg;
+
+    for (;;) {
+        uint64_t rflags = spin_lock_irqsave(&wq->lock);
+
+        if (wq->head == wq->tail) {
+            /* Interrupts stay disabled until sys_yield() has saved
+             * the frame, so a wakeup can't come in between */
+            curenv->env_status = ENV_NOT_RUNNABLE;
+            wq->sleeping = 1;
+            spin_unlock(&wq->lock);
+            sys_yield();
+            continue;
+        }
+
+        struct Work work = wq->items[wq->head++ % WORK_QUEUE_SIZE];
+        spin_unlock_irqrestore(&wq->lock, rflags);
+
+        work.fn(work.arg);
+    }
+}
+
+/* Start the worker of every CPU, after env_init() */
+void
+workqueue_init(void) {
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct WorkQueue *wq = &work_queues[cpu];
+        spin_initlock(&wq->lock, LOCK_ORDER_WORK);
+
+        struct Env *env;
+        int res = kthread_create(worker_main, wq, &env);
+        if (res < 0) panic("Can't start the worker of CPU %d: %i", cpu, res);
+
+        sched_dequeue(env);
+        env->env_cpunum = cpu;
+        env->env_weight = SCHED_WEIGHT_IDLE;
+        sched_enqueue(env);
+        wq->worker = env;
+    }
+}
+
+/* Run fn(arg) later from the worker of this CPU.
+ * Fails with -E_BAD_ENV before the workers are started and with
+ * -E_NO_MEM if the queue is full, the caller may do the work itself then */
+int
+queue_work(void (*fn)(void *), void *arg) {
+    /* If the caller migrates meanwhile the work just
+     * goes to the worker of the CPU it came from */
+    struct WorkQueue *wq = &work_queues[cpunum()];
+    if (!wq->worker) return -E_BAD_ENV;
+
+    uint64_t rflags = spin_lock_irqsave(&wq->lock);
+
+    int res = 0;
+    if (wq->tail - wq->head == WORK_QUEUE_SIZE) {
+        res = -E_NO_MEM;
+    } else {
+        wq->items[wq->tail++ % WORK_QUEUE_SIZE] = (struct Work){fn, arg};
+        if (wq->sleeping) {
+            wq->sleeping = 0;
+            wq->worker->env_status = ENV_RUNNABLE;
+            sched_enqueue(wq->worker);
+        }
+    }
+
+    spin_unlock_irqrestore(&wq->lock, rflags);
+    return res;
+}
+
+#else
+/* Kernel threads need kernel mode envs */
+int
+kthread_create(void (*fn)(void *), void *arg, struct Env **env_store) {
+    return -E_INVAL;
+}
+
+void
+workqueue_init(void) {
+}
+
+int
+queue_work(void (*fn)(void *), void *arg) {
+    return -E_BAD_ENV;
+}
+#endif
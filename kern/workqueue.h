@@ -0,0 +1,26 @@
+#ifndef JOS_KERN_WORKQUEUE_H
+#define JOS_KERN_WORKQUEUE_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+/* Deferred kernel work.
+ *
+ * Every CPU has a worker: a kernel thread, i.e. an ENV_TYPE_KERNEL env
+ * running a kernel function on its own stack. queue_work() appends a call
+ * to the queue of the current CPU and makes the worker runnable, the
+ * worker blocks as ENV_NOT_RUNNABLE while its queue is empty. Workers
+ * have the idle weight, so under the fair class they mostly get the time
+ * a CPU would otherwise spend idle. Work can be preempted and may block,
+ * but must not take locks the code that queued it may hold. */
+
+#define WORK_QUEUE_SIZE    256
+#define KTHREAD_STACK_CLASS 2 /* 16K */
+
+int kthread_create(void (*fn)(void *), void *arg, struct Env **env_store);
+void workqueue_init(void);
+int queue_work(void (*fn)(void *), void *arg);
+
+#endif /* !JOS_KERN_WORKQUEUE_H */
@@ -0,0 +1,398 @@
+/* User heap allocator.
+ *
+ * Every env has a heap of its own in the window the kernel gives it,
+ * see kern/uheap.h. The heap is the env's cache: allocation and free
+ * of its own memory take no locks and don't enter the kernel. Only a
+ * free of memory from another env's heap touches that heap, it pushes
+ * the object to the heap's remote list, which the owner takes over
+ * the next time it runs out of free objects.
+ *
+ * The window is cut into SPAN_SIZE spans, the first one holds struct
+ * Heap. Objects of up to SMALL_MAX bytes are rounded up to one of the
+ * size classes and come from spans of that class, each span has its
+ * own free list and every class has a bin of spans with free objects.
+ * Larger allocations take a run of spans to themselves. The header of
+ * a span is at its start, so the span of an object is found by
+ * rounding its address down.
+ *
+ * Spans are mapped with sys_heap_map() a few at a time. Free spans
+ * stay mapped and are reused first, memory goes back to the kernel
+ * only once more than HEAP_KEEP_SPANS of them have piled up, from the
+ * top of the window down */
+
+#include <inc/lib.h>
+
+#define SPAN_SIZE (64 * 1024)
+#define SPAN_HDR  64
+#define NSPANS    (UHEAP_WINDOW_SIZE / SPAN_SIZE)
+
+#define NCLASSES  32
+#define SMALL_MAX 8192
+
+/* Spans mapped at once when the heap grows */
+#define HEAP_GROW_SPANS 8
+/* Free spans kept mapped, trimming goes down to half of that */
+#define HEAP_KEEP_SPANS 16
+
+struct Span {
+    uint32_t class;           /* NCLASSES for a large allocation */
+    uint32_t nspans;          /* Length of the run */
+    uint32_t used;            /* Objects handed out */
+    uint32_t capacity;        /* Objects that fit */
+    void *free;               /* Freed objects, linked through their first word */
+    uint8_t *bump;            /* Start of the part never handed out */
+    struct Span *next, *prev; /* In the bin while it has free objects */
+};
+
+struct Heap {
+    struct Span *bins[NCLASSES]; /* Spans with free objects */
+    void *volatile remote;       /* Objects freed by other envs */
+    size_t cached;               /* Free spans that are still mapped */
+    uint64_t used[NSPANS / 64];  /* Spans in use, the first one is the header */
+    uint64_t mapped[NSPANS / 64];
+};
+
+#define HEAP_HDR_SIZE ROUNDUP(sizeof(struct Heap), PAGE_SIZE)
+
+static_assert(sizeof(struct Span) <= SPAN_HDR, "Span header is too large");
+static_assert(sizeof(struct Heap) <= SPAN_SIZE, "Heap header doesn't fit its span");
+
+static const uint16_t class_size[NCLASSES] = {
+        16, 32, 48, 64, 80, 96, 112, 128,
+        160, 192, 224, 256, 320, 384, 448, 512,
+        640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+        2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192};
+
+/* 16 byte steps up to 128, then four classes per power of two */
+static int
+size_class(size_t size) {
+    if (size <= 128) return (size + 15) / 16 - 1;
+    int log = 63 - __builtin_clzl(size - 1);
+    return 8 + (log - 7) * 4 + (((size - 1) >> (log - 2)) & 3);
+}
+
+/* ASAN instrumented programs see objects that aren't handed out as
+ * poisoned. Free lists are walked with non-sanitized accesses */
+static inline void
+heap_poison(void *va, size_t size) {
+#ifdef SANITIZE_USER_SHADOW_BASE
+    platform_asan_poison(va, size);
+#endif
+}
+
+static inline void
+heap_unpoison(void *va, size_t size) {
+#ifdef SANITIZE_USER_SHADOW_BASE
+    platform_asan_unpoison(va, size);
+#endif
+}
+
+static inline void *
+link_get(void *obj) {
+#ifdef SANITIZE_USER_SHADOW_BASE
+    void *next;
+    __nosan_memcpy(&next, obj, sizeof(next));
+    return next;
+#else
+    return *(void **)obj;
+#endif
+}
+
+static inline void
+link_set(void *obj, void *next) {
+#ifdef SANITIZE_USER_SHADOW_BASE
+    __nosan_memcpy(obj, &next, sizeof(next));
+#else
+    *(void **)obj = next;
+#endif
+}
+
+static inline bool
+bit(const uint64_t *map, size_t i) {
+    return map[i / 64] >> (i % 64) & 1;
+}
+
+static inline void
+bit_set(uint64_t *map, size_t i, bool val) {
+    if (val)
+        map[i / 64] |= 1ULL << (i % 64);
+    else
+        map[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static inline struct Span *
+span_at(struct Heap *heap, size_t i) {
+    return (struct Span *)((uint8_t *)heap + i * SPAN_SIZE);
+}
+
+/* Heap of the current env, attached on the first use */
+static struct Heap *
+heap_self(void) {
+    uintptr_t base = vsys_env_heap();
+    if (base) return (struct Heap *)base;
+
+    int64_t res = syscall(SYS_heap_attach, HEAP_HDR_SIZE, 0, 0, 0, 0);
+    if (res < 0) return NULL;
+
+    /* The window is new, its header is zeroed */
+    struct Heap *heap = (struct Heap *)res;
+    bit_set(heap->used, 0, 1);
+    bit_set(heap->mapped, 0, 1);
+    return heap;
+}
+
+/* First fit run of n free spans, only of mapped ones if mapped is set.
+ * Returns 0 if there is none, that is the header */
+static size_t
+span_find(struct Heap *heap, size_t n, bool mapped) {
+    size_t run = 0;
+    for (size_t i = 1; i < NSPANS; i++) {
+        uint64_t busy = heap->used[i / 64] | (mapped ? ~heap->mapped[i / 64] : 0);
+        if (!(i % 64) && busy == ~0ULL) {
+            run = 0;
+            i += 63;
+        } else if (busy >> (i % 64) & 1) {
+            run = 0;
+        } else if (++run == n) {
+            return i + 1 - n;
+        }
+    }
+    return 0;
+}
+
+/* Return free spans to the kernel until no more than keep are mapped */
+static void
+heap_trim(struct Heap *heap, size_t keep) {
+    for (size_t i = NSPANS; heap->cached > keep && --i > 0;) {
+        if (bit(heap->used, i) || !bit(heap->mapped, i)) continue;
+
+        size_t start = i;
+        while (start > 1 && heap->cached - (i + 1 - start) > keep &&
+               !bit(heap->used, start - 1) && bit(heap->mapped, start - 1)) start--;
+
+        size_t n = i + 1 - start;
+        if (syscall(SYS_heap_unmap, (uintptr_t)span_at(heap, start), n * SPAN_SIZE, 0, 0, 0) < 0) return;
+        for (size_t j = start; j <= i; j++) bit_set(heap->mapped, j, 0);
+        heap->cached -= n;
+        i = start;
+    }
+}
+
+/* Take a run of n spans, mapping what isn't mapped yet. Single
+ * spans are taken from the cached ones first, the heap grows by
+ * HEAP_GROW_SPANS at once, the rest of that is cached */
+static struct Span *
+span_alloc(struct Heap *heap, size_t n) {
+    size_t i = 0;
+    if (n == 1 && heap->cached) i = span_find(heap, 1, 1);
+    if (!i) i = span_find(heap, n, 0);
+    if (!i) return NULL;
+
+    size_t end = i + n;
+    while (end < i + HEAP_GROW_SPANS && end < NSPANS && !bit(heap->used, end) && !bit(heap->mapped, end)) end++;
+
+    for (size_t j = i; j < end;) {
+        if (bit(heap->mapped, j)) {
+            j++;
+            continue;
+        }
+
+        size_t k = j;
+        while (k < end && !bit(heap->mapped, k)) k++;
+        if (syscall(SYS_heap_map, (uintptr_t)span_at(heap, j), (k - j) * SPAN_SIZE, 0, 0, 0) < 0) {
+            /* Only the look-ahead may be left out */
+            if (j < i + n) return NULL;
+            break;
+        }
+        heap->cached += k - j;
+        for (; j < k; j++) bit_set(heap->mapped, j, 1);
+    }
+
+    for (size_t j = i; j < i + n; j++) bit_set(heap->used, j, 1);
+    heap->cached -= n;
+
+    struct Span *span = span_at(heap, i);
+    heap_poison(span, n * SPAN_SIZE);
+    heap_unpoison(span, SPAN_HDR);
+    *span = (struct Span){.nspans = n};
+    return span;
+}
+
+static void
+span_free(struct Heap *heap, struct Span *span) {
+    size_t i = ((uint8_t *)span - (uint8_t *)heap) / SPAN_SIZE;
+
+    for (size_t j = i; j < i + span->nspans; j++) bit_set(heap->used, j, 0);
+    heap->cached += span->nspans;
+    heap_poison(span, span->nspans * SPAN_SIZE);
+
+    if (heap->cached > HEAP_KEEP_SPANS) heap_trim(heap, HEAP_KEEP_SPANS / 2);
+}
+
+static void
+bin_insert(struct Heap *heap, struct Span *span) {
+    struct Span **bin = &heap->bins[span->class];
+    span->prev = NULL;
+    span->next = *bin;
+    if (*bin) (*bin)->prev = span;
+    *bin = span;
+}
+
+static void
+bin_remove(struct Heap *heap, struct Span *span) {
+    if (span->prev)
+        span->prev->next = span->next;
+    else
+        heap->bins[span->class] = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span->next = span->prev = NULL;
+}
+
+static void heap_free(struct Heap *heap, void *ptr);
+
+/* Take over objects other envs have freed */
+static void
+heap_drain(struct Heap *heap) {
+    void *obj = __atomic_exchange_n(&heap->remote, NULL, __ATOMIC_ACQUIRE);
+    while (obj) {
+        void *next = link_get(obj);
+        heap_free(heap, obj);
+        obj = next;
+    }
+}
+
+static void *
+small_alloc(struct Heap *heap, int class) {
+    struct Span *span = heap->bins[class];
+    if (!span) {
+        heap_drain(heap);
+        span = heap->bins[class];
+    }
+    if (!span) {
+        if (!(span = span_alloc(heap, 1))) return NULL;
+        span->class = class;
+        span->capacity = (SPAN_SIZE - SPAN_HDR) / class_size[class];
+        span->bump = (uint8_t *)span + SPAN_HDR;
+        bin_insert(heap, span);
+    }
+
+    void *obj = span->free;
+    if (obj) {
+        span->free = link_get(obj);
+    } else {
+        obj = span->bump;
+        span->bump += class_size[class];
+    }
+
+    if (++span->used == span->capacity) bin_remove(heap, span);
+    return obj;
+}
+
+static void *
+large_alloc(struct Heap *heap, size_t size) {
+    if (size > UHEAP_WINDOW_SIZE) return NULL;
+    heap_drain(heap);
+
+    struct Span *span = span_alloc(heap, ROUNDUP(size + SPAN_HDR, SPAN_SIZE) / SPAN_SIZE);
+    if (!span) return NULL;
+    span->class = NCLASSES;
+    return (uint8_t *)span + SPAN_HDR;
+}
+
+/* Free an object of heap, which belongs to the current env */
+static void
+heap_free(struct Heap *heap, void *ptr) {
+    struct Span *span = ROUNDDOWN(ptr, SPAN_SIZE);
+    if (span->class == NCLASSES) {
+        span_free(heap, span);
+        return;
+    }
+
+    heap_poison(ptr, class_size[span->class]);
+    link_set(ptr, span->free);
+    span->free = ptr;
+    if (span->used-- == span->capacity) bin_insert(heap, span);
+
+    /* The last span of a class is kept, so that a single
+     * object allocated and freed in a loop doesn't churn */
+    if (!span->used && (span->prev || span->next)) {
+        bin_remove(heap, span);
+        span_free(heap, span);
+    }
+}
+
+static size_t
+usable_size(void *ptr) {
+    struct Span *span = ROUNDDOWN(ptr, SPAN_SIZE);
+    if (span->class == NCLASSES) return span->nspans * SPAN_SIZE - SPAN_HDR;
+    return class_size[span->class];
+}
+
+static bool
+heap_pointer(void *ptr) {
+    uintptr_t va = (uintptr_t)ptr;
+    return va >= UHEAP_BASE && va - UHEAP_BASE < UHEAP_WINDOWS * UHEAP_WINDOW_SIZE &&
+           va % UHEAP_WINDOW_SIZE >= SPAN_SIZE;
+}
+
+void *
+malloc(size_t size) {
+    struct Heap *heap = heap_self();
+    if (!heap) return NULL;
+    if (!size) size = 1;
+
+    void *ptr = size <= SMALL_MAX ? small_alloc(heap, size_class(size)) : large_alloc(heap, size);
+    if (ptr) heap_unpoison(ptr, size);
+    return ptr;
+}
+
+void
+free(void *ptr) {
+    if (!heap_pointer(ptr)) return;
+
+    struct Heap *heap = ROUNDDOWN(ptr, UHEAP_WINDOW_SIZE);
+    if ((uintptr_t)heap == vsys_env_heap()) {
+        heap_free(heap, ptr);
+        return;
+    }
+
+    /* Another env's object, its heap takes it back later */
+    void *head = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+    do {
+        link_set(ptr, head);
+    } while (!__atomic_compare_exchange_n(&heap->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void *
+calloc(size_t n, size_t size) {
+    if (size && n > (size_t)-1 / size) return NULL;
+
+    void *ptr = malloc(n * size);
+    if (ptr) memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void *
+realloc(void *ptr, size_t size) {
+    if (!heap_pointer(ptr)) return malloc(size);
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
+
+    size_t old = usable_size(ptr);
+    if (size <= old) {
+        heap_unpoison(ptr, size);
+        return ptr;
+    }
+
+    void *res = malloc(size);
+    if (!res) return NULL;
+#ifdef SANITIZE_USER_SHADOW_BASE
+    __nosan_memcpy(res, ptr, MIN(old, size));
+#else
+    memcpy(res, ptr, MIN(old, size));
+#endif
+    free(ptr);
+    return res;
+}
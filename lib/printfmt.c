@@ -29,29 +29,119 @@ static const char *const error_string[MAXERROR] = {
         [E_INVALID_EXE] = "invalid ELF image",
         [E_NO_ENT] = "entry not found",
         [E_NO_SYS] = "no such system call",
+        [E_IPC_NOT_RECV] = "env is not recving",
 };
 
 /*
- * Print a number (base <= 16) in reverse order,
- * using specified putch function and associated pointer putdat.
+ * Formatted output is collected in a small on-stack buffer and handed
+ * to the sink in chunks, so that the sink sees one call per run of
+ * literal text or per flushed buffer instead of one call per character.
+ */
+
+#define PRINTBUF_SIZE 128
+
+struct printbuf {
+    void (*putstr)(const char *, size_t, void *);
+    void *put_arg;
+    size_t len;
+    char buf[PRINTBUF_SIZE];
+};
+
+static void
+printbuf_flush(struct printbuf *pb) {
+    if (pb->len) pb->putstr(pb->buf, pb->len, pb->put_arg);
+    pb->len = 0;
+}
+
+static inline void
+printbuf_putc(struct printbuf *pb, char ch) {
+    if (pb->len == sizeof(pb->buf)) printbuf_flush(pb);
+    pb->buf[pb->len++] = ch;
+}
+
+static void
+printbuf_write(struct printbuf *pb, const char *str, size_t len) {
+    /* Long runs bypass the buffer entirely */
+    if (len >= sizeof(pb->buf)) {
+        printbuf_flush(pb);
+        pb->putstr(str, len, pb->put_arg);
+        return;
+    }
+
+    if (pb->len + len > sizeof(pb->buf)) printbuf_flush(pb);
+    memcpy(pb->buf + pb->len, str, len);
+    pb->len += len;
+}
+
+static void
+printbuf_pad(struct printbuf *pb, char padc, int count) {
+    while (count-- > 0) printbuf_putc(pb, padc);
+}
+
+static const char digits_lower[] = "0123456789abcdef";
+static const char digits_upper[] = "0123456789ABCDEF";
+
+/* Pairs of decimal digits "00" to "99", two digits per division */
+static const char digits_dec2[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+/*
+ * Print a number (base <= 16), padded on the left to the given width
+ * with padc. Digits are produced least significant first into a local
+ * buffer and written out in one go.
  */
 static void
-print_num(void (*putch)(int, void *), void *put_arg,
-          uintmax_t num, unsigned base, int width, char padc, bool capital) {
-    /* First recursively print all preceding (more significant) digits */
-    if (num >= base) {
-        print_num(putch, put_arg, num / base, base, width - 1, padc, capital);
+print_num(struct printbuf *pb, uintmax_t num, unsigned base,
+          int width, char padc, bool capital) {
+    /* Enough for a 64-bit value in octal */
+    char tmp[24];
+    char *end = tmp + sizeof(tmp), *pos = end;
+
+    if (base == 10) {
+        while (num >= 100) {
+            unsigned rem = num % 100;
+            num /= 100;
+            pos -= 2;
+            pos[0] = digits_dec2[2 * rem];
+            pos[1] = digits_dec2[2 * rem + 1];
+        }
+        if (num >= 10) {
+            pos -= 2;
+            pos[0] = digits_dec2[2 * num];
+            pos[1] = digits_dec2[2 * num + 1];
+        } else {
+            *--pos = '0' + num;
+        }
     } else {
-        /* Print any needed pad characters before first digit */
-        while (--width > 0) {
-            putch(padc, put_arg);
+        const char *dig = capital ? digits_upper : digits_lower;
+        /* Bases 8 and 16 reduce to shifts */
+        unsigned shift = base == 16 ? 4 : base == 8 ? 3 : 0;
+
+        if (shift) {
+            do {
+                *--pos = dig[num & (base - 1)];
+                num >>= shift;
+            } while (num);
+        } else {
+            do {
+                *--pos = dig[num % base];
+                num /= base;
+            } while (num);
         }
     }
 
-    const char *dig = capital ? "0123456789ABCDEF" : "0123456789abcdef";
-
-    /* Then print this (the least significant) digit */
-    putch(dig[num % base], put_arg);
+    /* Print any needed pad characters before first digit */
+    printbuf_pad(pb, padc, width - (int)(end - pos));
+    printbuf_write(pb, pos, end - pos);
 }
 
 /* Get an unsigned int of various possible sizes from a varargs list,
@@ -86,11 +176,9 @@ get_int(va_list *ap, int lflag, bool zflag) {
     }
 }
 
-/* Main function to format and print a string. */
-void printfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, ...);
-
-void
-vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap) {
+/* Main function to format a string into the output buffer. */
+static void
+printbuf_format(struct printbuf *pb, const char *fmt, va_list ap) {
     const unsigned char *ufmt = (unsigned char *)fmt;
 
     va_list aq;
@@ -98,10 +186,11 @@ vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap
 
     for (;;) {
         unsigned char ch;
-        while ((ch = *ufmt++) != '%') {
-            if (!ch) return;
-            putch(ch, put_arg);
-        }
+        const unsigned char *run = ufmt;
+        while ((ch = *ufmt) && ch != '%') ufmt++;
+        if (ufmt != run) printbuf_write(pb, (const char *)run, ufmt - run);
+        if (!ch) break;
+        ufmt++;
 
         /* Process a %-escape sequence */
         char padc = ' ';
@@ -159,7 +248,7 @@ vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap
             goto reswitch;
 
         case 'c': /* character */
-            putch(va_arg(aq, int), put_arg);
+            printbuf_putc(pb, va_arg(aq, int));
             break;
 
         case 'i': /* error message */ {
@@ -169,9 +258,10 @@ vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap
             if (err < 0) err = -err;
 
             if (err >= MAXERROR || !(strerr = error_string[err])) {
-                printfmt(putch, put_arg, "error %d", err);
+                printbuf_write(pb, "error ", 6);
+                print_num(pb, err, 10, 0, ' ', 0);
             } else {
-                printfmt(putch, put_arg, "%s", strerr);
+                printbuf_write(pb, strerr, strlen(strerr));
             }
             break;
         }
@@ -180,24 +270,30 @@ vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap
             const char *ptr = va_arg(aq, char *);
             if (!ptr) ptr = "(null)";
 
-            if (width > 0 && padc != '-') {
-                width -= strnlen(ptr, precision);
+            size_t len = precision < 0 ? strlen(ptr) : strnlen(ptr, precision);
 
-                while (width-- > 0) putch(padc, put_arg);
+            if (width > 0 && padc != '-') {
+                printbuf_pad(pb, padc, width - (int)len);
+                width = 0;
             }
 
-            for (; (ch = *ptr++) && (precision < 0 || --precision >= 0); width--) {
-                putch(altflag && (ch < ' ' || ch > '~') ? '?' : ch, put_arg);
+            if (altflag) {
+                for (size_t i = 0; i < len; i++) {
+                    ch = ptr[i];
+                    printbuf_putc(pb, ch < ' ' || ch > '~' ? '?' : ch);
+                }
+            } else {
+                printbuf_write(pb, ptr, len);
             }
 
-            while (width-- > 0) putch(' ', put_arg);
+            printbuf_pad(pb, ' ', width - (int)len);
             break;
         }
 
         case 'd': /* (signed) decimal */ {
             intmax_t i = get_int(&aq, lflag, zflag);
             if (i < 0) {
-                putch('-', put_arg);
+                printbuf_putc(pb, '-');
                 i = -i;
             }
             num = i;
@@ -220,8 +316,7 @@ vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap
             break;
 
         case 'p': /* pointer */
-            putch('0', put_arg);
-            putch('x', put_arg);
+            printbuf_write(pb, "0x", 2);
             num = (uintptr_t)va_arg(aq, void *);
             base = 16;
             goto number;
@@ -231,19 +326,50 @@ vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap
             num = get_unsigned(&aq, lflag, zflag);
             base = 16;
         number:
-            print_num(putch, put_arg, num, base, width, padc, ch == 'X');
+            print_num(pb, num, base, width, padc, ch == 'X');
             break;
 
         case '%': /* escaped '%' character */
-            putch(ch, put_arg);
+            printbuf_putc(pb, ch);
             break;
 
         default: /* unrecognized escape sequence - just print it literally */
-            putch('%', put_arg);
+            printbuf_putc(pb, '%');
             while ((--ufmt)[-1] != '%') /* nothing */
                 ;
         }
     }
+
+    va_end(aq);
+}
+
+/* Format a string, passing the output to putstr in chunks */
+void
+vprintfmt_puts(void (*putstr)(const char *, size_t, void *), void *put_arg, const char *fmt, va_list ap) {
+    struct printbuf pb;
+
+    pb.putstr = putstr;
+    pb.put_arg = put_arg;
+    pb.len = 0;
+
+    printbuf_format(&pb, fmt, ap);
+    printbuf_flush(&pb);
+}
+
+struct putch_sink {
+    void (*putch)(int, void *);
+    void *put_arg;
+};
+
+static void
+putch_putstr(const char *str, size_t len, struct putch_sink *sink) {
+    while (len--) sink->putch((unsigned char)*str++, sink->put_arg);
+}
+
+void
+vprintfmt(void (*putch)(int, void *), void *put_arg, const char *fmt, va_list ap) {
+    struct putch_sink sink = {putch, put_arg};
+    vprintfmt_puts((void *)putch_putstr, &sink, fmt, ap);
 }
 
 void
@@ -262,11 +388,13 @@ struct sprintbuf {
 };
 
 static void
-sprintputch(int ch, struct sprintbuf *state) {
-    state->count++;
-    if (state->start < state->end) {
-        *state->start++ = ch;
-    }
+sprintputstr(const char *str, size_t len, struct sprintbuf *state) {
+    size_t room = state->end - state->start;
+    size_t n = MIN(len, room);
+
+    memcpy(state->start, str, n);
+    state->start += n;
+    state->count += len;
 }
 
 int
@@ -276,7 +404,7 @@ vsnprintf(char *buf, size_t n, const char *fmt, va_list ap) {
     if (!buf || n < 1) return -E_INVAL;
 
     /* Print the string to the buffer */
-    vprintfmt((void *)sprintputch, &state, fmt, ap);
+    vprintfmt_puts((void *)sprintputstr, &state, fmt, ap);
 
     /* Null terminate the buffer */
     *state.start = '\0';
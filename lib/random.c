@@ -1,21 +1,76 @@
 #include <inc/random.h>
+#include <inc/string.h>
 
-static unsigned int next = 1;
+/* rand() without srand() behaves as srand(1) */
+static struct RandState global_state = {{0x910a2dec89025cc1ULL, 0xbeeb8da1658eec67ULL,
+                                         0xf893a2eefb32555eULL, 0x71c18690ee42c90bULL}};
 
-static int
-rand_r(unsigned int *seed) {
-    *seed = *seed * 1103515245 + 12345;
-    return (*seed % ((unsigned int)RAND_MAX + 1));
+static inline uint64_t
+rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* The state is derived from the seed with splitmix64,
+ * so that it is never all zeroes */
+void
+rand_seed(struct RandState *state, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        state->s[i] = z ^ (z >> 31);
+    }
+}
+
+uint64_t
+rand_next(struct RandState *state) {
+    uint64_t *s = state->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Fill n bytes of buf with random data, 8 bytes per step.
+ * The state is kept in locals, so the loop stays in registers */
+void
+rand_fill_r(struct RandState *state, void *buf, size_t n) {
+    struct RandState local = *state;
+    uint8_t *dst = buf;
+
+    for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), dst += sizeof(uint64_t)) {
+        uint64_t value = rand_next(&local);
+        memcpy(dst, &value, sizeof(value));
+    }
+    if (n) {
+        uint64_t value = rand_next(&local);
+        memcpy(dst, &value, n);
+    }
+
+    *state = local;
 }
 
 int
 rand(void) {
-    return (rand_r(&next));
+    /* The high bits are the best ones */
+    return rand_next(&global_state) >> 33;
 }
 
 void
 srand(unsigned int seed) {
-    next = seed;
+    rand_seed(&global_state, seed);
+}
+
+void
+rand_fill(void *buf, size_t n) {
+    rand_fill_r(&global_state, buf, n);
 }
 
 void
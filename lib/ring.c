@@ -0,0 +1,100 @@
+/* Single-producer, single-consumer rings, see inc/ring.h */
+
+#include <inc/lib.h>
+
+int
+ring_create(struct Ring *ring, envid_t peer, void *va, void *peer_va, size_t size) {
+    int id = syscall(SYS_ring_create, peer, (uintptr_t)va, (uintptr_t)peer_va, size, 0);
+    if (id < 0) return id;
+    return ring_attach(ring, id);
+}
+
+int
+ring_attach(struct Ring *ring, int id) {
+    int64_t va = syscall(SYS_ring_attach, id, 0, 0, 0, 0);
+    if (va < 0) return va;
+
+    ring->id = id;
+    ring->hdr = (struct RingHeader *)va;
+    ring->data = (uint8_t *)va + RING_DATA_OFFSET;
+    return 0;
+}
+
+/* Wait until *word changes from seen. The flag is set before the last
+ * check, so the other side either sees it after its update and wakes
+ * us up, or the update is seen here (or by the kernel) */
+static int
+ring_block(struct Ring *ring, volatile uint32_t *flag, volatile uint64_t *word, uint64_t seen) {
+    int res = 0;
+
+    *flag = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (*word == seen) res = syscall(SYS_ring_wait, ring->id, (uintptr_t)word, seen, 0, 0);
+    *flag = 0;
+
+    return res;
+}
+
+/* Wake the other side up if it waits for the update that has just been published */
+static void
+ring_notify(struct Ring *ring, volatile uint32_t *flag) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (*flag) syscall(SYS_ring_wake, ring->id, 0, 0, 0, 0);
+}
+
+/* Write all len bytes of buf, blocking while the ring is full.
+ * Returns the number of bytes written, which is less than len
+ * only if the consumer has gone */
+ssize_t
+ring_write(struct Ring *ring, const void *buf, size_t len) {
+    struct RingHeader *hdr = ring->hdr;
+    size_t done = 0;
+
+    while (done < len) {
+        uint64_t head = hdr->head;
+        uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+
+        if (head - tail == hdr->size) {
+            int res = ring_block(ring, &hdr->writer_waiting, &hdr->tail, tail);
+            if (res < 0) return done ? (ssize_t)done : res;
+            continue;
+        }
+
+        size_t n = MIN(hdr->size - (head - tail), len - done);
+        size_t off = head & (hdr->size - 1);
+        size_t first = MIN(n, hdr->size - off);
+        memcpy(ring->data + off, (const uint8_t *)buf + done, first);
+        memcpy(ring->data, (const uint8_t *)buf + done + first, n - first);
+
+        __atomic_store_n(&hdr->head, head + n, __ATOMIC_RELEASE);
+        ring_notify(ring, &hdr->reader_waiting);
+        done += n;
+    }
+
+    return done;
+}
+
+/* Read up to len bytes into buf, blocking only while the ring is empty.
+ * Returns the number of bytes read */
+ssize_t
+ring_read(struct Ring *ring, void *buf, size_t len) {
+    struct RingHeader *hdr = ring->hdr;
+    uint64_t tail = hdr->tail;
+    uint64_t head;
+
+    while ((head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE)) == tail) {
+        if (!len) return 0;
+        int res = ring_block(ring, &hdr->reader_waiting, &hdr->head, tail);
+        if (res < 0) return res;
+    }
+
+    size_t n = MIN(head - tail, len);
+    size_t off = tail & (hdr->size - 1);
+    size_t first = MIN(n, hdr->size - off);
+    memcpy(buf, ring->data + off, first);
+    memcpy((uint8_t *)buf + first, ring->data, n - first);
+
+    __atomic_store_n(&hdr->tail, tail + n, __ATOMIC_RELEASE);
+    ring_notify(ring, &hdr->writer_waiting);
+    return n;
+}
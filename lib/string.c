@@ -1,6 +1,7 @@
 /* Basic string routines.  Not hardware optimized, but not shabby. */
 
 #include <inc/string.h>
+#include <inc/memops.h>
 
 /* Using assembly for memset/memmove
  * makes some difference on real hardware,
@@ -9,18 +10,82 @@
 
 #define ASM 1
 
-size_t
+/* Word-at-a-time helpers. HAS_ZERO(w) is nonzero iff some byte of w is
+ * zero, and its lowest set bit marks the first such byte (bits above it
+ * may be spurious). Strings are scanned in aligned words, which never
+ * cross a page boundary, so reading past the terminator can't fault.
+ * Those reads go outside the object though, so the scanners are not
+ * instrumented; the sanitizer wrappers check the exact ranges instead. */
+#define WORD_ONES    0x0101010101010101ULL
+#define WORD_HIGHS   0x8080808080808080ULL
+#define HAS_ZERO(w)  (((w)-WORD_ONES) & ~(w)&WORD_HIGHS)
+#define ZERO_BYTE(w) ((size_t)__builtin_ctzll(HAS_ZERO(w)) / 8)
+#define WORD_NOSAN   __attribute__((no_sanitize_address))
+
+/* Load the aligned word containing s with the bytes in front of s
+ * made nonzero, so they are never taken for a terminator */
+static inline uint64_t WORD_NOSAN
+load_first_word(const char *s) {
+    size_t off = (uintptr_t)s & 7;
+    uint64_t word = *(const uint64_t *)(s - off);
+    return word | ((1ULL << (off * 8)) - 1);
+}
+
+#ifdef CONFIG_STRING_SIMD
+static size_t __attribute__((target("sse2"))) WORD_NOSAN
+strlen_sse2(const char *s) {
+    /* The same trick with aligned 16-byte blocks */
+    size_t off = (uintptr_t)s & 15;
+    const char *block = s - off;
+    uint32_t mask;
+    asm("pxor %%xmm0, %%xmm0\n"
+        "movdqa (%1), %%xmm1\n"
+        "pcmpeqb %%xmm0, %%xmm1\n"
+        "pmovmskb %%xmm1, %0\n"
+        : "=r"(mask)
+        : "r"(block), "m"(*(const char(*)[16])block)
+        : "xmm0", "xmm1");
+    mask &= ~0U << off;
+    while (!mask) {
+        block += 16;
+        asm("pxor %%xmm0, %%xmm0\n"
+            "movdqa (%1), %%xmm1\n"
+            "pcmpeqb %%xmm0, %%xmm1\n"
+            "pmovmskb %%xmm1, %0\n"
+            : "=r"(mask)
+            : "r"(block), "m"(*(const char(*)[16])block)
+            : "xmm0", "xmm1");
+    }
+    return block + __builtin_ctz(mask) - s;
+}
+#endif
+
+size_t WORD_NOSAN
 strlen(const char *s) {
-    size_t n = 0;
-    while (*s++) n++;
-    return n;
+#ifdef CONFIG_STRING_SIMD
+    return strlen_sse2(s);
+#else
+    const uint64_t *word = (const uint64_t *)((uintptr_t)s & ~7ULL);
+    uint64_t val = load_first_word(s);
+    while (!HAS_ZERO(val)) val = *++word;
+    return (const char *)word + ZERO_BYTE(val) - s;
+#endif
 }
 
-size_t
+size_t WORD_NOSAN
 strnlen(const char *s, size_t size) {
-    size_t n = 0;
-    while (n < size && *s++) n++;
-    return n;
+    if (!size) return 0;
+
+    /* Bounded by the count scanned so far, s + size
+     * overflows for size == (size_t)-1 */
+    const uint64_t *word = (const uint64_t *)((uintptr_t)s & ~7ULL);
+    uint64_t val = load_first_word(s);
+    while (!HAS_ZERO(val)) {
+        if ((size_t)((const char *)(word + 1) - s) >= size) return size;
+        val = *++word;
+    }
+    size_t n = (const char *)word + ZERO_BYTE(val) - s;
+    return MIN(n, size);
 }
 
 char *
@@ -77,14 +142,49 @@ strlcat(char *restrict dst, const char *restrict src, size_t maxlen) {
     return dstlen + srclen;
 }
 
-int
+/* Skip the common prefix of p and q a word at a time, stopping at
+ * or before the first difference or terminator, and at most n bytes.
+ * p is aligned first; q is assembled from aligned words and the next
+ * one is only loaded once the current one has no terminator left. */
+static size_t WORD_NOSAN
+common_prefix_words(const char *p, const char *q, size_t n) {
+    size_t i = 0;
+    for (; i < n && ((uintptr_t)(p + i) & 7); i++)
+        if (!p[i] || p[i] != q[i]) return i;
+
+    const uint64_t *pw = (const uint64_t *)(p + i);
+    size_t shift = ((uintptr_t)(q + i) & 7) * 8;
+    const uint64_t *qw = (const uint64_t *)((uintptr_t)(q + i) & ~7ULL);
+    uint64_t lo = i + 8 <= n ? *qw : 0;
+
+    for (; i + 8 <= n; i += 8, pw++) {
+        uint64_t qval;
+        if (shift) {
+            /* Bytes of lo in q's range, the rest made nonzero */
+            if (HAS_ZERO((lo >> shift) | (~0ULL << (64 - shift)))) break;
+            uint64_t hi = *++qw;
+            qval = (lo >> shift) | (hi << (64 - shift));
+            lo = hi;
+        } else {
+            qval = *qw++;
+        }
+        if (*pw != qval || HAS_ZERO(qval)) break;
+    }
+    return i;
+}
+
+int WORD_NOSAN
 strcmp(const char *p, const char *q) {
+    size_t i = common_prefix_words(p, q, SIZE_MAX & ~7ULL);
+    p += i, q += i;
     while (*p && *p == *q) p++, q++;
     return (int)((unsigned char)*p - (unsigned char)*q);
 }
 
-int
+int WORD_NOSAN
 strncmp(const char *p, const char *q, size_t n) {
+    size_t i = common_prefix_words(p, q, n);
+    p += i, q += i, n -= i;
     while (n && *p && *p == *q) n--, p++, q++;
 
     if (!n) return 0;
@@ -94,14 +194,26 @@ strncmp(const char *p, const char *q, size_t n) {
 
 /* Return a pointer to the first occurrence of 'c' in 's',
  *  * or a null pointer if the string has no 'c' */
-char *
+char * WORD_NOSAN
 strchr(const char *str, int c) {
-    for (; *str; str++) {
-        if (*str == c) {
-            return (char *)str;
+    uint64_t pattern = WORD_ONES * (uint8_t)c;
+    const uint64_t *word = (const uint64_t *)((uintptr_t)str & ~7ULL);
+    size_t off = (uintptr_t)str & 7;
+    /* Bytes in front of str must match neither 0 nor c */
+    uint64_t head = (1ULL << (off * 8)) - 1;
+    uint64_t val = *word;
+
+    for (;;) {
+        uint64_t zero = HAS_ZERO(val | head), match = HAS_ZERO((val ^ pattern) | head);
+        if (zero || match) {
+            /* The lowest flagged byte is exact for both tests */
+            size_t z = zero ? (size_t)__builtin_ctzll(zero) : 64;
+            size_t m = match ? (size_t)__builtin_ctzll(match) : 64;
+            return m < z ? (char *)word + m / 8 : NULL;
         }
+        val = *++word;
+        head = 0;
     }
-    return NULL;
 }
 
 /* Return a pointer to the first occurrence of 'c' in 's',
@@ -117,34 +229,7 @@ strfind(const char *str, int ch) {
 #if ASM
 void *
 memset(void *v, int c, size_t n) {
-    uint8_t *ptr = v;
-    ssize_t ni = n;
-
-    if (__builtin_expect((ni -= ((8 - ((uintptr_t)v & 7))) & 7) < 0, 0)) {
-        while (n-- > 0) *ptr++ = c;
-        return v;
-    }
-
-    uint64_t k = 0x101010101010101ULL * (c & 0xFFU);
-
-    if (__builtin_expect((uintptr_t)ptr & 7, 0)) {
-        if ((uintptr_t)ptr & 1) *ptr = k, ptr += 1;
-        if ((uintptr_t)ptr & 2) *(uint16_t *)ptr = k, ptr += 2;
-        if ((uintptr_t)ptr & 4) *(uint32_t *)ptr = k, ptr += 4;
-    }
-
-    if (__builtin_expect(ni >> 3, 1)) {
-        asm volatile("cld; rep stosq\n" ::"D"(ptr), "a"(k), "c"(ni >> 3)
-                     : "cc", "memory");
-        ni &= 7;
-    }
-
-    if (__builtin_expect(ni, 0)) {
-        if (ni & 4) *(uint32_t *)ptr = k, ptr += 4;
-        if (ni & 2) *(uint16_t *)ptr = k, ptr += 2;
-        if (ni & 1) *ptr = k;
-    }
-
+    memops_fill(v, c, n);
     return v;
 }
 
@@ -167,17 +252,17 @@ memmove(void *dst, const void *src, size_t n) {
         asm volatile("cld" ::
                              : "cc");
     } else {
-        if (!(((intptr_t)s & 7) | ((intptr_t)d & 7) | (n & 7))) {
-            asm volatile("cld; rep movsq\n" ::"D"(d), "S"(s), "c"(n / 8)
-                         : "cc", "memory");
-        } else {
-            asm volatile("cld; rep movsb\n" ::"D"(d), "S"(s), "c"(n)
-                         : "cc", "memory");
-        }
+        memops_copy(d, s, n);
     }
     return dst;
 }
 
+void *
+memcpy(void *dst, const void *src, size_t n) {
+    memops_copy(dst, src, n);
+    return dst;
+}
+
 #else
 
 void *
@@ -203,18 +288,35 @@ memmove(void *dst, const void *src, size_t n) {
 
     return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n) {
     return memmove(dst, src, n);
 }
+#endif
+
+/* Unaligned load, both buffers are fully inside the caller's range */
+static inline uint64_t
+load_word(const void *p) {
+    uint64_t word;
+    __builtin_memcpy(&word, p, sizeof(word));
+    return word;
+}
 
 int
 memcmp(const void *v1, const void *v2, size_t n) {
     const uint8_t *s1 = (const uint8_t *)v1;
     const uint8_t *s2 = (const uint8_t *)v2;
 
+    for (; n >= 8; n -= 8, s1 += 8, s2 += 8) {
+        uint64_t diff = load_word(s1) ^ load_word(s2);
+        if (diff) {
+            /* Little endian: the lowest differing bit is in the first differing byte */
+            size_t i = __builtin_ctzll(diff) / 8;
+            return (int)s1[i] - (int)s2[i];
+        }
+    }
+
     while (n-- > 0) {
         if (*s1 != *s2) {
             return (int)*s1 - (int)*s2;
@@ -227,11 +329,17 @@ memcmp(const void *v1, const void *v2, size_t n) {
 
 void *
 memfind(const void *src, int c, size_t n) {
-    const void *end = (const char *)src + n;
-    for (; src < end; src++) {
-        if (*(const unsigned char *)src == (unsigned char)c) break;
+    const uint8_t *ptr = src, *end = ptr + n;
+    uint64_t pattern = WORD_ONES * (uint8_t)c;
+
+    for (; ptr + 8 <= end; ptr += 8) {
+        uint64_t val = load_word(ptr) ^ pattern;
+        if (HAS_ZERO(val)) return (void *)(ptr + ZERO_BYTE(val));
+    }
+    for (; ptr < end; ptr++) {
+        if (*ptr == (uint8_t)c) break;
     }
-    return (void *)src;
+    return (void *)ptr;
 }
 
 long
@@ -0,0 +1,45 @@
+/* Kernel data readable without a system call, see inc/vsyscall.h */
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+/* Wall clock time, nanoseconds since 1970-01-01 00:00 UTC */
+uint64_t
+vsys_time_ns(void) {
+    uint32_t seq;
+    uint64_t tsc, freq, base, time;
+
+    do {
+        while ((seq = vsys->seq) & 1) /* nothing */;
+        freq = vsys->tsc_freq;
+        base = vsys->tsc_base;
+        time = vsys->boot_time_ns;
+        tsc = read_tsc();
+    } while (vsys->seq != seq);
+
+    if (!freq) return 0;
+    uint64_t delta = tsc - base;
+    return time + delta / freq * 1000000000 + delta % freq * 1000000000 / freq;
+}
+
+static unsigned
+vsys_cpu(void) {
+    uint32_t cpu = 0;
+    if (vsys->rdtscp) read_tscp(&cpu);
+    return cpu < VSYS_CPUS ? cpu : 0;
+}
+
+envid_t
+vsys_getenvid(void) {
+    return vsys->cpu[vsys_cpu()].env_id;
+}
+
+uint32_t
+vsys_env_runs(void) {
+    return vsys->cpu[vsys_cpu()].env_runs;
+}
+
+uintptr_t
+vsys_env_heap(void) {
+    return vsys->cpu[vsys_cpu()].env_heap;
+}
@@ -77,5 +77,9 @@
 #define PLATFORM_ASAN_HAVE_STRNCPY
 #define PLATFORM_ASAN_HAVE_STRNLEN
 #define PLATFORM_ASAN_HAVE_STRLEN
+#define PLATFORM_ASAN_HAVE_STRCMP
+#define PLATFORM_ASAN_HAVE_STRNCMP
+#define PLATFORM_ASAN_HAVE_STRCHR
+#define PLATFORM_ASAN_HAVE_MEMFIND
 
 #endif /* __ASAN_CONFIG_H__ */
@@ -30,6 +30,18 @@ uint8_t *asan_internal_shadow_start = NULL;
 uint8_t *asan_internal_shadow_end = NULL;
 uint8_t *asan_internal_shadow_off = NULL;
 
+/* Shadow is scanned and filled a word at a time where it is aligned,
+ * a zero word covers 64 bytes of addressable memory. */
+#define SHADOW_WORD sizeof(uint64_t)
+typedef uint64_t __attribute__((may_alias)) shadow_word_t;
+
+/* Most ranges are entirely within shadow, their bounds are checked once. */
+static inline bool
+shadow_range_valid(uint8_t *shadow, size_t limit) {
+    return limit && shadow + limit - 1 >= shadow &&
+           SHADOW_ADDRESS_VALID(shadow) && SHADOW_ADDRESS_VALID(shadow + limit - 1);
+}
+
 bool
 asan_internal_range_poisoned(uptr base, size_t size, uptr *first_invalid, bool all) {
     /* Assume that only shadow-aligned ranges make sense. */
@@ -38,13 +50,21 @@ asan_internal_range_poisoned(uptr base, size_t size, uptr *first_invalid, bool a
 
     uint8_t *shadow = SHADOW_FOR_ADDRESS(base);
     size_t limit = (size + SHADOW_MASK) / SHADOW_ALIGN;
+    bool valid = shadow_range_valid(shadow, limit);
 
     bool failed_once = false;
 
-    for (size_t i = 0; i < limit; i++, size -= SHADOW_ALIGN) {
+    for (size_t i = 0; i < limit; i++) {
         /* FIXME: assert(size > 0); */
 
-        if (!SHADOW_ADDRESS_VALID(shadow + i)) {
+        if (valid) {
+            /* Fast path: skip fully addressable words.
+             * Zero shadow never fails the check when all is set. */
+            while (!all && !((uptr)(shadow + i) & (SHADOW_WORD - 1)) &&
+                   limit - i >= SHADOW_WORD && !*(shadow_word_t *)(shadow + i))
+                i += SHADOW_WORD;
+            if (i == limit) break;
+        } else if (!SHADOW_ADDRESS_VALID(shadow + i)) {
             /* We are not aborting due to userspace memory! */
             // platform_asan_fatal("check out of shadow range", base, size, 0);
             if (!failed_once) {
@@ -55,14 +75,15 @@ asan_internal_range_poisoned(uptr base, size_t size, uptr *first_invalid, bool a
         }
 
         uint8_t s = shadow[i];
+        size_t rest = size - i * SHADOW_ALIGN;
 
         /* All 8 bytes in qword are unpoisoned (i.e. addressable). The shadow value is 0.
          * All 8 bytes in qword are poisoned (i.e. not addressable). The shadow value is negative.
          * First k bytes are unpoisoned, the rest 8-k are poisoned. The shadow value is k. */
 
         /* All is used to check if the entire range is poisoned. */
-        if ((!all && s != 0 && (size > SHADOW_ALIGN || s < size || s > SHADOW_MASK)) ||
-            (all && s <= SHADOW_ALIGN && s < size)) {
+        if ((!all && s != 0 && (rest > SHADOW_ALIGN || s < rest || s > SHADOW_MASK)) ||
+            (all && s <= SHADOW_ALIGN && s < rest)) {
             /* The exact first byte that failed */
             if (first_invalid)
                 *first_invalid = base + i * SHADOW_ALIGN;
@@ -91,9 +112,19 @@ asan_internal_fill_range(uptr base, size_t size, uint8_t value) {
 
     uint8_t *shadow = SHADOW_FOR_ADDRESS(base);
     size_t limit = (size + SHADOW_MASK) / SHADOW_ALIGN;
+    bool valid = shadow_range_valid(shadow, limit);
+    shadow_word_t word = value * 0x0101010101010101ULL;
+
+    /* Shadow is populated on demand, so it is prepared page by page.
+     * Partially addressable tail is an unpoison too. */
+    uint8_t *tail = (value != 0 && (size & SHADOW_MASK)) ? shadow + limit - 1 : NULL;
+    uint8_t *page_end = NULL;
+    bool writable = false;
 
-    for (size_t i = 0; i < limit; i++, size -= SHADOW_ALIGN) {
-        if (!SHADOW_ADDRESS_VALID(shadow + i)) {
+    for (size_t i = 0; i < limit; i++) {
+        size_t rest = size - i * SHADOW_ALIGN;
+
+        if (!valid && !SHADOW_ADDRESS_VALID(shadow + i)) {
             /* We are not aborting due to kernelspace memory! */
             //platform_asan_fatal("poison out of shadow range", base, size, 0);
             if (!failed_once) {
@@ -103,10 +134,28 @@ asan_internal_fill_range(uptr base, size_t size, uint8_t value) {
             continue;
         }
 
-        if (size >= SHADOW_ALIGN || value == 0)
+        if (shadow + i >= page_end) {
+            page_end = (uint8_t *)ROUNDDOWN((uptr)(shadow + i), PAGE_SIZE) + PAGE_SIZE;
+            writable = platform_asan_shadow_prepare(shadow + i, value == 0 || (tail && tail < page_end));
+        }
+        if (!writable) {
+            /* Skip the rest of the page */
+            i = MIN(limit, (size_t)(page_end - shadow)) - 1;
+            continue;
+        }
+
+        /* Fast path: whole words of fully (un)poisoned granules */
+        if (!((uptr)(shadow + i) & (SHADOW_WORD - 1)) && limit - i >= SHADOW_WORD &&
+            (value == 0 || rest >= SHADOW_WORD * SHADOW_ALIGN)) {
+            *(shadow_word_t *)(shadow + i) = word;
+            i += SHADOW_WORD - 1;
+            continue;
+        }
+
+        if (rest >= SHADOW_ALIGN || value == 0)
             shadow[i] = value;
         else
-            shadow[i] = size;
+            shadow[i] = rest;
     }
 }
 
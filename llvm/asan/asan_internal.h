@@ -141,6 +141,9 @@ void platform_asan_init();
 void NORETURN platform_asan_fatal(const char *msg, uptr p, size_t width, unsigned access_type);
 bool platform_asan_fakestack_enter(uint32_t *thread_id);
 void platform_asan_fakestack_leave();
+/* Make shadow page containing shadow writable before it is changed,
+ * returns false if the write is not needed */
+bool platform_asan_shadow_prepare(uint8_t *shadow, bool unpoison);
 
 extern bool asan_internal_initialised;
 extern uint8_t *asan_internal_shadow_start;
@@ -35,6 +35,10 @@ size_t __wrap_strlcat(char *dst, const char *src, size_t sz) SYMBOL_ALIAS("__asa
 char *__wrap_strncat(char *dst, const char *src, size_t sz) SYMBOL_ALIAS("__asan_strncat");
 size_t __wrap_strnlen(const char *src, size_t sz) SYMBOL_ALIAS("__asan_strnlen");
 size_t __wrap_strlen(const char *src) SYMBOL_ALIAS("__asan_strlen");
+int __wrap_strcmp(const char *a, const char *b) SYMBOL_ALIAS("__asan_strcmp");
+int __wrap_strncmp(const char *a, const char *b, size_t sz) SYMBOL_ALIAS("__asan_strncmp");
+char *__wrap_strchr(const char *src, int c) SYMBOL_ALIAS("__asan_strchr");
+void *__wrap_memfind(const void *src, int c, size_t sz) SYMBOL_ALIAS("__asan_memfind");
 
 /* Implementations for memory functions */
 
@@ -221,8 +225,11 @@ __real_strncat(char *UNUSED dst, const char *UNUSED src, size_t UNUSED sz) {
 
 size_t
 __asan_strnlen(const char *src, size_t sz) {
-    asan_internal_check_range(src, sz, TYPE_STRINGLD);
-    return __real_strnlen(src, sz);
+    /* The real implementation reads whole words past the terminator,
+     * check only the bytes strnlen is defined to look at */
+    size_t len = __real_strnlen(src, sz);
+    asan_internal_check_range(src, len < sz ? len + 1 : sz, TYPE_STRINGLD);
+    return len;
 }
 
 #ifndef PLATFORM_ASAN_HAVE_STRNLEN
@@ -245,3 +252,73 @@ __real_strlen(const char *UNUSED src) {
     asan_internal_unsupported(__func__);
 }
 #endif
+
+/* String comparison reads both strings up to the first difference or
+ * terminator, but no further than sz bytes */
+static size_t
+asan_compared_len(const char *a, const char *b, size_t sz) {
+    size_t n = 0;
+    while (n < sz && a[n] && a[n] == b[n]) n++;
+    return n < sz ? n + 1 : sz;
+}
+
+int
+__asan_strcmp(const char *a, const char *b) {
+    size_t n = asan_compared_len(a, b, (size_t)-1);
+    asan_internal_check_range(a, n, TYPE_STRINGLD);
+    asan_internal_check_range(b, n, TYPE_STRINGLD);
+    return __real_strcmp(a, b);
+}
+
+#ifndef PLATFORM_ASAN_HAVE_STRCMP
+int
+__real_strcmp(const char *UNUSED a, const char *UNUSED b) {
+    asan_internal_unsupported(__func__);
+}
+#endif
+
+int
+__asan_strncmp(const char *a, const char *b, size_t sz) {
+    size_t n = asan_compared_len(a, b, sz);
+    asan_internal_check_range(a, n, TYPE_STRINGLD);
+    asan_internal_check_range(b, n, TYPE_STRINGLD);
+    return __real_strncmp(a, b, sz);
+}
+
+#ifndef PLATFORM_ASAN_HAVE_STRNCMP
+int
+__real_strncmp(const char *UNUSED a, const char *UNUSED b, size_t UNUSED sz) {
+    asan_internal_unsupported(__func__);
+}
+#endif
+
+char *
+__asan_strchr(const char *src, int c) {
+    /* strchr stops at the match or the terminator, whichever is first */
+    char *res = __real_strchr(src, c);
+    size_t len = res ? (size_t)(res - src) + 1 : __real_strlen(src) + 1;
+    asan_internal_check_range(src, len, TYPE_STRINGLD);
+    return res;
+}
+
+#ifndef PLATFORM_ASAN_HAVE_STRCHR
+char *
+__real_strchr(const char *UNUSED src, int UNUSED c) {
+    asan_internal_unsupported(__func__);
+}
+#endif
+
+void *
+__asan_memfind(const void *src, int c, size_t sz) {
+    void *res = __real_memfind(src, c, sz);
+    size_t len = (size_t)((const char *)res - (const char *)src);
+    asan_internal_check_range(src, len < sz ? len + 1 : sz, TYPE_MEMLD);
+    return res;
+}
+
+#ifndef PLATFORM_ASAN_HAVE_MEMFIND
+void *
+__real_memfind(const void *UNUSED src, int UNUSED c, size_t UNUSED sz) {
+    asan_internal_unsupported(__func__);
+}
+#endif
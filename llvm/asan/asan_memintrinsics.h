@@ -39,6 +39,10 @@ size_t __asan_strlcat(char *dst, const char *src, size_t sz);
 char *__asan_strncat(char *dst, const char *src, size_t sz);
 size_t __asan_strnlen(const char *src, size_t sz);
 size_t __asan_strlen(const char *src);
+int __asan_strcmp(const char *a, const char *b);
+int __asan_strncmp(const char *a, const char *b, size_t sz);
+char *__asan_strchr(const char *src, int c);
+void *__asan_memfind(const void *src, int c, size_t sz);
 
 /*
  * Aliases for original methods
@@ -59,6 +63,10 @@ size_t __real_strlcat(char *dst, const char *src, size_t sz);
 char *__real_strncat(char *dst, const char *src, size_t sz);
 size_t __real_strnlen(const char *src, size_t sz);
 size_t __real_strlen(const char *src);
+int __real_strcmp(const char *a, const char *b);
+int __real_strncmp(const char *a, const char *b, size_t sz);
+char *__real_strchr(const char *src, int c);
+void *__real_memfind(const void *src, int c, size_t sz);
 
 /*
  *  Not sanitised functions needed for asan itself
@@ -41,14 +41,16 @@ platform_asan_init() {
     asan_internal_shadow_off = (uint8_t *)SANITIZE_SHADOW_OFF;
 
     extern char end[];
-    extern size_t max_memory_map_addr;
 
-    /* Fill memory shadow memory of kernel itself with 0x00s, */
+    /* Fill memory shadow memory of kernel itself with 0x00s,
+     * the rest is left 0xFF until allocated pages are unpoisoned */
     asan_internal_fill_range(KERN_BASE_ADDR + KERN_START_OFFSET, (uintptr_t)end - (KERN_BASE_ADDR + KERN_START_OFFSET), 0);
+}
 
-    /* and the rest of preallocated shadow memory within BOOT_MEM_SIZE with 0xFFs */
-    if (KERN_BASE_ADDR + MIN(BOOT_MEM_SIZE, max_memory_map_addr) > (uintptr_t)end)
-        asan_internal_fill_range((uintptr_t)end, MIN(BOOT_MEM_SIZE, max_memory_map_addr) + KERN_BASE_ADDR - (uintptr_t)end, 0x00);
+bool
+platform_asan_shadow_prepare(uint8_t *shadow, bool unpoison) {
+    extern bool populate_shadow(uintptr_t shadow, bool unpoison);
+    return populate_shadow((uptr)shadow, unpoison);
 }
 
 void
@@ -61,6 +63,16 @@ platform_asan_poison(void *addr, size_t size) {
     asan_internal_fill_range((uptr)addr, size, ASAN_GLOBAL_RZ);
 }
 
+void
+platform_asan_alloc(void *slot, size_t size, size_t objsize, size_t redzone) {
+    asan_internal_alloc_poison((uptr)slot, size, objsize, redzone);
+}
+
+void
+platform_asan_free(void *addr, size_t size) {
+    asan_internal_fill_range((uptr)addr, size, ASAN_HEAP_FREED);
+}
+
 void
 platform_asan_fatal(const char *msg, uptr p, size_t width, unsigned access_type) {
     ASAN_LOG("Fatal error: %s (addr 0x%lx within i/o size 0x%lx of type %u), tracing:",
@@ -17,6 +17,8 @@
 #include "asan_internal.h"
 #include "asan_memintrinsics.h"
 
+#include <inc/memops.h>
+
 #define ASM 1
 
 /* Not sanitised functions needed for asan itself */
@@ -25,49 +27,13 @@
 
 void *
 __nosan_memset(void *v, int c, size_t n) {
-    uint8_t *ptr = v;
-    intptr_t ni = n;
-
-    if (__builtin_expect((ni -= ((8 - ((uintptr_t)v & 7))) & 7) < 0, 0)) {
-        while (n-- > 0) *ptr++ = c;
-        return v;
-    }
-
-    uint64_t k = 0x101010101010101ULL * (c & 0xFFU);
-
-    if (__builtin_expect((uintptr_t)ptr & 7, 0)) {
-        if ((uintptr_t)ptr & 1) *ptr = k, ptr += 1;
-        if ((uintptr_t)ptr & 2) *(uint16_t *)ptr = k, ptr += 2;
-        if ((uintptr_t)ptr & 4) *(uint32_t *)ptr = k, ptr += 4;
-    }
-
-    if (__builtin_expect(ni / 8, 1)) {
-        asm volatile("cld; rep stosq\n" ::"D"(ptr), "a"(k), "c"(ni / 8)
-                     : "cc", "memory");
-        ni &= 7;
-    }
-
-    if (__builtin_expect(ni, 0)) {
-        if (ni & 4) *(uint32_t *)ptr = k, ptr += 4;
-        if (ni & 2) *(uint16_t *)ptr = k, ptr += 2;
-        if (ni & 1) *ptr = k;
-    }
-
+    memops_fill(v, c, n);
     return v;
 }
 
 void *
 __nosan_memcpy(void *dst, const void *src, size_t n) {
-    const char *s = src;
-    char *d = dst;
-
-    if (!(((intptr_t)s & 7) | ((intptr_t)d & 7) | (n & 7))) {
-        asm volatile("cld; rep movsq\n" ::"D"(d), "S"(s), "c"(n / 8)
-                     : "cc", "memory");
-    } else {
-        asm volatile("cld; rep movsb\n" ::"D"(d), "S"(s), "c"(n)
-                     : "cc", "memory");
-    }
+    memops_copy(dst, src, n);
     return dst;
 }
 
@@ -29,6 +29,7 @@
 /* The implementation of UBSAN for JOS based on NetBSD micro UBSAN implementation which was given with the task. */
 
 #include "ubsan.h"
+#include <kern/kdebug.h>
 
 #define ASSERT(x) assert(x)
 
@@ -63,6 +64,9 @@
 
 #define NUMBER_SIGNED_BIT 1U
 
+/* Size of the table of triggered check sites, power of 2 */
+#define UBSAN_SITES 256
+
 #if __SIZEOF_INT128__
 typedef __int128 longest;
 typedef unsigned __int128 ulongest;
@@ -187,6 +191,7 @@ struct CFloatCastOverflowData {
 /* Local utility functions */
 __attribute__((__format__(__printf__, 2, 3))) static void report(bool isFatal, const char *pFormat, ...);
 static bool is_already_reported(struct CSourceLocation *pLocation);
+static void site_hit(struct CSourceLocation *pLocation, uintptr_t uPC, const char *szKind);
 static size_t z_deserialize_type_width(struct CTypeDescriptor *pType);
 static void deserialize_location(char *pBuffer, size_t zBUfferLength, struct CSourceLocation *pLocation);
 #ifdef __SIZEOF_INT128__
@@ -1062,6 +1067,8 @@ is_already_reported(struct CSourceLocation *pLocation) {
 
     ASSERT(pLocation);
 
+    site_hit(pLocation, 0, NULL);
+
     pLine = &pLocation->mLine;
 
     do {
@@ -1475,3 +1482,117 @@ is_shift_exponent_too_large(char *szLocation, struct CTypeDescriptor *pType, uns
 
     return lllu_get_number(szLocation, pType, ulNumber) >= zWidth;
 }
+
+/* Every triggered check site is counted, only the first hit is reported.
+ * Sites are keyed by SourceLocation pointer or, with the minimal runtime,
+ * by return address of the handler */
+struct CUbsanSite {
+    const void *pKey;
+    struct CSourceLocation *pLocation;
+    uintptr_t uPC;
+    const char *szKind;
+    uint64_t ullHits;
+};
+
+static struct CUbsanSite rgSites[UBSAN_SITES];
+static uint64_t ullSitesDropped;
+
+static void
+site_hit(struct CSourceLocation *pLocation, uintptr_t uPC, const char *szKind) {
+    const void *pKey = pLocation ? (const void *)pLocation : (const void *)uPC;
+    uintptr_t uHash = (uintptr_t)pKey;
+
+    uHash ^= uHash >> 17;
+    uHash *= 0x9E3779B97F4A7C15ULL;
+
+    for (size_t i = 0; i < UBSAN_SITES; i++) {
+        struct CUbsanSite *pSite = &rgSites[(uHash + i) & (UBSAN_SITES - 1)];
+        const void *pOld = __atomic_load_n(&pSite->pKey, __ATOMIC_ACQUIRE);
+
+        if (!pOld) {
+            if (!__sync_bool_compare_and_swap(&pSite->pKey, NULL, pKey)) {
+                pOld = pSite->pKey;
+            } else {
+                pSite->pLocation = pLocation;
+                pSite->uPC = uPC;
+                pSite->szKind = szKind;
+                pOld = pKey;
+            }
+        }
+
+        if (pOld == pKey) {
+            __atomic_fetch_add(&pSite->ullHits, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&ullSitesDropped, 1, __ATOMIC_RELAXED);
+}
+
+void
+ubsan_dump_sites(void) {
+    cprintf("%10s  %s\n", "hits", "site");
+
+    for (size_t i = 0; i < UBSAN_SITES; i++) {
+        struct CUbsanSite *pSite = &rgSites[i];
+        if (!__atomic_load_n(&pSite->pKey, __ATOMIC_ACQUIRE)) continue;
+
+        if (pSite->pLocation) {
+            char szLocation[LOCATION_MAXLEN];
+            deserialize_location(szLocation, LOCATION_MAXLEN, pSite->pLocation);
+            cprintf("%10lu  %s\n", (unsigned long)pSite->ullHits, szLocation);
+        } else {
+            struct Ripdebuginfo info;
+            if (debuginfo_rip(pSite->uPC, &info) >= 0)
+                cprintf("%10lu  %s at %s:%d (%.*s+%lx)\n", (unsigned long)pSite->ullHits, pSite->szKind,
+                        info.rip_file, info.rip_line, info.rip_fn_namelen, info.rip_fn_name,
+                        (unsigned long)(pSite->uPC - info.rip_fn_addr));
+            else
+                cprintf("%10lu  %s at %lx\n", (unsigned long)pSite->ullHits, pSite->szKind, (unsigned long)pSite->uPC);
+        }
+    }
+
+    if (ullSitesDropped) cprintf("%lu hits of sites not fitting the table\n", (unsigned long)ullSitesDropped);
+}
+
+/* Minimal runtime (KUBSAN_MINIMAL=1, -fsanitize-minimal-runtime).
+ * Handlers get no check data, so nothing is formatted or printed,
+ * only the trap site is recorded. Aborting variants panic. */
+
+#define UBSAN_MINIMAL_HANDLER(name)                                              \
+    void __ubsan_handle_##name##_minimal(void);                                 \
+    void __ubsan_handle_##name##_minimal_abort(void);                           \
+    void                                                                          \
+    __ubsan_handle_##name##_minimal(void) {                                     \
+        site_hit(NULL, (uintptr_t)__builtin_return_address(0), #name);          \
+    }                                                                             \
+    void                                                                          \
+    __ubsan_handle_##name##_minimal_abort(void) {                               \
+        uintptr_t uPC = (uintptr_t)__builtin_return_address(0);                 \
+        site_hit(NULL, uPC, #name);                                             \
+        panic("UBSAN: " #name " at %lx", (unsigned long)uPC);                   \
+    }
+
+UBSAN_MINIMAL_HANDLER(type_mismatch)
+UBSAN_MINIMAL_HANDLER(alignment_assumption)
+UBSAN_MINIMAL_HANDLER(add_overflow)
+UBSAN_MINIMAL_HANDLER(sub_overflow)
+UBSAN_MINIMAL_HANDLER(mul_overflow)
+UBSAN_MINIMAL_HANDLER(negate_overflow)
+UBSAN_MINIMAL_HANDLER(divrem_overflow)
+UBSAN_MINIMAL_HANDLER(shift_out_of_bounds)
+UBSAN_MINIMAL_HANDLER(out_of_bounds)
+UBSAN_MINIMAL_HANDLER(builtin_unreachable)
+UBSAN_MINIMAL_HANDLER(missing_return)
+UBSAN_MINIMAL_HANDLER(vla_bound_not_positive)
+UBSAN_MINIMAL_HANDLER(float_cast_overflow)
+UBSAN_MINIMAL_HANDLER(load_invalid_value)
+UBSAN_MINIMAL_HANDLER(invalid_builtin)
+UBSAN_MINIMAL_HANDLER(function_type_mismatch)
+UBSAN_MINIMAL_HANDLER(implicit_conversion)
+UBSAN_MINIMAL_HANDLER(nonnull_arg)
+UBSAN_MINIMAL_HANDLER(nonnull_return)
+UBSAN_MINIMAL_HANDLER(nullability_arg)
+UBSAN_MINIMAL_HANDLER(nullability_return)
+UBSAN_MINIMAL_HANDLER(pointer_overflow)
+UBSAN_MINIMAL_HANDLER(cfi_check_fail)
@@ -91,4 +91,7 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #define __arraycount(__x) (sizeof(__x) / sizeof(__x[0]))
 #endif
 
+/* Print triggered check sites with their hit counts */
+void ubsan_dump_sites(void);
+
 #endif /* UBSAN_H */
@@ -0,0 +1,34 @@
+/* Page allocator churn: allocate and free pages of mixed classes,
+ * yielding now and then so that several instances interleave */
+
+#include <inc/x86.h>
+
+#define ROUNDS    256
+#define BATCH     32
+#define MAX_CLASS 4
+
+int (*volatile cprintf)(const char *fmt, ...);
+void (*volatile sys_yield)(void);
+void *(*volatile kalloc_page)(int class);
+void (*volatile kfree_page)(void *va, int class);
+
+void
+umain(int argc, char **argv) {
+    void *pages[BATCH];
+    unsigned failed = 0;
+
+    uint64_t start = read_tsc();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < BATCH; i++) {
+            pages[i] = kalloc_page((r + i) % (MAX_CLASS + 1));
+            if (!pages[i]) failed++;
+        }
+        for (int i = BATCH - 1; i >= 0; i--)
+            if (pages[i]) kfree_page(pages[i], (r + i) % (MAX_CLASS + 1));
+        if (r % 16 == 15) sys_yield();
+    }
+    uint64_t cycles = read_tsc() - start;
+
+    cprintf("BENCH alloc ops=%d cycles=%lu per_op=%lu failed=%u\n", ROUNDS * BATCH * 2,
+            (unsigned long)cycles, (unsigned long)(cycles / (ROUNDS * BATCH * 2)), failed);
+}
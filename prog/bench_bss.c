@@ -0,0 +1,24 @@
+/* Large .bss image for load_icode: boot with several instances and
+ * compare their start spread with bench_spawn. The program slot in
+ * kspace is 64KB (see prog/Makefrag), so the image takes most of it */
+
+#include <inc/x86.h>
+
+#define BSS_SIZE (48 * 1024)
+
+int (*volatile cprintf)(const char *fmt, ...);
+
+uint8_t image_bss[BSS_SIZE];
+
+void
+umain(int argc, char **argv) {
+    uint64_t start = read_tsc();
+
+    /* Touch every page once */
+    unsigned sum = 0;
+    for (unsigned i = 0; i < BSS_SIZE; i += 4096)
+        sum += image_bss[i]++;
+
+    cprintf("BENCH bss tsc=%lu size=%u touch_cycles=%lu sum=%u\n", (unsigned long)start,
+            BSS_SIZE, (unsigned long)(read_tsc() - start), sum);
+}
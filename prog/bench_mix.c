@@ -0,0 +1,45 @@
+/* CPU-bound spinners mixed with frequent yielders: boot with several
+ * instances. Instances of a program share its image in kspace, so they
+ * take turns from a common counter: even ones spin without yielding,
+ * odd ones yield after every short burst of work */
+
+#include <inc/x86.h>
+
+#define SPIN_WORK   (1 << 26)
+#define YIELD_ITERS 2000
+#define YIELD_WORK  (1 << 10)
+
+int (*volatile cprintf)(const char *fmt, ...);
+void (*volatile sys_yield)(void);
+
+/* Zeroed by the kernel when the image is bound */
+volatile unsigned next_id;
+
+static void
+work(unsigned n) {
+    for (volatile unsigned i = 0; i < n; i++)
+        ;
+}
+
+void
+umain(int argc, char **argv) {
+    unsigned id = next_id++;
+    uint64_t start = read_tsc();
+
+    if (id % 2 == 0) {
+        work(SPIN_WORK);
+        cprintf("BENCH mix role=spin id=%u cycles=%lu\n", id, (unsigned long)(read_tsc() - start));
+    } else {
+        uint64_t max_gap = 0, last = start;
+        for (int i = 0; i < YIELD_ITERS; i++) {
+            work(YIELD_WORK);
+            sys_yield();
+            /* Time away from the CPU shows how long spinners hold it */
+            uint64_t now = read_tsc();
+            if (now - last > max_gap) max_gap = now - last;
+            last = now;
+        }
+        cprintf("BENCH mix role=yield id=%u cycles=%lu max_gap=%lu\n", id,
+                (unsigned long)(last - start), (unsigned long)max_gap);
+    }
+}
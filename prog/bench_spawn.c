@@ -0,0 +1,12 @@
+/* Env creation workload: boot with many instances of this program.
+ * Each instance reports when it first ran, the collector takes the
+ * spread between the first and the last one */
+
+#include <inc/x86.h>
+
+int (*volatile cprintf)(const char *fmt, ...);
+
+void
+umain(int argc, char **argv) {
+    cprintf("BENCH spawn tsc=%lu\n", (unsigned long)read_tsc());
+}
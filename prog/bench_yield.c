@@ -0,0 +1,20 @@
+/* Yield ping-pong: boot with 2 (or more) instances, every one of them
+ * does nothing but yield, so each yield switches to the other env */
+
+#include <inc/x86.h>
+
+#define ITERS 10000
+
+int (*volatile cprintf)(const char *fmt, ...);
+void (*volatile sys_yield)(void);
+
+void
+umain(int argc, char **argv) {
+    uint64_t start = read_tsc();
+    for (int i = 0; i < ITERS; i++)
+        sys_yield();
+    uint64_t cycles = read_tsc() - start;
+
+    cprintf("BENCH yield iters=%d cycles=%lu per_iter=%lu\n",
+            ITERS, (unsigned long)cycles, (unsigned long)(cycles / ITERS));
+}